@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+'''
+  aiomx.py: asyncio interface to MX.
+
+  Copyright: (c) 2016-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+  Created:   2026-10-18
+  Version:   $Id$
+
+  This software is distributed under the terms of the MIT license. See
+  http://www.opensource.org/licenses/mit-license.php for details.
+'''
+
+import asyncio, collections, threading
+
+from mx import MX
+
+class Subscription(object):
+  ''' An asynchronous iterator over incoming messages of one message type. Each
+      iteration gives an (fd, msg_type, msg_version, payload) tuple, like the
+      arguments of a handler installed with MX.subscribe. '''
+
+  _END = object()
+
+  def __init__(self, amx, msg_type):
+    self._amx = amx
+    self._msg_type = msg_type
+    self._queue = asyncio.Queue()
+    self._closed = False
+
+  def msg_type(self):
+    ''' Return the message type of this subscription. '''
+
+    return self._msg_type
+
+  def close(self):
+    ''' Stop receiving messages. Iteration ends once the messages that were
+        already received have been consumed. '''
+
+    if not self._closed:
+      self._closed = True
+      self._amx._drop_subscription(self)
+      self._queue.put_nowait(Subscription._END)
+
+  def _put(self, message):
+    self._queue.put_nowait(message)
+
+  def __aiter__(self):
+    return self
+
+  async def __anext__(self):
+    message = await self._queue.get()
+
+    if message is Subscription._END:
+      self._queue.put_nowait(Subscription._END)   # For any other readers.
+      raise StopAsyncIteration
+
+    return message
+
+  async def __aenter__(self):
+    return self
+
+  async def __aexit__(self, exc_type, exc_value, traceback):
+    self.close()
+
+class _Route(object):
+  ''' Everyone who is waiting for messages of one message type. '''
+
+  def __init__(self):
+    self.subscriptions = []
+    self.waiters = collections.defaultdict(collections.deque)
+
+  def idle(self):
+    return not self.subscriptions and not any(self.waiters.values())
+
+class AsyncMX(object):
+  ''' Runs an MX object in an asyncio event loop. The MX connection number is
+      registered with loop.add_reader, so events are processed whenever they
+      arrive without blocking the loop. wait() and sendAndWait() are
+      coroutines that let other tasks run while they wait for a message, and
+      subscribe() returns an asynchronous iterator over incoming messages.
+
+      AsyncMX installs its own handlers for the message types it waits for, so
+      don't use MX.subscribe for those types on the same MX object. Message
+      types that were waited for stay subscribed, so that a stream of requests
+      doesn't cause a stream of subscriptions and cancellations. '''
+
+  def __init__(self, mx, loop = None):
+    self._mx = mx
+    self._loop = loop or asyncio.get_event_loop()
+    self._thread = threading.get_ident()
+    self._routes = {}
+    self._done = self._loop.create_future()
+    self._fd = mx.connectionNumber()
+
+    self._loop.add_reader(self._fd, self._process_events)
+
+  def mx(self):
+    ''' Return the MX object that we're running. '''
+
+    return self._mx
+
+  def close(self):
+    ''' Stop processing events for the MX object, end all subscriptions and
+        wake up everyone who is still waiting for a message. '''
+
+    self._finish(0)
+
+  async def run(self):
+    ''' Wait until the MX object is shut down or an error occurs. Returns 0
+        if mx.shutdown() was called or -1 if an error occurred. '''
+
+    return await asyncio.shield(self._done)
+
+  def subscribe(self, msg_type):
+    ''' Subscribe to messages of type <msg_type> and return a Subscription,
+        which is an asynchronous iterator over the incoming messages. '''
+
+    subscription = Subscription(self, msg_type)
+
+    self._route(msg_type).subscriptions.append(subscription)
+
+    return subscription
+
+  async def wait(self, fd, timeout, msg_type):
+    ''' Wait for a message of type <msg_type> to arrive on file descriptor
+        <fd>. Returns a tuple consisting of a return value, and the version and
+        payload of the received message. If the message does not arrive within
+        <timeout> seconds, the return value will be 0, the version will be 0 and
+        the payload will be None. Otherwise the return value will be 1 and the
+        version and payload of the received message will be returned. '''
+
+    return await self._wait_for(fd, timeout, msg_type)
+
+  async def sendAndWait(self, fd, timeout, reply_type,
+      request_type, request_version, request_payload):
+    ''' Send a message with type <request_type>, version <request_version>
+        and payload <request_payload> to file descriptor <fd>, then wait for a
+        reply with type <reply_type>. Returns the same tuple as wait(). '''
+
+    # Start waiting before the request goes out, so we can't miss the reply.
+
+    waiter = self._wait_for(fd, timeout, reply_type)
+
+    self._mx.send(fd, request_type, request_version, request_payload)
+
+    return await waiter
+
+  def _wait_for(self, fd, timeout, msg_type):
+    future = self._loop.create_future()
+    waiters = self._route(msg_type).waiters[fd]
+
+    waiters.append(future)
+
+    async def wait():
+      try:
+        version, payload = await asyncio.wait_for(future, timeout)
+        return 1, version, payload
+      except asyncio.TimeoutError:
+        return 0, 0, None
+      finally:
+        if future in waiters:
+          waiters.remove(future)
+
+    return wait()
+
+  def _route(self, msg_type):
+    route = self._routes.get(msg_type)
+
+    if route is None:
+      route = self._routes[msg_type] = _Route()
+
+      self._mx.subscribe(msg_type, self._handle_message)
+
+    return route
+
+  def _release_route(self, msg_type):
+    route = self._routes.get(msg_type)
+
+    if route is not None and route.idle():
+      del self._routes[msg_type]
+
+      if not self._done.done():
+        self._mx.cancel(msg_type)
+
+  def _drop_subscription(self, subscription):
+    route = self._routes.get(subscription.msg_type())
+
+    if route is not None and subscription in route.subscriptions:
+      route.subscriptions.remove(subscription)
+
+      self._release_route(subscription.msg_type())
+
+  def _process_events(self):
+    r = self._mx.processEvents()
+
+    if r != 1:
+      self._finish(r)
+
+  def _handle_message(self, fd, msg_type, msg_version, payload):
+    # Handlers may be called on an MX dispatch thread.
+
+    if threading.get_ident() == self._thread:
+      self._deliver(fd, msg_type, msg_version, payload)
+    else:
+      self._loop.call_soon_threadsafe(self._deliver,
+          fd, msg_type, msg_version, payload)
+
+  def _deliver(self, fd, msg_type, msg_version, payload):
+    route = self._routes.get(msg_type)
+
+    if route is None:
+      return
+
+    waiters = route.waiters.get(fd)
+
+    while waiters:
+      future = waiters.popleft()
+
+      if not future.done():
+        future.set_result((msg_version, payload))
+        return
+
+    for subscription in route.subscriptions:
+      subscription._put((fd, msg_type, msg_version, payload))
+
+  def _finish(self, r):
+    if self._done.done():
+      return
+
+    self._loop.remove_reader(self._fd)
+    self._done.set_result(r)
+
+    for route in list(self._routes.values()):
+      for subscription in list(route.subscriptions):
+        subscription.close()
+
+      for waiters in route.waiters.values():
+        for future in waiters:
+          if not future.done():
+            future.set_exception(IOError(MX.error() or 'MX shut down'))
+
+    self._routes.clear()
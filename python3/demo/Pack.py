@@ -95,6 +95,14 @@ class Pack(object):
       else:
         raise Exception("unknown spec (%d)" % spec)
 
+# Use the C implementation in the mx module instead, if it is available. It has
+# the same interface, except that unpack returns a tuple instead of a generator.
+
+try:
+  from mx import Pack
+except ImportError:
+  pass
+
 if __name__ == '__main__':
   from hexdump import hexdump
 
@@ -15,20 +15,275 @@
 #include <Python.h>
 #include <structmember.h>
 
+/*
+ * A batch handler installed with MX.subscribeBatch(), and the messages that
+ * have been collected for it since it was last called.
+ */
+typedef struct Batch Batch;
+
+struct Batch {
+    Batch *next;
+    PyObject *handler;
+    PyObject *pending;
+};
+
 typedef struct {
     PyObject_HEAD
     MX *mx;
+    Batch *batches;
 } MXObject;
 
+/*
+ * A message payload. Takes over the malloc'ed buffer that libmx hands to
+ * message handlers and exposes it through the buffer protocol, so that it can
+ * be wrapped in a memoryview (or numpy.frombuffer etc.) without copying it.
+ * The buffer is freed when the last reference to the object goes away.
+ */
+typedef struct {
+    PyObject_HEAD
+    char *data;
+    Py_ssize_t size;
+} PayloadObject;
+
+static PyTypeObject PayloadType;
+
+/*
+ * Return a new Payload object that owns <data>, which is <size> bytes long and
+ * was allocated with malloc. If <data> is NULL, None is returned instead.
+ */
+static PyObject *Payload_New(char *data, uint32_t size)
+{
+    PayloadObject *self;
+
+    if (data == NULL) {
+        Py_RETURN_NONE;
+    }
+    else if ((self = PyObject_New(PayloadObject, &PayloadType)) == NULL) {
+        free(data);
+        return NULL;
+    }
+
+    self->data = data;
+    self->size = size;
+
+    return (PyObject *) self;
+}
+
+static void Payload_Dealloc(PayloadObject *self)
+{
+    free(self->data);
+
+    PyObject_Del(self);
+}
+
+static int Payload_GetBuffer(PayloadObject *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *) self,
+            self->data, self->size, 1, flags);
+}
+
+static Py_ssize_t Payload_Length(PayloadObject *self)
+{
+    return self->size;
+}
+
+/*
+ * Index or slice the payload the way a bytes object would: an index gives an
+ * int, a slice gives a new bytes object.
+ */
+static PyObject *Payload_Subscript(PayloadObject *self, PyObject *item)
+{
+    if (PyIndex_Check(item)) {
+        Py_ssize_t i = PyNumber_AsSsize_t(item, PyExc_IndexError);
+
+        if (i == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        else if (i < 0) {
+            i += self->size;
+        }
+
+        if (i < 0 || i >= self->size) {
+            PyErr_SetString(PyExc_IndexError, "payload index out of range");
+            return NULL;
+        }
+
+        return PyLong_FromLong((unsigned char) self->data[i]);
+    }
+    else if (PySlice_Check(item)) {
+        Py_ssize_t start, stop, step, count, i;
+        PyObject *result;
+        char *dst;
+
+        if (PySlice_Unpack(item, &start, &stop, &step) < 0) {
+            return NULL;
+        }
+
+        count = PySlice_AdjustIndices(self->size, &start, &stop, step);
+
+        if (step == 1) {
+            return PyBytes_FromStringAndSize(self->data + start, count);
+        }
+        else if ((result = PyBytes_FromStringAndSize(NULL, count)) == NULL) {
+            return NULL;
+        }
+
+        dst = PyBytes_AS_STRING(result);
+
+        for (i = 0; i < count; i++, start += step) {
+            dst[i] = self->data[start];
+        }
+
+        return result;
+    }
+    else {
+        PyErr_Format(PyExc_TypeError,
+                "payload indices must be integers or slices, not %.200s",
+                Py_TYPE(item)->tp_name);
+        return NULL;
+    }
+}
+
+/*
+ * Compare the payload with any object that supports the buffer protocol (such
+ * as bytes), so that existing code comparing payloads with bytes keeps working.
+ */
+static PyObject *Payload_RichCompare(PayloadObject *self, PyObject *other, int op)
+{
+    Py_buffer view;
+    int equal;
+
+    if ((op != Py_EQ && op != Py_NE) || !PyObject_CheckBuffer(other)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    else if (PyObject_GetBuffer(other, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+
+    equal = view.len == self->size && memcmp(view.buf, self->data, view.len) == 0;
+
+    PyBuffer_Release(&view);
+
+    return PyBool_FromLong(op == Py_EQ ? equal : !equal);
+}
+
+/* Return a copy of the payload as a bytes object. */
+static PyObject *Payload_Bytes(PayloadObject *self, PyObject *ignored)
+{
+    return PyBytes_FromStringAndSize(self->data, self->size);
+}
+
+/* Decode the payload, like bytes.decode(). */
+static PyObject *Payload_Decode(PayloadObject *self,
+        PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"encoding", "errors", NULL};
+    char *encoding = "utf-8", *errors = "strict";
+
+    if (PyArg_ParseTupleAndKeywords(args, kwds, "|ss:decode",
+                kwlist, &encoding, &errors) == 0) {
+        return NULL;
+    }
+
+    return PyUnicode_Decode(self->data, self->size, encoding, errors);
+}
+
+static PyMethodDef Payload_methods[] = {
+    { "__bytes__", (PyCFunction) Payload_Bytes, METH_NOARGS,
+      "payload.__bytes__(self)\n\n"
+      "Return a copy of the payload as a bytes object."
+    },
+    { "decode", (PyCFunction) Payload_Decode,
+      METH_KEYWORDS | METH_VARARGS,
+      "payload.decode(self, encoding = 'utf-8', errors = 'strict')\n\n"
+      "Decode the payload into a string, like bytes.decode()."
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyMappingMethods Payload_as_mapping = {
+    (lenfunc) Payload_Length,           /* mp_length */
+    (binaryfunc) Payload_Subscript,     /* mp_subscript */
+    0,                                  /* mp_ass_subscript */
+};
+
+static PySequenceMethods Payload_as_sequence = {
+    (lenfunc) Payload_Length,           /* sq_length */
+};
+
+static PyBufferProcs Payload_as_buffer = {
+    (getbufferproc) Payload_GetBuffer,  /* bf_getbuffer */
+    0,                                  /* bf_releasebuffer */
+};
+
+static PyTypeObject PayloadType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "mx.Payload",               /*tp_name*/
+    sizeof(PayloadObject),      /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)Payload_Dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    &Payload_as_sequence,       /*tp_as_sequence*/
+    &Payload_as_mapping,        /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    &Payload_as_buffer,         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "A received message payload.\n\n"
+    "Payloads support the buffer protocol, so memoryview(payload) or\n"
+    "numpy.frombuffer(payload) give access to the received data without\n"
+    "copying it. Indexing and slicing work as they do for bytes, and\n"
+    "bytes(payload) returns a copy.\n",
+    0,		                /* tp_traverse */
+    0,		                /* tp_clear */
+    (richcmpfunc)Payload_RichCompare, /* tp_richcompare */
+    0,		                /* tp_weaklistoffset */
+    0,		                /* tp_iter */
+    0,		                /* tp_iternext */
+    Payload_methods,            /* tp_methods */
+};
+
+/*
+ * Free the batch handlers of <self>.
+ */
+static void MX_FreeBatches(MXObject *self)
+{
+    Batch *batch, *next;
+
+    for (batch = self->batches; batch != NULL; batch = next) {
+        next = batch->next;
+
+        Py_DECREF(batch->handler);
+        Py_DECREF(batch->pending);
+
+        free(batch);
+    }
+
+    self->batches = NULL;
+}
+
 static void MX_Dealloc(MXObject *self)
 {
     if (self->mx != NULL) {
         mxShutdown(self->mx);
+
+        Py_BEGIN_ALLOW_THREADS
         mxDestroy(self->mx);
+        Py_END_ALLOW_THREADS
 
         self->mx = NULL;
     }
 
+    MX_FreeBatches(self);
+
     Py_TYPE(self)->tp_free((PyObject*) self);
 }
 
@@ -39,11 +294,16 @@ static int MX_Init(MXObject *self, PyObject *args, PyObject *kwds)
 
     if (self->mx != NULL) {
         mxShutdown(self->mx);
+
+        Py_BEGIN_ALLOW_THREADS
         mxDestroy(self->mx);
+        Py_END_ALLOW_THREADS
 
         self->mx = NULL;
     }
 
+    MX_FreeBatches(self);
+
     if (PyArg_ParseTupleAndKeywords(args, kwds, "|zzz:init",
                 kwlist, &my_name, &mx_name, &mx_host) == 0) {
         return -1;
@@ -224,15 +484,25 @@ static PyObject *MX_ComponentName(MXObject *self,
     return result;
 }
 
+/* The callbacks below are called from mxRun, mxProcessEvents, mxAwait etc.
+ * which are entered with the GIL released (or from one of MX's handler
+ * threads), so they must take the GIL back before touching Python objects.
+ */
 void subscribe_cb(MX *mx, int fd, uint32_t type, uint32_t version,
             char *payload, uint32_t size, void *udata)
 {
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
     PyObject *r;
     PyObject *handler = udata;
-    Py_ssize_t py_size = size;
-    PyObject *arglist = Py_BuildValue("(iIIy#)", fd, type, version, payload, py_size);
+    PyObject *arglist = Py_BuildValue("(iIIN)", fd, type, version,
+            Payload_New(payload, size));
 
-    free(payload);
+    if (arglist == NULL) {
+        PyErr_Print();
+        PyGILState_Release(gstate);
+        return;
+    }
 
     r = PyObject_CallObject(handler, arglist);
 
@@ -245,6 +515,8 @@ void subscribe_cb(MX *mx, int fd, uint32_t type, uint32_t version,
     }
 
     Py_DECREF(arglist);
+
+    PyGILState_Release(gstate);
 }
 
 /* void mxSubscribe(MX *mx, uint32_t type, handler, udata);
@@ -272,6 +544,123 @@ static PyObject *MX_Subscribe(MXObject *self,
     return PyLong_FromLong(mxSubscribe(self->mx, msg_type, subscribe_cb, handler));
 }
 
+/*
+ * Collect an incoming message for a batch handler. It is passed on by
+ * MX_FlushBatches once all pending events have been processed.
+ */
+static void subscribe_batch_cb(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata)
+{
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
+    Batch *batch = udata;
+    PyObject *item = Py_BuildValue("(iIIN)", fd, type, version,
+            Payload_New(payload, size));
+
+    if (item == NULL || PyList_Append(batch->pending, item) != 0) {
+        PyErr_Print();
+    }
+
+    Py_XDECREF(item);
+
+    PyGILState_Release(gstate);
+}
+
+/*
+ * Call every batch handler of <self> that has collected messages, with the
+ * list of those messages. Must be called with the GIL held.
+ */
+static void MX_FlushBatches(MXObject *self)
+{
+    Batch *batch;
+
+    for (batch = self->batches; batch != NULL; batch = batch->next) {
+        PyObject *r, *pending = batch->pending;
+
+        if (PyList_GET_SIZE(pending) == 0) continue;
+
+        /* Start a new list first, in case the handler processes events. */
+
+        if ((batch->pending = PyList_New(0)) == NULL) {
+            batch->pending = pending;
+            PyErr_Print();
+            return;
+        }
+
+        r = PyObject_CallFunctionObjArgs(batch->handler, pending, NULL);
+
+        if (r == NULL) {
+            PyErr_Print();
+        }
+        else {
+            Py_DECREF(r);
+        }
+
+        Py_DECREF(pending);
+    }
+}
+
+static void events_processed_cb(MX *mx, void *udata)
+{
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
+    MX_FlushBatches(udata);
+
+    PyGILState_Release(gstate);
+}
+
+/* void mxSubscribe(MX *mx, uint32_t type, handler, udata);
+ *      void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+ *          char *payload, uint32_t size, void *udata),
+ * with a handler that collects messages for a batch handler.
+ */
+static PyObject *MX_SubscribeBatch(MXObject *self,
+        PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"msg_type", "handler", NULL};
+    uint32_t msg_type = 0;
+    PyObject *handler;
+    Batch *batch;
+
+    if (PyArg_ParseTupleAndKeywords(args, kwds, "IO:subscribeBatch",
+                kwlist, &msg_type, &handler) == 0) {
+        return NULL;
+    }
+    else if (!PyCallable_Check(handler)) {
+        PyErr_SetString(PyExc_TypeError, "\"handler\" must be callable");
+        return NULL;
+    }
+
+    /* Messages of all types for the same handler go into the same batch. */
+
+    for (batch = self->batches; batch != NULL; batch = batch->next) {
+        if (batch->handler == handler) break;
+    }
+
+    if (batch == NULL) {
+        if ((batch = calloc(1, sizeof(Batch))) == NULL) {
+            return PyErr_NoMemory();
+        }
+        else if ((batch->pending = PyList_New(0)) == NULL) {
+            free(batch);
+            return NULL;
+        }
+
+        Py_INCREF(handler);
+
+        batch->handler = handler;
+        batch->next = self->batches;
+
+        if (self->batches == NULL) {
+            mxOnEventsProcessed(self->mx, events_processed_cb, self);
+        }
+
+        self->batches = batch;
+    }
+
+    return PyLong_FromLong(mxSubscribe(self->mx, msg_type, subscribe_batch_cb, batch));
+}
+
 /* void mxCancel(MX *mx, uint32_t type); */
 static PyObject *MX_Cancel(MXObject *self, PyObject *args, PyObject *kwds)
 {
@@ -288,6 +677,8 @@ static PyObject *MX_Cancel(MXObject *self, PyObject *args, PyObject *kwds)
 
 static void on_subscriber_cb(MX *mx, int fd, uint32_t msg_type, void *udata)
 {
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
     PyObject *r;
     PyObject *handler = udata;
     PyObject *arglist = Py_BuildValue("(iI)", fd, msg_type);
@@ -302,6 +693,8 @@ static void on_subscriber_cb(MX *mx, int fd, uint32_t msg_type, void *udata)
     }
 
     Py_DECREF(arglist);
+
+    PyGILState_Release(gstate);
 }
 
 /* void mxOnNewSubscriber(MX *mx, uint32_t type,
@@ -360,6 +753,8 @@ static PyObject *MX_OnEndSubscriber(MXObject *self,
 
 static void on_component_cb(MX *mx, int fd, const char *name, void *udata)
 {
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
     PyObject *r;
     PyObject *handler = udata;
     PyObject *arglist = Py_BuildValue("(is)", fd, name);
@@ -374,6 +769,8 @@ static void on_component_cb(MX *mx, int fd, const char *name, void *udata)
     }
 
     Py_DECREF(arglist);
+
+    PyGILState_Release(gstate);
 }
 
 /* void mxOnNewComponent(MX *mx,
@@ -431,6 +828,8 @@ static PyObject *MX_OnEndComponent(MXObject *self,
 static void on_new_message_cb(MX *mx,
         uint32_t type, const char *name, void *udata)
 {
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
     PyObject *r;
     PyObject *handler = udata;
     PyObject *arglist = Py_BuildValue("(Is)", type, name);
@@ -445,6 +844,8 @@ static void on_new_message_cb(MX *mx,
     }
 
     Py_DECREF(arglist);
+
+    PyGILState_Release(gstate);
 }
 
 /* void mxOnNewMessage(MX *mx,
@@ -528,18 +929,17 @@ static PyObject *MX_Await(MXObject *self,
     uint32_t type, version = 0;
     char *payload = NULL;
     uint32_t size = 0;
-    Py_ssize_t py_size;
 
     if (PyArg_ParseTupleAndKeywords(args, kwds, "idI:await",
                 kwlist, &fd, &timeout, &type) == 0) {
         return NULL;
     }
 
+    Py_BEGIN_ALLOW_THREADS
     r = mxAwait(self->mx, fd, timeout, type, &version, &payload, &size);
+    Py_END_ALLOW_THREADS
 
-    py_size = size;
-
-    result = Py_BuildValue("(iIy#)", r, version, payload, py_size);
+    result = Py_BuildValue("(iIN)", r, version, Payload_New(payload, size));
 
     return result;
 }
@@ -574,19 +974,22 @@ static PyObject *MX_SendAndWait(MXObject *self,
         return NULL;
     }
 
+    Py_BEGIN_ALLOW_THREADS
     r = mxSendAndWait(self->mx, fd, timeout,
             reply_type, &reply_version, &reply_payload, &reply_size,
             request_type, request_version, request_payload, request_size);
+    Py_END_ALLOW_THREADS
 
-    Py_ssize_t py_reply_size = reply_size;
-
-    result = Py_BuildValue("(iIy#)", r, reply_version, reply_payload, py_reply_size);
+    result = Py_BuildValue("(iIN)", r, reply_version,
+            Payload_New(reply_payload, reply_size));
 
     return result;
 }
 
 void timer_callback(MX *mx, MX_Timer *timer, double t, void *udata)
 {
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
     PyObject *r;
     PyObject *handler = udata;
     PyObject *arglist = Py_BuildValue("(Kd)", (uint64_t) timer, t);
@@ -601,6 +1004,8 @@ void timer_callback(MX *mx, MX_Timer *timer, double t, void *udata)
     }
 
     Py_DECREF(arglist);
+
+    PyGILState_Release(gstate);
 }
 
 /* void mxCreateTimer(MX *mx, unit32_t id, double t,
@@ -683,8 +1088,15 @@ static PyObject *MX_ProcessEvents(MXObject *self,
         PyObject *args, PyObject *kwds)
 {
     PyObject *result;
+    int r;
 
-    result = PyLong_FromLong(mxProcessEvents(self->mx));
+    Py_BEGIN_ALLOW_THREADS
+    r = mxProcessEvents(self->mx);
+    Py_END_ALLOW_THREADS
+
+    MX_FlushBatches(self);
+
+    result = PyLong_FromLong(r);
 
     return result;
 }
@@ -695,7 +1107,13 @@ static PyObject *MX_Run(MXObject *self,
 {
     PyObject *result;
 
-    int r = mxRun(self->mx);
+    int r;
+
+    Py_BEGIN_ALLOW_THREADS
+    r = mxRun(self->mx);
+    Py_END_ALLOW_THREADS
+
+    MX_FlushBatches(self);
 
     result = PyLong_FromLong(r);
 
@@ -790,7 +1208,25 @@ static PyMethodDef MX_methods[] = {
       "following signature:\n\n"
       "\thandler(fd, msg_type, msg_version, payload).\n\n"
       "where <msg_type> is the type of the received message, <msg_version> is "
-      "its version and <payload> is its payload."
+      "its version and <payload> is its payload, as an mx.Payload object. "
+      "This supports the buffer protocol, so it can be read through a "
+      "memoryview without copying it."
+    },
+    { "subscribeBatch", (PyCFunction) MX_SubscribeBatch,
+      METH_KEYWORDS | METH_VARARGS,
+      "mx.subscribeBatch(self, msg_type, handler)\n\n"
+      "Subscribe to messages of type <msg_type>, but instead of calling "
+      "<handler> for each message, collect the messages and call <handler> "
+      "once all pending events have been processed, with a list of all "
+      "messages received since the previous call. Subscribing to several "
+      "message types with the same handler puts their messages in the same "
+      "list, in the order in which they were received. Returns <0 or >0 for "
+      "errors and notices (in which case you should check mx.error) or 0. "
+      "<handler> should have the following signature:\n\n"
+      "\thandler(messages).\n\n"
+      "where <messages> is a list of (fd, msg_type, msg_version, payload) "
+      "tuples, with the same contents as the arguments passed to a handler "
+      "installed with mx.subscribe."
     },
     { "cancel", (PyCFunction) MX_Cancel,
       METH_KEYWORDS | METH_VARARGS,
@@ -987,6 +1423,523 @@ static PyTypeObject MXType = {
     0,                          /* tp_new */
 };
 
+/*
+ * C implementation of the Pack class in demo/Pack.py. Field types are checked
+ * and sized once, the output is sized before it is written, and the result is
+ * built in a single bytes object. All values are packed big-endian, strings
+ * as a 32-bit byte count followed by their UTF-8 encoding.
+ */
+
+enum {
+    PACK_INT8, PACK_UINT8, PACK_INT16, PACK_UINT16, PACK_INT32, PACK_UINT32,
+    PACK_INT64, PACK_UINT64, PACK_FLOAT, PACK_DOUBLE, PACK_STRING,
+    PACK_COUNT
+};
+
+static const char *pack_names[PACK_COUNT] = {
+    "INT8", "UINT8", "INT16", "UINT16", "INT32", "UINT32",
+    "INT64", "UINT64", "FLOAT", "DOUBLE", "STRING"
+};
+
+/* The number of bytes each field type takes (the length field for strings). */
+
+static const int pack_sizes[PACK_COUNT] = { 1, 1, 2, 2, 4, 4, 8, 8, 4, 8, 4 };
+
+/*
+ * A precompiled list of field types, as returned by Pack.compile().
+ */
+typedef struct {
+    PyObject_VAR_HEAD
+    Py_ssize_t fixed_size;      /* Bytes needed for everything but string data. */
+    int has_strings;
+    unsigned char spec[1];
+} PackFormatObject;
+
+static PyTypeObject PackFormatType;
+
+/*
+ * Convert <obj> to a field type in <spec>. Returns 0 on success or -1 (with an
+ * exception set) on failure.
+ */
+static int pack_get_spec(PyObject *obj, unsigned char *spec)
+{
+    long value = PyLong_AsLong(obj);
+
+    if (value == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    else if (value < 0 || value >= PACK_COUNT) {
+        PyErr_Format(PyExc_ValueError, "unknown spec (%ld)", value);
+        return -1;
+    }
+
+    *spec = value;
+
+    return 0;
+}
+
+static void pack_put(char *dst, uint64_t value, int size)
+{
+    while (size-- > 0) {
+        dst[size] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+static uint64_t pack_get(const char *src, int size)
+{
+    uint64_t value = 0;
+
+    while (size-- > 0) {
+        value = (value << 8) | (unsigned char) *src++;
+    }
+
+    return value;
+}
+
+/*
+ * Write <value> as field type <spec> to <dst>. Returns the number of bytes
+ * written, or -1 (with an exception set) if <value> can't be packed that way.
+ */
+static Py_ssize_t pack_value(char *dst, unsigned char spec, PyObject *value)
+{
+    int size = pack_sizes[spec];
+
+    if (spec == PACK_STRING) {
+        Py_ssize_t len;
+        const char *str = PyUnicode_AsUTF8AndSize(value, &len);
+
+        if (str == NULL) return -1;
+
+        pack_put(dst, len, size);
+        memcpy(dst + size, str, len);
+
+        return size + len;
+    }
+    else if (spec == PACK_FLOAT || spec == PACK_DOUBLE) {
+        double d = PyFloat_AsDouble(value);
+
+        if (d == -1 && PyErr_Occurred()) return -1;
+
+        if (spec == PACK_FLOAT) {
+            float f = d;
+            uint32_t u;
+
+            memcpy(&u, &f, sizeof(u));
+            pack_put(dst, u, size);
+        }
+        else {
+            uint64_t u;
+
+            memcpy(&u, &d, sizeof(u));
+            pack_put(dst, u, size);
+        }
+    }
+    else if (spec == PACK_UINT64) {
+        unsigned long long u = PyLong_AsUnsignedLongLong(value);
+
+        if (u == (unsigned long long) -1 && PyErr_Occurred()) return -1;
+
+        pack_put(dst, u, size);
+    }
+    else {
+        long long i = PyLong_AsLongLong(value);
+        int bits = 8 * size;
+
+        if (i == -1 && PyErr_Occurred()) return -1;
+
+        if (spec & 1) {             /* Unsigned types have odd numbers. */
+            if (i < 0 || (bits < 64 && i >= (1LL << bits))) {
+                PyErr_Format(PyExc_OverflowError,
+                        "%s value out of range", pack_names[spec]);
+                return -1;
+            }
+        }
+        else if (bits < 64 &&
+                 (i < -(1LL << (bits - 1)) || i >= (1LL << (bits - 1)))) {
+            PyErr_Format(PyExc_OverflowError,
+                    "%s value out of range", pack_names[spec]);
+            return -1;
+        }
+
+        pack_put(dst, (uint64_t) i, size);
+    }
+
+    return size;
+}
+
+/*
+ * Pack the <count> values in <values> (which are <stride> pointers apart) as
+ * the field types in <spec>. <fixed_size> is the space needed for all fields
+ * except the contents of strings. Returns a new bytes object, or NULL with an
+ * exception set.
+ */
+static PyObject *pack_values(const unsigned char *spec, Py_ssize_t count,
+        Py_ssize_t fixed_size, int has_strings,
+        PyObject **values, Py_ssize_t stride)
+{
+    PyObject *result;
+    Py_ssize_t i, n, size = fixed_size;
+    char *dst;
+
+    /* Strings are encoded here and again below, but Python caches the UTF-8
+     * encoding with the string, so the second time is free. */
+
+    for (i = 0; has_strings && i < count; i++) {
+        if (spec[i] == PACK_STRING) {
+            if (PyUnicode_AsUTF8AndSize(values[i * stride], &n) == NULL) {
+                return NULL;
+            }
+
+            size += n;
+        }
+    }
+
+    if ((result = PyBytes_FromStringAndSize(NULL, size)) == NULL) {
+        return NULL;
+    }
+
+    dst = PyBytes_AS_STRING(result);
+
+    for (i = 0; i < count; i++) {
+        if ((n = pack_value(dst, spec[i], values[i * stride])) < 0) {
+            Py_DECREF(result);
+            return NULL;
+        }
+
+        dst += n;
+    }
+
+    return result;
+}
+
+/*
+ * Unpack the <count> field types in <spec> from <payload>, and return them in a
+ * new tuple (or NULL with an exception set).
+ */
+static PyObject *unpack_values(const unsigned char *spec, Py_ssize_t count,
+        PyObject *payload)
+{
+    PyObject *result = NULL, *item;
+    Py_buffer view;
+    const char *src, *end;
+    Py_ssize_t i;
+
+    if (PyObject_GetBuffer(payload, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+
+    src = view.buf;
+    end = src + view.len;
+
+    if ((result = PyTuple_New(count)) == NULL) {
+        goto done;
+    }
+
+    for (i = 0; i < count; i++) {
+        int size = pack_sizes[spec[i]];
+        uint64_t u;
+
+        if (end - src < size) goto short_payload;
+
+        u = pack_get(src, size);
+        src += size;
+
+        switch(spec[i]) {
+        case PACK_INT8:
+            item = PyLong_FromLong((int8_t) u);
+            break;
+        case PACK_INT16:
+            item = PyLong_FromLong((int16_t) u);
+            break;
+        case PACK_INT32:
+            item = PyLong_FromLong((int32_t) u);
+            break;
+        case PACK_INT64:
+            item = PyLong_FromLongLong((int64_t) u);
+            break;
+        case PACK_UINT8:
+        case PACK_UINT16:
+        case PACK_UINT32:
+        case PACK_UINT64:
+            item = PyLong_FromUnsignedLongLong(u);
+            break;
+        case PACK_FLOAT: {
+            uint32_t u32 = u;
+            float f;
+
+            memcpy(&f, &u32, sizeof(f));
+            item = PyFloat_FromDouble(f);
+            break;
+        }
+        case PACK_DOUBLE: {
+            double d;
+
+            memcpy(&d, &u, sizeof(d));
+            item = PyFloat_FromDouble(d);
+            break;
+        }
+        default:                /* PACK_STRING */
+            if ((uint64_t) (end - src) < u) goto short_payload;
+
+            item = PyUnicode_DecodeUTF8(src, u, NULL);
+            src += u;
+            break;
+        }
+
+        if (item == NULL) {
+            Py_CLEAR(result);
+            goto done;
+        }
+
+        PyTuple_SET_ITEM(result, i, item);
+    }
+
+    goto done;
+
+short_payload:
+    PyErr_Format(PyExc_ValueError,
+            "payload too short for field %zd (%s)", i, pack_names[spec[i]]);
+    Py_CLEAR(result);
+
+done:
+    PyBuffer_Release(&view);
+
+    return result;
+}
+
+/* Pack.pack(type, value, type, value, ...) */
+static PyObject *Pack_Pack(PyObject *ignored, PyObject *args)
+{
+    PyObject *result;
+    unsigned char *spec;
+    Py_ssize_t i, count = PyTuple_GET_SIZE(args) / 2, fixed_size = 0;
+    int has_strings = 0;
+
+    if (PyTuple_GET_SIZE(args) % 2 != 0) {
+        PyErr_SetString(PyExc_TypeError,
+                "Pack.pack expects alternating field types and values");
+        return NULL;
+    }
+    else if ((spec = PyMem_Malloc(count + 1)) == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    for (i = 0; i < count; i++) {
+        if (pack_get_spec(PyTuple_GET_ITEM(args, 2 * i), spec + i) != 0) {
+            PyMem_Free(spec);
+            return NULL;
+        }
+
+        fixed_size += pack_sizes[spec[i]];
+        has_strings |= spec[i] == PACK_STRING;
+    }
+
+    result = pack_values(spec, count, fixed_size, has_strings,
+            &PyTuple_GET_ITEM(args, 1), 2);
+
+    PyMem_Free(spec);
+
+    return result;
+}
+
+/* Pack.unpack(payload, type, type, ...) */
+static PyObject *Pack_Unpack(PyObject *ignored, PyObject *args)
+{
+    PyObject *result;
+    unsigned char *spec;
+    Py_ssize_t i, count = PyTuple_GET_SIZE(args) - 1;
+
+    if (count < 0) {
+        PyErr_SetString(PyExc_TypeError, "Pack.unpack expects a payload");
+        return NULL;
+    }
+    else if ((spec = PyMem_Malloc(count + 1)) == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    for (i = 0; i < count; i++) {
+        if (pack_get_spec(PyTuple_GET_ITEM(args, i + 1), spec + i) != 0) {
+            PyMem_Free(spec);
+            return NULL;
+        }
+    }
+
+    result = unpack_values(spec, count, PyTuple_GET_ITEM(args, 0));
+
+    PyMem_Free(spec);
+
+    return result;
+}
+
+/* Pack.compile(type, type, ...) */
+static PyObject *Pack_Compile(PyObject *ignored, PyObject *args)
+{
+    PackFormatObject *format;
+    Py_ssize_t i, count = PyTuple_GET_SIZE(args);
+
+    if ((format = PyObject_NewVar(PackFormatObject,
+                    &PackFormatType, count)) == NULL) {
+        return NULL;
+    }
+
+    format->fixed_size = 0;
+    format->has_strings = 0;
+
+    for (i = 0; i < count; i++) {
+        if (pack_get_spec(PyTuple_GET_ITEM(args, i), format->spec + i) != 0) {
+            Py_DECREF(format);
+            return NULL;
+        }
+
+        format->fixed_size += pack_sizes[format->spec[i]];
+        format->has_strings |= format->spec[i] == PACK_STRING;
+    }
+
+    return (PyObject *) format;
+}
+
+/* format.pack(value, value, ...) */
+static PyObject *PackFormat_Pack(PackFormatObject *self, PyObject *args)
+{
+    if (PyTuple_GET_SIZE(args) != Py_SIZE(self)) {
+        PyErr_Format(PyExc_TypeError, "pack expects %zd values, got %zd",
+                Py_SIZE(self), PyTuple_GET_SIZE(args));
+        return NULL;
+    }
+
+    return pack_values(self->spec, Py_SIZE(self),
+            self->fixed_size, self->has_strings, &PyTuple_GET_ITEM(args, 0), 1);
+}
+
+/* format.unpack(payload) */
+static PyObject *PackFormat_Unpack(PackFormatObject *self, PyObject *payload)
+{
+    return unpack_values(self->spec, Py_SIZE(self), payload);
+}
+
+static PyMethodDef PackFormat_methods[] = {
+    { "pack", (PyCFunction) PackFormat_Pack, METH_VARARGS,
+      "format.pack(self, value, ...) -> bytes\n\n"
+      "Pack the given values, one for each field type in the format, and "
+      "return the resulting byte string."
+    },
+    { "unpack", (PyCFunction) PackFormat_Unpack, METH_O,
+      "format.unpack(self, payload) -> tuple\n\n"
+      "Unpack <payload> (bytes, an mx.Payload or anything else that supports "
+      "the buffer protocol) and return a tuple of the unpacked fields."
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject PackFormatType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "mx.PackFormat",            /*tp_name*/
+    offsetof(PackFormatObject, spec), /*tp_basicsize*/
+    sizeof(unsigned char),      /*tp_itemsize*/
+    0,                          /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "A precompiled list of field types, as returned by mx.Pack.compile().\n",
+    0,		                /* tp_traverse */
+    0,		                /* tp_clear */
+    0,		                /* tp_richcompare */
+    0,		                /* tp_weaklistoffset */
+    0,		                /* tp_iter */
+    0,		                /* tp_iternext */
+    PackFormat_methods,         /* tp_methods */
+};
+
+static PyMethodDef Pack_methods[] = {
+    { "pack", (PyCFunction) Pack_Pack, METH_VARARGS | METH_STATIC,
+      "Pack.pack(type, value, type, value, ...) -> bytes\n\n"
+      "Pack the given list of parameters (which consists of alternating field "
+      "types and field values) and return the resulting byte string."
+    },
+    { "unpack", (PyCFunction) Pack_Unpack, METH_VARARGS | METH_STATIC,
+      "Pack.unpack(payload, type, ...) -> tuple\n\n"
+      "Unpack <payload>, using the list of field types that follows, and "
+      "return a tuple of the unpacked fields."
+    },
+    { "compile", (PyCFunction) Pack_Compile, METH_VARARGS | METH_STATIC,
+      "Pack.compile(type, ...) -> PackFormat\n\n"
+      "Check the given list of field types once and return a PackFormat "
+      "whose pack() and unpack() methods use it, so that messages with the "
+      "same layout can be packed and unpacked without checking it again."
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject PackType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "mx.Pack",                  /*tp_name*/
+    sizeof(PyObject),           /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    0,                          /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "Data packer/unpacker.\n\n"
+    "A C implementation of the Pack class in demo/Pack.py, with the same\n"
+    "field types (Pack.INT8 to Pack.STRING) and the same wire format.\n",
+    0,		                /* tp_traverse */
+    0,		                /* tp_clear */
+    0,		                /* tp_richcompare */
+    0,		                /* tp_weaklistoffset */
+    0,		                /* tp_iter */
+    0,		                /* tp_iternext */
+    Pack_methods,               /* tp_methods */
+};
+
+/*
+ * Add the field types to the Pack class as class attributes.
+ */
+static int Pack_AddTypes(void)
+{
+    int i;
+
+    for (i = 0; i < PACK_COUNT; i++) {
+        PyObject *value = PyLong_FromLong(i);
+
+        if (value == NULL ||
+            PyDict_SetItemString(PackType.tp_dict, pack_names[i], value) != 0) {
+            Py_XDECREF(value);
+            return -1;
+        }
+
+        Py_DECREF(value);
+    }
+
+    PyType_Modified(&PackType);
+
+    return 0;
+}
+
 static struct PyModuleDef mx_module = {
     PyModuleDef_HEAD_INIT,          /* PyModuleDef_Base m_base */
     "mx",                           /* const char* m_name */
@@ -1012,6 +1965,15 @@ PyMODINIT_FUNC PyInit_mx(void)
     if (PyType_Ready(&MXType) < 0)
         return NULL;
 
+    if (PyType_Ready(&PayloadType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&PackType) < 0 || Pack_AddTypes() < 0)
+        return NULL;
+
+    if (PyType_Ready(&PackFormatType) < 0)
+        return NULL;
+
     m = PyModule_Create(&mx_module);
 
     if (m == NULL)
@@ -1021,5 +1983,17 @@ PyMODINIT_FUNC PyInit_mx(void)
 
     PyModule_AddObject(m, "MX", (PyObject *)&MXType);
 
+    Py_INCREF(&PayloadType);
+
+    PyModule_AddObject(m, "Payload", (PyObject *)&PayloadType);
+
+    Py_INCREF(&PackType);
+
+    PyModule_AddObject(m, "Pack", (PyObject *)&PackType);
+
+    Py_INCREF(&PackFormatType);
+
+    PyModule_AddObject(m, "PackFormat", (PyObject *)&PackFormatType);
+
     return m;
 }
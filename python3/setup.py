@@ -26,6 +26,7 @@ setup(
   description='Message Exchange',
   author='Jacco van Schaik',
   author_email='jacco@jaccovanschaik.net',
+  py_modules=[ 'aiomx' ],
   ext_modules=[
     Extension("mx",
       sources      = [ "pymx.c" ],
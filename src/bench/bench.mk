@@ -0,0 +1,23 @@
+# bench/bench.mk: Makefile fragment for the benchmarks.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+BENCH_DIR    := bench
+BENCH        := $(BENCH_DIR)/mxbench
+BENCH_FORMAT := csv
+BENCH_OUTPUT := $(BENCH_DIR)/results.$(BENCH_FORMAT)
+
+CLEAN += $(BENCH)
+
+.PHONY: bench
+
+# Run all benchmarks. Use BENCH_FLAGS to select workloads, payload sizes etc.
+# (see "bench/mxbench -h") and BENCH_FORMAT=json for JSON output.
+
+bench: $(BENCH)
+	$(BENCH) -f $(BENCH_FORMAT) $(BENCH_FLAGS) > $(BENCH_OUTPUT)
+	@echo "Results are in $(BENCH_OUTPUT)."
@@ -0,0 +1,850 @@
+/*
+ * mxbench.c: Benchmarks for MX.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ *
+ * Every benchmark run starts a master component (this process) with a unique MX
+ * name on localhost, spawns the required number of client components (which
+ * are this program again, started with "--child") and reports the results as
+ * one line of CSV or one JSON object.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <libjvs/options.h>
+#include <libjvs/utils.h>
+
+#include "libmx.h"
+
+/*
+ * Runs with large payloads or many components have their message count
+ * reduced, so that no more than this many payload bytes are sent in one run.
+ */
+#define MAX_RUN_BYTES (64 * 1024 * 1024)
+
+/*
+ * Give up on a run after this many seconds.
+ */
+#define RUN_TIMEOUT 60
+
+extern char **environ;
+
+typedef struct Bench Bench;
+
+/*
+ * A benchmark workload.
+ */
+typedef struct {
+    const char *name;                   // Name of the workload.
+    bool sized;                         // Sweeps payload sizes.
+    bool multi;                         // Sweeps component counts.
+    int count;                          // Default operations per component.
+    void (*setup)(MX *mx, Bench *bench);        // Set up the master.
+    void (*start)(MX *mx, Bench *bench);        // All children are ready.
+    void (*child)(MX *mx, Bench *bench);        // Set up a child.
+    void (*go)(MX *mx, int fd, Bench *bench);   // Child got Start message.
+} Workload;
+
+/*
+ * The state of a benchmark run.
+ */
+struct Bench {
+    const Workload *workload;
+
+    uint32_t size;                      // Payload size.
+    int comps;                          // Number of child components.
+    int count;                          // Number of operations per component.
+    int index;                          // Index of this child.
+    int busy_poll;                      // Busy-poll time in microseconds.
+
+    uint32_t start_msg;                 // Sent to children when all are ready.
+    uint32_t done_msg;                  // Sent by children when they're done.
+    uint32_t data_msg;                  // Workload data.
+    uint32_t reply_msg;                 // Replies to data messages.
+
+    char *payload;                      // Payload to send.
+
+    int ready;                          // Number of children ready.
+    int done;                           // Number of children done.
+    int *fd;                            // Connections to the children.
+
+    uint64_t received;                  // Number of messages received.
+    uint64_t operations;                // Number of operations done.
+
+    double t0, t1;                      // Start and end of the run.
+    double sent;                        // Time of the last send (roundtrip).
+    double *rtt;                        // Round trip times (pingpong etc.).
+
+    bool failed;                        // Run timed out or failed.
+};
+
+static const char *format = "csv";
+static bool first_result = true;
+
+/*
+ * Compare the doubles pointed to by <p1> and <p2>.
+ */
+static int compare_doubles(const void *p1, const void *p2)
+{
+    const double *d1 = p1;
+    const double *d2 = p2;
+
+    return *d1 < *d2 ? -1 : *d1 > *d2 ? 1 : 0;
+}
+
+/*
+ * Print the header for the output, if there is one.
+ */
+static void bench_header(void)
+{
+    if (strcmp(format, "json") == 0) {
+        printf("[\n");
+    }
+    else {
+        printf("workload,size,components,busy_poll_us,operations,seconds,"
+               "ops_per_sec,mb_per_sec,p50_us,p99_us,max_us\n");
+    }
+}
+
+/*
+ * Print the footer for the output, if there is one.
+ */
+static void bench_footer(void)
+{
+    if (strcmp(format, "json") == 0) {
+        printf("\n]\n");
+    }
+}
+
+/*
+ * Print the results of <bench>.
+ */
+static void bench_report(Bench *bench)
+{
+    double secs = bench->t1 - bench->t0;
+    double rate = bench->failed ? 0 : bench->operations / secs;
+    double mbps = bench->workload->sized ? rate * bench->size / 1e6 : 0;
+
+    bool json = strcmp(format, "json") == 0;
+
+    if (json) {
+        printf("%s  { \"workload\": \"%s\", \"size\": %u, \"components\": %d, "
+                "\"busy_poll_us\": %d, \"operations\": %lu, \"seconds\": %.6f, "
+                "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f",
+                first_result ? "" : ",\n", bench->workload->name, bench->size,
+                bench->comps, bench->busy_poll, bench->operations, secs, rate,
+                mbps);
+    }
+    else {
+        printf("%s,%u,%d,%d,%lu,%.6f,%.1f,%.3f", bench->workload->name,
+                bench->size, bench->comps, bench->busy_poll, bench->operations,
+                secs, rate, mbps);
+    }
+
+    if (bench->rtt != NULL && bench->operations > 0) {
+        uint64_t n = bench->operations;
+
+        qsort(bench->rtt, n, sizeof(double), compare_doubles);
+
+        printf(json ? ", \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f" :
+                ",%.1f,%.1f,%.1f",
+                1e6 * bench->rtt[(n - 1) / 2],
+                1e6 * bench->rtt[(n - 1) * 99 / 100],
+                1e6 * bench->rtt[n - 1]);
+    }
+    else {
+        printf(json ? ", \"p50_us\": null, \"p99_us\": null, \"max_us\": null" :
+                ",,,");
+    }
+
+    if (json) {
+        printf(", \"failed\": %s }", bench->failed ? "true" : "false");
+    }
+    else {
+        printf("\n");
+    }
+
+    first_result = false;
+
+    fflush(stdout);
+}
+
+/*
+ * End the current run.
+ */
+static void bench_finish(MX *mx, Bench *bench)
+{
+    bench->t1 = mxNow();
+
+    mxShutdown(mx);
+}
+
+/*
+ * Called when the current run takes too long.
+ */
+static void bench_timeout(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    Bench *bench = udata;
+
+    bench->failed = true;
+
+    bench_finish(mx, bench);
+}
+
+/*
+ * Called when a child sends a Done message.
+ */
+static void bench_handle_done(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    Bench *bench = udata;
+
+    free(payload);
+
+    if (++bench->done == bench->comps) {
+        bench_finish(mx, bench);
+    }
+}
+
+/*
+ * Called when a child subscribes to the Start message, which it does when it
+ * is ready.
+ */
+static void bench_handle_ready(MX *mx, int fd, uint32_t type, void *udata)
+{
+    Bench *bench = udata;
+
+    bench->fd[bench->ready++] = fd;
+
+    if (bench->ready == bench->comps) {
+        bench->t0 = mxNow();
+
+        bench->workload->start(mx, bench);
+    }
+}
+
+/*
+ * Called in a child when the master sends a Start message.
+ */
+static void bench_handle_start(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    Bench *bench = udata;
+
+    free(payload);
+
+    if (bench->workload->go) {
+        bench->workload->go(mx, fd, bench);
+    }
+}
+
+/*
+ * Tell the master that we're done.
+ */
+static void bench_send_done(MX *mx, int fd, Bench *bench)
+{
+    mxPackAndSend(mx, fd, bench->done_msg, 0, PACK_INT32, bench->index, END);
+}
+
+/*
+ * Ping-pong: the master sends a message to each child in turn using
+ * mxSendAndWait, and the child sends it back.
+ */
+static void pingpong_handle_ping(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    Bench *bench = udata;
+
+    mxSend(mx, fd, bench->reply_msg, version, payload, size);
+
+    free(payload);
+}
+
+static void pingpong_child(MX *mx, Bench *bench)
+{
+    mxSubscribe(mx, bench->data_msg, pingpong_handle_ping, bench);
+}
+
+static void pingpong_start(MX *mx, Bench *bench)
+{
+    int i;
+
+    for (i = 0; i < bench->count; i++) {
+        uint32_t version, size;
+        char *reply;
+
+        double t = mxNow();
+
+        if (mxSendAndWait(mx, bench->fd[i % bench->comps], RUN_TIMEOUT,
+                    bench->reply_msg, &version, &reply, &size,
+                    bench->data_msg, 0, bench->payload, bench->size) != 0) {
+            bench->failed = true;
+            break;
+        }
+
+        bench->rtt[bench->operations++] = mxNow() - t;
+
+        free(reply);
+    }
+
+    bench_finish(mx, bench);
+}
+
+static void pingpong_setup(MX *mx, Bench *bench)
+{
+    bench->rtt = calloc(bench->count, sizeof(double));
+}
+
+/*
+ * Round trip: like ping-pong, but the master sends with mxSend and sends the
+ * next message from the handler for the reply, so that every round trip passes
+ * through the main loops on both sides. This is the workload that shows the
+ * effect of busy-polling.
+ */
+static void roundtrip_send(MX *mx, Bench *bench)
+{
+    bench->sent = mxNow();
+
+    mxSend(mx, bench->fd[bench->operations % bench->comps], bench->data_msg, 0,
+            bench->payload, bench->size);
+}
+
+static void roundtrip_handle_reply(MX *mx, int fd, uint32_t type,
+        uint32_t version, char *payload, uint32_t size, void *udata)
+{
+    Bench *bench = udata;
+
+    free(payload);
+
+    bench->rtt[bench->operations++] = mxNow() - bench->sent;
+
+    if (bench->operations == bench->count) {
+        bench_finish(mx, bench);
+    }
+    else {
+        roundtrip_send(mx, bench);
+    }
+}
+
+static void roundtrip_setup(MX *mx, Bench *bench)
+{
+    bench->rtt = calloc(bench->count, sizeof(double));
+
+    mxSubscribe(mx, bench->reply_msg, roundtrip_handle_reply, bench);
+}
+
+static void roundtrip_start(MX *mx, Bench *bench)
+{
+    roundtrip_send(mx, bench);
+}
+
+/*
+ * Stream and fanout: the master sends messages to the children, using mxSend to
+ * each of them in turn (stream) or mxBroadcast (fanout). Children report when
+ * they have received all of them.
+ */
+static void sink_handle_data(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    Bench *bench = udata;
+
+    free(payload);
+
+    if (++bench->received == bench->count) {
+        bench_send_done(mx, fd, bench);
+    }
+}
+
+static void sink_child(MX *mx, Bench *bench)
+{
+    mxSubscribe(mx, bench->data_msg, sink_handle_data, bench);
+}
+
+static void stream_start(MX *mx, Bench *bench)
+{
+    int i, c;
+
+    for (i = 0; i < bench->count; i++) {
+        for (c = 0; c < bench->comps; c++) {
+            mxSend(mx, bench->fd[c], bench->data_msg, 0,
+                    bench->payload, bench->size);
+        }
+    }
+
+    bench->operations = (uint64_t) bench->count * bench->comps;
+}
+
+static void fanout_start(MX *mx, Bench *bench)
+{
+    int i;
+
+    for (i = 0; i < bench->count; i++) {
+        mxBroadcast(mx, bench->data_msg, 0, bench->payload, bench->size);
+    }
+
+    bench->operations = (uint64_t) bench->count * bench->comps;
+}
+
+/*
+ * Fan-in: all children send messages to the master at the same time.
+ */
+static void fanin_go(MX *mx, int fd, Bench *bench)
+{
+    int i;
+
+    for (i = 0; i < bench->count; i++) {
+        mxSend(mx, fd, bench->data_msg, 0, bench->payload, bench->size);
+    }
+}
+
+static void fanin_handle_data(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    Bench *bench = udata;
+
+    free(payload);
+
+    if (++bench->operations == (uint64_t) bench->count * bench->comps) {
+        bench_finish(mx, bench);
+    }
+}
+
+static void fanin_setup(MX *mx, Bench *bench)
+{
+    mxSubscribe(mx, bench->data_msg, fanin_handle_data, bench);
+}
+
+static void fanin_start(MX *mx, Bench *bench)
+{
+    mxBroadcast(mx, bench->start_msg, 0, NULL, 0);
+}
+
+/*
+ * Join storm: all children are started at once, and the run ends when the
+ * master has seen all of them. This includes the time to start the processes.
+ */
+static void join_handle_new_component(MX *mx, int fd, const char *name,
+        void *udata)
+{
+    Bench *bench = udata;
+
+    if (++bench->operations == bench->comps) {
+        bench_finish(mx, bench);
+    }
+}
+
+static void join_setup(MX *mx, Bench *bench)
+{
+    mxOnNewComponent(mx, join_handle_new_component, bench);
+
+    bench->t0 = mxNow();
+}
+
+/*
+ * Timer churn: create lots of timers in the master, remove a quarter of them,
+ * move the rest forward and wait for them all to go off.
+ */
+static void timers_handle_timer(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    Bench *bench = udata;
+
+    if (++bench->received == bench->operations) {
+        bench_finish(mx, bench);
+    }
+}
+
+static void timers_setup(MX *mx, Bench *bench)
+{
+    int i;
+
+    MX_Timer **timer = calloc(bench->count, sizeof(MX_Timer *));
+
+    bench->t0 = mxNow();
+
+    for (i = 0; i < bench->count; i++) {
+        timer[i] = mxCreateTimer(mx, bench->t0 + RUN_TIMEOUT + i,
+                timers_handle_timer, bench);
+    }
+
+    for (i = 0; i < bench->count; i++) {
+        if (i % 4 == 1) {
+            mxRemoveTimer(mx, timer[i]);
+        }
+        else {
+            mxAdjustTimer(mx, timer[i], mxNow());
+
+            bench->operations++;
+        }
+    }
+
+    free(timer);
+}
+
+/*
+ * Registration storm: all children register lots of new message types at the
+ * same time.
+ */
+static void register_go(MX *mx, int fd, Bench *bench)
+{
+    int i;
+    char name[64];
+
+    for (i = 0; i < bench->count; i++) {
+        snprintf(name, sizeof(name), "Bench.Register.%d.%d", bench->index, i);
+
+        mxRegister(mx, name);
+    }
+
+    bench_send_done(mx, fd, bench);
+}
+
+static void register_start(MX *mx, Bench *bench)
+{
+    mxBroadcast(mx, bench->start_msg, 0, NULL, 0);
+
+    bench->operations = (uint64_t) bench->count * bench->comps;
+}
+
+static const Workload workloads[] = {
+    { "pingpong",  true,  true,  10000,  pingpong_setup,  pingpong_start,  pingpong_child, NULL },
+    { "roundtrip", true,  true,  10000,  roundtrip_setup, roundtrip_start, pingpong_child, NULL },
+    { "stream",    true,  true,  100000, NULL,            stream_start,    sink_child,     NULL },
+    { "fanout",    true,  true,  100000, NULL,            fanout_start,    sink_child,     NULL },
+    { "fanin",     true,  true,  100000, fanin_setup,     fanin_start,     NULL,           fanin_go },
+    { "join",      false, true,  1,      join_setup,      NULL,            NULL,           NULL },
+    { "timers",    false, false, 10000,  timers_setup,    NULL,            NULL,           NULL },
+    { "register",  false, true,  200,    NULL,            register_start,  NULL,           register_go },
+};
+
+static const int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+
+/*
+ * Return the workload called <name>, or NULL if there is no such workload.
+ */
+static const Workload *find_workload(const char *name)
+{
+    int i;
+
+    for (i = 0; i < num_workloads; i++) {
+        if (strcmp(workloads[i].name, name) == 0) return &workloads[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Register the message types used by all workloads in <mx>.
+ */
+static void bench_register(MX *mx, Bench *bench)
+{
+    bench->start_msg = mxRegister(mx, "Bench.Start");
+    bench->done_msg  = mxRegister(mx, "Bench.Done");
+    bench->data_msg  = mxRegister(mx, "Bench.Data");
+    bench->reply_msg = mxRegister(mx, "Bench.Reply");
+
+    bench->payload = calloc(1, bench->size + 1);
+}
+
+/*
+ * Run as child component <index> in workload <workload> on MX <mx_name>.
+ */
+static int bench_child(const char *workload, const char *mx_name,
+        uint32_t size, int count, int index, int busy_poll)
+{
+    int r;
+    char name[32];
+    Bench bench = { 0 };
+
+    snprintf(name, sizeof(name), "Child.%d", index);
+
+    bench.workload = find_workload(workload);
+    bench.size     = size;
+    bench.count    = count;
+    bench.index    = index;
+
+    MX *mx = mxClient("localhost", mx_name, name);
+
+    if (mx == NULL) {
+        fputs(mxError(), stderr);
+        return 1;
+    }
+
+    mxSetBusyPoll(mx, busy_poll / 1e6);
+
+    bench_register(mx, &bench);
+
+    if (bench.workload->child) {
+        bench.workload->child(mx, &bench);
+    }
+
+    /* Subscribing to Start tells the master that we're ready. */
+
+    if (bench.workload->start) {
+        mxSubscribe(mx, bench.start_msg, bench_handle_start, &bench);
+    }
+
+    r = mxRun(mx);
+
+    mxDestroy(mx);
+
+    free(bench.payload);
+
+    return r;
+}
+
+/*
+ * Start child component <index> for <bench> on MX <mx_name>. Returns its pid.
+ */
+static pid_t bench_spawn(Bench *bench, const char *mx_name, int index)
+{
+    pid_t pid;
+    char size[16], count[16], number[16], busy_poll[16];
+
+    char *argv[] = {
+        "mxbench", "--child", (char *) bench->workload->name, (char *) mx_name,
+        size, count, number, busy_poll, NULL
+    };
+
+    snprintf(size, sizeof(size), "%u", bench->size);
+    snprintf(count, sizeof(count), "%d", bench->count);
+    snprintf(number, sizeof(number), "%d", index);
+    snprintf(busy_poll, sizeof(busy_poll), "%d", bench->busy_poll);
+
+    if (posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv, environ) != 0) {
+        perror("posix_spawn");
+        return -1;
+    }
+
+    return pid;
+}
+
+/*
+ * Do a single run of <workload> with payload size <size>, <comps> child
+ * components, <count> operations per component and a busy-poll time of
+ * <busy_poll> microseconds.
+ */
+static void bench_run(const Workload *workload, uint32_t size, int comps,
+        int count, int busy_poll, int run)
+{
+    int i;
+    char mx_name[64];
+    pid_t *pid = calloc(comps, sizeof(pid_t));
+    Bench bench = { 0 };
+
+    if (workload->sized && (uint64_t) size * comps * count > MAX_RUN_BYTES) {
+        count = MAX(100, MAX_RUN_BYTES / ((uint64_t) size * comps));
+    }
+
+    snprintf(mx_name, sizeof(mx_name), "mxbench.%d.%d", getpid(), run);
+
+    bench.workload  = workload;
+    bench.size      = size;
+    bench.comps     = comps;
+    bench.count     = count;
+    bench.busy_poll = busy_poll;
+    bench.fd        = calloc(comps, sizeof(int));
+
+    MX *mx = mxMaster(mx_name, "Bench", false);
+
+    if (mx == NULL) {
+        fputs(mxError(), stderr);
+        return;
+    }
+
+    mxSetBusyPoll(mx, busy_poll / 1e6);
+
+    bench_register(mx, &bench);
+
+    mxSubscribe(mx, bench.done_msg, bench_handle_done, &bench);
+
+    if (workload->start) {
+        mxOnNewSubscriber(mx, bench.start_msg, bench_handle_ready, &bench);
+    }
+
+    if (workload->setup) {
+        workload->setup(mx, &bench);
+    }
+
+    for (i = 0; i < comps; i++) {
+        pid[i] = bench_spawn(&bench, mx_name, i);
+    }
+
+    mxCreateTimer(mx, mxNow() + RUN_TIMEOUT, bench_timeout, &bench);
+
+    mxRun(mx);
+
+    bench_report(&bench);
+
+    mxDestroy(mx);
+
+    /* The children exit when the master goes away. Make sure they do. */
+
+    for (i = 0; i < comps; i++) {
+        if (pid[i] <= 0) continue;
+
+        if (bench.failed) kill(pid[i], SIGTERM);
+
+        waitpid(pid[i], NULL, 0);
+    }
+
+    free(bench.payload);
+    free(bench.rtt);
+    free(bench.fd);
+    free(pid);
+}
+
+/*
+ * Parse comma-separated list <list> into <values>, which has room for <max>
+ * values. Returns the number of values found.
+ */
+static int parse_list(const char *list, int *values, int max)
+{
+    int n = 0;
+    char *end;
+
+    while (n < max && *list != '\0') {
+        values[n++] = strtol(list, &end, 0);
+
+        if (*end != ',') break;
+
+        list = end + 1;
+    }
+
+    return n;
+}
+
+/*
+ * Show usage.
+ */
+static void usage(const char *argv0)
+{
+    int i;
+
+    fprintf(stderr, "Usage: %s [ <options> ]\n\n", argv0);
+
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -w, --workloads <w,...>    Workloads to run (default: all)\n");
+    fprintf(stderr, "  -s, --sizes <n,...>        Payload sizes (default: 16,1024,65536)\n");
+    fprintf(stderr, "  -c, --components <n,...>   Component counts (default: 1,4,16)\n");
+    fprintf(stderr, "  -n, --count <n>            Operations per component (default: depends\n");
+    fprintf(stderr, "                             on the workload)\n");
+    fprintf(stderr, "  -b, --busy-poll <us,...>   Busy-poll times in microseconds (default: 0)\n");
+    fprintf(stderr, "  -f, --format csv|json      Output format (default: csv)\n\n");
+
+    fprintf(stderr, "Workloads:");
+
+    for (i = 0; i < num_workloads; i++) {
+        fprintf(stderr, " %s", workloads[i].name);
+    }
+
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int i, s, c, b, run = 0;
+    int sizes[16], num_sizes;
+    int comps[16], num_comps;
+    int busy_polls[16], num_busy_polls;
+    int count;
+
+    const char *workload_list;
+    char *names, *name, *saveptr;
+    bool selected[num_workloads];
+
+    Options *options;
+
+    if (argc == 8 && strcmp(argv[1], "--child") == 0) {
+        return bench_child(argv[2], argv[3],
+                atoi(argv[4]), atoi(argv[5]), atoi(argv[6]), atoi(argv[7]));
+    }
+
+    options = optCreate();
+
+    optAdd(options, "workloads", 'w', ARG_REQUIRED);
+    optAdd(options, "sizes", 's', ARG_REQUIRED);
+    optAdd(options, "components", 'c', ARG_REQUIRED);
+    optAdd(options, "count", 'n', ARG_REQUIRED);
+    optAdd(options, "busy-poll", 'b', ARG_REQUIRED);
+    optAdd(options, "format", 'f', ARG_REQUIRED);
+    optAdd(options, "help", 'h', ARG_NONE);
+
+    if (optParse(options, argc, argv) == -1 || optIsSet(options, "help")) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    num_sizes = parse_list(optArg(options, "sizes", "16,1024,65536"), sizes, 16);
+    num_comps = parse_list(optArg(options, "components", "1,4,16"), comps, 16);
+    num_busy_polls = parse_list(optArg(options, "busy-poll", "0"), busy_polls, 16);
+
+    count  = atoi(optArg(options, "count", "0"));
+    format = optArg(options, "format", "csv");
+
+    workload_list = optArg(options, "workloads", NULL);
+
+    for (i = 0; i < num_workloads; i++) {
+        selected[i] = (workload_list == NULL);
+    }
+
+    if (workload_list != NULL) {
+        names = strdup(workload_list);
+
+        for (name = strtok_r(names, ",", &saveptr); name;
+             name = strtok_r(NULL, ",", &saveptr)) {
+            const Workload *workload = find_workload(name);
+
+            if (workload == NULL) {
+                fprintf(stderr, "Unknown workload \"%s\".\n", name);
+                usage(argv[0]);
+                return 1;
+            }
+
+            selected[workload - workloads] = true;
+        }
+
+        free(names);
+    }
+
+    /* Components talk to the master over sockets that may go away at any
+     * moment. Don't let that kill us. */
+
+    signal(SIGPIPE, SIG_IGN);
+
+    bench_header();
+
+    for (i = 0; i < num_workloads; i++) {
+        const Workload *workload = &workloads[i];
+
+        if (!selected[i]) continue;
+
+        for (s = 0; s < (workload->sized ? num_sizes : 1); s++) {
+            for (c = 0; c < (workload->multi ? num_comps : 1); c++) {
+                for (b = 0; b < num_busy_polls; b++) {
+                    bench_run(workload,
+                            workload->sized ? sizes[s] : 0,
+                            workload->multi ? comps[c] : 0,
+                            count ? count : workload->count,
+                            busy_polls[b], run++);
+                }
+            }
+        }
+    }
+
+    bench_footer();
+
+    optDestroy(options);
+
+    return 0;
+}
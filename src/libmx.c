@@ -8,6 +8,8 @@
  * http://www.opensource.org/licenses/mit-license.php for details.
  */
 
+#define _GNU_SOURCE                     /* For pthread_setaffinity_np. */
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -16,6 +18,8 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -23,6 +27,13 @@
 #include <limits.h>
 #include <float.h>
 #include <sys/socket.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
 
 #include <libjvs/pa.h>
 #include <libjvs/net.h>
@@ -37,10 +48,26 @@
 #include "msg.h"
 #include "cmd.h"
 #include "evt.h"
+#include "trc.h"
 
 #define MIN_PORT 1024
 #define MAX_PORT 65535
 
+#define DEFAULT_PEER_CONNECTS 32        /* Simultaneous peer connects. */
+#define PEER_CONNECT_TIMEOUT  5000      /* Peer connect timeout in ms. */
+#define DEFAULT_IDLE_TIMEOUT  60        /* Idle timeout in lazy mode (s). */
+#define STATS_REPORT_INTERVAL 1         /* Interval between StatsReports (s). */
+
+/* A StatsReport has a header with the time it was sent, the period its totals
+ * cover and the number of entries that follow. Each entry has the id of the
+ * component at the other end of the connection, the message type and the seven
+ * counts of an MX_StatsEntry. */
+
+#define STATS_REPORT_HEADER   20
+#define STATS_REPORT_ENTRY    62
+
+#define MX_FILTERED 0x80000000          /* Subscription entry has a filter. */
+
 static Buffer mx_message = { 0 };
 
 /* Severity of the last error. */
@@ -89,2330 +116,7690 @@ static void mx_notice(char *fmt, ...)
     va_end(ap);
 }
 
+/* Tracing. Each thread records events in its own ring, so recording needs no
+ * locks. The lock is only taken to add, remove and dump rings. Compile with
+ * -DMX_NO_TRACE to leave out the tracepoints altogether. */
+
+static int mx_trace_on = 0;
+static uint32_t mx_trace_events = MX_TRACE_EVENTS;
+
+static uint64_t mx_trace_start_ticks;
+static uint64_t mx_trace_start_ns;
+
+static MX_TraceRing *mx_trace_rings = NULL;
+static pthread_mutex_t mx_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t mx_trace_key;
+static pthread_once_t mx_trace_once = PTHREAD_ONCE_INIT;
+
+static __thread MX_TraceRing *mx_trace_ring = NULL;
+static __thread char mx_trace_thread_name[32];
+
+#ifdef MX_NO_TRACE
+#define MX_TRACING() 0
+#else
+#define MX_TRACING() \
+    __builtin_expect(__atomic_load_n(&mx_trace_on, __ATOMIC_RELAXED), 0)
+#endif
+
+#define MX_TRACE(what, fd, type, size) \
+    do { \
+        if (MX_TRACING()) mx_trace(what, mx_trace_ticks(), 0, fd, type, size); \
+    } while (0)
+
+#define MX_TRACE_START() (MX_TRACING() ? mx_trace_ticks() : 0)
+
+#define MX_TRACE_SPAN(what, t0, fd, type, size) \
+    do { \
+        if (MX_TRACING() && (t0) != 0) \
+            mx_trace(what, t0, mx_trace_ticks() - (t0), fd, type, size); \
+    } while (0)
+
 /*
- * Convert the double-precision timestamp in <t> to the timespec in <ts>.
+ * Return the monotonic clock in nanoseconds.
  */
-static void double_to_timespec(double t, struct timespec *ts)
+static uint64_t mx_trace_ns(void)
 {
-    if (t <= 0) {
-        ts->tv_sec  = 0;
-        ts->tv_nsec = 0;
-    }
-    else {
-        ts->tv_sec  = t;
-        ts->tv_nsec = (t - ts->tv_sec) * 1000000000L;
-    }
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 /*
- * Initialize command queue <queue>.
+ * Return the current time in ticks of the trace clock. That's the time stamp
+ * counter where there is one, because it's much cheaper than clock_gettime().
  */
-static void mx_init_queue(MX_Queue *queue)
+static inline uint64_t mx_trace_ticks(void)
 {
-    pthread_mutex_init(&queue->ok_to_access, NULL);
-
-    sem_init(&queue->ok_to_read, 0, 0);
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return mx_trace_ns();
+#endif
 }
 
 /*
- * Push command <cmd> onto queue <queue>.
+ * Give the calling thread the name <fmt> (plus arguments) in traces.
  */
-static void mx_push_command(MX_Queue *queue, MX_Command *cmd)
+__attribute__ ((format (printf, 1, 2)))
+static void mx_trace_name(const char *fmt, ...)
 {
-    pthread_mutex_lock(&queue->ok_to_access);
+    va_list ap;
 
-    listAppendTail(&queue->commands, cmd);
+    va_start(ap, fmt);
+    vsnprintf(mx_trace_thread_name, sizeof(mx_trace_thread_name), fmt, ap);
+    va_end(ap);
+}
 
-    pthread_mutex_unlock(&queue->ok_to_access);
+/*
+ * Mark the ring in <arg> as dead, because its thread is exiting.
+ */
+static void mx_trace_thread_exit(void *arg)
+{
+    MX_TraceRing *ring = arg;
 
-    sem_post(&queue->ok_to_read);
+    pthread_mutex_lock(&mx_trace_lock);
+    ring->dead = true;
+    pthread_mutex_unlock(&mx_trace_lock);
 }
 
 /*
- * Pop a command off of <queue> and return it. This function will block until a
- * command is available. <deadline> may point to a double precision timestamp,
- * in which case this function will wait until that time for a command. If
- * <deadline> is NULL this function will wait indefinitely.
- * If <deadline> is given and no command arrives on time this function returns
- * NULL. Otherwise it returns the received command.
+ * Create the key that tells us when a thread with a ring exits.
  */
-static MX_Command *mx_await_command(MX_Queue *queue, double deadline)
+static void mx_trace_create_key(void)
 {
-    int r;
+    pthread_key_create(&mx_trace_key, mx_trace_thread_exit);
+}
 
-    if (isfinite(deadline)) {
-        struct timespec time_spec;
+/*
+ * Create a trace ring for the calling thread.
+ */
+static MX_TraceRing *mx_trace_create_ring(void)
+{
+    MX_TraceRing *ring;
 
-        double_to_timespec(deadline, &time_spec);
+    pthread_once(&mx_trace_once, mx_trace_create_key);
 
-        r = sem_timedwait(&queue->ok_to_read, &time_spec);
-    }
-    else {
-        r = sem_wait(&queue->ok_to_read);
-    }
+    pthread_mutex_lock(&mx_trace_lock);
 
-    if (r == 0) {
-        pthread_mutex_lock(&queue->ok_to_access);
+    ring = calloc(1, sizeof(*ring) + mx_trace_events * sizeof(MX_TraceRecord));
 
-        MX_Command *cmd = listRemoveHead(&queue->commands);
+    ring->tid  = syscall(SYS_gettid);
+    ring->mask = mx_trace_events - 1;
 
-        pthread_mutex_unlock(&queue->ok_to_access);
+    strcpy(ring->name, mx_trace_thread_name[0] ? mx_trace_thread_name : "main");
 
-        return cmd;
-    }
-    else {
-        return NULL;
-    }
+    ring->next = mx_trace_rings;
+    mx_trace_rings = ring;
+
+    pthread_mutex_unlock(&mx_trace_lock);
+
+    pthread_setspecific(mx_trace_key, ring);
+
+    return ring;
 }
 
 /*
- * Create and return a new event of type <type>.
+ * Record trace event <what> at time <t> (in ticks), lasting <duration> ticks,
+ * involving file descriptor <fd>, message type <type> and <size> bytes.
  */
-static MX_Event *mx_new_event(MX_EventType type)
+static void mx_trace(MX_TraceEventType what, uint64_t t, uint64_t duration,
+        int fd, uint32_t type, uint32_t size)
 {
-    MX_Event *evt = calloc(1, sizeof(*evt));
+    MX_TraceRing *ring = mx_trace_ring;
+    MX_TraceRecord *rec;
 
-    evt->evt_type = type;
+    if (ring == NULL) {
+        ring = mx_trace_ring = mx_trace_create_ring();
+    }
 
-    return evt;
+    rec = ring->record + (ring->head & ring->mask);
+
+    rec->t        = t;
+    rec->duration = MIN(duration, UINT32_MAX);
+    rec->what     = what;
+    rec->fd       = fd;
+    rec->type     = type;
+    rec->size     = size;
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
 }
 
+/* Dispatch workers. The main thread holds the dispatcher's lock while it
+ * handles an event, and workers take it when they call into the library, so
+ * only one thread at a time touches the administration. */
+
+static __thread MX *mx_worker_mx = NULL;    /* Set in dispatch workers. */
+
 /*
- * Create and return a new MX_ET_CONN event. The new component's file
- * descriptor is <fd>.
+ * Take the lock that keeps <mx>'s dispatch workers out of its administration.
+ * Does nothing if <mx> has no dispatch workers.
  */
-static MX_Event *mx_connect_event(int fd)
+static void mx_lock(MX *mx)
 {
-    MX_Event *evt = mx_new_event(MX_ET_CONN);
-
-    evt->u.conn.fd = fd;
-
-    return evt;
+    if (mx->dispatcher != NULL) {
+        pthread_mutex_lock(&mx->dispatcher->lock);
+    }
 }
 
 /*
- * Create and return a new MX_ET_MSG event. The received message had type
- * <type>, version <version> and payload <payload> with size <size>.
+ * Release the lock taken by mx_lock().
  */
-static MX_Event *mx_message_event(int fd,
-        uint32_t type, uint32_t version, char *payload, uint32_t size)
-
+static void mx_unlock(MX *mx)
 {
-    MX_Event *evt = mx_new_event(MX_ET_MSG);
+    if (mx->dispatcher != NULL) {
+        pthread_mutex_unlock(&mx->dispatcher->lock);
+    }
+}
 
-    evt->u.msg.fd  = fd;
-    evt->u.msg.msg_type = type;
-    evt->u.msg.version = version;
-    evt->u.msg.payload = payload;
-    evt->u.msg.size = size;
+/* Publishing from any thread. Publishers find components and subscribers
+ * through immutable snapshots that the main thread replaces (never changes)
+ * when the administration changes. While it uses them, a publisher announces
+ * the epoch it started in, and whatever the main thread replaces or removes is
+ * only destroyed once every publisher has moved beyond the epoch in which that
+ * happened. */
 
-    return evt;
-}
+static __thread int mx_epoch_hint = -1;     /* Where to look for a free slot. */
 
 /*
- * Create and return a new MX_ET_ERR event. The error occurred on file
- * descriptor <fd> and had errno code <error>. <whence> is the function that
- * returned the error.
+ * Start using the snapshots in <mx>. Returns the slot to pass to mx_leave().
+ * If all MX_EPOCH_SLOTS slots are taken, we wait for one to come free, yielding
+ * the CPU after every pass over them.
  */
-static MX_Event *mx_error_event(int fd, const char *whence, int error)
+static MX_EpochSlot *mx_enter(MX *mx)
 {
-    MX_Event *evt = mx_new_event(MX_ET_ERR);
+    int i, n;
 
-    evt->u.err.fd     = fd;
-    evt->u.err.whence = strdup(whence);
-    evt->u.err.error  = error;
+    if (mx_epoch_hint < 0) {
+        mx_epoch_hint = syscall(SYS_gettid) % MX_EPOCH_SLOTS;
+    }
 
-    return evt;
+    for (i = mx_epoch_hint, n = 1; ; i = (i + 1) % MX_EPOCH_SLOTS, n++) {
+        MX_EpochSlot *slot = mx->epoch_slot + i;
+
+        uint64_t unused = 0;
+        uint64_t epoch = __atomic_load_n(&mx->epoch, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&slot->epoch, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&slot->epoch, &unused, epoch,
+                false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            mx_epoch_hint = i;
+
+            return slot;
+        }
+
+        if (n == MX_EPOCH_SLOTS) {
+            sched_yield();
+            n = 0;
+        }
+    }
 }
 
 /*
- * Create and return a new MX_ET_DISC event. The disconnected file descriptor
- * was <fd>; the function where the disconnect was first noticed was <whence>.
+ * Stop using the snapshots, and give up <slot>.
  */
-static MX_Event *mx_disc_event(int fd, const char *whence)
+static void mx_leave(MX_EpochSlot *slot)
 {
-    MX_Event *evt = mx_new_event(MX_ET_DISC);
-
-    evt->u.disc.fd = fd;
-    evt->u.disc.whence = strdup(whence);
-
-    return evt;
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
 }
 
 /*
- * Create and return a new MX_ET_TIMER event, about timer <timer> going off.
+ * Destroy everything retired in <mx> that no publisher can be using anymore,
+ * or everything if <all> is true.
  */
-static MX_Event *mx_timer_event(MX_Timer *timer)
+static void mx_reclaim(MX *mx, bool all)
 {
-    MX_Event *evt = mx_new_event(MX_ET_TIMER);
+    int i;
+    MX_Retired *retired;
 
-    // We're copying everything because we don't know what might happen to the
-    // original timer after we send this event to the main thread. We *do*
-    // know that at least the time is going to be set to infinitely far into
-    // the future, at least.
+    uint64_t oldest = UINT64_MAX;
 
-    evt->u.timer.t       = timer->t;
-    evt->u.timer.handler = timer->handler;
-    evt->u.timer.udata   = timer->udata;
+    if (listIsEmpty(&mx->retired)) return;
 
-    // We also copy the pointer to the original timer so the user can
-    // manipulate it in their timer handler.
+    for (i = 0; i < MX_EPOCH_SLOTS && !all; i++) {
+        uint64_t epoch = __atomic_load_n(&mx->epoch_slot[i].epoch,
+                __ATOMIC_SEQ_CST);
 
-    evt->u.timer.timer   = timer;
+        if (epoch != 0 && epoch < oldest) oldest = epoch;
+    }
 
-    return evt;
+    while ((retired = listHead(&mx->retired)) != NULL &&
+           retired->epoch < oldest) {
+        listRemoveHead(&mx->retired);
+
+        retired->destroy(mx, retired->ptr);
+
+        free(retired);
+    }
 }
 
 /*
- * Create a write command with <msg_type>, <version>, <payload> and payload
- * size <size>.
+ * Destroy <ptr> using <destroy> once no publisher can be using it anymore.
+ * Call this only after <ptr> has been removed from every snapshot.
  */
-static MX_Command *mx_create_write_command(uint32_t msg_type, uint32_t version,
-        const char *payload, uint32_t size)
+static void mx_retire(MX *mx, void *ptr, void (*destroy)(MX *mx, void *ptr))
 {
-    MX_Command *cmd = calloc(1, sizeof(*cmd));
+    MX_Retired *retired;
 
-    cmd->cmd_type = MX_CT_WRITE;
-    cmd->u.write.msg_type = msg_type;
-    cmd->u.write.version = version;
-    cmd->u.write.size = size;
+    if (ptr == NULL) return;
 
-    cmd->u.write.payload = memdup(payload, size);
+    retired = calloc(1, sizeof(*retired));
 
-    return cmd;
+    retired->epoch   = __atomic_fetch_add(&mx->epoch, 1, __ATOMIC_SEQ_CST);
+    retired->destroy = destroy;
+    retired->ptr     = ptr;
+
+    listAppendTail(&mx->retired, retired);
+
+    mx_reclaim(mx, false);
 }
 
 /*
- * Create a command that instructs the writer or timer threads to exit.
+ * Destroy snapshot <ptr>. To be used with mx_retire.
  */
-static MX_Command *mx_create_exit_command(void)
+static void mx_free_snapshot(MX *mx, void *ptr)
 {
-    MX_Command *cmd = calloc(1, sizeof(*cmd));
+    free(ptr);
+}
 
-    cmd->cmd_type = MX_CT_EXIT;
+/* Thread placement. */
 
-    return cmd;
-}
+static const char *mx_thread_names[NUM_MX_THREADS] = {
+    "main", "reader", "writer", "timer", "listener", "dispatch"
+};
 
 /*
- * Send pointer <ptr> over file descriptor <fd>.
+ * Give thread <thread>, which is of kind <kind>, the CPU affinity and scheduling
+ * set for that kind of thread. Returns 0 on success or an errno code.
  */
-static int mx_send_pointer(int fd, void *ptr)
+static int mx_place_thread(MX *mx, MX_Thread kind, pthread_t thread)
 {
-    int r = write(fd, &ptr, sizeof(ptr));
+    MX_Placement *place = &mx->placement[kind];
+    struct sched_param param = { .sched_priority = place->priority };
 
-    return r == sizeof(ptr) ? 0 : -1;
+    int r = 0;
+
+    if (place->pinned) {
+        r = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &place->cpus);
+    }
+
+    if (r == 0 && place->scheduled) {
+        r = pthread_setschedparam(thread, place->policy, &param);
+    }
+
+    return r;
 }
 
 /*
- * Send a message of type <type>, with version <version>, payload <payload> and
- * payload size <size> to component <comp>.
+ * Add the CPUs in <spec> to <cpus>. <spec> is a comma-separated list of CPU
+ * numbers, ranges like "2-5" and, if <nodes> is true, NUMA nodes like "node1".
+ * Returns true if <spec> was valid, false otherwise.
  */
-static void mx_send(MX_Component *comp,
-        uint32_t type, uint32_t version,
-        const char *payload, uint32_t size)
+static bool mx_parse_cpus(const char *spec, cpu_set_t *cpus, bool nodes)
 {
-    MX_Command *cmd;
+    const char *p = spec;
 
-    cmd = mx_create_write_command(type, version, payload, size);
+    while (*p != '\0') {
+        char *end;
+        unsigned long first, last;
 
-    mx_push_command(&comp->writer_queue, cmd);
+        if (nodes && strncmp(p, "node", 4) == 0) {
+            char path[64], list[4096];
+            FILE *fp;
+            bool ok;
+
+            first = strtoul(p + 4, &end, 10);
+
+            if (end == p + 4) return false;
+
+            snprintf(path, sizeof(path),
+                    "/sys/devices/system/node/node%lu/cpulist", first);
+
+            if ((fp = fopen(path, "r")) == NULL) return false;
+
+            ok = fgets(list, sizeof(list), fp) != NULL;
+
+            fclose(fp);
+
+            if (!ok) return false;
+
+            list[strcspn(list, "\n")] = '\0';
+
+            if (!mx_parse_cpus(list, cpus, false)) return false;
+        }
+        else {
+            first = last = strtoul(p, &end, 10);
+
+            if (end == p) return false;
+
+            if (*end == '-') {
+                p = end + 1;
+                last = strtoul(p, &end, 10);
+
+                if (end == p) return false;
+            }
+
+            if (first > last || last >= CPU_SETSIZE) return false;
+
+            while (first <= last) {
+                CPU_SET(first++, cpus);
+            }
+        }
+
+        if (*end == ',') {
+            end++;
+        }
+        else if (*end != '\0') {
+            return false;
+        }
+
+        p = end;
+    }
+
+    return true;
 }
 
 /*
- * Pack a message with type <type> and version <version> with the fields in <ap>
- * to component <comp>.
+ * Apply the placement for threads of kind <kind> to all such threads that
+ * currently exist. Returns 0 on success or -1 on failure.
  */
-static void mx_va_pack(MX_Component *comp,
-        uint32_t type, uint32_t version, va_list ap)
+static int mx_place_threads(MX *mx, MX_Thread kind)
 {
-    char *payload;
-    size_t size = vastrpack(&payload, ap);
+    int fd, i, r = 0;
+
+    switch(kind) {
+    case MX_THREAD_MAIN:
+        r = mx_place_thread(mx, kind, mx->main_thread);
+        break;
+    case MX_THREAD_TIMER:
+        if (mx->timer_thread != 0) {
+            r = mx_place_thread(mx, kind, mx->timer_thread);
+        }
+        break;
+    case MX_THREAD_LISTENER:
+        if (mx->listener_thread != 0) {
+            r = mx_place_thread(mx, kind, mx->listener_thread);
+        }
+        break;
+    case MX_THREAD_READER:
+    case MX_THREAD_WRITER:
+        for (fd = 0; r == 0 && fd < paCount(&mx->components); fd++) {
+            MX_Component *comp = paGet(&mx->components, fd);
+            pthread_t thread;
 
-    dbgAssert(stderr, size <= MAX_PAYLOAD_SIZE, "payload too large.\n");
+            if (comp == NULL) continue;
 
-    mx_send(comp, type, version, payload, size);
+            thread = kind == MX_THREAD_READER ?
+                comp->reader_thread : comp->writer_thread;
 
-    free(payload);
+            if (thread != 0) {
+                r = mx_place_thread(mx, kind, thread);
+            }
+        }
+        break;
+    case MX_THREAD_DISPATCH:
+        for (i = 0; r == 0 && mx->dispatcher && i < mx->dispatcher->count; i++) {
+            r = mx_place_thread(mx, kind, mx->dispatcher->threads[i]);
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (r != 0) {
+        mx_error("couldn't place %s thread (%s).\n",
+                mx_thread_names[kind], strerror(r));
+        return -1;
+    }
+
+    return 0;
 }
 
 /*
- * Pack a message with type <type> and version <version> and the subsequent
- * fields to component <comp>.
+ * Parse scheduling specification <spec> ("other", "batch", "idle", "fifo:<n>"
+ * or "rr:<n>") into <policy> and <priority>. Returns true if it was valid.
  */
-static void mx_pack(MX_Component *comp,
-        uint32_t type, uint32_t version, ...)
+static bool mx_parse_scheduling(const char *spec, int *policy, int *priority)
 {
-    va_list ap;
+    static const struct {
+        const char *name;
+        int policy;
+    } policies[] = {
+        { "other", SCHED_OTHER },
+        { "batch", SCHED_BATCH },
+        { "idle",  SCHED_IDLE },
+        { "fifo",  SCHED_FIFO },
+        { "rr",    SCHED_RR }
+    };
+
+    size_t i, len = strcspn(spec, ":");
+    char *end;
+
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strlen(policies[i].name) == len &&
+            strncmp(spec, policies[i].name, len) == 0) break;
+    }
 
-    va_start(ap, version);
-    mx_va_pack(comp, type, version, ap);
-    va_end(ap);
+    if (i == sizeof(policies) / sizeof(policies[0])) return false;
+
+    *policy = policies[i].policy;
+    *priority = 0;
+
+    if (spec[len] == ':') {
+        *priority = strtol(spec + len + 1, &end, 10);
+
+        if (end == spec + len + 1 || *end != '\0') return false;
+    }
+
+    return true;
 }
 
 /*
- * Add an await struct to the component associated with component <comp>.
+ * Set up thread placement from environment variable <var>, which contains
+ * whitespace-separated "<kind>=<value>" entries. If <affinity> is true the
+ * values are CPU lists, otherwise they are scheduling specifications. Returns
+ * 0 on success or -1 on failure.
  */
-static MX_Await *mx_add_await(MX_Component *comp, uint32_t type)
+static int mx_place_from_env(MX *mx, const char *var, bool affinity)
 {
-    MX_Await *await = calloc(1, sizeof(*await));
+    const char *env = getenv(var);
+    char *copy, *entry, *save;
 
-    await->msg_type = type;
+    int r = 0;
 
-    pthread_mutex_init(&await->mutex, NULL);
-    pthread_mutex_lock(&await->mutex);
+    if (env == NULL) return 0;
 
-    pthread_rwlock_wrlock(&comp->await_lock);
+    copy = strdup(env);
 
-    listAppendTail(&comp->awaits, await);
+    for (entry = strtok_r(copy, " \t", &save); entry && r == 0;
+         entry = strtok_r(NULL, " \t", &save)) {
+        char *value = strchr(entry, '=');
+        int kind, policy, priority;
 
-    pthread_rwlock_unlock(&comp->await_lock);
+        if (value != NULL) *value++ = '\0';
 
-    return await;
+        for (kind = 0; kind < NUM_MX_THREADS; kind++) {
+            if (strcmp(entry, mx_thread_names[kind]) == 0) break;
+        }
+
+        if (value == NULL || kind == NUM_MX_THREADS) {
+            mx_error("invalid entry \"%s\" in %s.\n", entry, var);
+            r = -1;
+        }
+        else if (affinity) {
+            r = mxSetAffinity(mx, kind, value);
+        }
+        else if (!mx_parse_scheduling(value, &policy, &priority)) {
+            mx_error("invalid scheduling \"%s\" for %s threads in %s.\n",
+                    value, entry, var);
+            r = -1;
+        }
+        else {
+            r = mxSetScheduling(mx, kind, policy, priority);
+        }
+    }
+
+    free(copy);
+
+    return r;
 }
 
 /*
- * Send a message of type <request_type> with version <request_version>, payload
- * <request_payload> and payload size <request_size> to component <comp>, and
- * wait for a reply with type <reply_type>. If the reply arrives within
- * <timeout> seconds, 0 is returned and the version, payload and payload size of
- * the reply are returned via <reply_version>, <reply_payload> and <reply_size>.
- * If the timeout expires before that, 1 is returned and if an error occurs -1
- * is returned. In both these cases <reply_version>, <reply_payload> and
- * <reply_size> are unchanged.
- *
- * If successful, <reply_payload> points to a newly allocated memory buffer. It
- * is the caller's responsibility to free it when it is no longer needed.
+ * Convert the double-precision timestamp in <t> to the timespec in <ts>.
  */
-static int mx_send_and_wait(MX_Component *comp, double timeout,
-        uint32_t reply_type, uint32_t *reply_version,
-        char **reply_payload, uint32_t *reply_size,
-        uint32_t request_type, uint32_t request_version,
-        const char *request_payload, uint32_t request_size)
+static void double_to_timespec(double t, struct timespec *ts)
 {
-    int r;
-    struct timespec deadline;
-    MX_Await *await;
-
-    /* Determine absolute timeout value. */
-
-    double_to_timespec(mxNow() + timeout, &deadline);
-
-    /* Add await info to the component. */
-
-    await = mx_add_await(comp, reply_type);
-
-    /* Send the request that we expect an answer to. */
-
-    mx_send(comp, request_type, request_version, request_payload, request_size);
-
-    /* Now wait until the reader thread unlocks the created mutex. */
-
-    r = pthread_mutex_timedlock(&await->mutex, &deadline);
-
-    if (r == 0) {
-        /* Reader thread unlocked the mutex (and removed the await struct from
-         * the await list): reply did arrive. Return reply info to the caller.
-         */
-        *reply_version = await->version;
-        *reply_payload = await->payload;
-        *reply_size = await->size;
-    }
-    else {
-        /* Timeout. We'll unlock the mutex ourselves (and remove the await
-         * struct from the await list). */
-        pthread_mutex_unlock(&await->mutex);
-
-        listRemove(&comp->awaits, await);
-    }
-
-    /* Destroy the mutex. */
-    pthread_mutex_destroy(&await->mutex);
-
-    /* Destroy the await struct. */
-    free(await);
-
-    /* Set the appropriate return value. */
-    if (r == 0) {
-        return 0;
-    }
-    else if (r == ETIMEDOUT) {
-        return 1;
+    if (t <= 0) {
+        ts->tv_sec  = 0;
+        ts->tv_nsec = 0;
     }
     else {
-        return -1;
+        ts->tv_sec  = t;
+        ts->tv_nsec = (t - ts->tv_sec) * 1000000000L;
     }
 }
 
 /*
- * Pack a message of type <request_type> with version <request_version> and the
- * payload in <ap>, send it to component <comp>, and wait for a reply with type
- * <reply_type>. If the reply arrives within <timeout> seconds, 0 is returned
- * and the version, payload and payload size of the reply are returned via
- * <reply_version>, <reply_payload> and <reply_size>. If the timeout expires
- * before that, 1 is returned and if an error occurs -1 is returned. In both
- * these cases <reply_version>, <reply_payload> and <reply_size> are unchanged.
- *
- * If successful, <reply_payload> points to a newly allocated memory buffer. It
- * is the caller's responsibility to free it when it is no longer needed.
+ * Initialize command queue <queue>.
  */
-static int mx_va_pack_and_wait(MX_Component *comp, double timeout,
-        uint32_t reply_type, uint32_t *reply_version,
-        char **reply_payload, uint32_t *reply_size,
-        uint32_t request_type, uint32_t request_version, va_list ap)
+static void mx_init_queue(MX_Queue *queue)
 {
-    int r;
-    char *payload;
-    size_t size = vastrpack(&payload, ap);
-
-    dbgAssert(stderr, size <= MAX_PAYLOAD_SIZE, "payload too large.\n");
-
-    r = mx_send_and_wait(comp, timeout,
-            reply_type, reply_version, reply_payload, reply_size,
-            request_type, request_version, payload, size);
+    queue->stub.next = NULL;
 
-    free(payload);
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
 
-    return r;
+    queue->waiting = 0;
 }
 
 /*
- * Pack a message of type <request_type> with version <request_version> and the
- * subsequent payload to component <comp>, and wait for a reply with type
- * <reply_type>. If the reply arrives within <timeout> seconds, 0 is returned
- * and the version, payload and payload size of the reply are returned via
- * <reply_version>, <reply_payload> and <reply_size>. If the timeout expires
- * before that, 1 is returned and if an error occurs -1 is returned. In both
- * these cases <reply_version>, <reply_payload> and <reply_size> are unchanged.
- *
- * If successful, <reply_payload> points to a newly allocated memory buffer. It
- * is the caller's responsibility to free it when it is no longer needed.
+ * Link <cmd> in at the tail of <queue>. Safe to call from any number of
+ * threads at the same time.
  */
-static int mx_pack_and_wait(MX_Component *comp, double timeout,
-        uint32_t reply_type, uint32_t *reply_version,
-        char **reply_payload, uint32_t *reply_size,
-        uint32_t request_type, uint32_t request_version, ...)
+static void mx_link_command(MX_Queue *queue, MX_Command *cmd)
 {
-    int r;
-    va_list ap;
+    __atomic_store_n(&cmd->next, NULL, __ATOMIC_RELAXED);
 
-    va_start(ap, request_version);
-    r = mx_va_pack_and_wait(comp, timeout,
-            reply_type, reply_version, reply_payload, reply_size,
-            request_type, request_version, ap);
-    va_end(ap);
+    MX_Command *prev = __atomic_exchange_n(&queue->tail, cmd, __ATOMIC_ACQ_REL);
 
-    return r;
+    __atomic_store_n(&prev->next, cmd, __ATOMIC_RELEASE);
 }
 
 /*
- * Create a new message type whose id is <type>.
+ * Push command <cmd> onto queue <queue>. The consumer is only woken up (which
+ * costs a system call) if it is actually asleep.
  */
-static MX_Message *mx_create_message(MX *mx, uint32_t type, const char *name)
+static void mx_push_command(MX_Queue *queue, MX_Command *cmd)
 {
-    MX_Message *msg = calloc(1, sizeof(*msg));
-
-    msg->msg_type = type;
-
-    hashAdd(&mx->message_by_type, msg, HASH_VALUE(type));
-
-    if (name != NULL) {
-        msg->msg_name = strdup(name);
+    mx_link_command(queue, cmd);
 
-        hashAdd(&mx->message_by_name, msg, HASH_STRING(name));
-    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-    if (mx->on_register_callback) {
-        mx->on_register_callback(mx, type, name, mx->on_register_udata);
+    if (__atomic_load_n(&queue->waiting, __ATOMIC_RELAXED) != 0 &&
+        __atomic_exchange_n(&queue->waiting, 0, __ATOMIC_SEQ_CST) != 0) {
+        syscall(SYS_futex, &queue->waiting, FUTEX_WAKE_PRIVATE, 1,
+                NULL, NULL, 0);
     }
-
-    mx->next_message_type = MAX(mx->next_message_type, type + 1);
-
-    return msg;
 }
 
 /*
- * Broadcast new message <msg> as an MX_MT_REGISTER_REPORT.
+ * Try to pop a command off of <queue> without waiting. Returns NULL if the
+ * queue is empty, or if a producer is halfway through pushing the only
+ * command on it (in which case it will show up momentarily).
  */
-static void mx_broadcast_new_message(MX *mx, MX_Message *msg, MX_Component *except)
+static MX_Command *mx_pop_command(MX_Queue *queue)
 {
-    int fd;
+    MX_Command *head = queue->head;
+    MX_Command *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
 
-    for (fd = 0; fd < paCount(&mx->components); fd++) {
-        MX_Component *comp = paGet(&mx->components, fd);
+    if (head == &queue->stub) {
+        if (next == NULL) return NULL;
 
-        if (comp == NULL || comp == except) continue;
+        queue->head = head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
 
-        mx_pack(comp, MX_MT_REGISTER_REPORT, 0,
-                PACK_STRING,    msg->msg_name ? msg->msg_name : "",
-                PACK_INT32,     msg->msg_type,
-                END);
+    if (next != NULL) {
+        queue->head = next;
+        return head;
     }
-}
 
-/*
- * A thread that listens for new components. <arg> is a pointer to an MX
- * struct.
- */
-static void *mx_listener_thread(void *arg)
-{
-    int new_fd;
+    if (head != __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) return NULL;
 
-    MX *mx = arg;
+    /* <head> is the last command. Put the stub back behind it so we can take
+     * it off. */
 
-    /* Listen for components on listen_fd and report new connections via the
-     * event_pipe. */
+    mx_link_command(queue, &queue->stub);
 
-    while ((new_fd = tcpAccept(mx->listen_fd)) > 0) {
-        mx_send_pointer(mx->event_pipe[WR], mx_connect_event(new_fd));
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    if (next != NULL) {
+        queue->head = next;
+        return head;
     }
 
     return NULL;
 }
 
 /*
- * Create the event pipe that subthreads can use to send events back to the main
- * loop.
+ * Pop a command off of <queue> and return it. This function will block until a
+ * command is available, or until timestamp <deadline> has passed. If
+ * <deadline> is INFINITY this function will wait indefinitely.
+ * If no command arrives on time this function returns NULL and sets errno to
+ * ETIMEDOUT. Otherwise it returns the received command.
  */
-static int mx_create_event_pipe(MX *mx)
+static MX_Command *mx_await_command(MX_Queue *queue, double deadline)
 {
-    if (pipe(mx->event_pipe) == -1) {
-        mx_error("couldn't create event_pipe (%s).\n", strerror(errno));
-        return -1;
-    }
-    else if (fcntl(mx->event_pipe[RD], F_SETFL, O_NONBLOCK) == -1) {
-        mx_error("couldn't set O_NONBLOCK on event pipe (%s).\n", strerror(errno));
-        return -1;
+    MX_Command *cmd;
+
+    struct timespec time_spec, *timeout = NULL;
+
+    if (isfinite(deadline)) {
+        double_to_timespec(deadline, &time_spec);
+
+        timeout = &time_spec;
     }
 
-    return 0;
-}
+    while (1) {
+        if ((cmd = mx_pop_command(queue)) != NULL) return cmd;
 
-/*
- * Start the thread that waits for incoming connection requests.
- */
-static int mx_start_listener_thread(MX *mx)
-{
-    int r;
+        /* Announce that we're going to sleep, then check again to catch
+         * commands that were pushed before the announcement was seen. */
 
-    r = pthread_create(&mx->listener_thread, NULL, mx_listener_thread, mx);
+        __atomic_store_n(&queue->waiting, 1, __ATOMIC_SEQ_CST);
 
-    if (r != 0) {
-        mx_error("couldn't create reader thread (%s)\n", strerror(r));
-        return -1;
-    }
+        if ((cmd = mx_pop_command(queue)) != NULL) {
+            __atomic_store_n(&queue->waiting, 0, __ATOMIC_RELAXED);
 
-    return 0;
+            return cmd;
+        }
+
+        int r = syscall(SYS_futex, &queue->waiting,
+                FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, 1,
+                timeout, NULL, FUTEX_BITSET_MATCH_ANY);
+
+        __atomic_store_n(&queue->waiting, 0, __ATOMIC_RELAXED);
+
+        if (r == -1 && errno == ETIMEDOUT) {
+            return mx_pop_command(queue);
+        }
+        else if (r == -1 && errno != EAGAIN && errno != EINTR) {
+            return NULL;
+        }
+    }
 }
 
 /*
- * Stop the thread that waits for incoming connection requests.
+ * Spin for up to <spin> seconds, waiting for a command to come in on <queue>
+ * without going to sleep. Returns the command, or NULL if none came in in time.
  */
-static void mx_stop_listener_thread(MX *mx)
+static MX_Command *mx_spin_for_command(MX_Queue *queue, double spin)
 {
-    if (mx->listener_thread == 0) {
-        return;
-    }
+    double deadline = mxNow() + spin;
 
-    shutdown(mx->listen_fd, SHUT_RDWR);
+    do {
+        MX_Command *cmd = mx_pop_command(queue);
 
-    pthread_join(mx->listener_thread, NULL);
+        if (cmd != NULL) return cmd;
+    } while (mxNow() < deadline);
 
-    mx->listener_thread = 0;
+    return NULL;
 }
 
 /*
- * Create and return a timer struct. with the given parameters.
+ * Create and return a new event of type <type>.
  */
-static MX_Timer *mx_create_timer(double t, void (*handler)(MX *mx,
-            MX_Timer *timer, double t, void *udata), void *udata)
+static MX_Event *mx_new_event(MX_EventType type)
 {
-    MX_Timer *timer = calloc(1, sizeof(*timer));
+    MX_Event *evt = calloc(1, sizeof(*evt));
 
-    timer->t       = t;
-    timer->handler = handler;
-    timer->udata   = udata;
+    evt->evt_type = type;
 
-    return timer;
+    return evt;
 }
 
-#if 0
 /*
- * Find the timer with the given id.
+ * Create and return a new MX_ET_CONN event. The new component's file
+ * descriptor is <fd>.
  */
-static MX_Timer *mx_find_timer(MX *mx, uint32_t id)
+static MX_Event *mx_connect_event(int fd)
 {
-    MX_Timer *timer;
+    MX_Event *evt = mx_new_event(MX_ET_CONN);
 
-    for (timer = listHead(&mx->timers); timer; timer = listNext(timer)) {
-        if (timer->id == id) break;
-    }
+    evt->u.conn.fd = fd;
 
-    return timer;
+    return evt;
 }
-#endif
 
 /*
- * Compare two MX_Timers in p1 and p2 and return -1, 0 or 1 depending on whether
- * the time in p1 is less than, equal to or greater than the one in p2.
+ * Create and return a new MX_ET_MSG event. The received message had type
+ * <type>, version <version> and payload <payload> with size <size>.
  */
-static int mx_compare_timers(const void *p1, const void *p2)
+static MX_Event *mx_message_event(int fd,
+        uint32_t type, uint32_t version, char *payload, uint32_t size)
+
 {
-    const MX_Timer *t1 = p1;
-    const MX_Timer *t2 = p2;
+    MX_Event *evt = mx_new_event(MX_ET_MSG);
 
-    if (t1->t < t2->t)
-        return -1;
-    else if (t1->t > t2->t)
-        return 1;
-    else
-        return 0;
+    evt->u.msg.fd  = fd;
+    evt->u.msg.msg_type = type;
+    evt->u.msg.version = version;
+    evt->u.msg.payload = payload;
+    evt->u.msg.size = size;
+
+    return evt;
 }
 
 /*
- * The timer_thread. This maintains a list of timers and sends Timer events back
- * to the main loop when one expires. Timers are added by sending them over the
- * timer_pipe.
+ * Create and return a new MX_ET_ERR event. The error occurred on file
+ * descriptor <fd> and had errno code <error>. <whence> is the function that
+ * returned the error.
  */
-static void *mx_timer_thread(void *arg)
+static MX_Event *mx_error_event(int fd, const char *whence, int error)
 {
-    MX *mx = arg;
-    MX_Timer *timer;
-
-    double deadline;
+    MX_Event *evt = mx_new_event(MX_ET_ERR);
 
-    /* Wait for timer commands on the timer_queue. */
+    evt->u.err.fd     = fd;
+    evt->u.err.whence = strdup(whence);
+    evt->u.err.error  = error;
 
-    while (1) {
-        timer = listHead(&mx->timers);
+    return evt;
+}
 
-        if (timer == NULL) {
-            deadline = INFINITY;
-        }
-        else {
-            deadline = timer->t;
-        }
+/*
+ * Create and return a new MX_ET_DISC event. The disconnected file descriptor
+ * was <fd>; the function where the disconnect was first noticed was <whence>.
+ */
+static MX_Event *mx_disc_event(int fd, const char *whence)
+{
+    MX_Event *evt = mx_new_event(MX_ET_DISC);
 
-        MX_Command *cmd = mx_await_command(&mx->timer_queue, deadline);
+    evt->u.disc.fd = fd;
+    evt->u.disc.whence = strdup(whence);
 
-        if (cmd == NULL) {
+    return evt;
+}
 
-            if (errno == ETIMEDOUT) {
-                MX_Event *event = mx_timer_event(timer);
+/*
+ * Create and return a new MX_ET_PEER event. The outgoing connection on <fd> has
+ * been set up if <error> is 0, otherwise it failed with errno code <error>.
+ */
+static MX_Event *mx_peer_event(int fd, int error)
+{
+    MX_Event *evt = mx_new_event(MX_ET_PEER);
 
-                mx_send_pointer(mx->event_pipe[WR], event);
+    evt->u.peer.fd    = fd;
+    evt->u.peer.error = error;
 
-                // Now that we've sent the event, set the timeout for this
-                // timer to infinity and re-sort the list. So the timer will
-                // still be in the timer list but it won't ever be triggered
-                // again. The user is now free to call mxAdjustTimer of
-                // mxRemoveTimer.
+    return evt;
+}
 
-                timer->t = INFINITY;
-                listSort(&mx->timers, mx_compare_timers);
-            }
-            else {
-                mx_send_pointer(mx->event_pipe[WR],
-                        mx_error_event(-1, "mx_await_command", errno));
-                break;
-            }
-        }
-        else if (cmd->cmd_type == MX_CT_TIMER_CREATE) {
-            listAppendTail(&mx->timers, cmd->u.timer_create.timer);
-            listSort(&mx->timers, mx_compare_timers);
+/*
+ * Create and return a new MX_ET_TIMER event, about timer <timer> going off.
+ */
+static MX_Event *mx_timer_event(MX_Timer *timer)
+{
+    MX_Event *evt = mx_new_event(MX_ET_TIMER);
 
-            free(cmd);
-        }
-        else if (cmd->cmd_type == MX_CT_TIMER_ADJUST) {
-            cmd->u.timer_adjust.timer->t = cmd->u.timer_adjust.t;
+    // We're copying everything because we don't know what might happen to the
+    // original timer after we send this event to the main thread. We *do*
+    // know that at least the time is going to be set to infinitely far into
+    // the future, at least.
 
-            listSort(&mx->timers, mx_compare_timers);
+    evt->u.timer.t       = timer->t;
+    evt->u.timer.handler = timer->handler;
+    evt->u.timer.udata   = timer->udata;
 
-            free(cmd);
-        }
-        else if (cmd->cmd_type == MX_CT_TIMER_DELETE) {
-            listRemove(&mx->timers, cmd->u.timer_delete.timer);
+    // We also copy the pointer to the original timer so the user can
+    // manipulate it in their timer handler.
 
-            free(cmd->u.timer_delete.timer);
-            free(cmd);
-        }
-        else if (cmd->cmd_type == MX_CT_EXIT) {
-            free(cmd);
+    evt->u.timer.timer   = timer;
 
-            break;
-        }
-        else {
-            mx_send_pointer(mx->event_pipe[WR],
-                        mx_error_event(-1, "read", EINVAL));
+    return evt;
+}
 
-            free(cmd);
+/*
+ * Create a write command with <msg_type>, <version> and an uninitialized
+ * payload of <size> bytes, for the caller to fill in.
+ */
+static MX_Command *mx_alloc_write_command(uint32_t msg_type, uint32_t version,
+        uint32_t size)
+{
+    MX_Command *cmd = calloc(1, sizeof(*cmd));
 
-            break;
-        }
-    }
+    cmd->cmd_type = MX_CT_WRITE;
+    cmd->u.write.msg_type = msg_type;
+    cmd->u.write.version = version;
+    cmd->u.write.size = size;
 
-    while ((timer = listRemoveHead(&mx->timers)) != NULL) {
-        free(timer);
-    }
+    cmd->u.write.payload = malloc(size > 0 ? size : 1);
 
-    return NULL;
+    return cmd;
 }
 
-static int mx_start_timer_thread(MX *mx)
+/*
+ * Create a write command with <msg_type>, <version>, <payload> and payload
+ * size <size>.
+ */
+static MX_Command *mx_create_write_command(uint32_t msg_type, uint32_t version,
+        const char *payload, uint32_t size)
 {
-    int r;
-
-    r = pthread_create(&mx->timer_thread, NULL, mx_timer_thread, mx);
+    MX_Command *cmd = mx_alloc_write_command(msg_type, version, size);
 
-    if (r != 0) {
-        mx_error("couldn't create reader thread (%s)\n", strerror(r));
-        return -1;
-    }
+    memcpy(cmd->u.write.payload, payload, size);
 
-    return 0;
+    return cmd;
 }
 
-static void mx_stop_timer_thread(MX *mx)
+/*
+ * Create a command that instructs the writer or timer threads to exit.
+ */
+static MX_Command *mx_create_exit_command(void)
 {
-    if (mx->timer_thread == 0) {
-        return;
-    }
+    MX_Command *cmd = calloc(1, sizeof(*cmd));
 
-    MX_Command *cmd = mx_create_exit_command();
+    cmd->cmd_type = MX_CT_EXIT;
 
-    mx_push_command(&mx->timer_queue, cmd);
+    return cmd;
+}
 
-    pthread_join(mx->timer_thread, NULL);
+/*
+ * Send pointer <ptr> over file descriptor <fd>.
+ */
+static int mx_send_pointer(int fd, void *ptr)
+{
+    int r = write(fd, &ptr, sizeof(ptr));
 
-    mx->timer_thread = 0;
+    return r == sizeof(ptr) ? 0 : -1;
 }
 
 /*
- * We have incoming data on component <comp>; it is <size> bytes long and is
- * contained in <data>. Process it.
+ * Return the counts for message type <type> in <counters>, allocating them if
+ * necessary. Only call this from the thread that owns <counters>. Returns NULL
+ * if <type> is too large to be counted.
  */
-static void mx_handle_incoming(MX_Component *comp, const char *data, size_t data_size)
+static MX_Count *mx_count_for(MX_Counters *counters, uint32_t type)
 {
-    bufAdd(&comp->incoming, data, data_size);
+    MX_Count *chunk;
+    uint32_t index = type / MX_STATS_CHUNK_SIZE;
 
-    while (bufLen(&comp->incoming) >= HEADER_SIZE) {
-        MX_Await *await;
-
-        uint32_t type;
-        uint32_t version;
-        uint32_t size;
-        char *payload;
+    if (index >= MX_STATS_CHUNKS) return NULL;
 
-        strunpack(bufGet(&comp->incoming), bufLen(&comp->incoming),
-                PACK_INT32, &type,
-                PACK_INT32, &version,
-                PACK_INT32, &size,
-                END);
+    if ((chunk = counters->chunk[index]) == NULL) {
+        size_t size = MX_STATS_CHUNK_SIZE * sizeof(MX_Count);
 
-        if (bufLen(&comp->incoming) < HEADER_SIZE + size) {
-            break;
-        }
+        chunk = aligned_alloc(MX_CACHE_LINE, size);
 
-        payload = memdup(bufGet(&comp->incoming) + HEADER_SIZE, size);
+        memset(chunk, 0, size);
 
-        bufTrim(&comp->incoming, HEADER_SIZE + size, 0);
+        /* Make sure mxGetStats sees the zeroed chunk, not just the pointer. */
 
-        /* Maybe someone is waiting for this message? First set a read/write
-         * lock so we can inspect the list of awaits. */
+        __atomic_store_n(&counters->chunk[index], chunk, __ATOMIC_RELEASE);
+    }
 
-        pthread_rwlock_wrlock(&comp->await_lock);
+    return chunk + type % MX_STATS_CHUNK_SIZE;
+}
 
-        for (await = listHead(&comp->awaits); await; await = listNext(await)) {
-            if (await->msg_type == type) {
-                listRemove(&comp->awaits, await);
-                break;
-            }
-        }
+/*
+ * Count a message of type <type> with payload size <size> in <counters>, or
+ * count it as dropped if <dropped> is true. Only the owning thread writes to
+ * <counters>, so plain increments will do. The relaxed stores only make sure
+ * that mxGetStats never sees a torn value.
+ */
+static void mx_count(MX_Counters *counters, uint32_t type, uint32_t size,
+        bool dropped)
+{
+    MX_Count *count = mx_count_for(counters, type);
 
-        pthread_rwlock_unlock(&comp->await_lock);
+    if (count == NULL) {
+        return;
+    }
+    else if (dropped) {
+        __atomic_store_n(&count->drops, count->drops + 1, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_store_n(&count->msgs, count->msgs + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&count->bytes, count->bytes + size, __ATOMIC_RELAXED);
+    }
+}
 
-        if (await != NULL) {            /* Someone is waiting! Pop the lock. */
-            await->version = version;
-            await->payload = payload;
-            await->size = size;
+static uint64_t mx_next_thread_id = 1;            /* Next id to hand out. */
+static __thread uint64_t mx_thread_id_value = 0;  /* Id of this thread. */
 
-            pthread_mutex_unlock(&await->mutex);
-        }
-        else {                          /* No-one waiting: deliver normally. */
-            mx_send_pointer(comp->mx->event_pipe[WR],
-                    mx_message_event(comp->fd, type, version, payload, size));
-        }
+/*
+ * Return a number that identifies the calling thread, and that no other thread
+ * will ever get, not even after this one exits.
+ */
+static uint64_t mx_thread_id(void)
+{
+    if (mx_thread_id_value == 0) {
+        mx_thread_id_value =
+            __atomic_fetch_add(&mx_next_thread_id, 1, __ATOMIC_RELAXED);
     }
+
+    return mx_thread_id_value;
 }
 
 /*
- * A thread to read incoming messages on a file descriptor. <arg> is a pointer
- * to an MX_Component struct.
+ * Return the counters of the calling thread in <list>, adding them if this
+ * thread has never used <list> before. Other threads may add theirs at the same
+ * time, but they never remove any.
  */
-static void *mx_reader_thread(void *arg)
+static MX_Counters *mx_thread_counters(MX_ThreadCounters **list)
 {
-    MX_Component *comp = arg;
+    MX_ThreadCounters *set, *head;
 
-    /* Listen for external data on comp->fd, exit when the connection on the
-     * reader_pipe is lost. */
+    uint64_t thread = mx_thread_id();
 
-    while (1) {
-        char data[9000];
+    head = __atomic_load_n(list, __ATOMIC_ACQUIRE);
 
-        ssize_t r = read(comp->fd, data, sizeof(data));
+    for (set = head; set != NULL; set = set->next) {
+        if (set->thread == thread) return &set->counters;
+    }
 
-        if (r == 0) {               /* Lost connection. */
-            mx_send_pointer(comp->mx->event_pipe[WR],
-                    mx_disc_event(comp->fd, "read"));
+    set = calloc(1, sizeof(*set));
 
-            break;
-        }
-        else if (r < 0) {
-            mx_send_pointer(comp->mx->event_pipe[WR],
-                    mx_error_event(comp->fd, "read", errno));
-            break;
-        }
-        else {                      /* Incoming data: handle it. */
-            mx_handle_incoming(comp, data, r);
-        }
+    set->thread = thread;
+    set->next   = head;
+
+    while (!__atomic_compare_exchange_n(list, &set->next, set,
+                false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        /* set->next was updated to the new head, try again. */
     }
 
-    return NULL;
+    return &set->counters;
 }
 
-static int mx_start_reader_thread(MX *mx, MX_Component *comp)
+/*
+ * Free the counts in <counters>.
+ */
+static void mx_free_counters(MX_Counters *counters)
 {
-    int r;
-
-    r = pthread_create(&comp->reader_thread, NULL, mx_reader_thread, comp);
+    int i;
 
-    if (r != 0) {
-        mx_error("couldn't create reader thread (%s)\n", strerror(r));
-        return -1;
+    for (i = 0; i < MX_STATS_CHUNKS; i++) {
+        free(counters->chunk[i]);
     }
-
-    return 0;
 }
 
-static void mx_stop_reader_thread(MX *mx, MX_Component *comp)
+/*
+ * Free the per-thread counters in <list>.
+ */
+static void mx_free_thread_counters(MX_ThreadCounters *list)
 {
-    if (comp->reader_thread == 0) {
-        return;
-    }
+    MX_ThreadCounters *set;
 
-    shutdown(comp->fd, O_RDWR);
+    while ((set = list) != NULL) {
+        list = set->next;
 
-    pthread_join(comp->reader_thread, NULL);    /* Wait for reader to exit. */
+        mx_free_counters(&set->counters);
 
-    comp->reader_thread = 0;
+        free(set);
+    }
 }
 
 /*
- * A thread to write outgoing messages to a file descriptor. <arg> is a pointer
- * to an MX_WriterInfo struct.
+ * Do the bookkeeping for write command <cmd> to component <comp>, which is
+ * about to be handed to its writer thread. May be called from any thread.
  */
-static void *mx_writer_thread(void *arg)
+static void mx_account_write(MX_Component *comp, MX_Command *cmd)
 {
-    MX_Component *comp = arg;
+    if (comp->mx->lazy) {
+        double now = mxNow();
 
-    Buffer outgoing = { 0 };
-
-    /* Wait for commands from the writer_queue and write data to comp->fd. */
-
-    while (1) {
-        MX_Command *cmd = mx_await_command(&comp->writer_queue, INFINITY);
+        __atomic_store(&comp->last_active, &now, __ATOMIC_RELAXED);
+    }
 
-        if (cmd->cmd_type == MX_CT_EXIT) {
-            break;
-        }
-        else if (cmd->cmd_type == MX_CT_WRITE) {
-            bufPack(&outgoing,
-                PACK_INT32, cmd->u.write.msg_type,
-                PACK_INT32, cmd->u.write.version,
-                PACK_INT32, cmd->u.write.size,
-                PACK_RAW,   cmd->u.write.payload, cmd->u.write.size,
-                END);
+    if (comp->mx->timestamps) {
+        cmd->u.write.queued = mxNow();
+    }
 
-            tcpWrite(comp->fd, bufGet(&outgoing), bufLen(&outgoing));
+    mx_count(mx_thread_counters(&comp->queued),
+            cmd->u.write.msg_type, cmd->u.write.size, false);
 
-            bufClear(&outgoing);
-        }
-        else {
-            mx_error("unexpected command type in writer thread: %d (%s)\n",
-                    cmd->cmd_type, cmd_enum_to_string(cmd->cmd_type));
-            break;
-        }
-    }
+    MX_TRACE(MX_TE_SEND, comp->fd, cmd->u.write.msg_type, cmd->u.write.size);
+}
 
-    bufClear(&outgoing);
+/*
+ * Queue write command <cmd> for component <comp>. May be called from any
+ * thread.
+ */
+static void mx_queue_write(MX_Component *comp, MX_Command *cmd)
+{
+    mx_account_write(comp, cmd);
 
-    return NULL;
+    mx_push_command(&comp->writer_queue, cmd);
 }
 
 /*
- * Start a thread to write messages to <comp>.
+ * Send a message of type <type>, with version <version>, payload <payload> and
+ * payload size <size> to component <comp>.
  */
-static int mx_start_writer_thread(MX *mx, MX_Component *comp)
+static void mx_send(MX_Component *comp,
+        uint32_t type, uint32_t version,
+        const char *payload, uint32_t size)
 {
-    int r = pthread_create(&comp->writer_thread, NULL, mx_writer_thread, comp);
+    mx_queue_write(comp,
+            mx_create_write_command(type, version, payload, size));
+}
 
-    if (r != 0) {
-        mx_error("couldn't create writer thread (%s)\n", strerror(r));
-        return -1;
+/*
+ * Write <value> to <dst> as a big-endian integer of <size> bytes.
+ */
+static void mx_put_uint(char *dst, uint64_t value, int size)
+{
+    while (size-- > 0) {
+        dst[size] = value & 0xFF;
+        value >>= 8;
     }
-
-    return 0;
 }
 
 /*
- * Stop the thread to write messages to <comp>.
+ * Take the value for a field of PACK_* type <type> from <ap>, pack it into <dst>
+ * in the same way as astrpack would, and return its packed size. If <dst> is
+ * NULL, only the size is returned. Like astrpack, this takes a uint32_t size for
+ * PACK_DATA and a size_t size for PACK_RAW.
  */
-static void mx_stop_writer_thread(MX *mx, MX_Component *comp)
+static size_t mx_pack_field(char *dst, int type, va_list *ap)
 {
-    if (comp->writer_thread == 0) {
-        return;
+    const char *data;
+    uint32_t u32, size;
+    size_t raw_size;
+    uint64_t u64;
+    double d;
+    float f;
+
+    switch(type) {
+    case PACK_INT8:
+        u32 = va_arg(*ap, int);
+        if (dst) mx_put_uint(dst, u32, 1);
+        return 1;
+    case PACK_INT16:
+        u32 = va_arg(*ap, int);
+        if (dst) mx_put_uint(dst, u32, 2);
+        return 2;
+    case PACK_INT32:
+        u32 = va_arg(*ap, uint32_t);
+        if (dst) mx_put_uint(dst, u32, 4);
+        return 4;
+    case PACK_INT64:
+        u64 = va_arg(*ap, uint64_t);
+        if (dst) mx_put_uint(dst, u64, 8);
+        return 8;
+    case PACK_FLOAT:
+        f = va_arg(*ap, double);
+        memcpy(&u32, &f, sizeof(u32));
+        if (dst) mx_put_uint(dst, u32, 4);
+        return 4;
+    case PACK_DOUBLE:
+        d = va_arg(*ap, double);
+        memcpy(&u64, &d, sizeof(u64));
+        if (dst) mx_put_uint(dst, u64, 8);
+        return 8;
+    case PACK_STRING:
+        data = va_arg(*ap, const char *);
+        size = data == NULL ? 0 : strlen(data);
+        break;
+    case PACK_DATA:
+        data = va_arg(*ap, const char *);
+        size = va_arg(*ap, uint32_t);
+        break;
+    case PACK_RAW:
+        data = va_arg(*ap, const char *);
+        raw_size = va_arg(*ap, size_t);
+
+        if (dst && raw_size > 0) memcpy(dst, data, raw_size);
+
+        return raw_size;
+    default:
+        dbgAssert(stderr, false, "unknown field type %d.\n", type);
+        return 0;
     }
 
-    MX_Command *cmd = mx_create_exit_command();
+    /* PACK_STRING and PACK_DATA: a 4-byte size followed by the data. */
 
-    mx_push_command(&comp->writer_queue, cmd);
+    if (dst) {
+        mx_put_uint(dst, size, 4);
 
-    pthread_join(comp->writer_thread, NULL);    /* Wait for writer to exit. */
+        if (size > 0) memcpy(dst + 4, data, size);
+    }
 
-    comp->writer_thread = 0;
+    return 4 + (size_t) size;
 }
 
 /*
- * Create a new component in <mx>.
+ * Pack the fields in <ap> into <dst> and return their packed size. If <layout>
+ * is NULL, <ap> contains PACK_* types each followed by their value(s),
+ * terminated by END, as for astrpack. Otherwise the types are taken from
+ * <layout>, and <ap> contains only the values. If <dst> is NULL, only the size
+ * is returned. <ap> itself is left untouched.
  */
-static MX_Component *mx_create_component(MX *mx)
+static size_t mx_pack_fields(char *dst, const MX_Layout *layout, va_list ap)
 {
-    MX_Component *comp = calloc(1, sizeof(*comp));
+    int i, type;
+    size_t size = 0;
+    va_list aq;
 
-    comp->mx = mx;
+    if (dst == NULL && layout != NULL && layout->fixed) {
+        return layout->fixed_size;
+    }
 
-    mx_init_queue(&comp->writer_queue);
+    va_copy(aq, ap);
 
-    bufClear(&mx_message);
+    for (i = 0; ; i++) {
+        if (layout != NULL) {
+            type = i < layout->count ? layout->type[i] : END;
+        }
+        else {
+            type = va_arg(aq, int);
+        }
 
-    pthread_rwlock_init(&comp->await_lock, NULL);
+        if (type == END) break;
 
-    return comp;
+        size += mx_pack_field(dst == NULL ? NULL : dst + size, type, &aq);
+    }
+
+    va_end(aq);
+
+    return size;
 }
 
 /*
- * Count the number of components known to <mx>. If <name> is not NULL, only
- * the components whose name begins with <name> are counted.
+ * Create a write command with type <type> and version <version>, and pack the
+ * fields in <ap> (see mx_pack_fields) straight into its payload.
  */
-static uint16_t mx_count_components(const MX *mx, const char *name)
+static MX_Command *mx_create_packed_write_command(uint32_t type,
+        uint32_t version, const MX_Layout *layout, va_list ap)
 {
-    int component_count = paCount(&mx->components);
-    int found = 0;
+    MX_Command *cmd;
 
-    for (int i = 0; i < component_count; i++) {
-        MX_Component *comp = paGet(&mx->components, i);
+    size_t size = mx_pack_fields(NULL, layout, ap);
 
-        if (comp == NULL) {
-            continue;
-        }
-        else if (name == NULL) {
-            found++;
-        }
-        else if (comp->name == NULL) {
-            continue;
-        }
-        else if (strcmp(name, comp->name) == 0) {
-            found++;
-        }
-    }
+    dbgAssert(stderr, size <= MAX_PAYLOAD_SIZE, "payload too large.\n");
 
-    return found;
+    cmd = mx_alloc_write_command(type, version, size);
+
+    mx_pack_fields(cmd->u.write.payload, layout, ap);
+
+    return cmd;
 }
 
 /*
- * Destroy all subscriptions by component <comp>.
+ * Pack a message with type <type> and version <version> with the fields in <ap>
+ * to component <comp>.
  */
-static void mx_destroy_component_subscriptions(MX_Component *comp)
+static void mx_va_pack(MX_Component *comp,
+        uint32_t type, uint32_t version, va_list ap)
 {
-    MX_Subscription *sub;
-
-    while ((sub = mlRemoveHead(&comp->subscriptions)) != NULL) {
-        mlRemove(&sub->msg->subscriptions, sub);
-        free(sub);
-    }
+    mx_queue_write(comp, mx_create_packed_write_command(type, version, NULL, ap));
 }
 
 /*
- * Destroy all subscriptions on message <msg>.
+ * Pack a message with type <type> and version <version> and the subsequent
+ * fields to component <comp>.
  */
-static void mx_destroy_message_subscriptions(MX_Message *msg)
+static void mx_pack(MX_Component *comp,
+        uint32_t type, uint32_t version, ...)
 {
-    MX_Subscription *sub;
+    va_list ap;
 
-    while ((sub = mlRemoveHead(&msg->subscriptions)) != NULL) {
-        mlRemove(&sub->comp->subscriptions, sub);
-        free(sub);
-    }
+    va_start(ap, version);
+    mx_va_pack(comp, type, version, ap);
+    va_end(ap);
 }
 
 /*
- * Destroy component <comp>.
+ * Add an await struct to the component associated with component <comp>.
  */
-static void mx_destroy_component(MX *mx, MX_Component *comp)
+static MX_Await *mx_add_await(MX_Component *comp, uint32_t type)
 {
-    MX_Await *await;
+    MX_Await *await = calloc(1, sizeof(*await));
 
-    bufClear(&comp->incoming);
+    await->msg_type = type;
 
-    pthread_rwlock_destroy(&comp->await_lock);
+    pthread_mutex_init(&await->mutex, NULL);
+    pthread_mutex_lock(&await->mutex);
 
-    /* Destroy any pending awaits. */
+    pthread_rwlock_wrlock(&comp->await_lock);
 
-    while ((await = listRemoveHead(&comp->awaits)) != NULL) {
-        pthread_mutex_unlock(&await->mutex);
-        pthread_mutex_destroy(&await->mutex);
+    listAppendTail(&comp->awaits, await);
 
-        if (await->payload != NULL) free(await->payload);
+    pthread_rwlock_unlock(&comp->await_lock);
 
-        free(await);
-    }
+    return await;
+}
 
-    if (comp != mx->me && comp->name != NULL && mx->on_end_comp_callback) {
-        mx->on_end_comp_callback(mx, comp->fd, comp->name,
-                mx->on_end_comp_udata);
-    }
+/*
+ * Send a message of type <request_type> with version <request_version>, payload
+ * <request_payload> and payload size <request_size> to component <comp>, and
+ * wait for a reply with type <reply_type>. If the reply arrives within
+ * <timeout> seconds, 0 is returned and the version, payload and payload size of
+ * the reply are returned via <reply_version>, <reply_payload> and <reply_size>.
+ * If the timeout expires before that, 1 is returned and if an error occurs -1
+ * is returned. In both these cases <reply_version>, <reply_payload> and
+ * <reply_size> are unchanged.
+ *
+ * If successful, <reply_payload> points to a newly allocated memory buffer. It
+ * is the caller's responsibility to free it when it is no longer needed.
+ */
+static int mx_send_and_wait(MX_Component *comp, double timeout,
+        uint32_t reply_type, uint32_t *reply_version,
+        char **reply_payload, uint32_t *reply_size,
+        uint32_t request_type, uint32_t request_version,
+        const char *request_payload, uint32_t request_size)
+{
+    int r;
+    struct timespec deadline;
+    MX_Await *await;
 
-    mx_stop_reader_thread(mx, comp);
-    mx_stop_writer_thread(mx, comp);
+    /* Determine absolute timeout value. */
 
-    mx_destroy_component_subscriptions(comp);
+    double_to_timespec(mxNow() + timeout, &deadline);
 
-    free(comp->name);
-    free(comp->host);
+    /* Add await info to the component. */
 
-    free(comp);
-}
+    await = mx_add_await(comp, reply_type);
 
-/*
- * Find the subscription to <msg> in <comp>.
- */
-static MX_Subscription *mx_find_subscription_for_comp(MX_Message *msg, MX_Component *comp)
-{
-    MX_Subscription *sub;
+    /* Send the request that we expect an answer to. */
 
-    for (sub = mlHead(&comp->subscriptions); sub;
-         sub = mlNext(&comp->subscriptions, sub)) {
-        if (sub->msg == msg) break;
-    }
+    mx_send(comp, request_type, request_version, request_payload, request_size);
 
-    return sub;
-}
+    /* Now wait until the reader thread unlocks the created mutex. */
 
-/*
- * Find the subscription from <comp> in <msg>.
- */
-static MX_Subscription *mx_find_subscription_to_msg(MX_Component *comp, MX_Message *msg)
-{
-    MX_Subscription *sub;
+    r = pthread_mutex_timedlock(&await->mutex, &deadline);
 
-    for (sub = mlHead(&msg->subscriptions); sub;
-         sub = mlNext(&msg->subscriptions, sub)) {
-        if (sub->comp == comp) break;
+    if (r == 0) {
+        /* Reader thread unlocked the mutex (and removed the await struct from
+         * the await list): reply did arrive. Return reply info to the caller.
+         */
+        *reply_version = await->version;
+        *reply_payload = await->payload;
+        *reply_size = await->size;
+    }
+    else {
+        /* Timeout. We'll unlock the mutex ourselves (and remove the await
+         * struct from the await list). */
+        pthread_mutex_unlock(&await->mutex);
+
+        listRemove(&comp->awaits, await);
     }
 
-    return sub;
-}
+    /* Destroy the mutex. */
+    pthread_mutex_destroy(&await->mutex);
 
-/*
- * Handle message <msg>, that came in via file descriptor <fd>.
- */
-static void mx_handle_message(MX *mx, int fd,
-        uint32_t type, uint32_t version, char *payload, uint32_t size)
-{
-    MX_Message *msg;
-    MX_Subscription *sub;
+    /* Destroy the await struct. */
+    free(await);
 
-    if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(type))) == NULL) {
-        return;
+    /* Set the appropriate return value. */
+    if (r == 0) {
+        return 0;
     }
-
-    if ((sub = mx_find_subscription_for_comp(msg, mx->me)) != NULL) {
-        sub->handler(mx, fd, type, version, payload, size, sub->udata);
+    else if (r == ETIMEDOUT) {
+        return 1;
+    }
+    else {
+        return -1;
     }
 }
 
 /*
- * Handle an MX_MT_REGISTER_REPORT (only in regular components). The message
- * came in on fd <fd> with type <type>, version <version>, and had payload
+ * Pack a message of type <request_type> with version <request_version> and the
+ * payload in <ap>, send it to component <comp>, and wait for a reply with type
+ * <reply_type>. If the reply arrives within <timeout> seconds, 0 is returned
+ * and the version, payload and payload size of the reply are returned via
+ * <reply_version>, <reply_payload> and <reply_size>. If the timeout expires
+ * before that, 1 is returned and if an error occurs -1 is returned. In both
+ * these cases <reply_version>, <reply_payload> and <reply_size> are unchanged.
+ *
+ * If successful, <reply_payload> points to a newly allocated memory buffer. It
+ * is the caller's responsibility to free it when it is no longer needed.
+ */
+static int mx_va_pack_and_wait(MX_Component *comp, double timeout,
+        uint32_t reply_type, uint32_t *reply_version,
+        char **reply_payload, uint32_t *reply_size,
+        uint32_t request_type, uint32_t request_version, va_list ap)
+{
+    int r;
+    char *payload;
+    size_t size = vastrpack(&payload, ap);
+
+    dbgAssert(stderr, size <= MAX_PAYLOAD_SIZE, "payload too large.\n");
+
+    r = mx_send_and_wait(comp, timeout,
+            reply_type, reply_version, reply_payload, reply_size,
+            request_type, request_version, payload, size);
+
+    free(payload);
+
+    return r;
+}
+
+/*
+ * Pack a message of type <request_type> with version <request_version> and the
+ * subsequent payload to component <comp>, and wait for a reply with type
+ * <reply_type>. If the reply arrives within <timeout> seconds, 0 is returned
+ * and the version, payload and payload size of the reply are returned via
+ * <reply_version>, <reply_payload> and <reply_size>. If the timeout expires
+ * before that, 1 is returned and if an error occurs -1 is returned. In both
+ * these cases <reply_version>, <reply_payload> and <reply_size> are unchanged.
+ *
+ * If successful, <reply_payload> points to a newly allocated memory buffer. It
+ * is the caller's responsibility to free it when it is no longer needed.
+ */
+static int mx_pack_and_wait(MX_Component *comp, double timeout,
+        uint32_t reply_type, uint32_t *reply_version,
+        char **reply_payload, uint32_t *reply_size,
+        uint32_t request_type, uint32_t request_version, ...)
+{
+    int r;
+    va_list ap;
+
+    va_start(ap, request_version);
+    r = mx_va_pack_and_wait(comp, timeout,
+            reply_type, reply_version, reply_payload, reply_size,
+            request_type, request_version, ap);
+    va_end(ap);
+
+    return r;
+}
+
+static void mx_apply_patterns(MX *mx, MX_Message *msg);
+static void mx_publish_message(MX *mx, MX_Message *msg);
+static int mx_wake_if_dormant(MX *mx, MX_Component *comp);
+
+/*
+ * Create a new message type whose id is <type>. Any pattern subscriptions that
+ * match its <name> are applied to it.
+ */
+static MX_Message *mx_create_message(MX *mx, uint32_t type, const char *name)
+{
+    MX_Message *msg = calloc(1, sizeof(*msg));
+
+    msg->msg_type = type;
+
+    pthread_mutex_init(&msg->cache_lock, NULL);
+
+    hashAdd(&mx->message_by_type, msg, HASH_VALUE(type));
+    mx_publish_message(mx, msg);
+
+    if (name != NULL) {
+        msg->msg_name = strdup(name);
+
+        hashAdd(&mx->message_by_name, msg, HASH_STRING(name));
+    }
+
+    if (mx->on_register_callback) {
+        mx->on_register_callback(mx, type, name, mx->on_register_udata);
+    }
+
+    mx->next_message_type = MAX(mx->next_message_type, type + 1);
+
+    if (name != NULL) {
+        mx_apply_patterns(mx, msg);
+    }
+
+    return msg;
+}
+
+/*
+ * Broadcast new message <msg> as an MX_MT_REGISTER_REPORT.
+ */
+static void mx_broadcast_new_message(MX *mx, MX_Message *msg, MX_Component *except)
+{
+    int fd;
+
+    for (fd = 0; fd < paCount(&mx->components); fd++) {
+        MX_Component *comp = paGet(&mx->components, fd);
+
+        if (comp == NULL || comp == except) continue;
+
+        mx_pack(comp, MX_MT_REGISTER_REPORT, 0,
+                PACK_STRING,    msg->msg_name ? msg->msg_name : "",
+                PACK_INT32,     msg->msg_type,
+                END);
+    }
+}
+
+/*
+ * A thread that listens for new components. <arg> is a pointer to an MX
+ * struct.
+ */
+static void *mx_listener_thread(void *arg)
+{
+    int new_fd;
+
+    MX *mx = arg;
+
+    mx_trace_name("listener");
+
+    /* Listen for components on listen_fd and report new connections via the
+     * event_pipe. */
+
+    while ((new_fd = tcpAccept(mx->listen_fd)) > 0) {
+        mx_send_pointer(mx->event_pipe[WR], mx_connect_event(new_fd));
+    }
+
+    return NULL;
+}
+
+/*
+ * Create the event pipe that subthreads can use to send events back to the main
+ * loop.
+ */
+static int mx_create_event_pipe(MX *mx)
+{
+    if (pipe(mx->event_pipe) == -1) {
+        mx_error("couldn't create event_pipe (%s).\n", strerror(errno));
+        return -1;
+    }
+    else if (fcntl(mx->event_pipe[RD], F_SETFL, O_NONBLOCK) == -1) {
+        mx_error("couldn't set O_NONBLOCK on event pipe (%s).\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Start the thread that waits for incoming connection requests.
+ */
+static int mx_start_listener_thread(MX *mx)
+{
+    int r;
+
+    r = pthread_create(&mx->listener_thread, NULL, mx_listener_thread, mx);
+
+    if (r != 0) {
+        mx_error("couldn't create reader thread (%s)\n", strerror(r));
+        return -1;
+    }
+
+    mx_place_thread(mx, MX_THREAD_LISTENER, mx->listener_thread);
+
+    return 0;
+}
+
+/*
+ * Stop the thread that waits for incoming connection requests.
+ */
+static void mx_stop_listener_thread(MX *mx)
+{
+    if (mx->listener_thread == 0) {
+        return;
+    }
+
+    shutdown(mx->listen_fd, SHUT_RDWR);
+
+    pthread_join(mx->listener_thread, NULL);
+
+    mx->listener_thread = 0;
+}
+
+/*
+ * Create and return a timer struct. with the given parameters.
+ */
+static MX_Timer *mx_create_timer(double t, void (*handler)(MX *mx,
+            MX_Timer *timer, double t, void *udata), void *udata)
+{
+    MX_Timer *timer = calloc(1, sizeof(*timer));
+
+    timer->t       = t;
+    timer->handler = handler;
+    timer->udata   = udata;
+
+    return timer;
+}
+
+#if 0
+/*
+ * Find the timer with the given id.
+ */
+static MX_Timer *mx_find_timer(MX *mx, uint32_t id)
+{
+    MX_Timer *timer;
+
+    for (timer = listHead(&mx->timers); timer; timer = listNext(timer)) {
+        if (timer->id == id) break;
+    }
+
+    return timer;
+}
+#endif
+
+/*
+ * Compare two MX_Timers in p1 and p2 and return -1, 0 or 1 depending on whether
+ * the time in p1 is less than, equal to or greater than the one in p2.
+ */
+static int mx_compare_timers(const void *p1, const void *p2)
+{
+    const MX_Timer *t1 = p1;
+    const MX_Timer *t2 = p2;
+
+    if (t1->t < t2->t)
+        return -1;
+    else if (t1->t > t2->t)
+        return 1;
+    else
+        return 0;
+}
+
+/*
+ * The timer_thread. This maintains a list of timers and sends Timer events back
+ * to the main loop when one expires. Timers are added by sending them over the
+ * timer_pipe.
+ */
+static void *mx_timer_thread(void *arg)
+{
+    MX *mx = arg;
+    MX_Timer *timer;
+
+    double deadline;
+
+    mx_trace_name("timer");
+
+    /* Wait for timer commands on the timer_queue. */
+
+    while (1) {
+        timer = listHead(&mx->timers);
+
+        if (timer == NULL) {
+            deadline = INFINITY;
+        }
+        else {
+            deadline = timer->t;
+        }
+
+        MX_Command *cmd = mx_await_command(&mx->timer_queue, deadline);
+
+        if (cmd == NULL) {
+
+            if (errno == ETIMEDOUT) {
+                MX_Event *event = mx_timer_event(timer);
+
+                MX_TRACE(MX_TE_TIMER, -1, 0, 0);
+
+                mx_send_pointer(mx->event_pipe[WR], event);
+
+                // Now that we've sent the event, set the timeout for this
+                // timer to infinity and re-sort the list. So the timer will
+                // still be in the timer list but it won't ever be triggered
+                // again. The user is now free to call mxAdjustTimer of
+                // mxRemoveTimer.
+
+                timer->t = INFINITY;
+                listSort(&mx->timers, mx_compare_timers);
+            }
+            else {
+                mx_send_pointer(mx->event_pipe[WR],
+                        mx_error_event(-1, "mx_await_command", errno));
+                break;
+            }
+        }
+        else if (cmd->cmd_type == MX_CT_TIMER_CREATE) {
+            listAppendTail(&mx->timers, cmd->u.timer_create.timer);
+            listSort(&mx->timers, mx_compare_timers);
+
+            free(cmd);
+        }
+        else if (cmd->cmd_type == MX_CT_TIMER_ADJUST) {
+            cmd->u.timer_adjust.timer->t = cmd->u.timer_adjust.t;
+
+            listSort(&mx->timers, mx_compare_timers);
+
+            free(cmd);
+        }
+        else if (cmd->cmd_type == MX_CT_TIMER_DELETE) {
+            listRemove(&mx->timers, cmd->u.timer_delete.timer);
+
+            free(cmd->u.timer_delete.timer);
+            free(cmd);
+        }
+        else if (cmd->cmd_type == MX_CT_EXIT) {
+            free(cmd);
+
+            break;
+        }
+        else {
+            mx_send_pointer(mx->event_pipe[WR],
+                        mx_error_event(-1, "read", EINVAL));
+
+            free(cmd);
+
+            break;
+        }
+    }
+
+    while ((timer = listRemoveHead(&mx->timers)) != NULL) {
+        free(timer);
+    }
+
+    return NULL;
+}
+
+static int mx_start_timer_thread(MX *mx)
+{
+    int r;
+
+    r = pthread_create(&mx->timer_thread, NULL, mx_timer_thread, mx);
+
+    if (r != 0) {
+        mx_error("couldn't create reader thread (%s)\n", strerror(r));
+        return -1;
+    }
+
+    mx_place_thread(mx, MX_THREAD_TIMER, mx->timer_thread);
+
+    return 0;
+}
+
+static void mx_stop_timer_thread(MX *mx)
+{
+    if (mx->timer_thread == 0) {
+        return;
+    }
+
+    MX_Command *cmd = mx_create_exit_command();
+
+    mx_push_command(&mx->timer_queue, cmd);
+
+    pthread_join(mx->timer_thread, NULL);
+
+    mx->timer_thread = 0;
+}
+
+/*
+ * We have incoming data on component <comp>; it is <size> bytes long and is
+ * contained in <data>. Process it. Returns 0 on success or -1 if <comp> sent a
+ * malformed message, in which case the connection should be dropped.
+ */
+static int mx_handle_incoming(MX_Component *comp, const char *data, size_t data_size)
+{
+    if (comp->mx->lazy) {
+        double now = mxNow();
+
+        __atomic_store(&comp->last_active, &now, __ATOMIC_RELAXED);
+    }
+
+    bufAdd(&comp->incoming, data, data_size);
+
+    while (bufLen(&comp->incoming) >= HEADER_SIZE) {
+        MX_Await *await;
+        MX_Event *evt;
+
+        uint32_t type;
+        uint32_t version;
+        uint32_t size;
+        char *payload;
+
+        uint32_t offset = HEADER_SIZE;
+        double stamp[3] = { 0 };
+
+        strunpack(bufGet(&comp->incoming), bufLen(&comp->incoming),
+                PACK_INT32, &type,
+                PACK_INT32, &version,
+                PACK_INT32, &size,
+                END);
+
+        if (bufLen(&comp->incoming) < HEADER_SIZE + size) {
+            break;
+        }
+
+        /* Split off the timestamps, if the sender added them. */
+
+        if (type & MX_TIMESTAMPED) {
+            if (size < TIMESTAMPS_SIZE) {
+                return -1;
+            }
+
+            strunpack(bufGet(&comp->incoming) + offset, TIMESTAMPS_SIZE,
+                    PACK_DOUBLE, &stamp[0],
+                    PACK_DOUBLE, &stamp[1],
+                    END);
+
+            stamp[2] = mxNow();
+
+            type   &= ~MX_TIMESTAMPED;
+            offset += TIMESTAMPS_SIZE;
+            size   -= TIMESTAMPS_SIZE;
+        }
+
+        payload = memdup(bufGet(&comp->incoming) + offset, size);
+
+        bufTrim(&comp->incoming, offset + size, 0);
+
+        MX_TRACE(MX_TE_PARSE, comp->fd, type, size);
+
+        mx_count(&comp->received, type, size, false);
+
+        /* Maybe someone is waiting for this message? First set a read/write
+         * lock so we can inspect the list of awaits. */
+
+        pthread_rwlock_wrlock(&comp->await_lock);
+
+        for (await = listHead(&comp->awaits); await; await = listNext(await)) {
+            if (await->msg_type == type) {
+                listRemove(&comp->awaits, await);
+                break;
+            }
+        }
+
+        pthread_rwlock_unlock(&comp->await_lock);
+
+        if (await != NULL) {            /* Someone is waiting! Pop the lock. */
+            await->version = version;
+            await->payload = payload;
+            await->size = size;
+
+            pthread_mutex_unlock(&await->mutex);
+        }
+        else {                          /* No-one waiting: deliver normally. */
+            evt = mx_message_event(comp->fd, type, version, payload, size);
+
+            if (stamp[2] != 0) {
+                evt->u.msg.timestamped = true;
+
+                memcpy(evt->u.msg.stamp, stamp, sizeof(stamp));
+            }
+
+            MX_TRACE(MX_TE_QUEUE, comp->fd, type, size);
+
+            mx_send_pointer(comp->mx->event_pipe[WR], evt);
+        }
+
+        /* In lazy mode, the main thread may move a new incoming connection to
+         * another fd when it sees the HelloUpdate. Wait until it has. */
+
+        if (comp->handshake) {
+            sem_wait(&comp->handshake_done);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Start a non-blocking connect to <host> on <port>. Returns the new socket, on
+ * which the connect may still be in progress, or -1 if the connect couldn't be
+ * started (in which case errno is set).
+ */
+static int mx_start_connect(const char *host, uint16_t port)
+{
+    int fd, r;
+    char service[8];
+    struct addrinfo hints = { 0 }, *info;
+
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    snprintf(service, sizeof(service), "%d", port);
+
+    if ((r = getaddrinfo(host, service, &hints, &info)) != 0) {
+        errno = (r == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+        return -1;
+    }
+
+    if ((fd = socket(info->ai_family, info->ai_socktype, 0)) == -1) {
+        freeaddrinfo(info);
+        return -1;
+    }
+
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+        (connect(fd, info->ai_addr, info->ai_addrlen) == -1 &&
+         errno != EINPROGRESS)) {
+        int error = errno;
+
+        close(fd);
+        freeaddrinfo(info);
+
+        errno = error;
+
+        return -1;
+    }
+
+    freeaddrinfo(info);
+
+    return fd;
+}
+
+/*
+ * Wait for the non-blocking connect on <fd> to finish and put <fd> back into
+ * blocking mode. Returns 0 if the connection was made or an errno code if it
+ * wasn't.
+ */
+static int mx_finish_connect(int fd)
+{
+    int r, error = 0;
+    socklen_t len = sizeof(error);
+
+    struct pollfd poll_fd = { fd, POLLOUT, 0 };
+
+    while ((r = poll(&poll_fd, 1, PEER_CONNECT_TIMEOUT)) == -1) {
+        if (errno != EINTR) return errno;
+    }
+
+    if (r == 0) {
+        return ETIMEDOUT;
+    }
+    else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+        return errno;
+    }
+    else if (error != 0) {
+        return error;
+    }
+    else if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) == -1) {
+        return errno;
+    }
+
+    return 0;
+}
+
+/*
+ * Read up to <size> bytes from the connection to <comp> into <data>, like
+ * read(). In busy-poll mode, first spin on non-blocking reads for a while. The
+ * writer thread uses the same socket, so it stays in blocking mode and we use
+ * MSG_DONTWAIT instead.
+ */
+static ssize_t mx_read(MX_Component *comp, char *data, size_t size)
+{
+    double spin = comp->mx->busy_poll;
+
+    if (spin > 0) {
+        double deadline = mxNow() + spin;
+
+        do {
+            ssize_t r = recv(comp->fd, data, size, MSG_DONTWAIT);
+
+            if (r >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return r;
+        } while (mxNow() < deadline);
+    }
+
+    return read(comp->fd, data, size);
+}
+
+/*
+ * Ask the kernel to busy-poll the device queue for the connection to <comp> for
+ * up to <spin> seconds when a read would otherwise block. This may not be
+ * supported or allowed, which only costs us some latency.
+ */
+static void mx_set_socket_busy_poll(MX_Component *comp, double spin)
+{
+#ifdef SO_BUSY_POLL
+    int usec = spin * 1e6;
+
+    setsockopt(comp->fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+#endif
+}
+
+/*
+ * A thread to read incoming messages on a file descriptor. <arg> is a pointer
+ * to an MX_Component struct.
+ */
+static void *mx_reader_thread(void *arg)
+{
+    MX_Component *comp = arg;
+
+    mx_trace_name("reader %d", comp->fd);
+
+    /* If we're still connecting to this component, wait for that to finish
+     * and let the main thread know how it went. */
+
+    if (comp->connecting) {
+        int error = mx_finish_connect(comp->fd);
+
+        mx_send_pointer(comp->mx->event_pipe[WR],
+                mx_peer_event(comp->fd, error));
+
+        if (error != 0) return NULL;
+    }
+
+    if (comp->mx->busy_poll > 0) {
+        mx_set_socket_busy_poll(comp, comp->mx->busy_poll);
+    }
+
+    /* Listen for external data on comp->fd, exit when the connection on the
+     * reader_pipe is lost. */
+
+    while (1) {
+        char data[9000];
+
+        ssize_t r = mx_read(comp, data, sizeof(data));
+
+        MX_TRACE(MX_TE_READ, comp->fd, 0, MAX(r, 0));
+
+        if (r == 0) {               /* Lost connection. */
+            mx_send_pointer(comp->mx->event_pipe[WR],
+                    mx_disc_event(comp->fd, "read"));
+
+            break;
+        }
+        else if (r < 0) {
+            mx_send_pointer(comp->mx->event_pipe[WR],
+                    mx_error_event(comp->fd, "read", errno));
+            break;
+        }
+        else if (mx_handle_incoming(comp, data, r) != 0) {
+            mx_send_pointer(comp->mx->event_pipe[WR],
+                    mx_disc_event(comp->fd, "mx_handle_incoming"));
+
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int mx_start_reader_thread(MX *mx, MX_Component *comp)
+{
+    int r;
+
+    r = pthread_create(&comp->reader_thread, NULL, mx_reader_thread, comp);
+
+    if (r != 0) {
+        mx_error("couldn't create reader thread (%s)\n", strerror(r));
+        return -1;
+    }
+
+    mx_place_thread(mx, MX_THREAD_READER, comp->reader_thread);
+
+    return 0;
+}
+
+static void mx_stop_reader_thread(MX *mx, MX_Component *comp)
+{
+    if (comp->reader_thread == 0) {
+        return;
+    }
+
+    shutdown(comp->fd, O_RDWR);
+
+    pthread_join(comp->reader_thread, NULL);    /* Wait for reader to exit. */
+
+    comp->reader_thread = 0;
+}
+
+/*
+ * Write the message in write command <cmd> to component <comp>, using
+ * <outgoing> as scratch space, and free <cmd>.
+ */
+static void mx_write_command(MX_Component *comp, Buffer *outgoing,
+        MX_Command *cmd)
+{
+    if (cmd->u.write.queued != 0) {
+        bufPack(outgoing,
+            PACK_INT32,  cmd->u.write.msg_type | MX_TIMESTAMPED,
+            PACK_INT32,  cmd->u.write.version,
+            PACK_INT32,  cmd->u.write.size + TIMESTAMPS_SIZE,
+            PACK_DOUBLE, cmd->u.write.queued,
+            PACK_DOUBLE, mxNow(),
+            PACK_RAW,    cmd->u.write.payload, (size_t) cmd->u.write.size,
+            END);
+    }
+    else {
+        bufPack(outgoing,
+            PACK_INT32, cmd->u.write.msg_type,
+            PACK_INT32, cmd->u.write.version,
+            PACK_INT32, cmd->u.write.size,
+            PACK_RAW,   cmd->u.write.payload, (size_t) cmd->u.write.size,
+            END);
+    }
+
+    uint64_t t0 = MX_TRACE_START();
+
+    int r = tcpWrite(comp->fd, bufGet(outgoing), bufLen(outgoing));
+
+    MX_TRACE_SPAN(MX_TE_WRITE, t0, comp->fd, cmd->u.write.msg_type,
+            bufLen(outgoing));
+
+    mx_count(&comp->written, cmd->u.write.msg_type, cmd->u.write.size, r < 0);
+
+    bufClear(outgoing);
+
+    free(cmd->u.write.payload);
+    free(cmd);
+}
+
+/*
+ * A thread to write outgoing messages to a file descriptor. <arg> is a pointer
+ * to an MX_WriterInfo struct.
+ */
+static void *mx_writer_thread(void *arg)
+{
+    MX_Component *comp = arg;
+
+    MX_Command *cmd;
+
+    Buffer outgoing = { 0 };
+
+    sigset_t sigpipe;
+
+    mx_trace_name("writer %d", comp->fd);
+
+    /* If the other side has gone away, let the write fail instead of killing
+     * the whole process. */
+
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+
+    pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+    /* After a lazy reconnect, introduce ourselves first, and then write
+     * whatever was kept while the component was dormant. */
+
+    if (comp->greeting != NULL) {
+        mx_write_command(comp, &outgoing, comp->greeting);
+        comp->greeting = NULL;
+    }
+
+    while ((cmd = comp->pending) != NULL) {
+        comp->pending = cmd->next;
+        mx_write_command(comp, &outgoing, cmd);
+    }
+
+    /* Wait for commands from the writer_queue and write data to comp->fd. */
+
+    while (1) {
+        double spin = comp->mx->busy_poll;
+
+        cmd = NULL;
+
+        if (spin > 0) {
+            cmd = mx_spin_for_command(&comp->writer_queue, spin);
+        }
+
+        if (cmd == NULL) {
+            cmd = mx_await_command(&comp->writer_queue, INFINITY);
+        }
+
+        if (cmd->cmd_type == MX_CT_EXIT) {
+            free(cmd);
+            break;
+        }
+        else if (cmd->cmd_type == MX_CT_WRITE) {
+            mx_write_command(comp, &outgoing, cmd);
+        }
+        else {
+            mx_error("unexpected command type in writer thread: %d (%s)\n",
+                    cmd->cmd_type, cmd_enum_to_string(cmd->cmd_type));
+            break;
+        }
+    }
+
+    bufClear(&outgoing);
+
+    return NULL;
+}
+
+/*
+ * Start a thread to write messages to <comp>.
+ */
+static int mx_start_writer_thread(MX *mx, MX_Component *comp)
+{
+    int r = pthread_create(&comp->writer_thread, NULL, mx_writer_thread, comp);
+
+    if (r != 0) {
+        mx_error("couldn't create writer thread (%s)\n", strerror(r));
+        return -1;
+    }
+
+    mx_place_thread(mx, MX_THREAD_WRITER, comp->writer_thread);
+
+    return 0;
+}
+
+/*
+ * Stop the thread to write messages to <comp>.
+ */
+static void mx_stop_writer_thread(MX *mx, MX_Component *comp)
+{
+    if (comp->writer_thread == 0) {
+        return;
+    }
+
+    MX_Command *cmd = mx_create_exit_command();
+
+    mx_push_command(&comp->writer_queue, cmd);
+
+    pthread_join(comp->writer_thread, NULL);    /* Wait for writer to exit. */
+
+    comp->writer_thread = 0;
+}
+
+/*
+ * Create a new component in <mx>.
+ */
+static MX_Component *mx_create_component(MX *mx)
+{
+    MX_Component *comp = calloc(1, sizeof(*comp));
+
+    comp->mx = mx;
+
+    mx_init_queue(&comp->writer_queue);
+
+    sem_init(&comp->handshake_done, 0, 0);
+
+    bufClear(&mx_message);
+
+    pthread_rwlock_init(&comp->await_lock, NULL);
+
+    return comp;
+}
+
+/*
+ * Count the number of components known to <mx>. If <name> is not NULL, only
+ * the components whose name begins with <name> are counted.
+ */
+static uint16_t mx_count_components(const MX *mx, const char *name)
+{
+    int component_count = paCount(&mx->components);
+    int found = 0;
+
+    for (int i = 0; i < component_count; i++) {
+        MX_Component *comp = paGet(&mx->components, i);
+
+        if (comp == NULL) {
+            continue;
+        }
+        else if (name == NULL) {
+            found++;
+        }
+        else if (comp->name == NULL) {
+            continue;
+        }
+        else if (strcmp(name, comp->name) == 0) {
+            found++;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Return true if <filter> is well-formed.
+ */
+static bool mx_filter_is_valid(const MX_Filter *filter)
+{
+    if (filter->width != 1 && filter->width != 2 &&
+        filter->width != 4 && filter->width != 8) {
+        return false;
+    }
+    else if (filter->count > 0 && filter->values == NULL) {
+        return false;
+    }
+
+    switch (filter->test) {
+    case MX_FILTER_EQUALS:
+        return filter->count == 1;
+    case MX_FILTER_RANGE:
+        return filter->count == 2;
+    case MX_FILTER_SET:
+        return filter->count >= 1;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Return a copy of <filter>, allocated as a single block that can be released
+ * with free().
+ */
+static MX_Filter *mx_copy_filter(const MX_Filter *filter)
+{
+    MX_Filter *copy = malloc(sizeof(*copy) + filter->count * sizeof(uint64_t));
+    uint64_t *values = (uint64_t *) (copy + 1);
+
+    memcpy(values, filter->values, filter->count * sizeof(uint64_t));
+
+    *copy = *filter;
+    copy->values = values;
+
+    return copy;
+}
+
+/*
+ * Get the unsigned, big-endian integer field of <width> bytes at <offset> in
+ * <payload> with size <size> into <value>. Returns false if the payload is too
+ * short to contain it.
+ */
+static bool mx_get_field(const char *payload, uint32_t size,
+        uint32_t offset, uint32_t width, uint64_t *value)
+{
+    uint32_t i;
+
+    if ((uint64_t) offset + width > size) {
+        return false;
+    }
+
+    for (*value = 0, i = 0; i < width; i++) {
+        *value = (*value << 8) | (uint8_t) payload[offset + i];
+    }
+
+    return true;
+}
+
+/*
+ * Return true if the message with payload <payload> and size <size> passes
+ * <filter>.
+ */
+static bool mx_filter_matches(const MX_Filter *filter,
+        const char *payload, uint32_t size)
+{
+    uint32_t i;
+    uint64_t value;
+
+    if (!mx_get_field(payload, size, filter->offset, filter->width, &value)) {
+        return false;
+    }
+
+    switch (filter->test) {
+    case MX_FILTER_EQUALS:
+        return value == filter->values[0];
+    case MX_FILTER_RANGE:
+        return value >= filter->values[0] && value <= filter->values[1];
+    case MX_FILTER_SET:
+        for (i = 0; i < filter->count; i++) {
+            if (value == filter->values[i]) return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Store payload <payload> with size <size> and version <version>, of a message
+ * of type <msg> that we're broadcasting, in the cache of <msg>. It replaces the
+ * value with the same key, if there is one.
+ */
+static void mx_cache_value(MX_Message *msg,
+        uint32_t version, const char *payload, uint32_t size)
+{
+    uint64_t key = 0;
+    MX_CachedValue *value;
+
+    if (msg->cache_width > 0 && !mx_get_field(payload, size,
+                msg->cache_offset, msg->cache_width, &key)) {
+        return;
+    }
+
+    if ((value = hashGet(&msg->cache_by_key, HASH_VALUE(key))) == NULL) {
+        value = calloc(1, sizeof(*value));
+
+        value->key = key;
+
+        listAppendTail(&msg->cache, value);
+        hashAdd(&msg->cache_by_key, value, HASH_VALUE(key));
+    }
+
+    value->payload = realloc(value->payload, size > 0 ? size : 1);
+    value->version = version;
+    value->size    = size;
+
+    memcpy(value->payload, payload, size);
+}
+
+/*
+ * Drop all values in the cache of <msg>.
+ */
+static void mx_clear_cache(MX_Message *msg)
+{
+    MX_CachedValue *value;
+
+    while ((value = listRemoveHead(&msg->cache)) != NULL) {
+        hashDrop(&msg->cache_by_key, HASH_VALUE(value->key));
+
+        free(value->payload);
+        free(value);
+    }
+}
+
+/*
+ * Send the values in the cache of the message type of new subscription <sub>
+ * to its subscriber, in the order in which they were first cached. The caller
+ * must hold the cache lock of that message type, and must have taken it before
+ * publishing the fanout that includes <sub>. That way, a broadcast either
+ * reaches the subscriber itself or is in the cache by the time we get here,
+ * but not both.
+ */
+static void mx_send_cached_values(MX *mx, MX_Subscription *sub)
+{
+    MX_CachedValue *value;
+    MX_Message *msg = sub->msg;
+
+    if (sub->comp == mx->me) return;
+
+    if (!listIsEmpty(&msg->cache) && mx_wake_if_dormant(mx, sub->comp) == 0) {
+        for (value = listHead(&msg->cache); value; value = listNext(value)) {
+            if (sub->filter == NULL ||
+                mx_filter_matches(sub->filter, value->payload, value->size)) {
+                mx_send(sub->comp, msg->msg_type,
+                        value->version, value->payload, value->size);
+            }
+        }
+    }
+}
+
+/*
+ * Add a subscription entry for message type <type> to <buf>. If <filter> is not
+ * NULL, it is added as well.
+ */
+static void mx_pack_entry(Buffer *buf, uint32_t type, const MX_Filter *filter)
+{
+    uint32_t i;
+
+    if (filter == NULL) {
+        bufPack(buf, PACK_INT32, type, END);
+        return;
+    }
+
+    bufPack(buf,
+            PACK_INT32, type | MX_FILTERED,
+            PACK_INT32, filter->offset,
+            PACK_INT16, filter->width,
+            PACK_INT16, filter->test,
+            PACK_INT32, filter->count,
+            END);
+
+    for (i = 0; i < filter->count; i++) {
+        bufPack(buf, PACK_INT64, filter->values[i], END);
+    }
+}
+
+/*
+ * Unpack the subscription entry at <data>, with <size> bytes available, into
+ * <type> and <filter>. <filter> is set to a newly allocated filter, or to NULL
+ * if the entry doesn't have one. Returns the size of the entry, or 0 if there is
+ * no (complete) entry or if its filter is invalid.
+ */
+static uint32_t mx_unpack_entry(const char *data, uint32_t size,
+        uint32_t *type, MX_Filter **filter)
+{
+    uint32_t i, offset, count;
+    uint16_t width, test;
+    uint64_t *values;
+
+    *filter = NULL;
+
+    if (size < 4) return 0;
+
+    strunpack(data, size, PACK_INT32, type, END);
+
+    if ((*type & MX_FILTERED) == 0) return 4;
+
+    *type &= ~MX_FILTERED;
+
+    if (size < 16) return 0;
+
+    strunpack(data + 4, size - 4,
+            PACK_INT32, &offset,
+            PACK_INT16, &width,
+            PACK_INT16, &test,
+            PACK_INT32, &count,
+            END);
+
+    if (count > (size - 16) / 8) return 0;
+
+    *filter = malloc(sizeof(MX_Filter) + count * sizeof(uint64_t));
+
+    values = (uint64_t *) (*filter + 1);
+
+    for (i = 0; i < count; i++) {
+        strunpack(data + 16 + 8 * i, 8, PACK_INT64, &values[i], END);
+    }
+
+    (*filter)->offset = offset;
+    (*filter)->width  = width;
+    (*filter)->test   = test;
+    (*filter)->count  = count;
+    (*filter)->values = values;
+
+    if (!mx_filter_is_valid(*filter)) {
+        free(*filter);
+        *filter = NULL;
+
+        return 0;
+    }
+
+    return 16 + 8 * count;
+}
+
+/*
+ * Replace the snapshot of the components in <mx> with a new one.
+ */
+static void mx_publish_components(MX *mx)
+{
+    uint32_t fd, count = paCount(&mx->components);
+
+    MX_Table *table = calloc(1, sizeof(*table) + count * sizeof(void *));
+
+    table->count = count;
+
+    for (fd = 0; fd < count; fd++) {
+        table->entry[fd] = paGet(&mx->components, fd);
+    }
+
+    mx_retire(mx, __atomic_exchange_n(&mx->component_table, table,
+                __ATOMIC_SEQ_CST), mx_free_snapshot);
+}
+
+/*
+ * Replace the snapshot of the messages in <mx> with one that includes new
+ * message <msg>.
+ */
+static void mx_publish_message(MX *mx, MX_Message *msg)
+{
+    MX_Table *old = mx->message_table, *table;
+
+    uint32_t count = old == NULL ? 0 : old->count;
+
+    if (msg->msg_type >= count) count = msg->msg_type + 1;
+
+    table = calloc(1, sizeof(*table) + count * sizeof(void *));
+
+    table->count = count;
+
+    if (old != NULL) {
+        memcpy(table->entry, old->entry, old->count * sizeof(void *));
+    }
+
+    table->entry[msg->msg_type] = msg;
+
+    __atomic_store_n(&mx->message_table, table, __ATOMIC_SEQ_CST);
+
+    mx_retire(mx, old, mx_free_snapshot);
+}
+
+/*
+ * Return message type <type> from the snapshot in <mx>, or NULL if it doesn't
+ * exist. Call this only between mx_enter() and mx_leave().
+ */
+static MX_Message *mx_lookup_message(MX *mx, uint32_t type)
+{
+    MX_Table *table = __atomic_load_n(&mx->message_table, __ATOMIC_SEQ_CST);
+
+    return table != NULL && type < table->count ? table->entry[type] : NULL;
+}
+
+/*
+ * Return the component on <fd> from the snapshot in <mx>, or NULL if there
+ * isn't one. Call this only between mx_enter() and mx_leave().
+ */
+static MX_Component *mx_lookup_component(MX *mx, int fd)
+{
+    MX_Table *table = __atomic_load_n(&mx->component_table, __ATOMIC_SEQ_CST);
+
+    return table != NULL && fd >= 0 && fd < table->count ?
+        table->entry[fd] : NULL;
+}
+
+/*
+ * Return true if the calling thread may wake up dormant components of <mx>
+ * itself: the main thread, or one of its dispatch workers.
+ */
+static bool mx_may_wake(MX *mx)
+{
+    return pthread_equal(pthread_self(), mx->main_thread) || mx_worker_mx == mx;
+}
+
+/*
+ * Send write command <cmd> to component <comp>, which we found in a snapshot.
+ * Takes over ownership of <cmd>. Dormant components must be woken up first,
+ * which only the main thread (or a dispatch worker, holding the lock) can do.
+ * Other threads leave that to the main thread with a wake event.
+ */
+static void mx_publish_command(MX *mx, MX_Component *comp, MX_Command *cmd)
+{
+    MX_Event *evt;
+
+    if (!__atomic_load_n(&comp->dormant, __ATOMIC_ACQUIRE)) {
+        mx_queue_write(comp, cmd);
+    }
+    else if (mx_may_wake(mx)) {
+        mx_lock(mx);
+
+        if (mx_wake_if_dormant(mx, comp) == 0) {
+            mx_queue_write(comp, cmd);
+        }
+        else {
+            free(cmd->u.write.payload);
+            free(cmd);
+        }
+
+        mx_unlock(mx);
+    }
+    else {
+        evt = mx_new_event(MX_ET_WAKE);
+
+        evt->u.wake.id  = comp->id;
+        evt->u.wake.cmd = cmd;
+
+        if (mx_send_pointer(mx->event_pipe[WR], evt) != 0) {
+            free(cmd->u.write.payload);
+            free(cmd);
+            free(evt);
+        }
+    }
+}
+
+/*
+ * Send a message with type <type>, version <version> and payload <payload> with
+ * size <size> to <comp>, as mx_publish_command does.
+ */
+static void mx_publish(MX *mx, MX_Component *comp,
+        uint32_t type, uint32_t version, const char *payload, uint32_t size)
+{
+    mx_publish_command(mx, comp,
+            mx_create_write_command(type, version, payload, size));
+}
+
+/*
+ * Handle a wake event, sent by mx_publish, for the component with id <id>, with
+ * write command <cmd> for it. We don't go by its fd, because by now it may have
+ * left and its fd may have been reused for another component.
+ */
+static void mx_handle_wake(MX *mx, uint16_t id, MX_Command *cmd)
+{
+    MX_Component *comp = hashGet(&mx->component_by_id, HASH_VALUE(id));
+
+    if (comp != NULL && mx_wake_if_dormant(mx, comp) == 0) {
+        mx_queue_write(comp, cmd);
+    }
+    else {
+        free(cmd->u.write.payload);
+        free(cmd);
+    }
+}
+
+/*
+ * Replace the snapshot of the subscribers to <msg> with a new one. We never
+ * send anything to ourselves, so we're left out.
+ */
+static void mx_publish_fanout(MX *mx, MX_Message *msg)
+{
+    MX_Subscription *sub;
+    MX_Fanout *fanout = NULL;
+    MX_Filter *filter;
+
+    int count = 0;
+    size_t size = sizeof(MX_Fanout);
+
+    for (sub = mlHead(&msg->subscriptions); sub;
+         sub = mlNext(&msg->subscriptions, sub)) {
+        if (sub->comp == mx->me) continue;
+
+        size += sizeof(MX_Subscriber);
+
+        if (sub->filter != NULL) {
+            size += sizeof(MX_Filter) + sub->filter->count * sizeof(uint64_t);
+        }
+
+        count++;
+    }
+
+    if (count > 0) {
+        fanout = calloc(1, size);
+
+        filter = (MX_Filter *) (fanout->sub + count);
+
+        for (sub = mlHead(&msg->subscriptions); sub;
+             sub = mlNext(&msg->subscriptions, sub)) {
+            if (sub->comp == mx->me) continue;
+
+            MX_Subscriber *subscriber = fanout->sub + fanout->count++;
+
+            subscriber->comp = sub->comp;
+
+            if (sub->filter == NULL) continue;
+
+            uint64_t *values = (uint64_t *) (filter + 1);
+
+            *filter = *sub->filter;
+
+            memcpy(values, sub->filter->values,
+                    sub->filter->count * sizeof(uint64_t));
+
+            filter->values = values;
+
+            subscriber->filter = filter;
+
+            filter = (MX_Filter *) (values + sub->filter->count);
+        }
+    }
+
+    mx_retire(mx, __atomic_exchange_n(&msg->fanout, fanout, __ATOMIC_SEQ_CST),
+            mx_free_snapshot);
+}
+
+/*
+ * Destroy component <ptr>, after it has been retired. To be used with
+ * mx_retire.
+ */
+static void mx_free_component(MX *mx, void *ptr)
+{
+    MX_Component *comp = ptr;
+    MX_Command *cmd;
+
+    /* Drop anything a publisher queued after its writer thread was stopped,
+     * or that was kept for a wake-up that never came. */
+
+    while ((cmd = mx_await_command(&comp->writer_queue, 0)) != NULL) {
+        if (cmd->cmd_type == MX_CT_WRITE) free(cmd->u.write.payload);
+
+        free(cmd);
+    }
+
+    while ((cmd = comp->pending) != NULL) {
+        comp->pending = cmd->next;
+
+        free(cmd->u.write.payload);
+        free(cmd);
+    }
+
+    if (comp->greeting != NULL) {
+        free(comp->greeting->u.write.payload);
+        free(comp->greeting);
+    }
+
+    mx_free_thread_counters(comp->queued);
+
+    free(comp);
+}
+
+/*
+ * Destroy all subscriptions by component <comp>.
+ */
+static void mx_destroy_component_subscriptions(MX_Component *comp)
+{
+    MX_Subscription *sub;
+
+    while ((sub = mlRemoveHead(&comp->subscriptions)) != NULL) {
+        mlRemove(&sub->msg->subscriptions, sub);
+        mx_publish_fanout(comp->mx, sub->msg);
+        free(sub->filter);
+        free(sub);
+    }
+}
+
+/*
+ * Destroy all pattern subscriptions by component <comp>.
+ */
+static void mx_destroy_component_patterns(MX_Component *comp)
+{
+    MX_PatternSub *ps;
+
+    while ((ps = mlRemoveHead(&comp->patterns)) != NULL) {
+        mlRemove(&ps->node->subs, ps);
+        free(ps->pattern);
+        free(ps);
+    }
+}
+
+/*
+ * Destroy all subscriptions on message <msg>.
+ */
+static void mx_destroy_message_subscriptions(MX_Message *msg)
+{
+    MX_Subscription *sub;
+
+    while ((sub = mlRemoveHead(&msg->subscriptions)) != NULL) {
+        mlRemove(&sub->comp->subscriptions, sub);
+        free(sub->filter);
+        free(sub);
+    }
+}
+
+/*
+ * Destroy component <comp>.
+ */
+static void mx_destroy_component(MX *mx, MX_Component *comp)
+{
+    MX_Await *await;
+
+    bufClear(&comp->incoming);
+
+    pthread_rwlock_destroy(&comp->await_lock);
+
+    /* Destroy any pending awaits. */
+
+    while ((await = listRemoveHead(&comp->awaits)) != NULL) {
+        pthread_mutex_unlock(&await->mutex);
+        pthread_mutex_destroy(&await->mutex);
+
+        if (await->payload != NULL) free(await->payload);
+
+        free(await);
+    }
+
+    if (comp != mx->me && comp->name != NULL && !comp->duplicate &&
+        mx->on_end_comp_callback) {
+        mx->on_end_comp_callback(mx, comp->fd, comp->name,
+                mx->on_end_comp_udata);
+    }
+
+    if (hashGet(&mx->component_by_id, HASH_VALUE(comp->id)) == comp) {
+        hashDrop(&mx->component_by_id, HASH_VALUE(comp->id));
+    }
+
+    if (comp->handshake) {              /* Don't leave the reader waiting. */
+        sem_post(&comp->handshake_done);
+    }
+
+    mx_stop_reader_thread(mx, comp);
+    mx_stop_writer_thread(mx, comp);
+
+    mx_destroy_component_subscriptions(comp);
+    mx_destroy_component_patterns(comp);
+
+    mx_free_counters(&comp->written);
+    mx_free_counters(&comp->received);
+    mx_free_counters(&comp->handled);
+
+    free(comp->last_stats);
+
+    free(comp->name);
+    free(comp->host);
+
+    /* Publishers on other threads may still be using it. */
+
+    mx_retire(mx, comp, mx_free_component);
+}
+
+/*
+ * Find the subscription to <msg> in <comp>.
+ */
+static MX_Subscription *mx_find_subscription_for_comp(MX_Message *msg, MX_Component *comp)
+{
+    MX_Subscription *sub;
+
+    for (sub = mlHead(&comp->subscriptions); sub;
+         sub = mlNext(&comp->subscriptions, sub)) {
+        if (sub->msg == msg) break;
+    }
+
+    return sub;
+}
+
+/*
+ * Find the subscription from <comp> in <msg>.
+ */
+static MX_Subscription *mx_find_subscription_to_msg(MX_Component *comp, MX_Message *msg)
+{
+    MX_Subscription *sub;
+
+    for (sub = mlHead(&msg->subscriptions); sub;
+         sub = mlNext(&msg->subscriptions, sub)) {
+        if (sub->comp == comp) break;
+    }
+
+    return sub;
+}
+
+/*
+ * Return the index of the histogram bucket for value <value>.
+ */
+static int mx_hist_index(uint64_t value)
+{
+    int bits;
+
+    if (value < MX_HIST_SUB) {
+        return value;
+    }
+    else if (value >= (uint64_t) 1 << MX_HIST_MAX_BITS) {
+        return MX_HIST_BUCKETS - 1;
+    }
+
+    bits = 63 - __builtin_clzll(value);
+
+    return (bits - MX_HIST_SUB_BITS + 1) * MX_HIST_SUB +
+           ((value >> (bits - MX_HIST_SUB_BITS)) & (MX_HIST_SUB - 1));
+}
+
+/*
+ * Return the largest value that goes into histogram bucket <index>.
+ */
+static uint64_t mx_hist_value(int index)
+{
+    int bits, shift;
+
+    if (index < MX_HIST_SUB) {
+        return index;
+    }
+
+    bits  = index / MX_HIST_SUB + MX_HIST_SUB_BITS - 1;
+    shift = bits - MX_HIST_SUB_BITS;
+
+    return (((uint64_t) (MX_HIST_SUB + index % MX_HIST_SUB) + 1) << shift) - 1;
+}
+
+/*
+ * Add <seconds> to histogram <hist>. Negative values (from clocks that are out
+ * of sync) are counted as 0.
+ */
+static void mx_hist_add(MX_Histogram *hist, double seconds)
+{
+    uint64_t value = seconds > 0 ? seconds * 1e9 : 0;
+
+    hist->count++;
+    hist->bucket[mx_hist_index(value)]++;
+
+    if (value > hist->max) hist->max = value;
+}
+
+/*
+ * Return the <percentile>th percentile of the values in <hist>, in seconds.
+ */
+static double mx_hist_percentile(const MX_Histogram *hist, double percentile)
+{
+    int index;
+    uint64_t seen = 0, wanted = ceil(hist->count * percentile / 100);
+
+    for (index = 0; index < MX_HIST_BUCKETS; index++) {
+        seen += hist->bucket[index];
+
+        if (seen >= wanted && seen > 0) break;
+    }
+
+    return MIN(mx_hist_value(index), hist->max) / 1e9;
+}
+
+/*
+ * Record the latency of a message of type <msg>, which was queued, written and
+ * read at the times in <stamp>, and whose handler ran from <start> to <end>.
+ */
+static void mx_record_latency(MX_Message *msg, const double stamp[3],
+        double start, double end)
+{
+    if (msg->latency == NULL) {
+        msg->latency = calloc(NUM_MX_STAGES, sizeof(MX_Histogram));
+    }
+
+    mx_hist_add(&msg->latency[MX_STAGE_QUEUE],    stamp[1] - stamp[0]);
+    mx_hist_add(&msg->latency[MX_STAGE_NETWORK],  stamp[2] - stamp[1]);
+    mx_hist_add(&msg->latency[MX_STAGE_DISPATCH], start - stamp[2]);
+    mx_hist_add(&msg->latency[MX_STAGE_HANDLER],  end - start);
+}
+
+/*
+ * Handle message <msg>, that came in via file descriptor <fd>. If the sender
+ * timestamped it, <stamp> contains the times at which it was queued, written
+ * and read. Otherwise it is NULL.
+ */
+static void mx_handle_message(MX *mx, int fd,
+        uint32_t type, uint32_t version, char *payload, uint32_t size,
+        const double *stamp)
+{
+    MX_Message *msg;
+    MX_Subscription *sub;
+
+    /* The handler may destroy <comp> (e.g. by calling mxShutdown), so keep it
+     * from being freed until we're done with it. */
+
+    MX_EpochSlot *slot = mx_enter(mx);
+
+    MX_Component *comp = paGet(&mx->components, fd);
+
+    if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(type))) != NULL &&
+        (sub = mx_find_subscription_for_comp(msg, mx->me)) != NULL) {
+        MX_TRACE(MX_TE_HANDLER_START, fd, type, size);
+
+        if (stamp != NULL) {
+            double start = mxNow();
+
+            sub->handler(mx, fd, type, version, payload, size, sub->udata);
+
+            mx_record_latency(msg, stamp, start, mxNow());
+        }
+        else {
+            sub->handler(mx, fd, type, version, payload, size, sub->udata);
+        }
+
+        MX_TRACE(MX_TE_HANDLER_END, fd, type, size);
+    }
+    else if (comp != NULL) {
+        mx_count(&comp->handled, type, size, true);
+    }
+
+    /* Let the reader thread continue if it was waiting for us. */
+
+    if (comp != NULL && comp->handshake) {
+        comp->handshake = false;
+
+        sem_post(&comp->handshake_done);
+    }
+
+    mx_leave(slot);
+}
+
+/*
+ * Handle an MX_MT_REGISTER_REPORT (only in regular components). The message
+ * came in on fd <fd> with type <type>, version <version>, and had payload
  * <payload> with size <size>.
  */
-static void mx_handle_register_report(MX *mx, int fd,
-        uint32_t type, uint32_t version,
-        char *payload, uint32_t size, void *udata)
+static void mx_handle_register_report(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    MX_Message *msg;
+    char *msg_name;
+
+    strunpack(payload, size,
+            PACK_STRING,    &msg_name,
+            PACK_INT32,     &type,
+            END);
+
+    free(payload);
+
+    if (strlen(msg_name) == 0) {        /* An anonymous message! */
+        free(msg_name);
+        msg_name = NULL;
+    }
+
+    msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+
+    if (msg == NULL) {
+        mx_create_message(mx, type, msg_name);
+
+        free(msg_name);
+    }
+    else if (msg->msg_name == NULL && msg_name != NULL) {
+        msg->msg_name = msg_name;
+
+        hashAdd(&mx->message_by_name, msg, HASH_STRING(msg_name));
+
+        mx_apply_patterns(mx, msg);
+    }
+    else if (msg_name != NULL) {
+        free(msg_name);
+    }
+}
+
+/*
+ * Add a subscription by component <comp> to message type <type>, with filter
+ * <filter> (which may be NULL). The subscription takes over <filter>. If <comp>
+ * was already subscribed, only its filter is replaced.
+ */
+static void mx_add_subscription(MX *mx, MX_Component *comp, uint32_t type,
+        MX_Filter *filter)
+{
+    MX_Subscription *sub;
+    MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+
+    if (msg == NULL) {
+        msg = mx_create_message(mx, type, NULL);
+    }
+    else if ((sub = mx_find_subscription_for_comp(msg, comp)) != NULL) {
+        free(sub->filter);
+        sub->filter  = filter;
+        sub->pattern = NULL;            /* It's an explicit one now. */
+        mx_publish_fanout(mx, msg);
+        return;
+    }
+
+    sub = calloc(1, sizeof(*sub));
+
+    sub->comp   = comp;
+    sub->msg    = msg;
+    sub->filter = filter;
+
+    mlAppendTail(&msg->subscriptions, sub);
+    mlAppendTail(&comp->subscriptions, sub);
+
+    pthread_mutex_lock(&msg->cache_lock);
+
+    mx_publish_fanout(mx, msg);
+    mx_send_cached_values(mx, sub);
+
+    pthread_mutex_unlock(&msg->cache_lock);
+
+    if (msg->on_new_sub_callback) {
+        msg->on_new_sub_callback(mx, comp->fd, type, msg->on_new_sub_udata);
+    }
+}
+
+/*
+ * Remove the subscription by component <comp> to message type <type>.
+ */
+static void mx_remove_subscription(MX *mx, MX_Component *comp, uint32_t type)
+{
+    MX_Message *msg;
+    MX_Subscription *sub;
+
+    if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(type))) == NULL) {
+        return;
+    }
+
+    if ((sub = mx_find_subscription_to_msg(comp, msg)) == NULL) {
+        return;
+    }
+
+    mlRemove(&msg->subscriptions, sub);
+    mlRemove(&comp->subscriptions, sub);
+
+    mx_publish_fanout(mx, msg);
+
+    if (msg->on_end_sub_callback) {
+        msg->on_end_sub_callback(mx, comp->fd, type, msg->on_end_sub_udata);
+    }
+
+    free(sub->filter);
+    free(sub);
+}
+
+/*
+ * Send the report of type <type>, with the payload given by the PACK_*
+ * arguments that follow, about component <about> to all other components. Used
+ * by the master in lazy mode.
+ */
+static void mx_report(MX *mx, MX_Component *about, uint32_t type, ...)
+{
+    int fd;
+    va_list ap;
+
+    for (fd = 0; fd < paCount(&mx->components); fd++) {
+        MX_Component *comp = paGet(&mx->components, fd);
+
+        if (comp == NULL || comp == about || comp->name == NULL) continue;
+
+        va_start(ap, type);
+        mx_va_pack(comp, type, 0, ap);
+        va_end(ap);
+    }
+}
+
+/*
+ * Add (if <subscribe> is true) or remove subscriptions by component <comp> for
+ * each of the entries in the list at <entries> with size <size>, as received in
+ * a subscribe or cancel update or report. A master in lazy mode relays the
+ * entries for user message types to all other components in a report.
+ */
+static void mx_apply_entries(MX *mx, MX_Component *comp, bool subscribe,
+        const char *entries, uint32_t size)
+{
+    uint32_t offset = 0, len, type;
+    MX_Filter *filter;
+
+    Buffer relay = { 0 };
+
+    while ((len = mx_unpack_entry(entries + offset, size - offset,
+                    &type, &filter)) > 0) {
+        offset += len;
+
+        if (type >= NUM_MX_MESSAGES || type == MX_MT_STATS_REPORT) {
+            mx_pack_entry(&relay, type, filter);
+        }
+
+        if (subscribe) {
+            mx_add_subscription(mx, comp, type, filter);
+        }
+        else {
+            mx_remove_subscription(mx, comp, type);
+            free(filter);
+        }
+    }
+
+    if (mx->lazy && mx->me == mx->master && bufLen(&relay) > 0) {
+        mx_report(mx, comp,
+                subscribe ? MX_MT_SUBSCRIBE_REPORT : MX_MT_CANCEL_REPORT,
+                PACK_INT16, comp->id,
+                PACK_RAW,   bufGet(&relay), bufLen(&relay),
+                END);
+    }
+
+    bufClear(&relay);
+}
+
+/*
+ * Return the node for the first <len> characters of <prefix> in the pattern
+ * trie of <mx>, creating it if necessary.
+ */
+static MX_PatternNode *mx_pattern_node(MX *mx, const char *prefix, size_t len)
+{
+    size_t i;
+    MX_PatternNode *node = &mx->patterns;
+
+    for (i = 0; i < len; i++) {
+        MX_PatternNode *child;
+
+        for (child = node->child; child; child = child->next) {
+            if (child->c == prefix[i]) break;
+        }
+
+        if (child == NULL) {
+            child = calloc(1, sizeof(*child));
+
+            child->c    = prefix[i];
+            child->next = node->child;
+
+            node->child = child;
+        }
+
+        node = child;
+    }
+
+    return node;
+}
+
+/*
+ * Free the nodes for the first <len> characters of <prefix> below <node> in the
+ * pattern trie, as far as they no longer have children or pattern
+ * subscriptions. Returns true if <node> itself is unused after that.
+ */
+static bool mx_prune_pattern_nodes(MX_PatternNode *node,
+        const char *prefix, size_t len)
+{
+    MX_PatternNode **link, *child;
+
+    if (len > 0) {
+        for (link = &node->child; (child = *link) != NULL; link = &child->next) {
+            if (child->c == prefix[0]) break;
+        }
+
+        if (child != NULL && mx_prune_pattern_nodes(child, prefix + 1, len - 1)) {
+            *link = child->next;
+
+            free(child);
+        }
+    }
+
+    return node->child == NULL && mlHead(&node->subs) == NULL;
+}
+
+/*
+ * Free the pattern trie nodes starting at <node>, and their siblings.
+ */
+static void mx_free_pattern_nodes(MX_PatternNode *node)
+{
+    while (node != NULL) {
+        MX_PatternNode *next = node->next;
+
+        mx_free_pattern_nodes(node->child);
+
+        free(node);
+
+        node = next;
+    }
+}
+
+/*
+ * Return true if message name <name> matches pattern subscription <ps>.
+ */
+static bool mx_pattern_matches(const MX_PatternSub *ps, const char *name)
+{
+    if (ps->prefix) {
+        return strncmp(name, ps->pattern, strlen(ps->pattern) - 1) == 0;
+    }
+    else {
+        return strcmp(name, ps->pattern) == 0;
+    }
+}
+
+/*
+ * Subscribe the component of pattern subscription <ps> to message <msg>, unless
+ * it is already subscribed to it.
+ */
+static void mx_expand_pattern(MX *mx, MX_PatternSub *ps, MX_Message *msg)
+{
+    MX_Subscription *sub;
+    MX_Component *comp = ps->comp;
+
+    if (msg->msg_type < NUM_MX_MESSAGES ||
+        mx_find_subscription_for_comp(msg, comp) != NULL) {
+        return;
+    }
+
+    sub = calloc(1, sizeof(*sub));
+
+    sub->comp    = comp;
+    sub->msg     = msg;
+    sub->pattern = ps;
+    sub->handler = ps->handler;
+    sub->udata   = ps->udata;
+
+    mlAppendTail(&msg->subscriptions, sub);
+    mlAppendTail(&comp->subscriptions, sub);
+
+    pthread_mutex_lock(&msg->cache_lock);
+
+    mx_publish_fanout(mx, msg);
+    mx_send_cached_values(mx, sub);
+
+    pthread_mutex_unlock(&msg->cache_lock);
+
+    if (comp != mx->me && msg->on_new_sub_callback) {
+        msg->on_new_sub_callback(mx, comp->fd, msg->msg_type,
+                msg->on_new_sub_udata);
+    }
+}
+
+/*
+ * Apply all pattern subscriptions that match the name of message <msg>. This is
+ * done by walking down the pattern trie along the name: prefix patterns match
+ * at every node on the way, full names only at the end.
+ */
+static void mx_apply_patterns(MX *mx, MX_Message *msg)
+{
+    MX_PatternSub *ps;
+    MX_PatternNode *node = &mx->patterns;
+    const char *p = msg->msg_name;
+
+    while (node != NULL) {
+        for (ps = mlHead(&node->subs); ps; ps = mlNext(&node->subs, ps)) {
+            if (ps->prefix || *p == '\0') mx_expand_pattern(mx, ps, msg);
+        }
+
+        if (*p == '\0') break;
+
+        for (node = node->child; node; node = node->next) {
+            if (node->c == *p) break;
+        }
+
+        p++;
+    }
+}
+
+/*
+ * Find the pattern subscription by component <comp> for <pattern>.
+ */
+static MX_PatternSub *mx_find_pattern(MX_Component *comp, const char *pattern)
+{
+    MX_PatternSub *ps;
+
+    for (ps = mlHead(&comp->patterns); ps; ps = mlNext(&comp->patterns, ps)) {
+        if (strcmp(ps->pattern, pattern) == 0) return ps;
+    }
+
+    return NULL;
+}
+
+/*
+ * Add a subscription by component <comp> to all messages whose name matches
+ * <pattern>, now and in the future. For our own subscriptions, <handler> and
+ * <udata> are used for incoming messages.
+ */
+static MX_PatternSub *mx_add_pattern(MX *mx, MX_Component *comp,
+        const char *pattern,
+        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata),
+        void *udata)
+{
+    uint32_t type;
+    size_t len = strlen(pattern);
+
+    MX_PatternSub *ps = calloc(1, sizeof(*ps));
+
+    ps->comp    = comp;
+    ps->pattern = strdup(pattern);
+    ps->prefix  = (len > 0 && pattern[len - 1] == '*');
+    ps->handler = handler;
+    ps->udata   = udata;
+    ps->node    = mx_pattern_node(mx, pattern, ps->prefix ? len - 1 : len);
+
+    mlAppendTail(&ps->node->subs, ps);
+    mlAppendTail(&comp->patterns, ps);
+
+    /* Apply it to the messages we already know. */
+
+    for (type = NUM_MX_MESSAGES; type < mx->next_message_type; type++) {
+        MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+
+        if (msg != NULL && msg->msg_name != NULL &&
+            mx_pattern_matches(ps, msg->msg_name)) {
+            mx_expand_pattern(mx, ps, msg);
+        }
+    }
+
+    return ps;
+}
+
+/*
+ * Find a pattern subscription by the component of <ps>, other than <ps> itself,
+ * that matches message name <name>.
+ */
+static MX_PatternSub *mx_find_other_pattern(const MX_PatternSub *ps,
+        const char *name)
+{
+    MX_PatternSub *other;
+    MX_Component *comp = ps->comp;
+
+    for (other = mlHead(&comp->patterns); other;
+         other = mlNext(&comp->patterns, other)) {
+        if (other != ps && mx_pattern_matches(other, name)) return other;
+    }
+
+    return NULL;
+}
+
+/*
+ * Remove pattern subscription <ps>, and all subscriptions that came from it.
+ * Subscriptions that another pattern of the same component also matches are
+ * handed over to that pattern instead.
+ */
+static void mx_remove_pattern(MX *mx, MX_PatternSub *ps)
+{
+    MX_Component *comp = ps->comp;
+    MX_Subscription *sub, *next;
+    MX_PatternSub *other;
+
+    for (sub = mlHead(&comp->subscriptions); sub; sub = next) {
+        MX_Message *msg = sub->msg;
+
+        next = mlNext(&comp->subscriptions, sub);
+
+        if (sub->pattern != ps) continue;
+
+        if ((other = mx_find_other_pattern(ps, msg->msg_name)) != NULL) {
+            sub->pattern = other;
+            sub->handler = other->handler;
+            sub->udata   = other->udata;
+
+            continue;
+        }
+
+        mlRemove(&msg->subscriptions, sub);
+        mlRemove(&comp->subscriptions, sub);
+
+        mx_publish_fanout(mx, msg);
+
+        free(sub->filter);
+        free(sub);
+
+        if (comp != mx->me && msg->on_end_sub_callback) {
+            msg->on_end_sub_callback(mx, comp->fd, msg->msg_type,
+                    msg->on_end_sub_udata);
+        }
+    }
+
+    mlRemove(&ps->node->subs, ps);
+    mlRemove(&comp->patterns, ps);
+
+    /* Drop the part of the trie that no other pattern uses anymore. */
+
+    mx_prune_pattern_nodes(&mx->patterns, ps->pattern,
+            ps->prefix ? strlen(ps->pattern) - 1 : strlen(ps->pattern));
+
+    free(ps->pattern);
+    free(ps);
+}
+
+/*
+ * Handle a PATTERN_SUBSCRIBE_UPDATE message (in all components). This message
+ * is exchanged between components to inform each other of new pattern
+ * subscriptions.
+ */
+static void mx_handle_pattern_subscribe_update(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    char *pattern;
+
+    MX_Component *comp = paGet(&mx->components, fd);
+
+    strunpack(payload, size, PACK_STRING, &pattern, END);
+
+    free(payload);
+
+    if ((!mx->lazy || mx->me == mx->master || comp == mx->master) &&
+        mx_find_pattern(comp, pattern) == NULL) {
+        mx_add_pattern(mx, comp, pattern, NULL, NULL);
+
+        /* Clients expand patterns themselves, so in lazy mode they need to
+         * know about them too. */
+
+        if (mx->lazy && mx->me == mx->master) {
+            mx_report(mx, comp, MX_MT_PATTERN_SUBSCRIBE_REPORT,
+                    PACK_INT16,  comp->id,
+                    PACK_STRING, pattern,
+                    END);
+        }
+    }
+
+    free(pattern);
+}
+
+/*
+ * Handle a PATTERN_CANCEL_UPDATE message (in all components). This message is
+ * exchanged between components to inform each other of cancelled pattern
+ * subscriptions.
+ */
+static void mx_handle_pattern_cancel_update(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    char *pattern;
+    MX_PatternSub *ps;
+
+    MX_Component *comp = paGet(&mx->components, fd);
+
+    strunpack(payload, size, PACK_STRING, &pattern, END);
+
+    free(payload);
+
+    if ((ps = mx_find_pattern(comp, pattern)) != NULL) {
+        mx_remove_pattern(mx, ps);
+
+        if (mx->lazy && mx->me == mx->master) {
+            mx_report(mx, comp, MX_MT_PATTERN_CANCEL_REPORT,
+                    PACK_INT16,  comp->id,
+                    PACK_STRING, pattern,
+                    END);
+        }
+    }
+
+    free(pattern);
+}
+
+/*
+ * Handle a PATTERN_SUBSCRIBE_REPORT message (only in regular components, in
+ * lazy mode). The master sends this message to report a new pattern
+ * subscription by a component we may not be connected to.
+ */
+static void mx_handle_pattern_subscribe_report(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint16_t id;
+    char *pattern;
+    MX_Component *comp;
+
+    strunpack(payload, size,
+            PACK_INT16,  &id,
+            PACK_STRING, &pattern,
+            END);
+
+    free(payload);
+
+    if ((comp = hashGet(&mx->component_by_id, HASH_VALUE(id))) != NULL &&
+        mx_find_pattern(comp, pattern) == NULL) {
+        mx_add_pattern(mx, comp, pattern, NULL, NULL);
+    }
+
+    free(pattern);
+}
+
+/*
+ * Handle a PATTERN_CANCEL_REPORT message (only in regular components, in lazy
+ * mode). The master sends this message to report a cancelled pattern
+ * subscription by a component we may not be connected to.
+ */
+static void mx_handle_pattern_cancel_report(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint16_t id;
+    char *pattern;
+    MX_PatternSub *ps;
+    MX_Component *comp;
+
+    strunpack(payload, size,
+            PACK_INT16,  &id,
+            PACK_STRING, &pattern,
+            END);
+
+    free(payload);
+
+    if ((comp = hashGet(&mx->component_by_id, HASH_VALUE(id))) != NULL &&
+        (ps = mx_find_pattern(comp, pattern)) != NULL) {
+        mx_remove_pattern(mx, ps);
+    }
+
+    free(pattern);
+}
+
+/*
+ * Handle a SUBSCRIBE_UPDATE message (in all clients). This message
+ * is exchanged between clients to inform each other of new
+ * subscriptions. It lists one or more message types.
+ */
+static void mx_handle_subscribe_update(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    MX_Component *comp = paGet(&mx->components, fd);
+
+    /* In lazy mode, clients learn about subscriptions from the master. */
+
+    if (!mx->lazy || mx->me == mx->master || comp == mx->master) {
+        mx_apply_entries(mx, comp, true, payload, size);
+    }
+
+    free(payload);
+}
+
+/*
+ * Handle a CANCEL_UPDATE message (only in regular components). This message is
+ * exchanged between regular components to inform each other of cancelled
+ * subscriptions. It lists one or more message types.
+ */
+static void mx_handle_cancel_update(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    MX_Component *comp = paGet(&mx->components, fd);
+
+    if (!mx->lazy || mx->me == mx->master || comp == mx->master) {
+        mx_apply_entries(mx, comp, false, payload, size);
+    }
+
+    free(payload);
+}
+
+/*
+ * Handle a SUBSCRIBE_REPORT message (only in regular components, in lazy mode).
+ * The master sends this message to report new subscriptions by a component we
+ * may not be connected to.
+ */
+static void mx_handle_subscribe_report(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint16_t id;
+    MX_Component *comp;
+
+    strunpack(payload, size, PACK_INT16, &id, END);
+
+    if ((comp = hashGet(&mx->component_by_id, HASH_VALUE(id))) != NULL) {
+        mx_apply_entries(mx, comp, true, payload + 2, size - 2);
+    }
+
+    free(payload);
+}
+
+/*
+ * Handle a CANCEL_REPORT message (only in regular components, in lazy mode).
+ * The master sends this message to report cancelled subscriptions by a
+ * component we may not be connected to.
+ */
+static void mx_handle_cancel_report(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint16_t id;
+    MX_Component *comp;
+
+    strunpack(payload, size, PACK_INT16, &id, END);
+
+    if ((comp = hashGet(&mx->component_by_id, HASH_VALUE(id))) != NULL) {
+        mx_apply_entries(mx, comp, false, payload + 2, size - 2);
+    }
+
+    free(payload);
+}
+
+/*
+ * Handle a GOODBYE_REPORT message (only in regular components, in lazy mode).
+ * The master sends this message when a component has left.
+ */
+static void mx_handle_goodbye_report(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint16_t id;
+    bool dormant;
+    MX_Component *comp;
+
+    strunpack(payload, size, PACK_INT16, &id, END);
+
+    free(payload);
+
+    if ((comp = hashGet(&mx->component_by_id, HASH_VALUE(id))) == NULL) {
+        return;
+    }
+
+    fd = comp->fd;
+    dormant = comp->dormant;
+
+    paDrop(&mx->components, fd);
+    mx_publish_components(mx);
+
+    mx_destroy_component(mx, comp);
+
+    if (dormant) close(fd);             /* Close the placeholder socket. */
+}
+
+/*
+ * Move the write commands still in the writer queue of component <comp> to the
+ * end of its pending list, to be written when it is woken up again.
+ */
+static void mx_keep_pending(MX_Component *comp)
+{
+    MX_Command *cmd, **tail = &comp->pending;
+
+    while (*tail != NULL) tail = &(*tail)->next;
+
+    while ((cmd = mx_await_command(&comp->writer_queue, 0)) != NULL) {
+        if (cmd->cmd_type == MX_CT_WRITE) {
+            cmd->next = NULL;
+
+            *tail = cmd;
+            tail = &cmd->next;
+        }
+        else {
+            free(cmd);
+        }
+    }
+}
+
+/*
+ * Put component <comp> to sleep (lazy mode): close our connection to it, but
+ * keep it, and its fd, around until the master tells us it has left. Anything
+ * that wasn't written yet is kept, and written after the HelloUpdate when it is
+ * woken up again.
+ */
+static void mx_make_dormant(MX *mx, MX_Component *comp)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    /* From here on, publishers go through the main thread to wake it up. */
+
+    __atomic_store_n(&comp->dormant, true, __ATOMIC_RELEASE);
+
+    mx_stop_writer_thread(mx, comp);
+    mx_stop_reader_thread(mx, comp);
+
+    /* A publisher that saw the component awake just before may still add to
+     * the writer queue after this. The writer thread writes those after the
+     * HelloUpdate and the pending list on the next wake-up. */
+
+    mx_keep_pending(comp);
+
+    /* A HelloUpdate that was never written (because the connect failed) will
+     * be replaced by a new one. */
+
+    if (comp->greeting != NULL) {
+        free(comp->greeting->u.write.payload);
+        free(comp->greeting);
+
+        comp->greeting = NULL;
+    }
+
+    bufClear(&comp->incoming);
+
+    /* Keep the fd number by replacing the socket with a fresh one. If we
+     * couldn't get one, keep the old socket but shut down the connection. */
+
+    if (fd == -1) {
+        shutdown(comp->fd, SHUT_RDWR);
+    }
+    else {
+        dup2(fd, comp->fd);
+        close(fd);
+    }
+
+    comp->connecting = false;
+}
+
+/*
+ * Create a HelloUpdate write command for <mx>, with the subsequent fields.
+ */
+static MX_Command *mx_create_greeting(MX *mx, ...)
+{
+    MX_Command *cmd;
+    va_list ap;
+
+    va_start(ap, mx);
+    cmd = mx_create_packed_write_command(MX_MT_HELLO_UPDATE, 0, NULL, ap);
+    va_end(ap);
+
+    return cmd;
+}
+
+/*
+ * Wake up dormant component <comp> (lazy mode) by connecting to it, because
+ * we're about to send it something. Returns 0 on success, or -1 if the connect
+ * couldn't be started.
+ */
+static int mx_wake_component(MX *mx, MX_Component *comp)
+{
+    double now;
+
+    int fd = mx_start_connect(comp->host, comp->port);
+
+    if (fd == -1) {
+        mx_error("could not connect to component %s at %s:%d (%s).\n",
+                comp->name, comp->host, comp->port, strerror(errno));
+        return -1;
+    }
+
+    /* Move the new socket onto the fd the application knows it by. */
+
+    dup2(fd, comp->fd);
+    close(fd);
+
+    /* The writer thread writes the HelloUpdate before anything else. */
+
+    comp->greeting = mx_create_greeting(mx,
+            PACK_STRING,    mx->me->name,
+            PACK_INT16,     mx->me->id,
+            PACK_INT16,     mx->me->port,
+            END);
+
+    mx_account_write(comp, comp->greeting);
+
+    comp->connecting = true;
+
+    __atomic_store_n(&comp->dormant, false, __ATOMIC_RELEASE);
+
+    now = mxNow();
+
+    __atomic_store(&comp->last_active, &now, __ATOMIC_RELAXED);
+
+    mx_start_reader_thread(mx, comp);
+
+    return 0;
+}
+
+/*
+ * Make sure we can send something to component <comp>, waking it up if it is
+ * dormant. Returns 0 if we can, -1 otherwise.
+ */
+static int mx_wake_if_dormant(MX *mx, MX_Component *comp)
+{
+    return comp->dormant ? mx_wake_component(mx, comp) : 0;
+}
+
+/*
+ * Check for peer connections that have been idle for longer than the idle
+ * timeout, and close them (lazy mode).
+ */
+static void mx_check_idle(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    int fd;
+
+    if (mx->idle_timeout <= 0) {        /* Disabled in the mean time. */
+        mxAdjustTimer(mx, timer, INFINITY);
+        return;
+    }
+
+    for (fd = 0; fd < paCount(&mx->components); fd++) {
+        double last_active;
+
+        MX_Component *comp = paGet(&mx->components, fd);
+
+        if (comp == NULL || comp == mx->master ||
+            comp->dormant || comp->connecting) {
+            continue;
+        }
+
+        __atomic_load(&comp->last_active, &last_active, __ATOMIC_RELAXED);
+
+        if (t - last_active < mx->idle_timeout) continue;
+
+        if (comp->duplicate) {
+            paDrop(&mx->components, fd);
+            mx_publish_components(mx);
+            mx_destroy_component(mx, comp);
+        }
+        else {
+            mx_make_dormant(mx, comp);
+        }
+    }
+
+    mxAdjustTimer(mx, timer, t + mx->idle_timeout / 2);
+}
+
+/*
+ * Add reported component <peer> without connecting to it (lazy mode), and
+ * destroy <peer>. Its subscriptions, as listed in the HelloReport that reported
+ * it, are in <entries> with size <size>.
+ */
+static void mx_add_lazy_peer(MX *mx, MX_Peer *peer,
+        const char *entries, uint32_t size)
+{
+    int fd;
+
+    MX_Component *comp = hashGet(&mx->component_by_id, HASH_VALUE(peer->id));
+
+    if (comp != NULL) {                 /* It connected to us already. */
+        free(peer->name);
+        free(peer->host);
+
+        comp->reported = true;
+    }
+    else if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        mx_error("could not reserve a file descriptor for component %s (%s).\n",
+                peer->name, strerror(errno));
+        free(peer->name);
+        free(peer->host);
+        free(peer);
+        mxShutdown(mx);
+        return;
+    }
+    else {
+        comp = mx_create_component(mx);
+
+        comp->name = peer->name;
+        comp->host = peer->host;
+        comp->port = peer->port;
+        comp->id   = peer->id;
+
+        /* Reserve an fd for it that we can connect on later. */
+
+        comp->fd       = fd;
+        comp->reported = true;
+
+        __atomic_store_n(&comp->dormant, true, __ATOMIC_RELEASE);
+
+        paSet(&mx->components, comp->fd, comp);
+        mx_publish_components(mx);
+        hashAdd(&mx->component_by_id, comp, HASH_VALUE(comp->id));
+
+        if (mx->on_new_comp_callback) {
+            mx->on_new_comp_callback(mx, comp->fd, comp->name,
+                    mx->on_new_comp_udata);
+        }
+    }
+
+    free(peer);
+
+    if (size > 0) {
+        mx_apply_entries(mx, comp, true, entries, size);
+    }
+}
+
+/*
+ * A component has connected to us and introduced itself as <comp> (lazy mode).
+ * We may already know it from a HelloReport, and the application may already
+ * have its fd. In that case, move the new connection onto that fd so the
+ * component keeps its identity. The reader thread for <comp> waits until we're
+ * done.
+ */
+static void mx_adopt_connection(MX *mx, MX_Component *comp)
+{
+    MX_Command *cmd;
+    MX_Subscription *sub;
+    MX_Component *known = hashGet(&mx->component_by_id, HASH_VALUE(comp->id));
+
+    if (known == NULL) {                /* Not reported to us yet. */
+        hashAdd(&mx->component_by_id, comp, HASH_VALUE(comp->id));
+
+        if (mx->on_new_comp_callback) {
+            mx->on_new_comp_callback(mx, comp->fd, comp->name,
+                    mx->on_new_comp_udata);
+        }
+    }
+    else if (!known->dormant) {         /* We connected to it as well. */
+        comp->duplicate = true;
+    }
+    else {
+        paDrop(&mx->components, comp->fd);
+
+        dup2(comp->fd, known->fd);
+        close(comp->fd);
+
+        comp->fd = known->fd;
+        comp->reported = true;
+
+        while ((sub = mlRemoveHead(&known->subscriptions)) != NULL) {
+            sub->comp = comp;
+            mlAppendTail(&comp->subscriptions, sub);
+            mx_publish_fanout(mx, sub->msg);
+        }
+
+        hashDrop(&mx->component_by_id, HASH_VALUE(comp->id));
+        hashAdd(&mx->component_by_id, comp, HASH_VALUE(comp->id));
+
+        paSet(&mx->components, comp->fd, comp);
+        mx_publish_components(mx);
+
+        /* Pass on whatever was kept for it while it was dormant. */
+
+        mx_keep_pending(known);
+
+        while ((cmd = known->pending) != NULL) {
+            known->pending = cmd->next;
+            mx_push_command(&comp->writer_queue, cmd);
+        }
+
+        free(known->name);
+        free(known->host);
+
+        mx_retire(mx, known, mx_free_component);
+    }
+}
+
+/*
+ * Inform component <comp> of all of our subscriptions, using a single
+ * SUBSCRIBE_UPDATE, followed by our pattern subscriptions.
+ */
+static void mx_send_subscriptions(MX *mx, MX_Component *comp)
+{
+    MX_Subscription *sub;
+    MX_PatternSub *ps;
+
+    Buffer types = { 0 };
+
+    for (sub = mlHead(&mx->me->subscriptions); sub;
+         sub = mlNext(&mx->me->subscriptions, sub)) {
+        if (sub->pattern != NULL) continue;     /* It'll expand it itself. */
+
+        mx_pack_entry(&types, sub->msg->msg_type, sub->filter);
+    }
+
+    if (bufLen(&types) > 0) {
+        mx_send(comp, MX_MT_SUBSCRIBE_UPDATE, 0, bufGet(&types), bufLen(&types));
+    }
+
+    bufClear(&types);
+
+    for (ps = mlHead(&mx->me->patterns); ps;
+         ps = mlNext(&mx->me->patterns, ps)) {
+        mx_pack(comp, MX_MT_PATTERN_SUBSCRIBE_UPDATE, 0,
+                PACK_STRING, ps->pattern,
+                END);
+    }
+}
+
+/*
+ * Mark <mx> as ready, i.e. connected to all components that the master reported
+ * to us, and call the on_ready callback if there is one.
+ */
+static void mx_set_ready(MX *mx)
+{
+    mx->ready = true;
+
+    if (mx->on_ready_callback) {
+        mx->on_ready_callback(mx, mx->on_ready_udata);
+    }
+}
+
+/*
+ * Start connecting to reported component <peer>, and destroy <peer>. The
+ * component's reader thread will finish the connect and report back with an
+ * MX_ET_PEER event. Meanwhile, we already queue our introduction.
+ */
+static void mx_connect_peer(MX *mx, MX_Peer *peer)
+{
+    int fd;
+
+    MX_Component *comp;
+
+    if ((fd = mx_start_connect(peer->host, peer->port)) == -1) {
+        mx_error("could not connect to component %s at %s:%d (%s).\n",
+                peer->name, peer->host, peer->port, strerror(errno));
+        free(peer->name);
+        free(peer->host);
+        free(peer);
+        mxShutdown(mx);
+        return;
+    }
+
+    comp = mx_create_component(mx);
+
+    comp->name = peer->name;
+    comp->host = peer->host;
+    comp->port = peer->port;
+    comp->fd   = fd;
+    comp->id   = peer->id;
+
+    comp->connecting = true;
+
+    free(peer);
+
+    paSet(&mx->components, comp->fd, comp);
+    mx_publish_components(mx);
+
+    mx->peer_connects++;
+
+    mx_start_reader_thread(mx, comp);
+
+    /* Tell it who we are... */
+
+    mx_pack(comp, MX_MT_HELLO_UPDATE, 0,
+            PACK_STRING,    mx->me->name,
+            PACK_INT16,     mx->me->id,
+            PACK_INT16,     mx->me->port,
+            END);
+
+    /* And inform it of all of our subscriptions. These will be written as soon
+     * as the connection is up and the writer thread has been started. */
+
+    mx_send_subscriptions(mx, comp);
+}
+
+/*
+ * Handle a HELLO_REPORT message (only in regular components). This message is
+ * sent by the master to inform a recently connected component of the already
+ * existing components in the system.
+ */
+static void mx_handle_hello_report(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    MX_Peer *peer = calloc(1, sizeof(*peer));
+
+    size_t offset = strunpack(payload, size,
+            PACK_STRING,    &peer->name,
+            PACK_INT16,     &peer->id,
+            PACK_STRING,    &peer->host,
+            PACK_INT16,     &peer->port,
+            END);
+
+    /* In lazy mode, we only connect to it when we have something to send. In
+     * that case, its subscriptions follow its address. */
+
+    if (mx->lazy) {
+        if (offset > size) offset = size;   /* Truncated report. */
+
+        mx_add_lazy_peer(mx, peer, payload + offset, size - offset);
+
+        free(payload);
+
+        if (!mx->ready && --mx->unready_peers == 0) {
+            mx_set_ready(mx);
+        }
+
+        return;
+    }
+
+    free(payload);
+
+    /* Connect to it right away if we're allowed another connect, otherwise
+     * wait until one of the connects in progress has finished. */
+
+    if (mx->peer_connects < mx->max_peer_connects) {
+        mx_connect_peer(mx, peer);
+    }
+    else {
+        listAppendTail(&mx->peer_backlog, peer);
+    }
+}
+
+/*
+ * Handle a HELLO_UPDATE message (only in regular components). This message is
+ * sent by a new component to existing components as a way of introducing
+ * themselves.
+ */
+static void mx_handle_hello_update(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    char *name;
+    uint16_t port;
+    uint16_t id;
+
+    MX_Component *comp = paGet(&mx->components, fd);
+
+    strunpack(payload, size,
+            PACK_STRING, &name,
+            PACK_INT16,  &id,
+            PACK_INT16,  &port,
+            END);
+
+    free(payload);
+
+    dbgAssert(stderr, comp->name == NULL,
+            "Expected comp->name to be NULL instead of \"%s\"\n", comp->name);
+
+    comp->name = name;
+    comp->host = strdup(netPeerHost(fd));
+    comp->port = port;
+    comp->id   = id;
+
+    /* In lazy mode, it already knows my subscriptions from the master. */
+
+    if (mx->lazy) {
+        mx_adopt_connection(mx, comp);
+        return;
+    }
+
+    /* Inform the new component of all of my subscriptions. */
+
+    mx_send_subscriptions(mx, comp);
+
+    if (mx->on_new_comp_callback) {
+        mx->on_new_comp_callback(mx, comp->fd, name, mx->on_new_comp_udata);
+    }
+}
+
+/*
+ * Send a HELLO_REPORT about component <about> to component <comp>, including
+ * its subscriptions to user message types (lazy mode).
+ */
+static void mx_report_component(MX *mx, MX_Component *comp, MX_Component *about)
+{
+    MX_Subscription *sub;
+    MX_PatternSub *ps;
+
+    Buffer entries = { 0 };
+
+    for (sub = mlHead(&about->subscriptions); sub;
+         sub = mlNext(&about->subscriptions, sub)) {
+        if ((sub->msg->msg_type < NUM_MX_MESSAGES &&
+             sub->msg->msg_type != MX_MT_STATS_REPORT) || sub->pattern != NULL) {
+            continue;
+        }
+
+        mx_pack_entry(&entries, sub->msg->msg_type, sub->filter);
+    }
+
+    mx_pack(comp, MX_MT_HELLO_REPORT, 0,
+            PACK_STRING,    about->name,
+            PACK_INT16,     about->id,
+            PACK_STRING,    about->host,
+            PACK_INT16,     about->port,
+            PACK_RAW,       bufGet(&entries), bufLen(&entries),
+            END);
+
+    bufClear(&entries);
+
+    /* Its pattern subscriptions are expanded by <comp> itself. */
+
+    for (ps = mlHead(&about->patterns); ps; ps = mlNext(&about->patterns, ps)) {
+        mx_pack(comp, MX_MT_PATTERN_SUBSCRIBE_REPORT, 0,
+                PACK_INT16,  about->id,
+                PACK_STRING, ps->pattern,
+                END);
+    }
+}
+
+/*
+ * Handle a HELLO_REQUEST message (only in the master component). This message
+ * is sent by new components to the master to introduce themselves.
+ */
+static void mx_handle_hello_request(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    char *name;
+    uint16_t port;
+
+    strunpack(payload, size,
+            PACK_STRING,    &name,
+            PACK_INT16,     &port,
+            END);
+
+    free(payload);
+
+    MX_Component *comp = paGet(&mx->components, fd);
+
+    dbgAssert(stderr, comp != NULL,
+            "HELLO request from unconnected component?!\n");
+
+    dbgAssert(stderr, comp->name == NULL,
+            "Expected comp->name to be NULL instead of \"%s\"\n", comp->name);
+
+    int name_len = asprintf(&comp->name, "%s/%u",
+            name, mx_count_components(mx, name) + 1);
+
+    dbgAssert(stderr, name_len != -1, "Could not create component name.\n");
+
+    /* In lazy mode, ids must stay unique because clients use them to identify
+     * components they haven't connected to. */
+
+    if (mx->lazy) {
+        comp->id = ++mx->next_component_id;
+    }
+    else {
+        comp->id = mx_count_components(mx, NULL);
+    }
+
+    comp->host = strdup(netPeerHost(fd));
+    comp->port = port;
+
+    /* Count the components that we're going to report, so the new component
+     * knows when it has connected to all of them. */
+
+    uint32_t peer_count = 0;
+
+    for (fd = 0; fd < paCount(&mx->components); fd++) {
+        MX_Component *existing = paGet(&mx->components, fd);
+
+        if (existing == NULL || existing == comp || existing->name == NULL)
+            continue;
+
+        peer_count++;
+    }
+
+    /* Tell it my name (which may be different from "master"), its new id, its
+     * new name, the number of components that will be reported to it and
+     * whether we're in lazy mode. */
+
+    mx_pack(comp, MX_MT_HELLO_REPLY, 0,
+            PACK_STRING,    mx->me->name,
+            PACK_INT16,     comp->id,
+            PACK_STRING,    comp->name,
+            PACK_INT32,     peer_count,
+            PACK_INT16,     mx->lazy,
+            END);
+
+    /* Inform the new component of alle existing components. In lazy mode, also
+     * tell it their subscriptions, and tell them about the new component. */
+
+    for (fd = 0; fd < paCount(&mx->components); fd++) {
+        MX_Component *existing = paGet(&mx->components, fd);
+
+        if (existing == NULL || existing == comp || existing->name == NULL)
+            continue;
+
+        if (mx->lazy) {
+            mx_report_component(mx, comp, existing);
+            mx_report_component(mx, existing, comp);
+        }
+        else {
+            mx_pack(comp, MX_MT_HELLO_REPORT, 0,
+                    PACK_STRING,    existing->name,
+                    PACK_INT16,     existing->id,
+                    PACK_STRING,    existing->host,
+                    PACK_INT16,     existing->port,
+                    END);
+        }
+    }
+
+    /* Inform the new component of all registered messages. */
+
+    for (type = NUM_MX_MESSAGES; type < mx->next_message_type; type++) {
+        MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+
+        mx_pack(comp, MX_MT_REGISTER_REPORT, 0,
+                PACK_STRING,    msg->msg_name ? msg->msg_name : "",
+                PACK_INT32,     msg->msg_type,
+                END);
+    }
+
+    /* Inform the new component of my subscriptions. */
+
+    mx_send_subscriptions(mx, comp);
+
+    if (mx->on_new_comp_callback) {
+        mx->on_new_comp_callback(mx, comp->fd, name, mx->on_new_comp_udata);
+    }
+}
+
+/*
+ * Handle a REGISTER_REQUEST (only in the master component). This message is
+ * sent from a component to the master to register a message type.
+ */
+static void mx_handle_register_request(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    char *msg_name = NULL;
+    MX_Message *msg = NULL;
+
+    MX_Component *comp = paGet(&mx->components, fd);
+
+    /* Get the name of the message. */
+
+    strunpack(payload, size,
+            PACK_STRING, &msg_name,
+            END);
+
+    free(payload);
+
+    if (strlen(msg_name) == 0) {        /* An anonymous message! */
+        free(msg_name);
+        msg_name = NULL;
+    }
+
+    if (msg_name == NULL) {             /* Always allocate anon messages. */
+        msg = mx_create_message(mx, mx->next_message_type, msg_name);
+
+        mx_broadcast_new_message(mx, msg, comp);
+    }
+    else {                              /* Else try to find existing... */
+        msg = hashGet(&mx->message_by_name, HASH_STRING(msg_name));
+
+        if (msg == NULL) {              /* Or create a new message. */
+            msg = mx_create_message(mx, mx->next_message_type, msg_name);
+
+            mx_broadcast_new_message(mx, msg, comp);
+        }
+    }
+
+    if (msg_name != NULL) free(msg_name);
+
+    /* Send reply. */
+
+    mx_pack(comp, MX_MT_REGISTER_REPLY, version,
+            PACK_INT32,     msg->msg_type,
+            END);
+}
+
+/*
+ * Handle a QUIT_REQUEST message (only in the master).
+ */
+static void mx_handle_quit_request(MX *mx, int client_fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    free(payload);
+
+    mxShutdown(mx);
+}
+
+/*
+ * Handle a new connection on <fd>.
+ */
+static void mx_handle_connect(MX *mx, int fd)
+{
+    MX_Component *comp = mx_create_component(mx);
+
+    comp->fd = fd;
+
+    /* In lazy mode, the reader must wait for the new component's HelloUpdate
+     * to be handled, since that may move the connection to a different fd. */
+
+    comp->handshake   = mx->lazy && mx->me != mx->master;
+    comp->last_active = mxNow();
+
+    paSet(&mx->components, fd, comp);
+    mx_publish_components(mx);
+
+    mx_start_reader_thread(mx, comp);
+    mx_start_writer_thread(mx, comp);
+}
+
+/*
+ * Handle the outcome of our connect to a reported component on <fd>. <error> is
+ * 0 if the connection was made, or an errno code if it failed.
+ */
+static void mx_handle_peer(MX *mx, int fd, int error)
+{
+    MX_Peer *peer;
+    MX_Component *comp = paGet(&mx->components, fd);
+
+    if (comp == NULL) return;
+
+    /* In lazy mode, we connect on demand. If that fails, just go back to
+     * sleep: the master will tell us if the component has really gone. */
+
+    if (mx->lazy) {
+        if (error != 0) {
+            mx_notice("could not connect to component %s at %s:%d (%s).\n",
+                    comp->name, comp->host, comp->port, strerror(error));
+            mx_make_dormant(mx, comp);
+        }
+        else {
+            comp->connecting = false;
+
+            mx_start_writer_thread(mx, comp);
+        }
+
+        return;
+    }
+
+    mx->peer_connects--;
+    mx->unready_peers--;
+
+    if (error != 0) {
+        mx_error("could not connect to component %s at %s:%d (%s).\n",
+                comp->name, comp->host, comp->port, strerror(error));
+        mxShutdown(mx);
+        return;
+    }
+
+    comp->connecting = false;
+
+    mx_start_writer_thread(mx, comp);
+
+    if (mx->on_new_comp_callback) {
+        mx->on_new_comp_callback(mx, comp->fd, comp->name, mx->on_new_comp_udata);
+    }
+
+    /* A connect slot has opened up. Use it for the next reported peer. */
+
+    while (mx->peer_connects < mx->max_peer_connects &&
+           (peer = listRemoveHead(&mx->peer_backlog)) != NULL) {
+        mx_connect_peer(mx, peer);
+    }
+
+    if (mx->unready_peers == 0 && !mx->ready) {
+        mx_set_ready(mx);
+    }
+}
+
+/*
+ * Handle a disconnect event on <fd>, triggered at <whence>.
+ */
+static void mx_handle_disconnect(MX *mx, int fd, char *whence)
+{
+    MX_Component *comp = paGet(&mx->components, fd);
+
+    free(whence);
+
+    if (comp == mx->master) {
+        mx_notice("lost connection with master, shutting down.\n");
+        mxShutdown(mx);
+    }
+    else if (comp != NULL && comp->reported && !comp->duplicate) {
+        /* A lazy connection was closed. Keep the component around until the
+         * master reports it has left, unless this is a stale event. */
+
+        if (!comp->dormant && !comp->connecting) {
+            mx_make_dormant(mx, comp);
+        }
+    }
+    else if (comp != NULL) {
+        if (mx->lazy && mx->me == mx->master && comp->name != NULL) {
+            mx_report(mx, comp, MX_MT_GOODBYE_REPORT,
+                    PACK_INT16, comp->id,
+                    END);
+        }
+
+        paDrop(&mx->components, fd);
+        mx_publish_components(mx);
+
+        mx_destroy_component(mx, comp);
+    }
+}
+
+/*
+ * Return true if we should not send subscription updates directly to component
+ * <comp>. In lazy mode, clients only send them to the master, which reports
+ * them to everyone else.
+ */
+static bool mx_skip_update(MX *mx, MX_Component *comp)
+{
+    return mx->lazy && mx->me != mx->master && comp != mx->master;
+}
+
+/*
+ * Send message <msg_type>, with the list of subscription entries in <entries>
+ * as its payload, to all components that should get our subscription updates.
+ */
+static void mx_update_all(MX *mx, uint32_t msg_type, const Buffer *entries)
+{
+    int fd;
+
+    if (bufLen(entries) == 0) return;
+
+    for (fd = 0; fd < paCount(&mx->components); fd++) {
+        MX_Component *comp = paGet(&mx->components, fd);
+
+        if (comp == NULL || mx_skip_update(mx, comp)) continue;
+
+        mx_send(comp, msg_type, 0, bufGet(entries), bufLen(entries));
+    }
+}
+
+/*
+ * Add our own subscription to messages of type <type>, with filter <filter>
+ * (which may be NULL), without telling anyone. The subscription takes over
+ * <filter>. Returns 0 if the subscription was added, 1 if it was added for a
+ * previously unknown message type, or 2 if we were already subscribed and only
+ * the handler and filter were replaced. <announce> is set to true if other
+ * components need to be told.
+ */
+static int mx_add_own_subscription(MX *mx, uint32_t type, MX_Filter *filter,
+        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata),
+        void *udata, bool *announce)
+{
+    int r = 0;
+
+    MX_Message *msg;
+    MX_Subscription *sub;
+
+    if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(type))) == NULL) {
+        mx_notice("Subscribing to unknown message type %d. "
+                  "Adding message type.\n", type);
+
+        msg = mx_create_message(mx, type, NULL);
+
+        r = 1;
+    }
+
+    if ((sub = mx_find_subscription_for_comp(msg, mx->me)) != NULL) {
+        mx_notice("mxSubscribe for message type %d (%s), "
+                  "which I'm already subscribed to. Replacing callback.\n",
+                  type, mxMessageName(mx, type));
+
+        sub->handler = handler;
+        sub->udata = udata;
+
+        /* Others only need to know if the filter was or is now set. */
+
+        *announce = (sub->filter != NULL || filter != NULL ||
+                     sub->pattern != NULL);
+
+        sub->pattern = NULL;
+
+        free(sub->filter);
+        sub->filter = filter;
+
+        return 2;
+    }
+
+    *announce = true;
+
+    sub = calloc(1, sizeof(*sub));
+
+    sub->msg = msg;
+    sub->comp = mx->me;
+    sub->filter = filter;
+
+    sub->handler = handler;
+    sub->udata = udata;
+
+    mlAppendTail(&msg->subscriptions, sub);
+    mlAppendTail(&mx->me->subscriptions, sub);
+
+    return r;
+}
+
+/*
+ * Remove our own subscription to messages of type <type>, without telling
+ * anyone. Returns 0 if the subscription was removed, or 1 if there was nothing
+ * to remove.
+ */
+static int mx_remove_own_subscription(MX *mx, uint32_t type)
+{
+    MX_Message *msg;
+    MX_Subscription *sub;
+
+    if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(type))) == NULL) {
+        mx_notice("mxCancel for unknown message type %d. Ignored\n", type);
+        return 1;
+    }
+
+    if ((sub = mx_find_subscription_for_comp(msg, mx->me)) == NULL) {
+        mx_notice("mxCancel for message type %d (%s), "
+                  "which I'm not subscribed to. Ignored.\n",
+                  type, mxMessageName(mx, type));
+        return 1;
+    }
+
+    mlRemove(&sub->msg->subscriptions, sub);
+    mlRemove(&mx->me->subscriptions, sub);
+
+    free(sub->filter);
+    free(sub);
+
+    return 0;
+}
+
+/*
+ * Subscribe to messages of the <count> types in <types>, calling <handler> with
+ * <udata> for each of them. If <filter> is not NULL, each subscription gets a
+ * copy of it. All other components are told about the new subscriptions in a
+ * single SUBSCRIBE_UPDATE. Returns <0 on errors, >0 on notices and 0 otherwise.
+ */
+static int mx_subscribe_many(MX *mx, const uint32_t *types, int count,
+        const MX_Filter *filter,
+        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata),
+        void *udata)
+{
+    int i, r = 0;
+    bool announce;
+
+    Buffer added = { 0 };
+
+    for (i = 0; i < count; i++) {
+        MX_Filter *copy = filter ? mx_copy_filter(filter) : NULL;
+
+        int s = mx_add_own_subscription(mx, types[i], copy,
+                handler, udata, &announce);
+
+        if (announce) mx_pack_entry(&added, types[i], copy);
+
+        r = MAX(r, s);
+    }
+
+    mx_update_all(mx, MX_MT_SUBSCRIBE_UPDATE, &added);
+
+    bufClear(&added);
+
+    return r;
+}
+
+/*
+ * Subscribe to messages of type <type>. <handler> will be called for all
+ * incoming messages of this type, passing in the same <udata> that is passed in
+ * to this function. Returns <0 on errors, >0 on notices and 0 otherwise.
+ */
+static int mx_subscribe(MX *mx, uint32_t type,
+        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata),
+        void *udata)
+{
+    return mx_subscribe_many(mx, &type, 1, NULL, handler, udata);
+}
+
+/*
+ * Cancel our subscriptions to messages of the <count> types in <types>. All
+ * other components are told in a single CANCEL_UPDATE. Returns <0 on errors, >0
+ * on notices and 0 otherwise.
+ */
+static int mx_cancel_many(MX *mx, const uint32_t *types, int count)
+{
+    int i, r = 0;
+
+    Buffer removed = { 0 };
+
+    for (i = 0; i < count; i++) {
+        int s = mx_remove_own_subscription(mx, types[i]);
+
+        if (s == 0) mx_pack_entry(&removed, types[i], NULL);
+
+        r = MAX(r, s);
+    }
+
+    mx_update_all(mx, MX_MT_CANCEL_UPDATE, &removed);
+
+    bufClear(&removed);
+
+    return r;
+}
+
+/*
+ * Cancel our subscription to messages of type <type> that calls <handler>.
+ * Returns <0 on errors, >0 on notices and 0 otherwise.
+ */
+static int mx_cancel(MX *mx, uint32_t type)
+{
+    return mx_cancel_many(mx, &type, 1);
+}
+
+/*
+ * Return the mx_name to use if <mx_name> was given to mxClient() or mxMaster().
+ * If it is a valid name (i.e. not NULL) use it. Otherwise use the environment
+ * variable MX_NAME if it is set. Otherwise use the environment variable USER
+ * (the user's login name) if it is set. Otherwise give up and return NULL.
+ */
+const char *mxEffectiveName(const char *mx_name)
+{
+    if (mx_name != NULL)
+        return mx_name;
+    else if ((mx_name = getenv("MX_NAME")) != NULL)
+        return mx_name;
+    else if ((mx_name = getenv("USER")) != NULL)
+        return mx_name;
+    else
+        return NULL;
+}
+
+/*
+ * Return the listen port that the master component will use for mx name
+ * <mx_name>.
+ */
+uint16_t mxEffectivePort(const char *mx_name)
+{
+    const char *p;
+    int hash = 0;
+
+    mx_name = mxEffectiveName(mx_name);
+
+    for (p = mx_name; *p != '\0'; p++) {
+        hash += *p * 307;
+    }
+
+    return MIN_PORT + (hash % (MAX_PORT - MIN_PORT + 1));
+}
+
+/*
+ * Return the mx_host to use if <mx_host> was given to mxClient() or mxMaster().
+ * If it is a valid name (i.e. not NULL) use it. Otherwise use the environment
+ * variable MX_HOST if it is set. Otherwise simply use "localhost".
+ */
+const char *mxEffectiveHost(const char *mx_host)
+{
+    if (mx_host != NULL)
+        return mx_host;
+    else if ((mx_host = getenv("MX_HOST")) != NULL)
+        return mx_host;
+    else
+        return "localhost";
+}
+
+/*
+ * Scan the options given by <argc> and <argv> and extract the argument given
+ * with the <short_name> or <long_name> option. If found, the argument is
+ * returned through <argument> and the option and associated argument are
+ * removed from the option list. If not, <argument> is set to NULL and <argc>
+ * and <argv> are unchanged.
+ *
+ * If the given option is present but it has no argument, -1 is returned and an
+ * error message can be retrieved through mxError(). Otherwise 0 is returned.
+ *
+ * <short_name> and <long_name> should be given without the leading "-" or "--".
+ *
+ * The following formats are allowed:
+ *
+ *      -N Bla
+ *      -NBla
+ *      --mx-name Bla
+ *      --mx-name=Bla
+ */
+int mxOption(char short_name, const char *long_name, int *argc, char *argv[], char **argument)
+{
+    int i, new_argc = 1;
+
+    int len_long_name = strlen(long_name);
+
+    char * const not_found = (char *) -1;
+
+    char *full_short_name = malloc(3);
+    char *full_long_name = malloc(len_long_name + 3);
+
+    sprintf(full_short_name, "-%c", short_name);
+    sprintf(full_long_name, "--%s", long_name);
+
+    int len_full_short_name = 2;
+    int len_full_long_name = len_long_name + 2;
+
+    for (i = 1; i < *argc; i++) {
+        char *my_arg = not_found;
+
+        if (strcmp(argv[i], full_short_name) == 0) {
+            my_arg = argv[++i];
+        }
+        else if (strncmp(argv[i], full_short_name, len_full_short_name) == 0) {
+            my_arg = argv[i] + len_full_short_name;
+        }
+        else if (strcmp(argv[i], full_long_name) == 0) {
+            my_arg = argv[++i];
+        }
+        else if (strncmp(argv[i], full_long_name, len_full_long_name) == 0 &&
+                 argv[i][len_full_long_name] == '=') {
+            my_arg = argv[i] + len_full_long_name + 1;
+        }
+
+        if (my_arg == not_found) {
+            argv[new_argc++] = argv[i];
+        }
+        else if (my_arg == NULL || my_arg[0] == '-') {
+            mx_error("Missing argument for option %s.\n", argv[i-1]);
+            return -1;
+        }
+        else {
+            *argument = my_arg;
+        }
+    }
+
+    *argc = new_argc;
+
+    return 0;
+}
+
+/*
+ * Create and return an MX struct that will act as a client, connecting to the
+ * Message Exchange with name <mx_name> running on host <mx_host>. We will
+ * introduce ourselves as <my_name>.
+ *
+ * If <mx_host> is NULL, the environment variable MX_HOST is used. If that
+ * doesn't exist, "localhost" is used.
+ * If <mx_name> is NULL, the environment variable MX_NAME is used. If that
+ * doesn't exist, the environment variable USER is used. If that doesn't exist
+ * either, the function fails and NULL is returned.
+ * If <my_name> is NULL, the function fails and returns NULL.
+ *
+ * When this function finishes successfully, a listen port has been opened
+ * for other components to connect to. No other connections have been made, and
+ * no communication threads have been started yet (use mx_begin() for this).
+ */
+static MX *mx_create_client(const char *mx_host, const char *mx_name, const char *my_name)
+{
+    uint16_t mx_port;
+
+    if (my_name == NULL) {
+        mx_error("<my_name> can not be NULL in call to mx_create_client (%s).\n",
+                strerror(EINVAL));
+        return NULL;
+    }
+
+    mx_host = mxEffectiveHost(mx_host);
+    mx_name = mxEffectiveName(mx_name);
+    mx_port = mxEffectivePort(mx_name);
+
+    if (mx_name == NULL) {
+        mx_error("couldn't determine MX name.\n");
+        return NULL;
+    }
+
+    MX *mx = calloc(1, sizeof(*mx));
+
+    if ((mx->listen_fd = tcpListen(NULL, 0)) == -1) {
+        mx_error("couldn't open a listen socket (%s).\n", strerror(errno));
+        free(mx);
+        return NULL;
+    }
+
+    if ((mx->master = mx_create_component(mx)) == NULL) {
+        mx_error("couldn't create master component for \"%s\".\n", mx_name);
+        free(mx);
+        return NULL;
+    }
+
+    if ((mx->me = mx_create_component(mx)) == NULL) {
+        mx_error("couldn't create own component for \"%s\".\n", mx_name);
+        mx_destroy_component(mx, mx->master);
+        free(mx);
+        return NULL;
+    }
+
+    mx_init_queue(&mx->timer_queue);
+
+    mx->epoch = 1;                      /* 0 marks an unused epoch slot. */
+
+    mx->max_peer_connects = DEFAULT_PEER_CONNECTS;
+    mx->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+    mx->master->host = strdup(mx_host);
+    mx->master->port = mx_port;
+
+    mx->me->name = strdup(my_name);
+    mx->me->port = netLocalPort(mx->listen_fd),
+
+    mx->mx_name = strdup(mx_name);
+
+    return mx;
+}
+
+/*
+ * Create and return an MX struct that will act as a master for the Message
+ * Exchange with name <mx_name>, running on the local host and using the name
+ * <my_name>.
+ *
+ * If <mx_name> is NULL, the environment variable MX_NAME is used. If that
+ * doesn't exist, the environment variable USER is used. If that doesn't exist
+ * either, the function fails and NULL is returned.
+ * If <my_name> is NULL, "master" is used.
+ *
+ * When this function finishes successfully, a listen port has been opened
+ * for other components to connect to. No other connections have been made, and
+ * no communication threads have been started yet (use mx_begin() for this).
+ */
+static MX *mx_create_master(const char *mx_name, const char *my_name)
+{
+    uint16_t mx_port;
+
+    if (my_name == NULL) {
+        my_name = "master";
+    }
+
+    mx_name = mxEffectiveName(mx_name);
+    mx_port = mxEffectivePort(mx_name);
+
+    if (mx_name == NULL) {
+        mx_error("couldn't determine MX name.\n");
+        return NULL;
+    }
+
+    MX *mx = calloc(1, sizeof(*mx));
+
+    if ((mx->listen_fd = tcpListen(NULL, mx_port)) == -1) {
+        mx_error("couldn't open listen socket on port %d (%s)\n",
+                mx_port, strerror(errno));
+        free(mx);
+        return NULL;
+    }
+
+    if ((mx->me = mx->master = mx_create_component(mx)) == NULL) {
+        mx_error("couldn't create own component for \"%s\".\n", mx_name);
+        close(mx->listen_fd);
+        free(mx);
+        return NULL;
+    }
+
+    mx->me->host = strdup("localhost");
+    mx->me->name = strdup(my_name);
+    mx->me->port = mx_port;
+    mx->me->id   = 0;
+
+    mx->mx_name = strdup(mx_name);
+
+    mx_init_queue(&mx->timer_queue);
+
+    mx->epoch = 1;                      /* 0 marks an unused epoch slot. */
+
+    mx->max_peer_connects = DEFAULT_PEER_CONNECTS;
+    mx->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+    mx->ready = true;                   /* Nobody to connect to. */
+
+    return mx;
+}
+
+static void mx_handle_stats_subscriber(MX *mx, int fd, uint32_t type, void *udata);
+
+/*
+ * Begin running the threads that listen for connection and timer events.
+ */
+static int mx_begin(MX *mx)
+{
+    mx_create_message(mx, MX_MT_QUIT_REQUEST, "QuitRequest");
+    mx_create_message(mx, MX_MT_HELLO_REQUEST, "HelloRequest");
+    mx_create_message(mx, MX_MT_HELLO_REPLY, "HelloReply");
+    mx_create_message(mx, MX_MT_HELLO_REPORT, "HelloReport");
+    mx_create_message(mx, MX_MT_HELLO_UPDATE, "HelloUpdate");
+    mx_create_message(mx, MX_MT_REGISTER_REQUEST, "RegisterRequest");
+    mx_create_message(mx, MX_MT_REGISTER_REPORT, "RegisterReport");
+    mx_create_message(mx, MX_MT_REGISTER_REPLY, "RegisterReply");
+    mx_create_message(mx, MX_MT_SUBSCRIBE_UPDATE, "SubscribeUpdate");
+    mx_create_message(mx, MX_MT_CANCEL_UPDATE, "CancelUpdate");
+    mx_create_message(mx, MX_MT_SUBSCRIBE_REPORT, "SubscribeReport");
+    mx_create_message(mx, MX_MT_CANCEL_REPORT, "CancelReport");
+    mx_create_message(mx, MX_MT_GOODBYE_REPORT, "GoodbyeReport");
+    mx_create_message(mx, MX_MT_PATTERN_SUBSCRIBE_UPDATE, "PatternSubscribeUpdate");
+    mx_create_message(mx, MX_MT_PATTERN_CANCEL_UPDATE, "PatternCancelUpdate");
+    mx_create_message(mx, MX_MT_PATTERN_SUBSCRIBE_REPORT, "PatternSubscribeReport");
+    mx_create_message(mx, MX_MT_PATTERN_CANCEL_REPORT, "PatternCancelReport");
+    mx_create_message(mx, MX_MT_STATS_REPORT, "StatsReport");
+
+    mxOnNewSubscriber(mx, MX_MT_STATS_REPORT, mx_handle_stats_subscriber, NULL);
+
+    mx->stats_start = mx->stats_time = mxNow();
+
+    mx_create_event_pipe(mx);
+
+    mx->main_thread = pthread_self();
+
+    mx_start_timer_thread(mx);
+    mx_start_listener_thread(mx);
+
+    if (mx_place_from_env(mx, "MX_AFFINITY", true) != 0 ||
+        mx_place_from_env(mx, "MX_SCHEDULING", false) != 0) {
+        return -1;
+    }
+
+    if (mx->me == mx->master) {     /* Running as master */
+        mx_subscribe(mx, MX_MT_QUIT_REQUEST, mx_handle_quit_request, NULL);
+        mx_subscribe(mx, MX_MT_HELLO_REQUEST, mx_handle_hello_request, NULL);
+        mx_subscribe(mx, MX_MT_REGISTER_REQUEST, mx_handle_register_request, NULL);
+        mx_subscribe(mx, MX_MT_SUBSCRIBE_UPDATE, mx_handle_subscribe_update, NULL);
+        mx_subscribe(mx, MX_MT_CANCEL_UPDATE, mx_handle_cancel_update, NULL);
+        mx_subscribe(mx, MX_MT_PATTERN_SUBSCRIBE_UPDATE,
+                mx_handle_pattern_subscribe_update, NULL);
+        mx_subscribe(mx, MX_MT_PATTERN_CANCEL_UPDATE,
+                mx_handle_pattern_cancel_update, NULL);
+    }
+    else {                          /* Running as client */
+        int r;
+        uint32_t reply_version, reply_size;
+        char *reply_payload;
+
+        if ((mx->master->fd = tcpConnect(mx->master->host, mx->master->port)) < 0) {
+            mx_error("couldn't connect to master for \"%s\" at %s:%d (%s).\n",
+                    mx->mx_name, mx->master->host, mx->master->port, strerror(errno));
+            return -1;
+        }
+
+        paSet(&mx->components, mx->master->fd, mx->master);
+        mx_publish_components(mx);
+
+        mx_start_reader_thread(mx, mx->master);
+        mx_start_writer_thread(mx, mx->master);
+
+        r = mx_pack_and_wait(mx->master, 5,
+                MX_MT_HELLO_REPLY, &reply_version, &reply_payload, &reply_size,
+                MX_MT_HELLO_REQUEST, 0,
+                PACK_STRING,    mx->me->name,
+                PACK_INT16,     mx->me->port,
+                END);
+
+        if (r != 0) {
+            mx_error("%s while waiting for HelloReply.\n",
+                    r == 1 ? "timeout" : "error");
+            return -1;
+        }
+
+        uint32_t peer_count = 0;
+        uint16_t lazy = 0;
+
+        strunpack(reply_payload, reply_size,
+                PACK_STRING, &mx->master->name,
+                PACK_INT16,  &mx->me->id,
+                PACK_STRING, &mx->me->name,
+                PACK_INT32,  &peer_count,
+                PACK_INT16,  &lazy,
+                END);
+
+        free(reply_payload);
+
+        /* We're ready once we've connected to all the components that the
+         * master is about to report. */
+
+        mx->unready_peers = peer_count;
+        mx->ready = (peer_count == 0);
+
+        mx_subscribe(mx, MX_MT_HELLO_REPORT, mx_handle_hello_report, NULL);
+        mx_subscribe(mx, MX_MT_HELLO_UPDATE, mx_handle_hello_update, NULL);
+        mx_subscribe(mx, MX_MT_REGISTER_REPORT, mx_handle_register_report, NULL);
+        mx_subscribe(mx, MX_MT_SUBSCRIBE_UPDATE, mx_handle_subscribe_update, NULL);
+        mx_subscribe(mx, MX_MT_CANCEL_UPDATE, mx_handle_cancel_update, NULL);
+        mx_subscribe(mx, MX_MT_PATTERN_SUBSCRIBE_UPDATE,
+                mx_handle_pattern_subscribe_update, NULL);
+        mx_subscribe(mx, MX_MT_PATTERN_CANCEL_UPDATE,
+                mx_handle_pattern_cancel_update, NULL);
+
+        /* In lazy mode, the master tells us about other components'
+         * subscriptions, and we close connections that have gone idle. */
+
+        if ((mx->lazy = lazy)) {
+            mx_subscribe(mx, MX_MT_SUBSCRIBE_REPORT, mx_handle_subscribe_report, NULL);
+            mx_subscribe(mx, MX_MT_CANCEL_REPORT, mx_handle_cancel_report, NULL);
+            mx_subscribe(mx, MX_MT_GOODBYE_REPORT, mx_handle_goodbye_report, NULL);
+            mx_subscribe(mx, MX_MT_PATTERN_SUBSCRIBE_REPORT,
+                    mx_handle_pattern_subscribe_report, NULL);
+            mx_subscribe(mx, MX_MT_PATTERN_CANCEL_REPORT,
+                    mx_handle_pattern_cancel_report, NULL);
+
+            mx->idle_timer = mxCreateTimer(mx, mxNow() + mx->idle_timeout / 2,
+                    mx_check_idle, NULL);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Create and return an MX struct that will act as a master for the Message
+ * Exchange with name <mx_name>, running on the local host.
+ *
+ * If <mx_name> is NULL, the environment variable MX_NAME is used instead. If
+ * that doesn't exist, the environment variable USER is used. If that doesn't
+ * exist either, the function fails and NULL is returned. If <my_name> is NULL,
+ * "master" is used.
+ *
+ * If <background> is true, the master component will be put into the background
+ * after the listen port for this master component has been opened. This means
+ * that any additional components started after the master (in a shell script,
+ * for instance) will find a listen port waiting for them.
+ *
+ * This "backgrounding" is done using a fork() system call, which means that any
+ * threads started before calling this function (if any) will not survive. So if
+ * you want to background the master component and also start additional
+ * threads, do the latter *after* calling this function.
+ */
+MX *mxMaster(const char *mx_name, const char *my_name, bool background)
+{
+    int r;
+    pid_t pid;
+
+    MX *mx = mx_create_master(mx_name, my_name);
+
+    if (mx == NULL) {
+        mx_error("couldn't create mx (%s).\n", strerror(errno));
+        return NULL;
+    }
+    else if (background && (pid = fork()) == -1) {
+        mx_error("fork() failed (%s).\n", strerror(errno));
+
+        mxShutdown(mx);
+        mxDestroy(mx);
+
+        return NULL;
+    }
+    else if (background && pid != 0) {
+        exit(0);
+    }
+    else if ((r = mx_begin(mx)) != 0) {
+        mxShutdown(mx);
+        mxDestroy(mx);
+
+        return NULL;
+    }
+
+    return mx;
+}
+
+/*
+ * Create and return an MX struct that will act as a client for the Message
+ * Exchange with name <mx_name>, running on <mx_host>.
+ *
+ * If <mx_host> is NULL, the environment variable MX_HOST is used. If that
+ * doesn't exist, "localhost" is used.
+ * If <mx_name> is NULL, the environment variable MX_NAME is used. If that
+ * doesn't exist, the environment variable USER is used. If that doesn't exist
+ * either, the function fails and NULL is returned.
+ * If <my_name> is NULL, the function fails and returns NULL.
+ *
+ * When this function finishes successfully, a listen port has been opened for
+ * other components to connect to, and the necessary background threads will
+ * also be started.
+ */
+MX *mxClient(const char *mx_host, const char *mx_name, const char *my_name)
+{
+    int r;
+
+    MX *mx = mx_create_client(mx_host, mx_name, my_name);
+
+    if (mx == NULL) {
+        mx_error("couldn't create mx (%s).\n", strerror(errno));
+
+        return NULL;
+    }
+    else if ((r = mx_begin(mx)) != 0) {
+        mxShutdown(mx);
+        mxDestroy(mx);
+
+        return NULL;
+    }
+
+    return mx;
+}
+
+/*
+ * Call the handler that the main thread found for message event <evt>. Runs in
+ * a dispatch worker.
+ */
+static void mx_dispatch_message(MX *mx, MX_MessageEvent *evt)
+{
+    MX_Message *msg;
+
+    MX_TRACE(MX_TE_HANDLER_START, evt->fd, evt->msg_type, evt->size);
+
+    if (evt->timestamped) {
+        double start = mxNow();
+
+        evt->handler(mx, evt->fd, evt->msg_type, evt->version,
+                evt->payload, evt->size, evt->udata);
+
+        double end = mxNow();
+
+        mx_lock(mx);
+
+        if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(evt->msg_type))) != NULL) {
+            mx_record_latency(msg, evt->stamp, start, end);
+        }
+
+        mx_unlock(mx);
+    }
+    else {
+        evt->handler(mx, evt->fd, evt->msg_type, evt->version,
+                evt->payload, evt->size, evt->udata);
+    }
+
+    MX_TRACE(MX_TE_HANDLER_END, evt->fd, evt->msg_type, evt->size);
+}
+
+/*
+ * Dispatch worker. Repeatedly takes a shard from the run queue and handles a
+ * batch of its messages. If the shard has more messages after that it goes to
+ * the back of the run queue, so that a busy shard can't starve the others and
+ * any idle worker can pick it up.
+ */
+static void *mx_dispatch_thread(void *arg)
+{
+    MX *mx = arg;
+    MX_Dispatcher *disp = mx->dispatcher;
+    MX_Event *batch[MX_DISPATCH_BATCH];
+    MX_Shard *shard;
+
+    int i, count;
+
+    mx_worker_mx = mx;
+
+    mx_trace_name("dispatch");
+
+    pthread_mutex_lock(&disp->queue_lock);
+
+    while (!disp->stop) {
+        if ((shard = listRemoveHead(&disp->run_queue)) == NULL) {
+            pthread_cond_wait(&disp->work, &disp->queue_lock);
+            continue;
+        }
+
+        for (count = 0; count < MX_DISPATCH_BATCH; count++) {
+            if ((batch[count] = listRemoveHead(&shard->events)) == NULL) break;
+        }
+
+        if (disp->backlog >= MX_DISPATCH_BACKLOG) {
+            pthread_cond_signal(&disp->room);
+        }
+
+        disp->backlog -= count;
+
+        pthread_mutex_unlock(&disp->queue_lock);
+
+        for (i = 0; i < count; i++) {
+            if (__atomic_load_n(&disp->stop, __ATOMIC_RELAXED)) {
+                free(batch[i]->u.msg.payload);
+            }
+            else {
+                mx_dispatch_message(mx, &batch[i]->u.msg);
+            }
+
+            free(batch[i]);
+        }
+
+        pthread_mutex_lock(&disp->queue_lock);
+
+        if (listIsEmpty(&shard->events)) {
+            shard->busy = false;
+        }
+        else {
+            listAppendTail(&disp->run_queue, shard);
+        }
+    }
+
+    pthread_mutex_unlock(&disp->queue_lock);
+
+    return NULL;
+}
+
+/*
+ * Hand message event <evt> to the dispatch workers, if <mx> has them and we
+ * have a handler for it. Waits while the workers are too far behind. Returns
+ * true if the workers now own <evt>, false if the main thread should handle it
+ * itself.
+ */
+static bool mx_dispatch(MX *mx, MX_Event *evt)
+{
+    MX_Dispatcher *disp = mx->dispatcher;
+    MX_MessageEvent *msg_evt = &evt->u.msg;
+    MX_Message *msg;
+    MX_Subscription *sub;
+    MX_Shard *shard;
+
+    uint32_t key;
+
+    if (disp == NULL || msg_evt->msg_type < NUM_MX_MESSAGES) return false;
+
+    mx_lock(mx);
+
+    if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(msg_evt->msg_type))) != NULL &&
+        (sub = mx_find_subscription_for_comp(msg, mx->me)) != NULL) {
+        msg_evt->handler = sub->handler;
+        msg_evt->udata = sub->udata;
+    }
+
+    mx_unlock(mx);
+
+    if (msg_evt->handler == NULL) return false;
+
+    if (disp->key == MX_DISPATCH_BY_SENDER) {
+        key = msg_evt->msg_type + msg_evt->fd * 0x9E3779B1;
+    }
+    else {
+        key = msg_evt->msg_type;
+    }
+
+    shard = &disp->shard[key % MX_DISPATCH_SHARDS];
+
+    pthread_mutex_lock(&disp->queue_lock);
+
+    while (disp->backlog >= MX_DISPATCH_BACKLOG && !disp->stop) {
+        pthread_cond_wait(&disp->room, &disp->queue_lock);
+    }
+
+    listAppendTail(&shard->events, evt);
+
+    disp->backlog++;
+
+    if (!shard->busy) {
+        shard->busy = true;
+
+        listAppendTail(&disp->run_queue, shard);
+
+        pthread_cond_signal(&disp->work);
+    }
+
+    pthread_mutex_unlock(&disp->queue_lock);
+
+    return true;
+}
+
+/*
+ * Tell the dispatch workers of <mx> to stop after the message they're handling
+ * now. Messages that are still waiting for them are dropped.
+ */
+static void mx_stop_dispatcher(MX *mx)
+{
+    MX_Dispatcher *disp = mx->dispatcher;
+
+    if (disp == NULL) return;
+
+    pthread_mutex_lock(&disp->queue_lock);
+
+    disp->stop = true;
+
+    pthread_cond_broadcast(&disp->work);
+    pthread_cond_broadcast(&disp->room);
+
+    pthread_mutex_unlock(&disp->queue_lock);
+}
+
+/*
+ * Stop and join the dispatch workers of <mx>, and free everything they used.
+ */
+static void mx_destroy_dispatcher(MX *mx)
+{
+    MX_Dispatcher *disp = mx->dispatcher;
+    MX_Event *evt;
+
+    int i;
+
+    if (disp == NULL) return;
+
+    mx_stop_dispatcher(mx);
+
+    for (i = 0; i < disp->count; i++) {
+        pthread_join(disp->threads[i], NULL);
+    }
+
+    for (i = 0; i < MX_DISPATCH_SHARDS; i++) {
+        while ((evt = listRemoveHead(&disp->shard[i].events)) != NULL) {
+            free(evt->u.msg.payload);
+            free(evt);
+        }
+    }
+
+    close(disp->wake_fd);
+
+    pthread_cond_destroy(&disp->room);
+    pthread_cond_destroy(&disp->work);
+    pthread_mutex_destroy(&disp->queue_lock);
+    pthread_mutex_destroy(&disp->lock);
+
+    free(disp->threads);
+    free(disp);
+
+    mx->dispatcher = NULL;
+}
+
+/*
+ * Return the file descriptor on which all events associated with <mx> arrive.
+ */
+int mxConnectionNumber(MX *mx)
+{
+    return mx->event_pipe[RD];
+}
+
+/*
+ * Process any pending events associated with <mx>. Returns -1 if an error
+ * occurred, 1 if event processing has finished normally and 0 if no more events
+ * are forthcoming (so there's no sense in waiting for them anymore).
+ */
+int mxProcessEvents(MX *mx)
+{
+    MX_Event *evt;
+
+    int r;
+
+    while (1) {
+        if (mx->shutting_down) {
+            return 0;
+        }
+
+        r = read(mx->event_pipe[RD], &evt, sizeof(evt));
+
+        if (r == 0) {
+            return mx_severity == MX_ERROR ? -1 : 0;
+        }
+        else if (r < 0) {
+            if (errno == EAGAIN) {
+                if (mx->on_processed_callback) {
+                    mx->on_processed_callback(mx, mx->on_processed_udata);
+                }
+
+                return 1;
+            }
+            else {
+                mx_notice("read returned %d (%s)\n", r, strerror(errno));
+                return -1;
+            }
+        }
+
+        if (evt->evt_type == MX_ET_MSG && mx_dispatch(mx, evt)) {
+            continue;
+        }
+
+        mx_lock(mx);
+
+        switch(evt->evt_type) {
+        case MX_ET_CONN:
+            mx_handle_connect(mx, evt->u.conn.fd);
+            break;
+        case MX_ET_DISC:
+            mx_handle_disconnect(mx, evt->u.disc.fd, evt->u.disc.whence);
+            break;
+        case MX_ET_MSG:
+            mx_handle_message(mx, evt->u.msg.fd,
+                    evt->u.msg.msg_type, evt->u.msg.version,
+                    evt->u.msg.payload, evt->u.msg.size,
+                    evt->u.msg.timestamped ? evt->u.msg.stamp : NULL);
+            break;
+        case MX_ET_TIMER:
+            MX_TRACE(MX_TE_HANDLER_START, -1, 0, 0);
+
+            evt->u.timer.handler(mx,
+                    evt->u.timer.timer, evt->u.timer.t, evt->u.timer.udata);
+
+            MX_TRACE(MX_TE_HANDLER_END, -1, 0, 0);
+            break;
+        case MX_ET_PEER:
+            mx_handle_peer(mx, evt->u.peer.fd, evt->u.peer.error);
+            break;
+        case MX_ET_ERR:
+            mx_notice("error event: %s (%d) in %s.\n",
+                    strerror(evt->u.err.error), evt->u.err.error,
+                    evt->u.err.whence);
+            free(evt->u.err.whence);
+            break;
+        case MX_ET_SHUTDOWN:
+            mxShutdown(mx);
+            break;
+        case MX_ET_WAKE:
+            mx_handle_wake(mx, evt->u.wake.id, evt->u.wake.cmd);
+            break;
+        default:
+            mx_notice("unexpected event type (%d)\n", evt->evt_type);
+            break;
+        }
+
+        mx_reclaim(mx, false);
+
+        mx_unlock(mx);
+
+        free(evt);
+    }
+}
+
+/*
+ * Loop while listening for and handling events. Returns -1 if an error occurred
+ * or 0 if mxShutdown was called.
+ */
+int mxRun(MX *mx)
+{
+    struct pollfd poll_fd = { mx->event_pipe[RD], POLLIN, 0 };
+
+    double deadline = 0;
+
+    while (1) {
+        /* In busy-poll mode, keep checking for events without going to sleep
+         * until the spin time has passed since the last one. */
+
+        bool spinning = mx->busy_poll > 0 && mxNow() < deadline;
+
+        int r = poll(&poll_fd, 1, spinning ? 0 : -1);
+
+        if (r < 0) {
+            mx_error("poll() failed: %s\n", strerror(errno));
+
+            return r;
+        }
+        else if (r == 0) {
+            continue;
+        }
+
+        r = mxProcessEvents(mx);
+
+        if (r != 1) return(r);
+
+        if (mx->busy_poll > 0) {
+            deadline = mxNow() + mx->busy_poll;
+        }
+    }
+}
+
+/*
+ * Return the name of the local component.
+ */
+const char *mxMyName(const MX *mx)
+{
+    return mx->me->name;
+}
+
+/*
+ * Return the ID of the local component.
+ */
+uint16_t mxMyID(const MX *mx)
+{
+    return mx->me->id;
+}
+
+/*
+ * Return the current MX name.
+ */
+const char *mxName(const MX *mx)
+{
+    return mx->mx_name;
+}
+
+/*
+ * Return the current MX host, i.e. the host where the master component is
+ * running.
+ */
+const char *mxHost(const MX *mx)
+{
+    return mx->master->host;
+}
+
+/*
+ * Return the current MX port, i.e. the port on which the master listens.
+ */
+uint16_t mxPort(const MX *mx)
+{
+    return mx->master->port;
+}
+
+/*
+ * Register the message named <msg_name>. Returns the associated message type
+ * id.
+ */
+uint32_t mxRegister(MX *mx, const char *msg_name)
+{
+    MX_Message *msg;
+
+    if (msg_name != NULL &&
+        (msg = hashGet(&mx->message_by_name, HASH_STRING(msg_name))) != NULL) {
+        return msg->msg_type;
+    }
+    else if (mx->me == mx->master) {
+        msg = mx_create_message(mx, mx->next_message_type, msg_name);
+
+        mx_broadcast_new_message(mx, msg, NULL);
+
+        return msg->msg_type;
+    }
+    else {
+        int r;
+        char *reply_payload = NULL;
+        uint32_t reply_size, reply_version, msg_type;
+
+        r = mx_pack_and_wait(mx->master, 5,
+                MX_MT_REGISTER_REPLY, &reply_version,
+                &reply_payload, &reply_size,
+                MX_MT_REGISTER_REQUEST, 0,
+                PACK_STRING, msg_name ? msg_name : "",
+                END);
+
+        if (r != 0) {
+            mx_error("%s while waiting for RegisterReply.\n",
+                    r == 1 ? "timeout" : "error");
+            mxShutdown(mx);
+            return 0;
+        }
+        else {
+            strunpack(reply_payload, reply_size,
+                    PACK_INT32, &msg_type,
+                    END);
+
+            free(reply_payload);
+
+            msg = hashGet(&mx->message_by_type, HASH_VALUE(msg_type));
+
+            if (msg == NULL) {
+                msg = mx_create_message(mx, msg_type, msg_name);
+            }
+            else if (msg_name != NULL) {
+                msg->msg_name = strdup(msg_name);
+
+                hashAdd(&mx->message_by_name, msg, HASH_STRING(msg_name));
+            }
+
+            return msg->msg_type;
+        }
+    }
+}
+
+/*
+ * Returns the name of message type <type>.
+ */
+const char *mxMessageName(MX *mx, uint32_t type)
+{
+    MX_Message *msg;
+
+    mx_lock(mx);
+
+    msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+
+    mx_unlock(mx);
+
+    return msg == NULL ? NULL : msg->msg_name;
+}
+
+/*
+ * Returns the name of the component connected on fd <fd>.
+ */
+const char *mxComponentName(MX *mx, int fd)
+{
+    MX_Component *comp;
+
+    mx_lock(mx);
+
+    comp = paGet(&mx->components, fd);
+
+    mx_unlock(mx);
+
+    if (comp == NULL)
+        return NULL;
+    else
+        return comp->name;
+}
+
+/*
+ * Subscribe to messages of type <type>. <handler> will be called for all
+ * incoming messages of this type, passing in the same <udata> that is passed in
+ * to this function. Returns <0 on errors, >0 on notices and 0 otherwise. Check
+ * mxError() when return value is not 0.
+ */
+int mxSubscribe(MX *mx, uint32_t type,
+        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata),
+        void *udata)
+{
+    if (type < NUM_MX_MESSAGES) {
+        mx_error("Illegal message type %d in mxSubscribe.\n", type);
+        return -1;
+    }
+    else {
+        return mx_subscribe(mx, type, handler, udata);
+    }
+}
+
+/*
+ * Cancel our subscription to messages of type <type> that calls <handler>.
+ * Returns <0 on errors, >0 on notices and 0 otherwise. Check mxError() when
+ * return value is not 0.
+ */
+int mxCancel(MX *mx, uint32_t type)
+{
+    if (type < NUM_MX_MESSAGES) {
+        mx_error("Illegal message type %d in mxCancel.\n", type);
+        return -1;
+    }
+    else {
+        return mx_cancel(mx, type);
+    }
+}
+
+/*
+ * Subscribe to messages of the <count> message types in <types>, calling
+ * <handler> with <udata> for each of them. This is the same as calling
+ * mxSubscribe for each type, except that other components are told about all of
+ * them in a single message. Returns <0 on errors, >0 on notices and 0 otherwise.
+ * Check mxError() when return value is not 0.
+ */
+int mxSubscribeMany(MX *mx, const uint32_t *types, int count,
+        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata),
+        void *udata)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (types[i] < NUM_MX_MESSAGES) {
+            mx_error("Illegal message type %d in mxSubscribeMany.\n", types[i]);
+            return -1;
+        }
+    }
+
+    return mx_subscribe_many(mx, types, count, NULL, handler, udata);
+}
+
+/*
+ * Cancel our subscriptions to the <count> message types in <types>. This is the
+ * same as calling mxCancel for each type, except that other components are told
+ * about all of them in a single message. Returns <0 on errors, >0 on notices and
+ * 0 otherwise. Check mxError() when return value is not 0.
+ */
+int mxCancelMany(MX *mx, const uint32_t *types, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (types[i] < NUM_MX_MESSAGES) {
+            mx_error("Illegal message type %d in mxCancelMany.\n", types[i]);
+            return -1;
+        }
+    }
+
+    return mx_cancel_many(mx, types, count);
+}
+
+/*
+ * Subscribe to messages of type <type>, but only to those that pass <filter>.
+ * Publishers evaluate the filter, so messages that don't pass it are never sent
+ * to us. Otherwise the same as mxSubscribe. <filter> is copied, so it need not
+ * remain valid after this call.
+ */
+int mxSubscribeFiltered(MX *mx, uint32_t type, const MX_Filter *filter,
+        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata),
+        void *udata)
+{
+    if (type < NUM_MX_MESSAGES) {
+        mx_error("Illegal message type %d in mxSubscribeFiltered.\n", type);
+        return -1;
+    }
+    else if (!mx_filter_is_valid(filter)) {
+        mx_error("Invalid filter in mxSubscribeFiltered.\n");
+        return -1;
+    }
+    else {
+        return mx_subscribe_many(mx, &type, 1, filter, handler, udata);
+    }
+}
+
+/*
+ * Subscribe to all messages whose name matches <pattern>, including message
+ * types that are registered later. <pattern> is either a full message name or a
+ * prefix followed by "*" (so "Quote.*" matches "Quote.EURUSD"). <handler> and
+ * <udata> are used as in mxSubscribe. Message types that we're already
+ * subscribed to keep their existing subscription. Returns <0 on errors, >0 on
+ * notices and 0 otherwise. Check mxError() when return value is not 0.
+ */
+int mxSubscribePattern(MX *mx, const char *pattern,
+        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata),
+        void *udata)
+{
+    MX_PatternSub *ps;
+    MX_Subscription *sub;
+
+    Buffer update = { 0 };
+
+    const char *star = strchr(pattern, '*');
+
+    if (star != NULL && star[1] != '\0') {
+        mx_error("Illegal pattern \"%s\" in mxSubscribePattern "
+                 "(\"*\" is only allowed at the end).\n", pattern);
+        return -1;
+    }
+
+    if ((ps = mx_find_pattern(mx->me, pattern)) != NULL) {
+        mx_notice("mxSubscribePattern for pattern \"%s\", "
+                  "which I'm already subscribed to. Replacing callback.\n",
+                  pattern);
+
+        ps->handler = handler;
+        ps->udata = udata;
+
+        for (sub = mlHead(&mx->me->subscriptions); sub;
+             sub = mlNext(&mx->me->subscriptions, sub)) {
+            if (sub->pattern != ps) continue;
+
+            sub->handler = handler;
+            sub->udata = udata;
+        }
+
+        return 2;
+    }
+
+    mx_add_pattern(mx, mx->me, pattern, handler, udata);
+
+    bufPack(&update, PACK_STRING, pattern, END);
+
+    mx_update_all(mx, MX_MT_PATTERN_SUBSCRIBE_UPDATE, &update);
+
+    bufClear(&update);
+
+    return 0;
+}
+
+/*
+ * Cancel our subscription to <pattern>, and to all message types that we were
+ * subscribed to only because of it. Returns <0 on errors, >0 on notices and 0
+ * otherwise. Check mxError() when return value is not 0.
+ */
+int mxCancelPattern(MX *mx, const char *pattern)
+{
+    MX_PatternSub *ps;
+
+    Buffer update = { 0 };
+
+    if ((ps = mx_find_pattern(mx->me, pattern)) == NULL) {
+        mx_notice("mxCancelPattern for pattern \"%s\", "
+                  "which I'm not subscribed to. Ignored.\n", pattern);
+        return 1;
+    }
+
+    mx_remove_pattern(mx, ps);
+
+    bufPack(&update, PACK_STRING, pattern, END);
+
+    mx_update_all(mx, MX_MT_PATTERN_CANCEL_UPDATE, &update);
+
+    bufClear(&update);
+
+    return 0;
+}
+
+/*
+ * Call <handler> for new subscribers to message type <type>, passing in the
+ * same <udata> that was passed in here.
+ */
+void mxOnNewSubscriber(MX *mx, uint32_t type,
+        void (*handler)(MX *mx, int fd, uint32_t type, void *udata),
+        void *udata)
+{
+    MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+
+    if (msg == NULL) {
+        msg = mx_create_message(mx, type, NULL);
+    }
+
+    msg->on_new_sub_callback = handler;
+    msg->on_new_sub_udata = udata;
+}
+
+/*
+ * Call <handler> when a subscriber cancels their subscription to messages of
+ * type <type>.
+ */
+void mxOnEndSubscriber(MX *mx, uint32_t type,
+        void (*handler)(MX *mx, int fd, uint32_t type, void *udata),
+        void *udata)
+{
+    MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+
+    if (msg == NULL) {
+        msg = mx_create_message(mx, type, NULL);
+    }
+
+    msg->on_end_sub_callback = handler;
+    msg->on_end_sub_udata = udata;
+}
+
+/*
+ * Keep the last value of message type <type> that we broadcast, and send it to
+ * every new subscriber to <type> as soon as it subscribes. If <key_width> is
+ * not 0, keep the last value for every value of the unsigned, big-endian
+ * integer field of <key_width> bytes (1, 2, 4 or 8) at <key_offset> in the
+ * payload, and send all of them. Returns <0 on errors, >0 on notices and 0
+ * otherwise. Check mxError() when return value is not 0.
+ */
+int mxSetCache(MX *mx, uint32_t type, uint32_t key_offset, uint32_t key_width)
+{
+    MX_Message *msg;
+
+    if (type < NUM_MX_MESSAGES) {
+        mx_error("Illegal message type %d in mxSetCache.\n", type);
+        return -1;
+    }
+    else if (key_width != 0 && key_width != 1 && key_width != 2 &&
+             key_width != 4 && key_width != 8) {
+        mx_error("Illegal key width %u in mxSetCache.\n", key_width);
+        return -1;
+    }
+
+    if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(type))) == NULL) {
+        msg = mx_create_message(mx, type, NULL);
+    }
+
+    pthread_mutex_lock(&msg->cache_lock);
+
+    /* Values cached under another key are no use to us. */
+
+    if (msg->cache_offset != key_offset || msg->cache_width != key_width) {
+        mx_clear_cache(msg);
+    }
+
+    msg->cache_offset = key_offset;
+    msg->cache_width  = key_width;
+    msg->cached       = true;
+
+    pthread_mutex_unlock(&msg->cache_lock);
+
+    return 0;
+}
+
+/*
+ * Stop caching values of message type <type>, and drop the ones that were
+ * cached.
+ */
+void mxClearCache(MX *mx, uint32_t type)
+{
+    MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+
+    if (msg == NULL) return;
+
+    pthread_mutex_lock(&msg->cache_lock);
+
+    mx_clear_cache(msg);
+
+    msg->cached = false;
+
+    pthread_mutex_unlock(&msg->cache_lock);
+}
+
+/*
+ * Call <handler> when a new component reports in. <handler> is called with the
+ * file descriptor through which we're connected to the new component in <fd>,
+ * and its name in <name>.
+ */
+void mxOnNewComponent(MX *mx,
+        void (*handler)(MX *mx, int fd, const char *name, void *udata),
+        void *udata)
+{
+    int fd;
+
+    mx->on_new_comp_callback = handler;
+    mx->on_new_comp_udata = udata;
+
+    for (fd = 0; fd < paCount(&mx->components); fd++) {
+        MX_Component *comp = paGet(&mx->components, fd);
+
+        if (comp == NULL || comp->name == NULL) continue;
+
+        handler(mx, fd, comp->name, udata);
+    }
+}
+
+/*
+ * Call <handler> when connection with a component is lost. <handler> is called
+ * with the file descriptor through which we were connected to the new component
+ * in <fd>, and its name in <name>.
+ */
+void mxOnEndComponent(MX *mx,
+        void (*handler)(MX *mx, int fd, const char *name, void *udata),
+        void *udata)
+{
+    mx->on_end_comp_callback = handler;
+    mx->on_end_comp_udata = udata;
+}
+
+/*
+ * Call <handler> when a new message type is registered.
+ */
+void mxOnNewMessage(MX *mx,
+        void (*handler)(MX *mx, uint32_t type, const char *name, void *udata),
+        void *udata)
 {
-    MX_Message *msg;
-    char *msg_name;
+    uint32_t type = 0;
 
-    strunpack(payload, size,
-            PACK_STRING,    &msg_name,
-            PACK_INT32,     &type,
-            END);
+    mx->on_register_callback = handler;
+    mx->on_register_udata = udata;
 
-    free(payload);
+    for (type = NUM_MX_MESSAGES; type < mx->next_message_type; type++) {
+        MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
 
-    if (strlen(msg_name) == 0) {        /* An anonymous message! */
-        free(msg_name);
-        msg_name = NULL;
+        handler(mx, msg->msg_type, msg->msg_name, udata);
     }
+}
 
-    msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
-
-    if (msg == NULL) {
-        mx_create_message(mx, type, msg_name);
+/*
+ * Call <handler> once we're connected to all components that were already
+ * present when we joined, so that from then on broadcasts reach every
+ * subscriber. If that is already the case, <handler> is called immediately.
+ */
+void mxOnReady(MX *mx,
+        void (*handler)(MX *mx, void *udata),
+        void *udata)
+{
+    mx->on_ready_callback = handler;
+    mx->on_ready_udata = udata;
 
-        free(msg_name);
+    if (mx->ready) {
+        handler(mx, udata);
     }
-    else if (msg->msg_name == NULL && msg_name != NULL) {
-        msg->msg_name = msg_name;
+}
 
-        hashAdd(&mx->message_by_name, msg, HASH_STRING(msg_name));
-    }
-    else if (msg_name != NULL) {
-        free(msg_name);
-    }
+/*
+ * Call <handler> each time mxProcessEvents (or mxRun, which calls it) has
+ * handled all events that were pending, just before it goes back to waiting
+ * for new ones. Message handlers can use this to collect messages and deal
+ * with them in batches.
+ */
+void mxOnEventsProcessed(MX *mx,
+        void (*handler)(MX *mx, void *udata),
+        void *udata)
+{
+    mx->on_processed_callback = handler;
+    mx->on_processed_udata = udata;
 }
 
 /*
- * Handle a SUBSCRIBE_UPDATE message (in all clients). This message
- * is exchanged between clients to inform each other of new
- * subscriptions.
+ * Set the maximum number of connections to other components that are set up
+ * simultaneously while joining the message exchange to <limit>. The default is
+ * 32.
  */
-static void mx_handle_subscribe_update(MX *mx, int fd,
-        uint32_t type, uint32_t version,
-        char *payload, uint32_t size, void *udata)
+void mxSetConnectLimit(MX *mx, int limit)
 {
-    MX_Message *msg;
+    MX_Peer *peer;
 
-    MX_Component *comp = paGet(&mx->components, fd);
-    MX_Subscription *sub = calloc(1, sizeof(*sub));
+    mx->max_peer_connects = MAX(limit, 1);
 
-    strunpack(payload, size, PACK_INT32, &type, END);
+    while (mx->peer_connects < mx->max_peer_connects &&
+           (peer = listRemoveHead(&mx->peer_backlog)) != NULL) {
+        mx_connect_peer(mx, peer);
+    }
+}
 
-    free(payload);
+/*
+ * Put the message exchange in lazy mode if <lazy> is true. Only a master can do
+ * this, and it must be done before any other components have joined. In lazy
+ * mode, components only connect to each other when they have something to send,
+ * and close those connections again once they have been idle for a while (see
+ * mxSetIdleTimeout). The master keeps everyone informed of all subscriptions.
+ */
+void mxSetLazy(MX *mx, bool lazy)
+{
+    dbgAssert(stderr, mx->me == mx->master,
+            "mxSetLazy may only be called by the master.\n");
 
-    msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+    mx->lazy = lazy;
+}
 
-    if (msg == NULL) {
-        msg = mx_create_message(mx, type, NULL);
+/*
+ * Close connections to other components in lazy mode after they have been idle
+ * for <timeout> seconds. The default is 60 seconds. If <timeout> is 0,
+ * connections are never closed.
+ */
+void mxSetIdleTimeout(MX *mx, double timeout)
+{
+    mx->idle_timeout = timeout;
+
+    if (mx->idle_timer == NULL) return;
+
+    if (timeout > 0) {
+        mxAdjustTimer(mx, mx->idle_timer, mxNow() + timeout / 2);
     }
+    else {
+        mxAdjustTimer(mx, mx->idle_timer, INFINITY);
+    }
+}
 
-    sub->comp = comp;
-    sub->msg  = msg;
+/*
+ * Put <mx> in busy-poll mode: after handling an event, mxRun() keeps checking
+ * for new ones for <spin> seconds before it goes to sleep, and reader and
+ * writer threads do the same for incoming data and outgoing messages. This
+ * trades CPU time for latency. If <spin> is 0, busy-polling is switched off.
+ */
+void mxSetBusyPoll(MX *mx, double spin)
+{
+    int fd;
 
-    mlAppendTail(&msg->subscriptions, sub);
-    mlAppendTail(&comp->subscriptions, sub);
+    mx->busy_poll = MAX(spin, 0);
 
-    if (msg->on_new_sub_callback) {
-        msg->on_new_sub_callback(mx, fd, type, msg->on_new_sub_udata);
+    for (fd = 0; fd < paCount(&mx->components); fd++) {
+        MX_Component *comp = paGet(&mx->components, fd);
+
+        if (comp != NULL && comp->reader_thread != 0) {
+            mx_set_socket_busy_poll(comp, mx->busy_poll);
+        }
     }
 }
 
 /*
- * Handle a CANCEL_UPDATE message (only in regular components). This message is
- * exchanged between regular components to inform each other of cancelled
- * subscriptions.
+ * Call message handlers on a pool of <threads> worker threads instead of on the
+ * thread that calls mxRun() or mxProcessEvents(). Messages are divided among
+ * the workers by <key>: messages with the same key are handled one at a time
+ * and in order, while those with different keys may be handled in parallel.
+ * Timers, system messages and the callbacks for new and ended components,
+ * subscribers and messages stay on the main thread.
+ *
+ * Handlers that run on a worker may call mxSend(), mxBroadcast() and their
+ * Pack variants, mxMessageName(), mxComponentName() and mxShutdown(). Anything
+ * else that changes the message exchange, like subscribing or registering
+ * messages, must be done on the main thread. Handlers for different keys must
+ * protect any data they share themselves.
+ *
+ * Call this function once, before mxRun() or mxProcessEvents(). If <threads>
+ * is 0 nothing changes. Returns <0 on errors and 0 otherwise. Check mxError()
+ * when return value is not 0.
  */
-static void mx_handle_cancel_update(MX *mx, int fd,
-        uint32_t type, uint32_t version,
-        char *payload, uint32_t size, void *udata)
+int mxSetDispatchThreads(MX *mx, int threads, MX_DispatchKey key)
 {
-    MX_Message *msg;
-    MX_Subscription *sub;
+    MX_Dispatcher *disp;
+    pthread_mutexattr_t attr;
 
-    MX_Component *comp = paGet(&mx->components, fd);
+    int i, r;
 
-    strunpack(payload, size, PACK_INT32, &type, END);
+    if (mx->dispatcher != NULL) {
+        mx_error("mxSetDispatchThreads may only be called once.\n");
+        return -1;
+    }
+    else if (threads < 0) {
+        mx_error("Illegal number of threads (%d) in mxSetDispatchThreads.\n",
+                threads);
+        return -1;
+    }
+    else if (threads == 0) {
+        return 0;
+    }
 
-    free(payload);
+    disp = calloc(1, sizeof(MX_Dispatcher));
 
-    if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(type))) == NULL) {
-        return;
-    }
+    disp->key = key;
+    disp->threads = calloc(threads, sizeof(pthread_t));
+    disp->wake_fd = dup(mx->event_pipe[WR]);
 
-    if ((sub = mx_find_subscription_to_msg(comp, msg)) == NULL) {
-        return;
-    }
+    /* The main thread may already hold the lock when a handler it calls
+     * broadcasts a message, hence the recursive mutex. */
 
-    mlRemove(&msg->subscriptions, sub);
-    mlRemove(&comp->subscriptions, sub);
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&disp->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
 
-    if (msg->on_end_sub_callback) {
-        msg->on_end_sub_callback(mx, fd, type, msg->on_end_sub_udata);
+    pthread_mutex_init(&disp->queue_lock, NULL);
+    pthread_cond_init(&disp->work, NULL);
+    pthread_cond_init(&disp->room, NULL);
+
+    mx->dispatcher = disp;
+
+    for (i = 0; i < threads; i++) {
+        r = pthread_create(&disp->threads[i], NULL, mx_dispatch_thread, mx);
+
+        if (r != 0) {
+            mx_error("couldn't create dispatch thread (%s)\n", strerror(r));
+            mx_destroy_dispatcher(mx);
+            return -1;
+        }
+
+        mx_place_thread(mx, MX_THREAD_DISPATCH, disp->threads[i]);
+
+        disp->count++;
     }
 
-    free(sub);
+    return 0;
 }
 
 /*
- * Handle a HELLO_REPORT message (only in regular components). This message is
- * sent by the master to inform a recently connected component of the already
- * existing components in the system.
+ * Run all threads of kind <thread> on the CPUs in <cpus>, both the ones that
+ * exist now and the ones started later. <cpus> is a comma-separated list of
+ * CPU numbers, ranges of CPU numbers like "2-5", and NUMA nodes like "node1"
+ * (meaning all CPUs on that node). If <cpus> is NULL the threads may run on
+ * any CPU. The initial placement can also be set using the MX_AFFINITY
+ * environment variable, e.g. "main=0 reader=2-3 writer=2-3 timer=1". Returns
+ * <0 on errors and 0 otherwise. Check mxError() when return value is not 0.
  */
-static void mx_handle_hello_report(MX *mx, int fd,
-        uint32_t type, uint32_t version,
-        char *payload, uint32_t size, void *udata)
+int mxSetAffinity(MX *mx, MX_Thread thread, const char *cpus)
 {
-    char *name;
-    char *host;
-    uint16_t port;
-    uint16_t id;
+    cpu_set_t set;
 
-    MX_Subscription *sub;
-    MX_Component *comp;
+    int cpu;
 
-    strunpack(payload, size,
-            PACK_STRING,    &name,
-            PACK_INT16,     &id,
-            PACK_STRING,    &host,
-            PACK_INT16,     &port,
-            END);
+    CPU_ZERO(&set);
 
-    free(payload);
+    if (thread < 0 || thread >= NUM_MX_THREADS) {
+        mx_error("Illegal thread kind %d in mxSetAffinity.\n", thread);
+        return -1;
+    }
+    else if (cpus == NULL) {
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    else if (!mx_parse_cpus(cpus, &set, true) || CPU_COUNT(&set) == 0) {
+        mx_error("Illegal CPU list \"%s\" in mxSetAffinity.\n", cpus);
+        return -1;
+    }
 
-    /* Create component data and connect to it. */
+    mx->placement[thread].pinned = true;
+    mx->placement[thread].cpus = set;
 
-    fd = tcpConnect(host, port);
+    return mx_place_threads(mx, thread);
+}
 
-    if (fd == -1) {
-        mx_error("could not connect to component %s at %s:%d (%s).\n",
-                name, host, port, strerror(errno));
-        mxShutdown(mx);
-        return;
+/*
+ * Run all threads of kind <thread> with scheduling policy <policy> (one of the
+ * SCHED_* constants from <sched.h>) and static priority <priority>, both the
+ * ones that exist now and the ones started later. Real-time policies usually
+ * require special privileges. The initial scheduling can also be set using the
+ * MX_SCHEDULING environment variable, e.g. "reader=fifo:50 timer=rr:10", where
+ * the policy is one of "other", "batch", "idle", "fifo" and "rr". Returns <0
+ * on errors and 0 otherwise. Check mxError() when return value is not 0.
+ */
+int mxSetScheduling(MX *mx, MX_Thread thread, int policy, int priority)
+{
+    if (thread < 0 || thread >= NUM_MX_THREADS) {
+        mx_error("Illegal thread kind %d in mxSetScheduling.\n", thread);
+        return -1;
+    }
+    else if (sched_get_priority_min(policy) == -1 ||
+             priority < sched_get_priority_min(policy) ||
+             priority > sched_get_priority_max(policy)) {
+        mx_error("Illegal policy %d or priority %d in mxSetScheduling.\n",
+                policy, priority);
+        return -1;
     }
 
-    comp = mx_create_component(mx);
+    mx->placement[thread].scheduled = true;
+    mx->placement[thread].policy = policy;
+    mx->placement[thread].priority = priority;
 
-    comp->name = name;
-    comp->host = host;
-    comp->port = port;
-    comp->fd   = fd;
-    comp->id   = id;
+    return mx_place_threads(mx, thread);
+}
 
-    paSet(&mx->components, comp->fd, comp);
+/*
+ * Find the entry for message type <type> in the <count> entries in <entries>,
+ * which are sorted on type. Returns NULL if there is none.
+ */
+static const MX_StatsEntry *mx_find_stats_entry(const MX_StatsEntry *entries,
+        int count, uint32_t type)
+{
+    int lo = 0, hi = count - 1;
 
-    mx_start_reader_thread(mx, comp);
-    mx_start_writer_thread(mx, comp);
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
 
-    /* Tell it who we are... */
+        if (entries[mid].type < type)
+            lo = mid + 1;
+        else if (entries[mid].type > type)
+            hi = mid - 1;
+        else
+            return entries + mid;
+    }
 
-    mx_pack(comp, MX_MT_HELLO_UPDATE, 0,
-            PACK_STRING,    mx->me->name,
-            PACK_INT16,     mx->me->id,
-            PACK_INT16,     mx->me->port,
-            END);
+    return NULL;
+}
 
-    /* And inform it of all of our subscriptions. */
+/*
+ * Load the counts for message type <index> * MX_STATS_CHUNK_SIZE + <offset>
+ * from <counters> (owned by another thread) into <count>.
+ */
+static void mx_load_count(MX_Counters *counters, int index, int offset,
+        MX_Count *count)
+{
+    MX_Count *chunk = __atomic_load_n(&counters->chunk[index], __ATOMIC_ACQUIRE);
 
-    for (sub = mlHead(&mx->me->subscriptions); sub;
-         sub = mlNext(&mx->me->subscriptions, sub)) {
-        mx_pack(comp, MX_MT_SUBSCRIBE_UPDATE, 0,
-                PACK_INT32, sub->msg->msg_type,
-                END);
+    if (chunk == NULL) {
+        memset(count, 0, sizeof(*count));
+    }
+    else {
+        count->msgs  = __atomic_load_n(&chunk[offset].msgs, __ATOMIC_RELAXED);
+        count->bytes = __atomic_load_n(&chunk[offset].bytes, __ATOMIC_RELAXED);
+        count->drops = __atomic_load_n(&chunk[offset].drops, __ATOMIC_RELAXED);
     }
+}
 
-    if (mx->on_new_comp_callback) {
-        mx->on_new_comp_callback(mx, comp->fd, name, mx->on_new_comp_udata);
+/*
+ * Load the sum of the counts for message type <index> * MX_STATS_CHUNK_SIZE +
+ * <offset> from the per-thread counters in <list> into <count>.
+ */
+static void mx_load_thread_counts(MX_ThreadCounters *list, int index,
+        int offset, MX_Count *count)
+{
+    MX_ThreadCounters *set;
+
+    memset(count, 0, sizeof(*count));
+
+    for (set = list; set != NULL; set = set->next) {
+        MX_Count part;
+
+        mx_load_count(&set->counters, index, offset, &part);
+
+        count->msgs  += part.msgs;
+        count->bytes += part.bytes;
+        count->drops += part.drops;
     }
 }
 
 /*
- * Handle a HELLO_UPDATE message (only in regular components). This message is
- * sent by a new component to existing components as a way of introducing
- * themselves.
+ * Return true if any of the per-thread counters in <list> has counts for the
+ * message types in chunk <index>.
  */
-static void mx_handle_hello_update(MX *mx, int fd,
-        uint32_t type, uint32_t version,
-        char *payload, uint32_t size, void *udata)
+static bool mx_thread_counts_chunk(MX_ThreadCounters *list, int index)
 {
-    MX_Subscription *sub;
+    MX_ThreadCounters *set;
 
-    char *name;
-    uint16_t port;
-    uint16_t id;
+    for (set = list; set != NULL; set = set->next) {
+        if (__atomic_load_n(&set->counters.chunk[index],
+                    __ATOMIC_ACQUIRE) != NULL) {
+            return true;
+        }
+    }
 
-    MX_Component *comp = paGet(&mx->components, fd);
+    return false;
+}
 
-    strunpack(payload, size,
-            PACK_STRING, &name,
-            PACK_INT16,  &id,
-            PACK_INT16,  &port,
-            END);
+/*
+ * Add the traffic totals for component <comp> to <totals>.
+ */
+static void mx_collect_stats(MX_Component *comp, Buffer *totals)
+{
+    int index, offset;
 
-    free(payload);
+    MX_ThreadCounters *queued_sets =
+        __atomic_load_n(&comp->queued, __ATOMIC_ACQUIRE);
 
-    dbgAssert(stderr, comp->name == NULL,
-            "Expected comp->name to be NULL instead of \"%s\"\n", comp->name);
+    for (index = 0; index < MX_STATS_CHUNKS; index++) {
+        if (!mx_thread_counts_chunk(queued_sets, index) &&
+            __atomic_load_n(&comp->written.chunk[index], __ATOMIC_ACQUIRE) == NULL &&
+            __atomic_load_n(&comp->received.chunk[index], __ATOMIC_ACQUIRE) == NULL &&
+            comp->handled.chunk[index] == NULL) {
+            continue;
+        }
 
-    comp->name = name;
-    comp->host = strdup(netPeerHost(fd));
-    comp->port = port;
-    comp->id   = id;
+        for (offset = 0; offset < MX_STATS_CHUNK_SIZE; offset++) {
+            MX_Count queued, written, received, handled;
+            MX_StatsEntry entry = { 0 };
 
-    /* Inform the new component of all of my subscriptions. */
+            /* Load the written count first: it only ever catches up with the
+             * queued counts, which only go up, so the queue depth never comes
+             * out negative. Reload the list of queued counters after it, in
+             * case a new publishing thread turned up in the meantime. */
 
-    for (sub = mlHead(&mx->me->subscriptions); sub;
-         sub = mlNext(&mx->me->subscriptions, sub)) {
+            mx_load_count(&comp->written, index, offset, &written);
+            mx_load_thread_counts(
+                    __atomic_load_n(&comp->queued, __ATOMIC_ACQUIRE),
+                    index, offset, &queued);
+            mx_load_count(&comp->received, index, offset, &received);
+            mx_load_count(&comp->handled, index, offset, &handled);
 
-        mx_pack(comp, MX_MT_SUBSCRIBE_UPDATE, 0,
-                PACK_INT32, sub->msg->msg_type,
-                END);
-    }
+            if (queued.msgs == 0 && received.msgs == 0) continue;
 
-    if (mx->on_new_comp_callback) {
-        mx->on_new_comp_callback(mx, comp->fd, name, mx->on_new_comp_udata);
+            entry.fd   = comp->fd;
+            entry.type = index * MX_STATS_CHUNK_SIZE + offset;
+
+            entry.sent_msgs  = written.msgs;
+            entry.sent_bytes = written.bytes;
+            entry.send_drops = written.drops;
+            entry.recv_msgs  = received.msgs;
+            entry.recv_bytes = received.bytes;
+            entry.recv_drops = handled.drops;
+            entry.queued     = queued.msgs - written.msgs - written.drops;
+
+            bufAdd(totals, &entry, sizeof(entry));
+        }
     }
 }
 
 /*
- * Handle a HELLO_REQUEST message (only in the master component). This message
- * is sent by new components to the master to introduce themselves.
+ * Return traffic statistics for <mx>, with an entry for every connection and
+ * message type that has seen any traffic. If <delta> is true, the counts are
+ * those since the previous call to this function, otherwise they're totals since
+ * <mx> was created. The queue depth is always the current one. The returned
+ * struct must be freed using mxFreeStats().
  */
-static void mx_handle_hello_request(MX *mx, int fd,
-        uint32_t type, uint32_t version,
-        char *payload, uint32_t size, void *udata)
+MX_Stats *mxGetStats(MX *mx, bool delta)
 {
-    char *name;
-    uint16_t port;
-    MX_Subscription *sub;
+    int fd, i;
 
-    strunpack(payload, size,
-            PACK_STRING,    &name,
-            PACK_INT16,     &port,
-            END);
+    Buffer entries = { 0 };
+    Buffer totals = { 0 };
+
+    MX_Stats *stats = calloc(1, sizeof(*stats));
+
+    stats->t = mxNow();
+    stats->interval = stats->t - (delta ? mx->stats_time : mx->stats_start);
+
+    mx->stats_time = stats->t;
+
+    for (fd = 0; fd < paCount(&mx->components); fd++) {
+        MX_Component *comp = paGet(&mx->components, fd);
+
+        if (comp == NULL || comp == mx->me) continue;
+
+        mx_collect_stats(comp, &totals);
 
-    free(payload);
+        const MX_StatsEntry *total = (const MX_StatsEntry *) bufGet(&totals);
+        int count = bufLen(&totals) / sizeof(MX_StatsEntry);
 
-    MX_Component *comp = paGet(&mx->components, fd);
+        for (i = 0; i < count; i++) {
+            MX_StatsEntry entry = total[i];
+            const MX_StatsEntry *last;
 
-    dbgAssert(stderr, comp != NULL,
-            "HELLO request from unconnected component?!\n");
+            if (delta && (last = mx_find_stats_entry(comp->last_stats,
+                            comp->last_stats_count, entry.type)) != NULL) {
+                entry.sent_msgs  -= last->sent_msgs;
+                entry.sent_bytes -= last->sent_bytes;
+                entry.send_drops -= last->send_drops;
+                entry.recv_msgs  -= last->recv_msgs;
+                entry.recv_bytes -= last->recv_bytes;
+                entry.recv_drops -= last->recv_drops;
 
-    dbgAssert(stderr, comp->name == NULL,
-            "Expected comp->name to be NULL instead of \"%s\"\n", comp->name);
+                if (entry.sent_msgs == 0 && entry.send_drops == 0 &&
+                    entry.recv_msgs == 0 && entry.recv_drops == 0 &&
+                    entry.queued == 0) {
+                    continue;
+                }
+            }
 
-    int name_len = asprintf(&comp->name, "%s/%u",
-            name, mx_count_components(mx, name) + 1);
+            bufAdd(&entries, &entry, sizeof(entry));
+        }
 
-    dbgAssert(stderr, name_len != -1, "Could not create component name.\n");
+        /* Remember these totals for the next delta. */
 
-    comp->id   = mx_count_components(mx, NULL);
-    comp->host = strdup(netPeerHost(fd));
-    comp->port = port;
+        free(comp->last_stats);
 
-    /* Tell it my name (which may be different from "master"), its new id and
-     * its new name. */
+        comp->last_stats_count = count;
+        comp->last_stats = (MX_StatsEntry *) bufDetach(&totals);
+    }
 
-    mx_pack(comp, MX_MT_HELLO_REPLY, 0,
-            PACK_STRING,    mx->me->name,
-            PACK_INT16,     comp->id,
-            PACK_STRING,    comp->name,
-            END);
+    stats->count = bufLen(&entries) / sizeof(MX_StatsEntry);
+    stats->entry = (MX_StatsEntry *) bufDetach(&entries);
 
-    /* Inform the new component of alle existing components. */
+    return stats;
+}
 
-    for (fd = 0; fd < paCount(&mx->components); fd++) {
-        MX_Component *existing = paGet(&mx->components, fd);
+/*
+ * Free <stats>, as returned by mxGetStats().
+ */
+void mxFreeStats(MX_Stats *stats)
+{
+    free(stats->entry);
+    free(stats);
+}
 
-        if (existing == NULL || existing == comp || existing->name == NULL)
-            continue;
+/*
+ * Send a StatsReport with our traffic totals to everyone who subscribed to it,
+ * and do it again after STATS_REPORT_INTERVAL for as long as anyone does.
+ */
+static void mx_send_stats_report(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    int fd, i;
 
-        mx_pack(comp, MX_MT_HELLO_REPORT, 0,
-                PACK_STRING,    existing->name,
-                PACK_INT16,     existing->id,
-                PACK_STRING,    existing->host,
-                PACK_INT16,     existing->port,
-                END);
-    }
+    Buffer totals = { 0 };
+    Buffer report = { 0 };
 
-    /* Inform the new component of all registered messages. */
+    MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(MX_MT_STATS_REPORT));
 
-    for (type = NUM_MX_MESSAGES; type < mx->next_message_type; type++) {
-        MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+    if (mlHead(&msg->subscriptions) == NULL) return;
 
-        mx_pack(comp, MX_MT_REGISTER_REPORT, 0,
-                PACK_STRING,    msg->msg_name ? msg->msg_name : "",
-                PACK_INT32,     msg->msg_type,
-                END);
+    /* Not using mxGetStats(), which would reset the deltas it returns. */
+
+    for (fd = 0; fd < paCount(&mx->components); fd++) {
+        MX_Component *comp = paGet(&mx->components, fd);
+
+        if (comp != NULL && comp != mx->me) mx_collect_stats(comp, &totals);
     }
 
-    /* Inform the new component of my subscriptions. */
+    const MX_StatsEntry *entry = (const MX_StatsEntry *) bufGet(&totals);
+    int count = bufLen(&totals) / sizeof(MX_StatsEntry);
 
-    for (sub = mlHead(&mx->me->subscriptions); sub;
-         sub = mlNext(&mx->me->subscriptions, sub)) {
+    bufPack(&report,
+            PACK_DOUBLE, t,
+            PACK_DOUBLE, t - mx->stats_start,
+            PACK_INT32,  count,
+            END);
 
-        mx_pack(comp, MX_MT_SUBSCRIBE_UPDATE, 0,
-                PACK_INT32, sub->msg->msg_type,
+    for (i = 0; i < count; i++, entry++) {
+        MX_Component *comp = paGet(&mx->components, entry->fd);
+
+        bufPack(&report,
+                PACK_INT16, comp->id,
+                PACK_INT32, entry->type,
+                PACK_INT64, entry->sent_msgs,
+                PACK_INT64, entry->sent_bytes,
+                PACK_INT64, entry->send_drops,
+                PACK_INT64, entry->recv_msgs,
+                PACK_INT64, entry->recv_bytes,
+                PACK_INT64, entry->recv_drops,
+                PACK_INT64, entry->queued,
                 END);
     }
 
-    if (mx->on_new_comp_callback) {
-        mx->on_new_comp_callback(mx, comp->fd, name, mx->on_new_comp_udata);
-    }
+    mxBroadcast(mx, MX_MT_STATS_REPORT, 0, bufGet(&report), bufLen(&report));
+
+    bufClear(&totals);
+    bufClear(&report);
+
+    mxAdjustTimer(mx, timer, t + STATS_REPORT_INTERVAL);
 }
 
 /*
- * Handle a REGISTER_REQUEST (only in the master component). This message is
- * sent from a component to the master to register a message type.
+ * Handle a StatsReport from the component on <fd>, and pass it on to the
+ * callback set with mxOnStatsReport().
  */
-static void mx_handle_register_request(MX *mx, int fd,
+static void mx_handle_stats_report(MX *mx, int fd,
         uint32_t type, uint32_t version,
         char *payload, uint32_t size, void *udata)
 {
-    char *msg_name = NULL;
-    MX_Message *msg = NULL;
+    int i, j;
+    uint32_t count;
+    const char *p = payload + STATS_REPORT_HEADER;
 
-    MX_Component *comp = paGet(&mx->components, fd);
+    PointerArray by_id = { 0 };
 
-    /* Get the name of the message. */
+    MX_Stats *stats = calloc(1, sizeof(*stats));
 
     strunpack(payload, size,
-            PACK_STRING, &msg_name,
+            PACK_DOUBLE, &stats->t,
+            PACK_DOUBLE, &stats->interval,
+            PACK_INT32,  &count,
             END);
 
-    free(payload);
-
-    if (strlen(msg_name) == 0) {        /* An anonymous message! */
-        free(msg_name);
-        msg_name = NULL;
+    if (size < STATS_REPORT_HEADER ||
+        count > (size - STATS_REPORT_HEADER) / STATS_REPORT_ENTRY ||
+        mx->on_stats_callback == NULL) {
+        mxFreeStats(stats);
+        free(payload);
+        return;
     }
 
-    if (msg_name == NULL) {             /* Always allocate anon messages. */
-        msg = mx_create_message(mx, mx->next_message_type, msg_name);
+    /* The report identifies components by id, we use file descriptors. */
 
-        mx_broadcast_new_message(mx, msg, comp);
+    for (i = 0; i < paCount(&mx->components); i++) {
+        MX_Component *comp = paGet(&mx->components, i);
+
+        if (comp != NULL && comp != mx->me) paSet(&by_id, comp->id, comp);
     }
-    else {                              /* Else try to find existing... */
-        msg = hashGet(&mx->message_by_name, HASH_STRING(msg_name));
 
-        if (msg == NULL) {              /* Or create a new message. */
-            msg = mx_create_message(mx, mx->next_message_type, msg_name);
+    stats->count = count;
+    stats->entry = calloc(count, sizeof(MX_StatsEntry));
+
+    for (i = 0; i < stats->count; i++, p += STATS_REPORT_ENTRY) {
+        MX_StatsEntry *entry = stats->entry + i;
+        MX_Component *comp;
+        uint16_t id;
+        uint64_t *counts[] = {
+            &entry->sent_msgs, &entry->sent_bytes, &entry->send_drops,
+            &entry->recv_msgs, &entry->recv_bytes, &entry->recv_drops,
+            &entry->queued
+        };
+
+        strunpack(p, STATS_REPORT_ENTRY,
+                PACK_INT16, &id,
+                PACK_INT32, &entry->type,
+                END);
 
-            mx_broadcast_new_message(mx, msg, comp);
+        for (j = 0; j < 7; j++) {
+            strunpack(p + 6 + 8 * j, 8, PACK_INT64, counts[j], END);
         }
-    }
 
-    if (msg_name != NULL) free(msg_name);
+        entry->fd = (comp = paGet(&by_id, id)) != NULL ? comp->fd : -1;
+    }
 
-    /* Send reply. */
+    paClear(&by_id);
+    free(payload);
 
-    mx_pack(comp, MX_MT_REGISTER_REPLY, version,
-            PACK_INT32,     msg->msg_type,
-            END);
+    mx->on_stats_callback(mx, fd, stats, mx->on_stats_udata);
 }
 
 /*
- * Handle a QUIT_REQUEST message (only in the master).
+ * Start sending StatsReports when someone subscribes to them.
  */
-static void mx_handle_quit_request(MX *mx, int client_fd,
-        uint32_t type, uint32_t version,
-        char *payload, uint32_t size, void *udata)
+static void mx_handle_stats_subscriber(MX *mx, int fd, uint32_t type, void *udata)
 {
-    free(payload);
-
-    mxShutdown(mx);
+    if (mx->stats_timer == NULL) {
+        mx->stats_timer = mxCreateTimer(mx, mxNow(), mx_send_stats_report, NULL);
+    }
+    else {
+        mxAdjustTimer(mx, mx->stats_timer, mxNow());
+    }
 }
 
 /*
- * Handle a new connection on <fd>.
+ * Call <handler> with the traffic totals of every other component, which they
+ * send us once a second from now on. <handler> is called with the file
+ * descriptor of the reporting component in <fd>, and its totals in <stats> (see
+ * mxGetStats()), which must be freed using mxFreeStats(). The fd of an entry is
+ * that of our own connection to the component at the other end, or -1 if we
+ * don't have one (which includes when it is us). If <handler> is NULL, the
+ * reports are stopped again.
  */
-static void mx_handle_connect(MX *mx, int fd)
+void mxOnStatsReport(MX *mx,
+        void (*handler)(MX *mx, int fd, MX_Stats *stats, void *udata),
+        void *udata)
 {
-    MX_Component *comp = mx_create_component(mx);
-
-    comp->fd = fd;
+    if (handler != NULL && mx->on_stats_callback == NULL) {
+        mx_subscribe(mx, MX_MT_STATS_REPORT, mx_handle_stats_report, NULL);
+    }
+    else if (handler == NULL && mx->on_stats_callback != NULL) {
+        mx_cancel(mx, MX_MT_STATS_REPORT);
+    }
 
-    paSet(&mx->components, fd, comp);
+    mx->on_stats_callback = handler;
+    mx->on_stats_udata = udata;
+}
 
-    mx_start_reader_thread(mx, comp);
-    mx_start_writer_thread(mx, comp);
+/*
+ * Add timestamps to messages sent by <mx> if <enable> is true, so that their
+ * receivers can measure their latency (see mxGetLatency()). This adds 16 bytes
+ * to every message.
+ */
+void mxSetTimestamps(MX *mx, bool enable)
+{
+    mx->timestamps = enable;
 }
 
 /*
- * Handle a disconnect event on <fd>, triggered at <whence>.
+ * Get latency percentiles for the timestamped messages of type <type> that <mx>
+ * has received and handled, for stage <stage>, into <latency>. The network
+ * stage is only meaningful if the clocks of sender and receiver are in sync.
+ * Returns <0 on errors, >0 on notices and 0 otherwise. Check mxError() when
+ * return value is not 0.
  */
-static void mx_handle_disconnect(MX *mx, int fd, char *whence)
+int mxGetLatency(MX *mx, uint32_t type, MX_Stage stage, MX_Latency *latency)
 {
-    MX_Component *comp = paGet(&mx->components, fd);
+    MX_Histogram *hist;
+    MX_Message *msg;
 
-    free(whence);
+    if (stage < 0 || stage >= NUM_MX_STAGES) {
+        mx_error("mxGetLatency for invalid stage %d.\n", stage);
+        return -1;
+    }
 
-    if (comp == mx->master) {
-        mx_notice("lost connection with master, shutting down.\n");
-        mxShutdown(mx);
+    /* Dispatch workers record latencies under the lock. */
+
+    mx_lock(mx);
+
+    if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(type))) == NULL) {
+        mx_unlock(mx);
+        mx_error("mxGetLatency for unknown message type %d.\n", type);
+        return -1;
     }
-    else if (comp != NULL) {
-        paDrop(&mx->components, fd);
 
-        mx_destroy_component(mx, comp);
+    memset(latency, 0, sizeof(*latency));
+
+    if (msg->latency != NULL) {
+        hist = &msg->latency[stage];
+
+        latency->count = hist->count;
+        latency->p50   = mx_hist_percentile(hist, 50);
+        latency->p99   = mx_hist_percentile(hist, 99);
+        latency->p999  = mx_hist_percentile(hist, 99.9);
+        latency->max   = hist->max / 1e9;
     }
+
+    mx_unlock(mx);
+
+    return 0;
 }
 
 /*
- * Subscribe to messages of type <type>. <handler> will be called for all
- * incoming messages of this type, passing in the same <udata> that is passed in
- * to this function. Returns <0 on errors, >0 on notices and 0 otherwise.
+ * Start recording trace events in every thread, in a ring of <events> events
+ * per thread (rounded up to a power of two, or MX_TRACE_EVENTS if it is 0).
+ * Threads that are already recording keep the ring they have. Use mxTraceDump()
+ * to write the events out. Returns <0 on errors, >0 on notices and 0 otherwise.
+ * Check mxError() when return value is not 0.
  */
-static int mx_subscribe(MX *mx, uint32_t type,
-        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
-            char *payload, uint32_t size, void *udata),
-        void *udata)
+int mxTraceStart(uint32_t events)
 {
-    int fd, r = 0;
-
-    MX_Message *msg;
-    MX_Subscription *sub;
+#ifdef MX_NO_TRACE
+    mx_error("mxTraceStart: tracing was left out of this build.\n");
 
-    if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(type))) == NULL) {
-        mx_notice("Subscribing to unknown message type %d. "
-                  "Adding message type.\n", type);
+    return -1;
+#else
+    uint32_t size = 1;
+    MX_TraceRing *ring, **link;
 
-        msg = mx_create_message(mx, type, NULL);
+    if (events == 0) {
+        events = MX_TRACE_EVENTS;
+    }
 
-        r = 1;
+    while (size < events && size < 0x80000000) {
+        size <<= 1;
     }
 
-    if ((sub = mx_find_subscription_for_comp(msg, mx->me)) != NULL) {
-        mx_notice("mxSubscribe for message type %d (%s), "
-                  "which I'm already subscribed to. Replacing callback.\n",
-                  type, mxMessageName(mx, type));
+    pthread_mutex_lock(&mx_trace_lock);
 
-        sub->handler = handler;
-        sub->udata = udata;
+    /* We no longer need the rings of threads that are gone. */
 
-        return 2;
+    for (link = &mx_trace_rings; (ring = *link) != NULL; ) {
+        if (ring->dead) {
+            *link = ring->next;
+            free(ring);
+        }
+        else {
+            link = &ring->next;
+        }
     }
 
-    sub = calloc(1, sizeof(*sub));
-
-    sub->msg = msg;
-    sub->comp = mx->me;
-
-    sub->handler = handler;
-    sub->udata = udata;
+    mx_trace_events = size;
 
-    mlAppendTail(&msg->subscriptions, sub);
-    mlAppendTail(&mx->me->subscriptions, sub);
+    mx_trace_start_ns    = mx_trace_ns();
+    mx_trace_start_ticks = mx_trace_ticks();
 
-    for (fd = 0; fd < paCount(&mx->components); fd++) {
-        MX_Component *comp = paGet(&mx->components, fd);
+    pthread_mutex_unlock(&mx_trace_lock);
 
-        if (comp == NULL) continue;
+    __atomic_store_n(&mx_trace_on, 1, __ATOMIC_RELEASE);
 
-        mx_pack(comp, MX_MT_SUBSCRIBE_UPDATE, 0, PACK_INT32, type, END);
-    }
+    return 0;
+#endif
+}
 
-    return r;
+/*
+ * Stop recording trace events.
+ */
+void mxTraceStop(void)
+{
+    __atomic_store_n(&mx_trace_on, 0, __ATOMIC_RELEASE);
 }
 
 /*
- * Cancel our subscription to messages of type <type> that calls <handler>.
- * Returns <0 on errors, >0 on notices and 0 otherwise.
+ * Write the trace events recorded since the last call to mxTraceStart() to
+ * <path>, in the Chrome trace event format (which Perfetto can also read), with
+ * one event per line. Only the last events that fit in its ring are available
+ * for each thread. Call mxTraceStop() first to get a consistent snapshot.
+ * Returns <0 on errors, >0 on notices and 0 otherwise. Check mxError() when
+ * return value is not 0.
  */
-static int mx_cancel(MX *mx, uint32_t type)
+int mxTraceDump(const char *path)
 {
-    int fd;
+    int pid = getpid();
+    bool first = true;
+    double ns_per_tick = 1;
 
-    MX_Message *msg;
-    MX_Subscription *sub;
+    uint64_t now_ns, now_ticks;
+    MX_TraceRing *ring;
+    FILE *fp;
 
-    if ((msg = hashGet(&mx->message_by_type, HASH_VALUE(type))) == NULL) {
-        mx_notice("mxCancel for unknown message type %d. Ignored\n", type);
-        return 1;
+    if ((fp = fopen(path, "w")) == NULL) {
+        mx_error("mxTraceDump: couldn't open \"%s\" (%s).\n", path, strerror(errno));
+        return -1;
     }
 
-    if ((sub = mx_find_subscription_for_comp(msg, mx->me)) == NULL) {
-        mx_notice("mxCancel for message type %d (%s), "
-                  "which I'm not subscribed to. Ignored.\n",
-                  type, mxMessageName(mx, type));
-        return 1;
+    pthread_mutex_lock(&mx_trace_lock);
+
+    now_ns    = mx_trace_ns();
+    now_ticks = mx_trace_ticks();
+
+    if (now_ticks > mx_trace_start_ticks) {
+        ns_per_tick = (double) (now_ns - mx_trace_start_ns) /
+                      (now_ticks - mx_trace_start_ticks);
     }
 
-    mlRemove(&sub->msg->subscriptions, sub);
-    mlRemove(&mx->me->subscriptions, sub);
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
 
-    free(sub);
+    for (ring = mx_trace_rings; ring; ring = ring->next) {
+        uint64_t i, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = head > ring->mask + 1 ? head - ring->mask - 1 : 0;
 
-    for (fd = 0; fd < paCount(&mx->components); fd++) {
-        MX_Component *comp = paGet(&mx->components, fd);
+        fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",", pid, ring->tid, ring->name);
 
-        if (comp == NULL) continue;
+        first = false;
+
+        for (i = tail; i < head; i++) {
+            MX_TraceRecord rec = ring->record[i & ring->mask];
+            const char *name = trc_enum_to_string(rec.what);
+
+            if (rec.t < mx_trace_start_ticks) continue;
 
-        mx_pack(comp, MX_MT_CANCEL_UPDATE, 0, PACK_INT32, type, END);
+            fprintf(fp, ",\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,",
+                    rec.what == MX_TE_HANDLER_START ||
+                    rec.what == MX_TE_HANDLER_END ? "handler" : name,
+                    pid, ring->tid,
+                    (rec.t - mx_trace_start_ticks) * ns_per_tick / 1000);
+
+            if (rec.what == MX_TE_WRITE) {
+                fprintf(fp, "\"ph\":\"X\",\"dur\":%.3f,",
+                        rec.duration * ns_per_tick / 1000);
+            }
+            else if (rec.what == MX_TE_HANDLER_START) {
+                fprintf(fp, "\"ph\":\"B\",");
+            }
+            else if (rec.what == MX_TE_HANDLER_END) {
+                fprintf(fp, "\"ph\":\"E\",");
+            }
+            else {
+                fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",");
+            }
+
+            fprintf(fp, "\"args\":{\"fd\":%d,\"type\":%u,\"size\":%u}}",
+                    rec.fd, rec.type, rec.size);
+        }
+    }
+
+    fprintf(fp, "\n]}\n");
+
+    pthread_mutex_unlock(&mx_trace_lock);
+
+    if (fclose(fp) != 0) {
+        mx_error("mxTraceDump: couldn't write \"%s\" (%s).\n", path, strerror(errno));
+        return -1;
     }
 
     return 0;
 }
 
 /*
- * Return the mx_name to use if <mx_name> was given to mxClient() or mxMaster().
- * If it is a valid name (i.e. not NULL) use it. Otherwise use the environment
- * variable MX_NAME if it is set. Otherwise use the environment variable USER
- * (the user's login name) if it is set. Otherwise give up and return NULL.
+ * Return the number of bytes taken up by a log record with a payload of <size>
+ * bytes.
  */
-const char *mxEffectiveName(const char *mx_name)
+static size_t mx_log_record_size(uint32_t size)
 {
-    if (mx_name != NULL)
-        return mx_name;
-    else if ((mx_name = getenv("MX_NAME")) != NULL)
-        return mx_name;
-    else if ((mx_name = getenv("USER")) != NULL)
-        return mx_name;
-    else
-        return NULL;
+    return (sizeof(MX_LogRecord) + size + 7) & ~(size_t) 7;
 }
 
 /*
- * Return the listen port that the master component will use for mx name
- * <mx_name>.
+ * If <name> is the file name of a log segment, get its number into <number>
+ * and return true. Otherwise return false.
  */
-uint16_t mxEffectivePort(const char *mx_name)
+static bool mx_log_segment_number(const char *name, uint32_t *number)
 {
-    const char *p;
-    int hash = 0;
-
-    mx_name = mxEffectiveName(mx_name);
-
-    for (p = mx_name; *p != '\0'; p++) {
-        hash += *p * 307;
-    }
+    char suffix[5];
 
-    return MIN_PORT + (hash % (MAX_PORT - MIN_PORT + 1));
+    return sscanf(name, "%8u.%4s", number, suffix) == 2 &&
+           strcmp(suffix, "log") == 0;
 }
 
 /*
- * Return the mx_host to use if <mx_host> was given to mxClient() or mxMaster().
- * If it is a valid name (i.e. not NULL) use it. Otherwise use the environment
- * variable MX_HOST if it is set. Otherwise simply use "localhost".
+ * Write the index entry for the current block of recorder <rec>, if it has one.
  */
-const char *mxEffectiveHost(const char *mx_host)
+static void mx_recorder_flush_block(MX_Recorder *rec)
 {
-    if (mx_host != NULL)
-        return mx_host;
-    else if ((mx_host = getenv("MX_HOST")) != NULL)
-        return mx_host;
-    else
-        return "localhost";
+    if (rec->block_count == 0) return;
+
+    fwrite(&rec->block, sizeof(rec->block), 1, rec->index);
+
+    rec->block_count = 0;
 }
 
 /*
- * Scan the options given by <argc> and <argv> and extract the argument given
- * with the <short_name> or <long_name> option. If found, the argument is
- * returned through <argument> and the option and associated argument are
- * removed from the option list. If not, <argument> is set to NULL and <argc>
- * and <argv> are unchanged.
- *
- * If the given option is present but it has no argument, -1 is returned and an
- * error message can be retrieved through mxError(). Otherwise 0 is returned.
- *
- * <short_name> and <long_name> should be given without the leading "-" or "--".
- *
- * The following formats are allowed:
- *
- *      -N Bla
- *      -NBla
- *      --mx-name Bla
- *      --mx-name=Bla
+ * Ask the kernel to start writing out the part of the current segment of <rec>
+ * that we haven't handed to it yet. This doesn't wait for it to do so.
  */
-int mxOption(char short_name, const char *long_name, int *argc, char *argv[], char **argument)
+static void mx_recorder_sync(MX_Recorder *rec)
 {
-    int i, new_argc = 1;
-
-    int len_long_name = strlen(long_name);
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t from = rec->synced & ~(page - 1);
 
-    char * const not_found = (char *) -1;
+    if (rec->used > from) {
+        msync(rec->map + from, rec->used - from, MS_ASYNC);
+    }
 
-    char *full_short_name = malloc(3);
-    char *full_long_name = malloc(len_long_name + 3);
+    rec->synced = rec->used;
 
-    sprintf(full_short_name, "-%c", short_name);
-    sprintf(full_long_name, "--%s", long_name);
+    fflush(rec->index);
+}
 
-    int len_full_short_name = 2;
-    int len_full_long_name = len_long_name + 2;
+/*
+ * Finish the current segment of recorder <rec>, cutting it back to the size
+ * that was actually used.
+ */
+static void mx_recorder_close_segment(MX_Recorder *rec)
+{
+    if (rec->map == NULL) return;
 
-    for (i = 1; i < *argc; i++) {
-        char *my_arg = not_found;
+    mx_recorder_flush_block(rec);
+    mx_recorder_sync(rec);
 
-        if (strcmp(argv[i], full_short_name) == 0) {
-            my_arg = argv[++i];
-        }
-        else if (strncmp(argv[i], full_short_name, len_full_short_name) == 0) {
-            my_arg = argv[i] + len_full_short_name;
-        }
-        else if (strcmp(argv[i], full_long_name) == 0) {
-            my_arg = argv[++i];
-        }
-        else if (strncmp(argv[i], full_long_name, len_full_long_name) == 0 &&
-                 argv[i][len_full_long_name] == '=') {
-            my_arg = argv[i] + len_full_long_name + 1;
-        }
+    munmap(rec->map, rec->map_size);
 
-        if (my_arg == not_found) {
-            argv[new_argc++] = argv[i];
-        }
-        else if (my_arg == NULL || my_arg[0] == '-') {
-            mx_error("Missing argument for option %s.\n", argv[i-1]);
-            return -1;
-        }
-        else {
-            *argument = my_arg;
-        }
+    if (ftruncate(rec->fd, rec->used) != 0) {
+        mx_error("couldn't truncate log segment %u (%s).\n",
+                rec->number, strerror(errno));
     }
 
-    *argc = new_argc;
+    close(rec->fd);
+    fclose(rec->index);
 
-    return 0;
+    rec->map = NULL;
+    rec->index = NULL;
 }
 
 /*
- * Create and return an MX struct that will act as a client, connecting to the
- * Message Exchange with name <mx_name> running on host <mx_host>. We will
- * introduce ourselves as <my_name>.
- *
- * If <mx_host> is NULL, the environment variable MX_HOST is used. If that
- * doesn't exist, "localhost" is used.
- * If <mx_name> is NULL, the environment variable MX_NAME is used. If that
- * doesn't exist, the environment variable USER is used. If that doesn't exist
- * either, the function fails and NULL is returned.
- * If <my_name> is NULL, the function fails and returns NULL.
- *
- * When this function finishes successfully, a listen port has been opened
- * for other components to connect to. No other connections have been made, and
- * no communication threads have been started yet (use mx_begin() for this).
+ * Start a new segment for recorder <rec>, with room for at least <need> bytes
+ * of records. The segment is allocated on disk in full and mapped into memory,
+ * so that adding records to it is just a memcpy. Returns -1 on errors or 0 on
+ * success.
  */
-static MX *mx_create_client(const char *mx_host, const char *mx_name, const char *my_name)
+static int mx_recorder_open_segment(MX_Recorder *rec, size_t need)
 {
-    uint16_t mx_port;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = rec->segment_size;
+    char *path;
+    int r;
 
-    if (my_name == NULL) {
-        mx_error("<my_name> can not be NULL in call to mx_create_client (%s).\n",
-                strerror(EINVAL));
-        return NULL;
+    MX_LogHeader *header;
+
+    mx_recorder_close_segment(rec);
+
+    if (size < sizeof(MX_LogHeader) + need) {
+        size = sizeof(MX_LogHeader) + need;
     }
 
-    mx_host = mxEffectiveHost(mx_host);
-    mx_name = mxEffectiveName(mx_name);
-    mx_port = mxEffectivePort(mx_name);
+    size = (size + page - 1) & ~(page - 1);
 
-    if (mx_name == NULL) {
-        mx_error("couldn't determine MX name.\n");
-        return NULL;
+    rec->number++;
+
+    asprintf(&path, "%s/%08u.log", rec->path, rec->number);
+
+    rec->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (rec->fd == -1) {
+        mx_error("couldn't create \"%s\" (%s).\n", path, strerror(errno));
+        free(path);
+        return -1;
     }
 
-    MX *mx = calloc(1, sizeof(*mx));
+    /* Not every file system supports posix_fallocate, so fall back on a
+     * sparse file if we have to. */
 
-    if ((mx->listen_fd = tcpListen(NULL, 0)) == -1) {
-        mx_error("couldn't open a listen socket (%s).\n", strerror(errno));
-        free(mx);
-        return NULL;
+    if ((r = posix_fallocate(rec->fd, 0, size)) != 0 && ftruncate(rec->fd, size) != 0) {
+        mx_error("couldn't allocate \"%s\" (%s).\n", path, strerror(r));
+        close(rec->fd);
+        free(path);
+        return -1;
     }
 
-    if ((mx->master = mx_create_component(mx)) == NULL) {
-        mx_error("couldn't create master component for \"%s\".\n", mx_name);
-        free(mx);
-        return NULL;
+    rec->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, rec->fd, 0);
+
+    if (rec->map == MAP_FAILED) {
+        mx_error("couldn't map \"%s\" (%s).\n", path, strerror(errno));
+        rec->map = NULL;
+        close(rec->fd);
+        free(path);
+        return -1;
     }
 
-    if ((mx->me = mx_create_component(mx)) == NULL) {
-        mx_error("couldn't create own component for \"%s\".\n", mx_name);
-        mx_destroy_component(mx, mx->master);
-        free(mx);
-        return NULL;
+    free(path);
+
+    madvise(rec->map, size, MADV_SEQUENTIAL);
+
+    asprintf(&path, "%s/%08u.idx", rec->path, rec->number);
+
+    if ((rec->index = fopen(path, "w")) == NULL) {
+        mx_error("couldn't create \"%s\" (%s).\n", path, strerror(errno));
+        munmap(rec->map, size);
+        rec->map = NULL;
+        close(rec->fd);
+        free(path);
+        return -1;
     }
 
-    mx_init_queue(&mx->timer_queue);
+    free(path);
 
-    mx->master->host = strdup(mx_host);
-    mx->master->port = mx_port;
+    rec->map_size = size;
+    rec->used     = sizeof(MX_LogHeader);
+    rec->synced   = 0;
 
-    mx->me->name = strdup(my_name);
-    mx->me->port = netLocalPort(mx->listen_fd),
+    header = (MX_LogHeader *) rec->map;
 
-    mx->mx_name = strdup(mx_name);
+    memcpy(header->magic, MX_LOG_MAGIC, sizeof(header->magic));
+    header->number = rec->number;
+    header->start  = mxNow();
 
-    return mx;
+    /* Every segment names the components and message types it uses, so
+     * that it can be read without the ones before it. */
+
+    memset(rec->comp_seen, 0, sizeof(rec->comp_seen));
+    memset(rec->type_seen, 0, rec->type_seen_size);
+
+    return 0;
 }
 
 /*
- * Create and return an MX struct that will act as a master for the Message
- * Exchange with name <mx_name>, running on the local host and using the name
- * <my_name>.
- *
- * If <mx_name> is NULL, the environment variable MX_NAME is used. If that
- * doesn't exist, the environment variable USER is used. If that doesn't exist
- * either, the function fails and NULL is returned.
- * If <my_name> is NULL, "master" is used.
- *
- * When this function finishes successfully, a listen port has been opened
- * for other components to connect to. No other connections have been made, and
- * no communication threads have been started yet (use mx_begin() for this).
+ * Add a record of kind <kind> to the current segment of recorder <rec>, which
+ * must have room for it.
  */
-static MX *mx_create_master(const char *mx_name, const char *my_name)
+static void mx_recorder_append(MX_Recorder *rec, MX_LogKind kind,
+        uint16_t sender, uint32_t type, uint32_t version, double t,
+        const char *payload, uint32_t size)
 {
-    uint16_t mx_port;
+    MX_LogRecord *record = (MX_LogRecord *) (rec->map + rec->used);
 
-    if (my_name == NULL) {
-        my_name = "master";
-    }
+    record->kind    = kind;
+    record->sender  = sender;
+    record->type    = type;
+    record->version = version;
+    record->size    = size;
+    record->t       = t;
 
-    mx_name = mxEffectiveName(mx_name);
-    mx_port = mxEffectivePort(mx_name);
+    memcpy(record + 1, payload, size);
 
-    if (mx_name == NULL) {
-        mx_error("couldn't determine MX name.\n");
-        return NULL;
+    if (rec->block_count == 0) {
+        rec->block.t      = t;
+        rec->block.offset = rec->used;
+        rec->block.types  = 0;
     }
 
-    MX *mx = calloc(1, sizeof(*mx));
-
-    if ((mx->listen_fd = tcpListen(NULL, mx_port)) == -1) {
-        mx_error("couldn't open listen socket on port %d (%s)\n",
-                mx_port, strerror(errno));
-        free(mx);
-        return NULL;
+    if (kind != MX_LOG_COMPONENT) {
+        rec->block.types |= (uint64_t) 1 << (type % 64);
     }
 
-    if ((mx->me = mx->master = mx_create_component(mx)) == NULL) {
-        mx_error("couldn't create own component for \"%s\".\n", mx_name);
-        close(mx->listen_fd);
-        free(mx);
-        return NULL;
+    if (++rec->block_count == MX_LOG_INDEX_BLOCK) {
+        mx_recorder_flush_block(rec);
     }
 
-    mx->me->host = strdup("localhost");
-    mx->me->name = strdup(my_name);
-    mx->me->port = mx_port;
-    mx->me->id   = 0;
-
-    mx->mx_name = strdup(mx_name);
-
-    return mx;
+    rec->used += mx_log_record_size(size);
 }
 
 /*
- * Begin running the threads that listen for connection and timer events.
+ * Called when a message arrives that recorder <udata> is subscribed to. Adds it
+ * to the log, preceded by the names of its sender and type if this segment
+ * doesn't have them yet.
  */
-static int mx_begin(MX *mx)
+static void mx_recorder_handle_message(MX *mx, int fd,
+        uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
 {
-    mx_create_message(mx, MX_MT_QUIT_REQUEST, "QuitRequest");
-    mx_create_message(mx, MX_MT_HELLO_REQUEST, "HelloRequest");
-    mx_create_message(mx, MX_MT_HELLO_REPLY, "HelloReply");
-    mx_create_message(mx, MX_MT_HELLO_REPORT, "HelloReport");
-    mx_create_message(mx, MX_MT_HELLO_UPDATE, "HelloUpdate");
-    mx_create_message(mx, MX_MT_REGISTER_REQUEST, "RegisterRequest");
-    mx_create_message(mx, MX_MT_REGISTER_REPORT, "RegisterReport");
-    mx_create_message(mx, MX_MT_REGISTER_REPLY, "RegisterReply");
-    mx_create_message(mx, MX_MT_SUBSCRIBE_UPDATE, "SubscribeUpdate");
-    mx_create_message(mx, MX_MT_CANCEL_UPDATE, "CancelUpdate");
+    MX_Recorder *rec = udata;
+    MX_Component *comp;
 
-    mx_create_event_pipe(mx);
+    double t = mxNow();
 
-    mx_start_timer_thread(mx);
-    mx_start_listener_thread(mx);
+    uint16_t id;
+    const char *comp_name, *msg_name;
 
-    if (mx->me == mx->master) {     /* Running as master */
-        mx_subscribe(mx, MX_MT_QUIT_REQUEST, mx_handle_quit_request, NULL);
-        mx_subscribe(mx, MX_MT_HELLO_REQUEST, mx_handle_hello_request, NULL);
-        mx_subscribe(mx, MX_MT_REGISTER_REQUEST, mx_handle_register_request, NULL);
-        mx_subscribe(mx, MX_MT_SUBSCRIBE_UPDATE, mx_handle_subscribe_update, NULL);
-        mx_subscribe(mx, MX_MT_CANCEL_UPDATE, mx_handle_cancel_update, NULL);
-    }
-    else {                          /* Running as client */
-        int r;
-        uint32_t reply_version, reply_size;
-        char *reply_payload;
+    bool comp_seen, type_seen;
+    size_t need;
 
-        if ((mx->master->fd = tcpConnect(mx->master->host, mx->master->port)) < 0) {
-            mx_error("couldn't connect to master for \"%s\" at %s:%d (%s).\n",
-                    mx->mx_name, mx->master->host, mx->master->port, strerror(errno));
-            return -1;
-        }
+    /* With dispatch workers, messages of different types may come in
+     * simultaneously. */
 
-        paSet(&mx->components, mx->master->fd, mx->master);
+    mx_lock(mx);
 
-        mx_start_reader_thread(mx, mx->master);
-        mx_start_writer_thread(mx, mx->master);
+    comp = paGet(&mx->components, fd);
 
-        r = mx_pack_and_wait(mx->master, 5,
-                MX_MT_HELLO_REPLY, &reply_version, &reply_payload, &reply_size,
-                MX_MT_HELLO_REQUEST, 0,
-                PACK_STRING,    mx->me->name,
-                PACK_INT16,     mx->me->port,
-                END);
+    id = comp ? comp->id : 0;
+    comp_name = comp ? comp->name : "";
+    msg_name = mxMessageName(mx, type);
 
-        if (r != 0) {
-            mx_error("%s while waiting for HelloReply.\n",
-                    r == 1 ? "timeout" : "error");
-            return -1;
-        }
+    if (msg_name == NULL) msg_name = "";
 
-        strunpack(reply_payload, reply_size,
-                PACK_STRING, &mx->master->name,
-                PACK_INT16,  &mx->me->id,
-                PACK_STRING, &mx->me->name,
-                END);
+    if (type / 8 >= rec->type_seen_size) {
+        uint32_t new_size = type / 8 + 64;
 
-        free(reply_payload);
+        rec->type_seen = realloc(rec->type_seen, new_size);
 
-        mx_subscribe(mx, MX_MT_HELLO_REPORT, mx_handle_hello_report, NULL);
-        mx_subscribe(mx, MX_MT_HELLO_UPDATE, mx_handle_hello_update, NULL);
-        mx_subscribe(mx, MX_MT_REGISTER_REPORT, mx_handle_register_report, NULL);
-        mx_subscribe(mx, MX_MT_SUBSCRIBE_UPDATE, mx_handle_subscribe_update, NULL);
-        mx_subscribe(mx, MX_MT_CANCEL_UPDATE, mx_handle_cancel_update, NULL);
-    }
+        memset(rec->type_seen + rec->type_seen_size, 0,
+                new_size - rec->type_seen_size);
 
-    return 0;
-}
+        rec->type_seen_size = new_size;
+    }
 
-/*
- * Create and return an MX struct that will act as a master for the Message
- * Exchange with name <mx_name>, running on the local host.
- *
- * If <mx_name> is NULL, the environment variable MX_NAME is used instead. If
- * that doesn't exist, the environment variable USER is used. If that doesn't
- * exist either, the function fails and NULL is returned. If <my_name> is NULL,
- * "master" is used.
- *
- * If <background> is true, the master component will be put into the background
- * after the listen port for this master component has been opened. This means
- * that any additional components started after the master (in a shell script,
- * for instance) will find a listen port waiting for them.
- *
- * This "backgrounding" is done using a fork() system call, which means that any
- * threads started before calling this function (if any) will not survive. So if
- * you want to background the master component and also start additional
- * threads, do the latter *after* calling this function.
- */
-MX *mxMaster(const char *mx_name, const char *my_name, bool background)
-{
-    int r;
-    pid_t pid;
+    while (true) {
+        comp_seen = rec->comp_seen[id / 8] & (1 << (id % 8));
+        type_seen = rec->type_seen[type / 8] & (1 << (type % 8));
 
-    MX *mx = mx_create_master(mx_name, my_name);
+        need = mx_log_record_size(size);
 
-    if (mx == NULL) {
-        mx_error("couldn't create mx (%s).\n", strerror(errno));
-        return NULL;
+        if (!comp_seen) need += mx_log_record_size(strlen(comp_name));
+        if (!type_seen) need += mx_log_record_size(strlen(msg_name));
+
+        if (rec->map != NULL && rec->used + need <= rec->map_size) break;
+
+        need = mx_log_record_size(size) +
+               mx_log_record_size(strlen(comp_name)) +
+               mx_log_record_size(strlen(msg_name));
+
+        if (mx_recorder_open_segment(rec, need) != 0) {
+            mx_unlock(mx);
+            free(payload);
+            return;
+        }
     }
-    else if (background && (pid = fork()) == -1) {
-        mx_error("fork() failed (%s).\n", strerror(errno));
 
-        mxShutdown(mx);
-        mxDestroy(mx);
+    if (!comp_seen) {
+        mx_recorder_append(rec, MX_LOG_COMPONENT, id, 0, 0, t,
+                comp_name, strlen(comp_name));
 
-        return NULL;
+        rec->comp_seen[id / 8] |= (1 << (id % 8));
     }
-    else if (background && pid != 0) {
-        exit(0);
+
+    if (!type_seen) {
+        mx_recorder_append(rec, MX_LOG_NAME, 0, type, 0, t,
+                msg_name, strlen(msg_name));
+
+        rec->type_seen[type / 8] |= (1 << (type % 8));
     }
-    else if ((r = mx_begin(mx)) != 0) {
-        mxShutdown(mx);
-        mxDestroy(mx);
 
-        return NULL;
+    mx_recorder_append(rec, MX_LOG_MESSAGE, id, type, version, t, payload, size);
+
+    free(payload);
+
+    rec->count++;
+
+    if (rec->used - rec->synced >= MX_LOG_SYNC_SIZE) {
+        mx_recorder_sync(rec);
     }
 
-    return mx;
+    mx_unlock(mx);
 }
 
 /*
- * Create and return an MX struct that will act as a client for the Message
- * Exchange with name <mx_name>, running on <mx_host>.
- *
- * If <mx_host> is NULL, the environment variable MX_HOST is used. If that
- * doesn't exist, "localhost" is used.
- * If <mx_name> is NULL, the environment variable MX_NAME is used. If that
- * doesn't exist, the environment variable USER is used. If that doesn't exist
- * either, the function fails and NULL is returned.
- * If <my_name> is NULL, the function fails and returns NULL.
- *
- * When this function finishes successfully, a listen port has been opened for
- * other components to connect to, and the necessary background threads will
- * also be started.
+ * Create a recorder that writes the messages that <mx> receives to a message
+ * log in directory <path>, which is created if it doesn't exist yet. If it
+ * already contains a log, new segments are added to it. The log consists of
+ * segments of <segment_size> bytes (64 MB if it is 0). Use
+ * mxRecord() and mxRecordPattern() to say which messages to record. Returns
+ * NULL on errors. Check mxError() in that case.
  */
-MX *mxClient(const char *mx_host, const char *mx_name, const char *my_name)
+MX_Recorder *mxCreateRecorder(MX *mx, const char *path, size_t segment_size)
 {
-    int r;
+    MX_Recorder *rec;
+    DIR *dir;
+    struct dirent *entry;
 
-    MX *mx = mx_create_client(mx_host, mx_name, my_name);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        mx_error("mxCreateRecorder: couldn't create \"%s\" (%s).\n",
+                path, strerror(errno));
+        return NULL;
+    }
 
-    if (mx == NULL) {
-        mx_error("couldn't create mx (%s).\n", strerror(errno));
+    rec = calloc(1, sizeof(*rec));
 
-        return NULL;
+    rec->mx = mx;
+    rec->path = strdup(path);
+    rec->segment_size = segment_size ? segment_size : MX_LOG_SEGMENT_SIZE;
+    rec->fd = -1;
+
+    /* If there already is a log here, we add to it. */
+
+    if ((dir = opendir(path)) != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            uint32_t number;
+
+            if (mx_log_segment_number(entry->d_name, &number) &&
+                number > rec->number) {
+                rec->number = number;
+            }
+        }
+
+        closedir(dir);
     }
-    else if ((r = mx_begin(mx)) != 0) {
-        mxShutdown(mx);
-        mxDestroy(mx);
 
+    if (mx_recorder_open_segment(rec, 0) != 0) {
+        free(rec->path);
+        free(rec);
         return NULL;
     }
 
-    return mx;
+    return rec;
 }
 
 /*
- * Return the file descriptor on which all events associated with <mx> arrive.
+ * Record all messages of type <type> using recorder <rec>. This subscribes to
+ * <type>, so <rec>'s MX can't have its own subscription to it. Returns <0 on
+ * errors, >0 on notices and 0 otherwise. Check mxError() when return value is
+ * not 0.
  */
-int mxConnectionNumber(MX *mx)
+int mxRecord(MX_Recorder *rec, uint32_t type)
 {
-    return mx->event_pipe[RD];
+    int r = mxSubscribe(rec->mx, type, mx_recorder_handle_message, rec);
+
+    if (r == 0) {
+        bufAdd(&rec->types, &type, sizeof(type));
+    }
+
+    return r;
 }
 
 /*
- * Process any pending events associated with <mx>. Returns -1 if an error
- * occurred, 1 if event processing has finished normally and 0 if no more events
- * are forthcoming (so there's no sense in waiting for them anymore).
+ * Record all messages whose name matches <pattern> (see mxSubscribePattern())
+ * using recorder <rec>. Returns <0 on errors, >0 on notices and 0 otherwise.
+ * Check mxError() when return value is not 0.
  */
-int mxProcessEvents(MX *mx)
+int mxRecordPattern(MX_Recorder *rec, const char *pattern)
 {
-    MX_Event *evt;
-
-    int r;
+    int r = mxSubscribePattern(rec->mx, pattern, mx_recorder_handle_message, rec);
 
-    while (1) {
-        if (mx->shutting_down) {
-            return 0;
-        }
-
-        r = read(mx->event_pipe[RD], &evt, sizeof(evt));
-
-        if (r == 0) {
-            return mx_severity == MX_ERROR ? -1 : 0;
-        }
-        else if (r < 0) {
-            if (errno == EAGAIN) {
-                return 1;
-            }
-            else {
-                mx_notice("read returned %d (%s)\n", r, strerror(errno));
-                return -1;
-            }
-        }
+    if (r == 0) {
+        paSet(&rec->patterns, paCount(&rec->patterns), strdup(pattern));
+    }
 
-        switch(evt->evt_type) {
-        case MX_ET_CONN:
-            mx_handle_connect(mx, evt->u.conn.fd);
-            break;
-        case MX_ET_DISC:
-            mx_handle_disconnect(mx, evt->u.disc.fd, evt->u.disc.whence);
-            break;
-        case MX_ET_MSG:
-            mx_handle_message(mx, evt->u.msg.fd,
-                    evt->u.msg.msg_type, evt->u.msg.version,
-                    evt->u.msg.payload, evt->u.msg.size);
-            break;
-        case MX_ET_TIMER:
-            evt->u.timer.handler(mx,
-                    evt->u.timer.timer, evt->u.timer.t, evt->u.timer.udata);
-            break;
-        case MX_ET_ERR:
-            mx_notice("error event: %s (%d) in %s.\n",
-                    strerror(evt->u.err.error), evt->u.err.error,
-                    evt->u.err.whence);
-            free(evt->u.err.whence);
-            break;
-        default:
-            mx_notice("unexpected event type (%d)\n", evt->evt_type);
-            break;
-        }
+    return r;
+}
 
-        free(evt);
-    }
+/*
+ * Return the number of messages recorded by <rec>.
+ */
+uint64_t mxRecordCount(const MX_Recorder *rec)
+{
+    return rec->count;
 }
 
 /*
- * Loop while listening for and handling events. Returns -1 if an error occurred
- * or 0 if mxShutdown was called.
+ * Stop recording, and finish and close the log that <rec> was writing.
  */
-int mxRun(MX *mx)
+void mxDestroyRecorder(MX_Recorder *rec)
 {
-    struct pollfd poll_fd = { mx->event_pipe[RD], POLLIN, 0 };
+    int i;
 
-    while (1) {
-        int r = poll(&poll_fd, 1, -1);
+    const uint32_t *type = (const uint32_t *) bufGet(&rec->types);
 
-        if (r < 0) {
-            mx_error("poll() failed: %s\n", strerror(errno));
+    for (i = 0; i < bufLen(&rec->types) / sizeof(uint32_t); i++) {
+        mxCancel(rec->mx, type[i]);
+    }
 
-            return r;
-        }
+    for (i = 0; i < paCount(&rec->patterns); i++) {
+        char *pattern = paGet(&rec->patterns, i);
 
-        r = mxProcessEvents(mx);
+        mxCancelPattern(rec->mx, pattern);
 
-        if (r != 1) return(r);
+        free(pattern);
     }
+
+    mx_recorder_close_segment(rec);
+
+    bufClear(&rec->types);
+    paClear(&rec->patterns);
+
+    free(rec->type_seen);
+    free(rec->path);
+    free(rec);
 }
 
 /*
- * Return the name of the local component.
+ * Compare two log segments by their number.
  */
-const char *mxMyName(const MX *mx)
+static int mx_log_compare_segments(const void *p1, const void *p2)
 {
-    return mx->me->name;
+    const MX_LogSegment *s1 = p1;
+    const MX_LogSegment *s2 = p2;
+
+    return s1->number < s2->number ? -1 : s1->number > s2->number ? 1 : 0;
 }
 
 /*
- * Return the ID of the local component.
+ * Map segment <seg> of the log in directory <path> into memory, and read its
+ * index. Returns -1 on errors or 0 on success.
  */
-uint16_t mxMyID(const MX *mx)
+static int mx_log_open_segment(const char *path, MX_LogSegment *seg)
 {
-    return mx->me->id;
+    char *seg_path;
+    struct stat st;
+    int fd;
+    FILE *fp;
+
+    asprintf(&seg_path, "%s/%08u.log", path, seg->number);
+
+    if ((fd = open(seg_path, O_RDONLY)) == -1 || fstat(fd, &st) != 0) {
+        mx_error("couldn't open \"%s\" (%s).\n", seg_path, strerror(errno));
+        if (fd != -1) close(fd);
+        free(seg_path);
+        return -1;
+    }
+
+    seg->size = st.st_size;
+
+    if (seg->size < sizeof(MX_LogHeader) ||
+        (seg->map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+        memcmp(seg->map, MX_LOG_MAGIC, strlen(MX_LOG_MAGIC)) != 0) {
+        mx_error("\"%s\" is not a message log segment.\n", seg_path);
+        if (seg->size >= sizeof(MX_LogHeader) && seg->map != MAP_FAILED) {
+            munmap(seg->map, seg->size);
+        }
+        seg->map = NULL;
+        close(fd);
+        free(seg_path);
+        return -1;
+    }
+
+    close(fd);
+    free(seg_path);
+
+    seg->start = ((MX_LogHeader *) seg->map)->start;
+
+    /* A missing index only makes seeking slower. */
+
+    asprintf(&seg_path, "%s/%08u.idx", path, seg->number);
+
+    if ((fp = fopen(seg_path, "r")) != NULL) {
+        MX_LogIndexEntry entry;
+
+        while (fread(&entry, sizeof(entry), 1, fp) == 1) {
+            seg->index = realloc(seg->index,
+                    (seg->index_count + 1) * sizeof(MX_LogIndexEntry));
+            seg->index[seg->index_count++] = entry;
+        }
+
+        fclose(fp);
+    }
+
+    free(seg_path);
+
+    return 0;
 }
 
 /*
- * Return the current MX name.
+ * Return the record at <offset> in segment <seg>, or NULL if there are no more
+ * records in it.
  */
-const char *mxName(const MX *mx)
+static const MX_LogRecord *mx_log_record(const MX_LogSegment *seg, size_t offset)
 {
-    return mx->mx_name;
+    const MX_LogRecord *record = (const MX_LogRecord *) (seg->map + offset);
+
+    if (offset + sizeof(MX_LogRecord) > seg->size ||
+        record->kind == MX_LOG_END ||
+        offset + mx_log_record_size(record->size) > seg->size) {
+        return NULL;
+    }
+
+    return record;
 }
 
 /*
- * Return the current MX host, i.e. the host where the master component is
- * running.
+ * Process <record> in <log> if it is a component or message name.
  */
-const char *mxHost(const MX *mx)
+static void mx_log_handle_name(MX_Log *log, const MX_LogRecord *record)
 {
-    return mx->master->host;
+    PointerArray *names;
+    int index;
+
+    if (record->kind == MX_LOG_COMPONENT) {
+        names = &log->components;
+        index = record->sender;
+    }
+    else if (record->kind == MX_LOG_NAME) {
+        names = &log->messages;
+        index = record->type;
+    }
+    else {
+        return;
+    }
+
+    free(paGet(names, index));
+
+    paSet(names, index, strndup((const char *) (record + 1), record->size));
+
+    if (record->kind == MX_LOG_NAME && log->filter != NULL &&
+        strcmp(log->filter, paGet(names, index)) == 0) {
+        log->filter_type = record->type;
+        log->filter_known = true;
+    }
 }
 
 /*
- * Return the current MX port, i.e. the port on which the master listens.
+ * Pick up the names in the current segment of <log> up to the current offset.
+ * We need this if we arrived there by seeking or skipping.
  */
-uint16_t mxPort(const MX *mx)
+static void mx_log_scan_names(MX_Log *log)
 {
-    return mx->master->port;
+    const MX_LogSegment *seg = &log->segment[log->current];
+    const MX_LogRecord *record;
+
+    size_t offset = sizeof(MX_LogHeader);
+
+    while (offset < log->offset && (record = mx_log_record(seg, offset)) != NULL) {
+        mx_log_handle_name(log, record);
+
+        offset += mx_log_record_size(record->size);
+    }
 }
 
 /*
- * Register the message named <msg_name>. Returns the associated message type
- * id.
+ * Open the message log in directory <path>, as written by an MX_Recorder, and
+ * position it at the first message. Returns NULL on errors. Check mxError() in
+ * that case.
  */
-uint32_t mxRegister(MX *mx, const char *msg_name)
+MX_Log *mxOpenLog(const char *path)
 {
-    MX_Message *msg;
+    DIR *dir;
+    struct dirent *entry;
+    MX_Log *log;
+    int i;
 
-    if (msg_name != NULL &&
-        (msg = hashGet(&mx->message_by_name, HASH_STRING(msg_name))) != NULL) {
-        return msg->msg_type;
+    if ((dir = opendir(path)) == NULL) {
+        mx_error("mxOpenLog: couldn't open \"%s\" (%s).\n", path, strerror(errno));
+        return NULL;
     }
-    else if (mx->me == mx->master) {
-        msg = mx_create_message(mx, mx->next_message_type, msg_name);
 
-        mx_broadcast_new_message(mx, msg, NULL);
+    log = calloc(1, sizeof(*log));
 
-        return msg->msg_type;
+    while ((entry = readdir(dir)) != NULL) {
+        uint32_t number;
+
+        if (!mx_log_segment_number(entry->d_name, &number)) continue;
+
+        log->segment = realloc(log->segment,
+                (log->count + 1) * sizeof(MX_LogSegment));
+
+        memset(&log->segment[log->count], 0, sizeof(MX_LogSegment));
+
+        log->segment[log->count++].number = number;
     }
-    else {
-        int r;
-        char *reply_payload = NULL;
-        uint32_t reply_size, reply_version, msg_type;
 
-        r = mx_pack_and_wait(mx->master, 5,
-                MX_MT_REGISTER_REPLY, &reply_version,
-                &reply_payload, &reply_size,
-                MX_MT_REGISTER_REQUEST, 0,
-                PACK_STRING, msg_name ? msg_name : "",
-                END);
+    closedir(dir);
 
-        if (r != 0) {
-            mx_error("%s while waiting for RegisterReply.\n",
-                    r == 1 ? "timeout" : "error");
-            mxShutdown(mx);
-            return 0;
+    qsort(log->segment, log->count, sizeof(MX_LogSegment), mx_log_compare_segments);
+
+    for (i = 0; i < log->count; i++) {
+        if (mx_log_open_segment(path, &log->segment[i]) != 0) {
+            log->count = i;
+            mxCloseLog(log);
+            return NULL;
         }
-        else {
-            strunpack(reply_payload, reply_size,
-                    PACK_INT32, &msg_type,
-                    END);
+    }
 
-            free(reply_payload);
+    log->offset = sizeof(MX_LogHeader);
+
+    return log;
+}
+
+/*
+ * Position <log> at the first message that was received at or after time <t>.
+ * Returns 0 if there is such a message, or 1 if there isn't (in which case the
+ * next call to mxReadLog() will return 1).
+ */
+int mxSeekLog(MX_Log *log, double t)
+{
+    int seg_index = 0;
+    size_t lo, hi;
+
+    const MX_LogSegment *seg;
+    const MX_LogRecord *record;
+
+    /* Find the last segment that was started before <t>... */
+
+    while (seg_index + 1 < log->count && log->segment[seg_index + 1].start <= t) {
+        seg_index++;
+    }
+
+    log->current = seg_index;
+    log->offset = sizeof(MX_LogHeader);
+
+    if (seg_index == log->count) return 1;
+
+    seg = &log->segment[seg_index];
+
+    /* ... then the last block in it that was started before <t>... */
+
+    lo = 0;
+    hi = seg->index_count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (seg->index[mid].t <= t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo > 0) {
+        log->offset = seg->index[lo - 1].offset;
+    }
+
+    /* ... and then the first message in or after that block from <t>. */
 
-            msg = hashGet(&mx->message_by_type, HASH_VALUE(msg_type));
+    while (log->current < log->count) {
+        seg = &log->segment[log->current];
 
-            if (msg == NULL) {
-                msg = mx_create_message(mx, msg_type, msg_name);
-            }
-            else if (msg_name != NULL) {
-                msg->msg_name = strdup(msg_name);
+        while ((record = mx_log_record(seg, log->offset)) != NULL) {
+            if (record->kind == MX_LOG_MESSAGE && record->t >= t) return 0;
 
-                hashAdd(&mx->message_by_name, msg, HASH_STRING(msg_name));
-            }
+            mx_log_handle_name(log, record);
 
-            return msg->msg_type;
+            log->offset += mx_log_record_size(record->size);
         }
-    }
-}
 
-/*
- * Returns the name of message type <type>.
- */
-const char *mxMessageName(MX *mx, uint32_t type)
-{
-    MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+        log->current++;
+        log->offset = sizeof(MX_LogHeader);
+    }
 
-    return msg == NULL ? NULL : msg->msg_name;
+    return 1;
 }
 
 /*
- * Returns the name of the component connected on fd <fd>.
+ * If we're reading one type of message from <log> and, according to the index,
+ * the block that its current offset is in doesn't contain that type, skip to
+ * the first block that does. The last block is never skipped, because we don't
+ * know where it ends.
  */
-const char *mxComponentName(MX *mx, int fd)
+static void mx_log_skip_blocks(MX_Log *log)
 {
-    MX_Component *comp = paGet(&mx->components, fd);
+    const MX_LogSegment *seg = &log->segment[log->current];
+    uint64_t bit = (uint64_t) 1 << (log->filter_type % 64);
+    size_t lo = 0, hi = seg->index_count;
 
-    if (comp == NULL)
-        return NULL;
-    else
-        return comp->name;
-}
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
 
-/*
- * Subscribe to messages of type <type>. <handler> will be called for all
- * incoming messages of this type, passing in the same <udata> that is passed in
- * to this function. Returns <0 on errors, >0 on notices and 0 otherwise. Check
- * mxError() when return value is not 0.
- */
-int mxSubscribe(MX *mx, uint32_t type,
-        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
-            char *payload, uint32_t size, void *udata),
-        void *udata)
-{
-    if (type < NUM_MX_MESSAGES) {
-        mx_error("Illegal message type %d in mxSubscribe.\n", type);
-        return -1;
+        if (seg->index[mid].offset <= log->offset)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    else {
-        return mx_subscribe(mx, type, handler, udata);
+
+    /* The block we're in is now at lo - 1. */
+
+    while (lo > 0 && lo < seg->index_count && (seg->index[lo - 1].types & bit) == 0) {
+        log->offset = seg->index[lo++].offset;
     }
 }
 
 /*
- * Cancel our subscription to messages of type <type> that calls <handler>.
- * Returns <0 on errors, >0 on notices and 0 otherwise. Check mxError() when
- * return value is not 0.
+ * Read the next message from <log> into <entry>. If <name> is not NULL only
+ * messages with that name are returned. The pointers in <entry> remain valid
+ * until <log> is closed. Returns 0 if a message was read, or 1 if there are no
+ * more messages.
  */
-int mxCancel(MX *mx, uint32_t type)
+int mxReadLog(MX_Log *log, const char *name, MX_LogEntry *entry)
 {
-    if (type < NUM_MX_MESSAGES) {
-        mx_error("Illegal message type %d in mxCancel.\n", type);
-        return -1;
+    const MX_LogSegment *seg;
+    const MX_LogRecord *record;
+
+    if (name == NULL) {
+        free(log->filter);
+        log->filter = NULL;
     }
-    else {
-        return mx_cancel(mx, type);
+    else if (log->filter == NULL || strcmp(log->filter, name) != 0) {
+        int type;
+
+        free(log->filter);
+        log->filter = strdup(name);
+        log->filter_known = false;
+
+        for (type = 0; type < paCount(&log->messages); type++) {
+            const char *msg_name = paGet(&log->messages, type);
+
+            if (msg_name != NULL && strcmp(msg_name, name) == 0) {
+                log->filter_type = type;
+                log->filter_known = true;
+                break;
+            }
+        }
     }
-}
 
-/*
- * Call <handler> for new subscribers to message type <type>, passing in the
- * same <udata> that was passed in here.
- */
-void mxOnNewSubscriber(MX *mx, uint32_t type,
-        void (*handler)(MX *mx, int fd, uint32_t type, void *udata),
-        void *udata)
-{
-    MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+    while (log->current < log->count) {
+        seg = &log->segment[log->current];
 
-    if (msg == NULL) {
-        msg = mx_create_message(mx, type, NULL);
+        if (log->filter_known) {
+            mx_log_skip_blocks(log);
+        }
+
+        if ((record = mx_log_record(seg, log->offset)) == NULL) {
+            log->current++;
+            log->offset = sizeof(MX_LogHeader);
+
+            continue;
+        }
+
+        log->offset += mx_log_record_size(record->size);
+
+        if (record->kind != MX_LOG_MESSAGE) {
+            mx_log_handle_name(log, record);
+            continue;
+        }
+
+        /* If we skipped over the names this message needs, go back for them. */
+
+        if (paGet(&log->messages, record->type) == NULL ||
+            paGet(&log->components, record->sender) == NULL) {
+            mx_log_scan_names(log);
+        }
+
+        if (log->filter != NULL) {
+            const char *msg_name = paGet(&log->messages, record->type);
+
+            if (msg_name == NULL || strcmp(msg_name, log->filter) != 0) continue;
+        }
+
+        entry->t       = record->t;
+        entry->sender  = paGet(&log->components, record->sender);
+        entry->name    = paGet(&log->messages, record->type);
+        entry->type    = record->type;
+        entry->version = record->version;
+        entry->payload = (const char *) (record + 1);
+        entry->size    = record->size;
+
+        if (entry->sender == NULL) entry->sender = "";
+        if (entry->name == NULL) entry->name = "";
+
+        return 0;
     }
 
-    msg->on_new_sub_callback = handler;
-    msg->on_new_sub_udata = udata;
+    return 1;
 }
 
 /*
- * Call <handler> when a subscriber cancels their subscription to messages of
- * type <type>.
+ * Close <log>.
  */
-void mxOnEndSubscriber(MX *mx, uint32_t type,
-        void (*handler)(MX *mx, int fd, uint32_t type, void *udata),
-        void *udata)
+void mxCloseLog(MX_Log *log)
 {
-    MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+    int i;
 
-    if (msg == NULL) {
-        msg = mx_create_message(mx, type, NULL);
+    for (i = 0; i < log->count; i++) {
+        munmap(log->segment[i].map, log->segment[i].size);
+        free(log->segment[i].index);
     }
 
-    msg->on_end_sub_callback = handler;
-    msg->on_end_sub_udata = udata;
+    for (i = 0; i < paCount(&log->components); i++) {
+        free(paGet(&log->components, i));
+    }
+
+    for (i = 0; i < paCount(&log->messages); i++) {
+        free(paGet(&log->messages, i));
+    }
+
+    paClear(&log->components);
+    paClear(&log->messages);
+
+    free(log->segment);
+    free(log->filter);
+    free(log);
 }
 
 /*
- * Call <handler> when a new component reports in. <handler> is called with the
- * file descriptor through which we're connected to the new component in <fd>,
- * and its name in <name>.
+ * Create a layout for messages with the fields given by PACK_* type <type> and
+ * the types in <ap>, terminated by END.
  */
-void mxOnNewComponent(MX *mx,
-        void (*handler)(MX *mx, int fd, const char *name, void *udata),
-        void *udata)
+static MX_Layout *mx_create_layout(int type, va_list ap)
 {
-    int fd;
+    int i, count = 0;
+    MX_Layout *layout;
+    va_list aq;
 
-    mx->on_new_comp_callback = handler;
-    mx->on_new_comp_udata = udata;
+    va_copy(aq, ap);
 
-    for (fd = 0; fd < paCount(&mx->components); fd++) {
-        MX_Component *comp = paGet(&mx->components, fd);
+    for (i = type; i != END; i = va_arg(aq, int)) {
+        count++;
+    }
 
-        if (comp == NULL || comp->name == NULL) continue;
+    va_end(aq);
 
-        handler(mx, fd, comp->name, udata);
+    layout = calloc(1, sizeof(*layout) + count * sizeof(layout->type[0]));
+
+    layout->count = count;
+    layout->fixed = true;
+
+    for (i = 0; i < count; i++, type = va_arg(ap, int)) {
+        layout->type[i] = type;
+
+        switch(type) {
+        case PACK_INT8:
+            layout->fixed_size += 1;
+            break;
+        case PACK_INT16:
+            layout->fixed_size += 2;
+            break;
+        case PACK_INT32:
+        case PACK_FLOAT:
+            layout->fixed_size += 4;
+            break;
+        case PACK_INT64:
+        case PACK_DOUBLE:
+            layout->fixed_size += 8;
+            break;
+        case PACK_STRING:
+        case PACK_DATA:
+        case PACK_RAW:
+            layout->fixed = false;
+            break;
+        default:
+            mx_error("Unknown field type %d in layout.\n", type);
+            free(layout);
+            return NULL;
+        }
     }
+
+    return layout;
 }
 
 /*
- * Call <handler> when connection with a component is lost. <handler> is called
- * with the file descriptor through which we were connected to the new component
- * in <fd>, and its name in <name>.
+ * Create a layout for messages with the fields given by the PACK_* types that
+ * follow, terminated by END. The layout can be used with mxSendWithLayout and
+ * mxBroadcastWithLayout to pack messages with those fields without parsing the
+ * field types again every time. Returns NULL if one of the types is unknown.
  */
-void mxOnEndComponent(MX *mx,
-        void (*handler)(MX *mx, int fd, const char *name, void *udata),
-        void *udata)
+MX_Layout *mxCreateLayout(int type, ...)
 {
-    mx->on_end_comp_callback = handler;
-    mx->on_end_comp_udata = udata;
+    va_list ap;
+    MX_Layout *layout;
+
+    va_start(ap, type);
+    layout = mx_create_layout(type, ap);
+    va_end(ap);
+
+    return layout;
 }
 
 /*
- * Call <handler> when a new message type is registered.
+ * Create a layout for messages with the fields given by the PACK_* types in
+ * <ap>, terminated by END.
  */
-void mxOnNewMessage(MX *mx,
-        void (*handler)(MX *mx, uint32_t type, const char *name, void *udata),
-        void *udata)
+MX_Layout *mxVaCreateLayout(va_list ap)
 {
-    uint32_t type = 0;
-
-    mx->on_register_callback = handler;
-    mx->on_register_udata = udata;
+    int type = va_arg(ap, int);
 
-    for (type = NUM_MX_MESSAGES; type < mx->next_message_type; type++) {
-        MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+    return mx_create_layout(type, ap);
+}
 
-        handler(mx, msg->msg_type, msg->msg_name, udata);
-    }
+/*
+ * Destroy layout <layout>.
+ */
+void mxDestroyLayout(MX_Layout *layout)
+{
+    free(layout);
 }
 
 /*
- * Send a message of type <type> to file descriptor <fd>.
+ * Send a message of type <type> to file descriptor <fd>. This function may be
+ * called from any thread, but at most 64 threads can be sending at the same
+ * time; any more wait until one of them is done.
  */
 void mxSend(MX *mx, int fd, uint32_t type, uint32_t version, const void *payload, uint32_t size)
 {
-    MX_Component *comp = paGet(&mx->components, fd);
+    MX_EpochSlot *slot = mx_enter(mx);
+
+    MX_Component *comp = mx_lookup_component(mx, fd);
 
-    mx_send(comp, type, version, payload, size);
+    if (comp != NULL) {
+        mx_publish(mx, comp, type, version, payload, size);
+    }
+
+    mx_leave(slot);
 }
 
 /*
@@ -2436,28 +7823,102 @@ void mxPackAndSend(MX *mx, int fd, uint32_t type, uint32_t version, ...)
  */
 void mxVaPackAndSend(MX *mx, int fd, uint32_t type, uint32_t version, va_list ap)
 {
-    char *payload;
+    mxVaSendWithLayout(mx, fd, type, version, NULL, ap);
+}
 
-    int size = vastrpack(&payload, ap);
+/*
+ * Write a message of type <type> with version <version> to file descriptor <fd>
+ * over message exchange <mx>. The payload of the message consists of the fields
+ * in <layout>, with the values that follow. These are the same values that
+ * would follow each PACK_* type in mxPackAndSend, without the types themselves
+ * (so the size after a PACK_DATA pointer is a uint32_t, and the size after a
+ * PACK_RAW pointer is a size_t). The message is packed directly into the buffer
+ * that will be sent, without any intermediate copies. This function may be
+ * called from any thread.
+ */
+void mxSendWithLayout(MX *mx, int fd, uint32_t type, uint32_t version,
+        const MX_Layout *layout, ...)
+{
+    va_list ap;
 
-    mxSend(mx, fd, type, version, payload, size);
+    va_start(ap, layout);
+    mxVaSendWithLayout(mx, fd, type, version, layout, ap);
+    va_end(ap);
+}
 
-    free(payload);
+/*
+ * Write a message of type <type> with version <version> to file descriptor <fd>
+ * over message exchange <mx>. The payload of the message consists of the fields
+ * in <layout>, with the values in <ap>.
+ */
+void mxVaSendWithLayout(MX *mx, int fd, uint32_t type, uint32_t version,
+        const MX_Layout *layout, va_list ap)
+{
+    MX_EpochSlot *slot = mx_enter(mx);
+
+    MX_Component *comp = mx_lookup_component(mx, fd);
+
+    if (comp != NULL) {
+        mx_publish_command(mx, comp,
+                mx_create_packed_write_command(type, version, layout, ap));
+    }
+
+    mx_leave(slot);
 }
 
 /*
  * Broadcast a message with type <type>, version <version> and payload <payload>
- * with size <size> to all subscribers of this message type.
+ * with size <size> to all subscribers of this message type. This function may
+ * be called from any thread, but at most 64 threads can be sending at the same
+ * time; any more wait until one of them is done.
  */
 void mxBroadcast(MX *mx, uint32_t type, uint32_t version, const void *payload, uint32_t size)
 {
-    MX_Subscription *sub;
-    MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+    int i;
+    bool cached, locked;
+    MX_Fanout *fanout;
 
-    for (sub = mlHead(&msg->subscriptions); sub;
-         sub = mlNext(&msg->subscriptions, sub)) {
-        mx_send(sub->comp, type, version, payload, size);
+    MX_EpochSlot *slot = mx_enter(mx);
+
+    MX_Message *msg = mx_lookup_message(mx, type);
+
+    if (msg == NULL) {
+        mx_leave(slot);
+        return;
     }
+
+    /* For a cached message type, hold the cache lock until the value is in the
+     * cache, so that a new subscriber (see mx_send_cached_values) gets it
+     * exactly once. Waking up a dormant subscriber on this thread takes the
+     * main lock, which must be taken before the cache lock. */
+
+    cached = msg->cached;
+    locked = cached && mx_may_wake(mx);
+
+    if (locked) mx_lock(mx);
+
+    if (cached) pthread_mutex_lock(&msg->cache_lock);
+
+    fanout = __atomic_load_n(&msg->fanout, __ATOMIC_SEQ_CST);
+
+    for (i = 0; fanout != NULL && i < fanout->count; i++) {
+        MX_Subscriber *sub = fanout->sub + i;
+
+        if (sub->filter && !mx_filter_matches(sub->filter, payload, size)) {
+            continue;
+        }
+
+        mx_publish(mx, sub->comp, type, version, payload, size);
+    }
+
+    if (cached) {
+        mx_cache_value(msg, version, payload, size);
+        pthread_mutex_unlock(&msg->cache_lock);
+    }
+
+    if (locked) mx_unlock(mx);
+
+    mx_leave(slot);
 }
 
 /*
@@ -2481,19 +7942,53 @@ void mxPackAndBroadcast(MX *mx, uint32_t type, uint32_t version, ...)
  */
 void mxVaPackAndBroadcast(MX *mx, uint32_t type, uint32_t version, va_list ap)
 {
-    MX_Subscription *sub;
-    char *payload;
+    mxVaBroadcastWithLayout(mx, type, version, NULL, ap);
+}
 
-    MX_Message *msg = hashGet(&mx->message_by_type, HASH_VALUE(type));
+/*
+ * Broadcast a message with type <type> and version <version> to all subscribers
+ * of this message type. The payload of the message consists of the fields in
+ * <layout>, with the values that follow, as for mxSendWithLayout. This function
+ * may be called from any thread.
+ */
+void mxBroadcastWithLayout(MX *mx, uint32_t type, uint32_t version,
+        const MX_Layout *layout, ...)
+{
+    va_list ap;
 
-    int size = vastrpack(&payload, ap);
+    va_start(ap, layout);
+    mxVaBroadcastWithLayout(mx, type, version, layout, ap);
+    va_end(ap);
+}
 
-    for (sub = mlHead(&msg->subscriptions); sub;
-         sub = mlNext(&msg->subscriptions, sub)) {
-        mx_send(sub->comp, type, version, payload, size);
+/*
+ * Broadcast a message with type <type> and version <version> to all subscribers
+ * of this message type. The payload of the message consists of the fields in
+ * <layout>, with the values in <ap>.
+ */
+void mxVaBroadcastWithLayout(MX *mx, uint32_t type, uint32_t version,
+        const MX_Layout *layout, va_list ap)
+{
+    char local[1024], *payload = local;
+
+    /* Every subscriber gets its own copy anyway, so pack small messages on the
+     * stack instead of allocating a buffer for them. */
+
+    size_t size = mx_pack_fields(NULL, layout, ap);
+
+    dbgAssert(stderr, size <= MAX_PAYLOAD_SIZE, "payload too large.\n");
+
+    if (size > sizeof(local)) {
+        payload = malloc(size);
     }
 
-    free(payload);
+    mx_pack_fields(payload, layout, ap);
+
+    mxBroadcast(mx, type, version, payload, size);
+
+    if (payload != local) {
+        free(payload);
+    }
 }
 
 /*
@@ -2625,6 +8120,9 @@ int mxSendAndWait(MX *mx, int fd, double timeout,
                 strerror(EINVAL));
         return -1;
     }
+    else if (mx_wake_if_dormant(mx, comp) != 0) {
+        return -1;
+    }
 
     return mx_send_and_wait(comp, timeout,
             reply_type, reply_version,
@@ -2700,12 +8198,30 @@ double mxNow(void)
 void mxShutdown(MX *mx)
 {
     int fd;
+    MX_Peer *peer;
+
+    /* A dispatch worker leaves this to the main thread. */
+
+    if (mx_worker_mx == mx) {
+        mx_send_pointer(mx->dispatcher->wake_fd, mx_new_event(MX_ET_SHUTDOWN));
+        return;
+    }
+
+    mx_lock(mx);
 
     /* Stop the timer_thread. */
 
     mx_stop_timer_thread(mx);
     mx_stop_listener_thread(mx);
 
+    /* Forget about peers we haven't started connecting to yet. */
+
+    while ((peer = listRemoveHead(&mx->peer_backlog)) != NULL) {
+        free(peer->name);
+        free(peer->host);
+        free(peer);
+    }
+
     /* Stop reader and writer threads for all components. */
 
     for (fd = 0; fd < paCount(&mx->components); fd++) {
@@ -2713,14 +8229,27 @@ void mxShutdown(MX *mx)
 
         if (comp == NULL) continue;
 
+        /* If we're still connecting to it, finish that first so that any
+         * messages we've queued for it still get written. */
+
+        if (comp->connecting && mx_finish_connect(comp->fd) == 0) {
+            mx_start_writer_thread(mx, comp);
+            mx_stop_writer_thread(mx, comp);
+        }
+
         paDrop(&mx->components, fd); /* Remove it from the administration. */
+        mx_publish_components(mx);
 
         mx_destroy_component(mx, comp);
     }
 
+    mx_stop_dispatcher(mx);
+
     mx->shutting_down = 1;
 
     close(mx->event_pipe[WR]);
+
+    mx_unlock(mx);
 }
 
 /*
@@ -2734,6 +8263,8 @@ void mxDestroy(MX *mx)
 
     mxShutdown(mx);
 
+    mx_destroy_dispatcher(mx);
+
     /* Destroy all messages. */
 
     for (type = 0; type < mx->next_message_type; type++) {
@@ -2749,10 +8280,29 @@ void mxDestroy(MX *mx)
         }
 
         mx_destroy_message_subscriptions(msg);
+        mx_clear_cache(msg);
+
+        pthread_mutex_destroy(&msg->cache_lock);
 
+        free(msg->fanout);
+        free(msg->latency);
         free(msg);
     }
 
+    /* Nobody is publishing anymore, so everything retired can go. */
+
+    mx_reclaim(mx, true);
+
+    free(mx->component_table);
+    free(mx->message_table);
+
+    /* Destroy my pattern subscriptions and the pattern trie. */
+
+    mx_destroy_component_patterns(mx->me);
+    mx_free_pattern_nodes(mx->patterns.child);
+
+    mx_free_thread_counters(mx->me->queued);
+
     close(mx->listen_fd);
 
     free(mx->mx_name);
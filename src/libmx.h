@@ -18,11 +18,122 @@ extern "C" {
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #define MAX_PAYLOAD_SIZE UINT32_MAX
 
 typedef struct MX MX;
 typedef struct MX_Timer MX_Timer;
+typedef struct MX_Layout MX_Layout;
+
+/*
+ * The tests that a subscription filter can do on a payload field.
+ */
+typedef enum {
+    MX_FILTER_EQUALS,                   // Field equals values[0].
+    MX_FILTER_RANGE,                    // values[0] <= field <= values[1].
+    MX_FILTER_SET                       // Field equals one of the values.
+} MX_FilterTest;
+
+/*
+ * A subscription filter. It selects messages on an unsigned, big-endian integer
+ * field (as written by PACK_INT8 ... PACK_INT64) of <width> bytes at <offset> in
+ * the payload. Messages that are too short to contain the field never match.
+ */
+typedef struct {
+    uint32_t offset;                    // Offset of the field in the payload.
+    uint32_t width;                     // Width of the field: 1, 2, 4 or 8.
+    MX_FilterTest test;                 // Test to do on the field.
+    uint32_t count;                     // Number of values.
+    const uint64_t *values;             // Values to test against.
+} MX_Filter;
+
+/*
+ * The stages in the life of a message for which latency is measured.
+ */
+typedef enum {
+    MX_STAGE_QUEUE,                     // From mxSend() etc. until written.
+    MX_STAGE_NETWORK,                   // From written until read.
+    MX_STAGE_DISPATCH,                  // From read until the handler is called.
+    MX_STAGE_HANDLER,                   // Time spent in the handler.
+    NUM_MX_STAGES
+} MX_Stage;
+
+/*
+ * Latency percentiles for one message type and stage, in seconds.
+ */
+typedef struct {
+    uint64_t count;                     // Number of messages measured.
+    double p50;                         // Median.
+    double p99;                         // 99th percentile.
+    double p999;                        // 99.9th percentile.
+    double max;                         // Maximum.
+} MX_Latency;
+
+/*
+ * The kinds of threads that an MX component runs (see mxSetAffinity and
+ * mxSetScheduling).
+ */
+typedef enum {
+    MX_THREAD_MAIN,                     // Calls mxRun() or mxProcessEvents().
+    MX_THREAD_READER,                   // Reads from a connection.
+    MX_THREAD_WRITER,                   // Writes to a connection.
+    MX_THREAD_TIMER,                    // Waits for timers.
+    MX_THREAD_LISTENER,                 // Accepts new connections.
+    MX_THREAD_DISPATCH,                 // Dispatch worker.
+    NUM_MX_THREADS
+} MX_Thread;
+
+/*
+ * How dispatch workers divide incoming messages among themselves (see
+ * mxSetDispatchThreads). Messages with the same key are handled in the order
+ * in which they arrived.
+ */
+typedef enum {
+    MX_DISPATCH_BY_TYPE,                // Key is the message type.
+    MX_DISPATCH_BY_SENDER               // Key is the sender and message type.
+} MX_DispatchKey;
+
+/*
+ * Traffic statistics for one message type on one connection.
+ */
+typedef struct {
+    int fd;                             // Connection to the other component.
+    uint32_t type;                      // Message type.
+    uint64_t sent_msgs;                 // Messages written to it.
+    uint64_t sent_bytes;                // Payload bytes written to it.
+    uint64_t send_drops;                // Messages for it that were never written.
+    uint64_t recv_msgs;                 // Messages received from it.
+    uint64_t recv_bytes;                // Payload bytes received from it.
+    uint64_t recv_drops;                // Messages from it that had no handler.
+    uint64_t queued;                    // Messages waiting to be written now.
+} MX_StatsEntry;
+
+/*
+ * A set of traffic statistics, as returned by mxGetStats().
+ */
+typedef struct {
+    double t;                           // Time at which they were taken.
+    double interval;                    // Length of the period they cover.
+    int count;                          // Number of entries.
+    MX_StatsEntry *entry;               // The entries, sorted on fd and type.
+} MX_Stats;
+
+typedef struct MX_Recorder MX_Recorder;
+typedef struct MX_Log MX_Log;
+
+/*
+ * A message read from a message log by mxReadLog().
+ */
+typedef struct {
+    double t;                           // Time at which it was received.
+    const char *sender;                 // Name of the component that sent it.
+    const char *name;                   // Name of its message type.
+    uint32_t type;                      // Its message type in the recording MX.
+    uint32_t version;                   // Its message version.
+    const char *payload;                // Its payload...
+    uint32_t size;                      // ... and the size of that payload.
+} MX_LogEntry;
 
 /*
  * Return the mx_name to use if <mx_name> was given to mxClient() or mxMaster().
@@ -182,6 +293,57 @@ int mxSubscribe(MX *mx, uint32_t type,
  */
 int mxCancel(MX *mx, uint32_t type);
 
+/*
+ * Subscribe to messages of type <type>, but only to those that pass <filter>.
+ * Publishers evaluate the filter, so messages that don't pass it are never sent
+ * to us. Otherwise the same as mxSubscribe. <filter> is copied, so it need not
+ * remain valid after this call.
+ */
+int mxSubscribeFiltered(MX *mx, uint32_t type, const MX_Filter *filter,
+        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata),
+        void *udata);
+
+/*
+ * Subscribe to all messages whose name matches <pattern>, including message
+ * types that are registered later. <pattern> is either a full message name or a
+ * prefix followed by "*" (so "Quote.*" matches "Quote.EURUSD"). <handler> and
+ * <udata> are used as in mxSubscribe. Message types that we're already
+ * subscribed to keep their existing subscription. Returns <0 on errors, >0 on
+ * notices and 0 otherwise. Check mxError() when return value is not 0.
+ */
+int mxSubscribePattern(MX *mx, const char *pattern,
+        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata),
+        void *udata);
+
+/*
+ * Cancel our subscription to <pattern>, and to all message types that we were
+ * subscribed to only because of it. Returns <0 on errors, >0 on notices and 0
+ * otherwise. Check mxError() when return value is not 0.
+ */
+int mxCancelPattern(MX *mx, const char *pattern);
+
+/*
+ * Subscribe to messages of the <count> message types in <types>, calling
+ * <handler> with <udata> for each of them. This is the same as calling
+ * mxSubscribe for each type, except that other components are told about all of
+ * them in a single message. Returns <0 on errors, >0 on notices and 0 otherwise.
+ * Check mxError() when return value is not 0.
+ */
+int mxSubscribeMany(MX *mx, const uint32_t *types, int count,
+        void (*handler)(MX *mx, int fd, uint32_t type, uint32_t version,
+            char *payload, uint32_t size, void *udata),
+        void *udata);
+
+/*
+ * Cancel our subscriptions to the <count> message types in <types>. This is the
+ * same as calling mxCancel for each type, except that other components are told
+ * about all of them in a single message. Returns <0 on errors, >0 on notices and
+ * 0 otherwise. Check mxError() when return value is not 0.
+ */
+int mxCancelMany(MX *mx, const uint32_t *types, int count);
+
 /*
  * Call <handler> for new subscribers to message type <type>, passing in the
  * same <udata> that was passed in here.
@@ -198,6 +360,22 @@ void mxOnEndSubscriber(MX *mx, uint32_t type,
         void (*handler)(MX *mx, int fd, uint32_t type, void *udata),
         void *udata);
 
+/*
+ * Keep the last value of message type <type> that we broadcast, and send it to
+ * every new subscriber to <type> as soon as it subscribes. If <key_width> is
+ * not 0, keep the last value for every value of the unsigned, big-endian
+ * integer field of <key_width> bytes (1, 2, 4 or 8) at <key_offset> in the
+ * payload, and send all of them. Returns <0 on errors, >0 on notices and 0
+ * otherwise. Check mxError() when return value is not 0.
+ */
+int mxSetCache(MX *mx, uint32_t type, uint32_t key_offset, uint32_t key_width);
+
+/*
+ * Stop caching values of message type <type>, and drop the ones that were
+ * cached.
+ */
+void mxClearCache(MX *mx, uint32_t type);
+
 /*
  * Call <handler> when a new component reports in. <handler> is called with the
  * file descriptor through which we're connected to the new component in <fd>,
@@ -224,7 +402,249 @@ void mxOnNewMessage(MX *mx,
         void *udata);
 
 /*
- * Send a message of type <type> to file descriptor <fd>.
+ * Call <handler> once we're connected to all components that were already
+ * present when we joined, so that from then on broadcasts reach every
+ * subscriber. If that is already the case, <handler> is called immediately.
+ */
+void mxOnReady(MX *mx,
+        void (*handler)(MX *mx, void *udata),
+        void *udata);
+
+/*
+ * Call <handler> each time mxProcessEvents (or mxRun, which calls it) has
+ * handled all events that were pending, just before it goes back to waiting
+ * for new ones. Message handlers can use this to collect messages and deal
+ * with them in batches.
+ */
+void mxOnEventsProcessed(MX *mx,
+        void (*handler)(MX *mx, void *udata),
+        void *udata);
+
+/*
+ * Set the maximum number of connections to other components that are set up
+ * simultaneously while joining the message exchange to <limit>. The default is
+ * 32.
+ */
+void mxSetConnectLimit(MX *mx, int limit);
+
+/*
+ * Put the message exchange in lazy mode if <lazy> is true. Only a master can do
+ * this, and it must be done before any other components have joined. In lazy
+ * mode, components only connect to each other when they have something to send,
+ * and close those connections again once they have been idle for a while (see
+ * mxSetIdleTimeout). The master keeps everyone informed of all subscriptions.
+ */
+void mxSetLazy(MX *mx, bool lazy);
+
+/*
+ * Close connections to other components in lazy mode after they have been idle
+ * for <timeout> seconds. The default is 60 seconds. If <timeout> is 0,
+ * connections are never closed.
+ */
+void mxSetIdleTimeout(MX *mx, double timeout);
+
+/*
+ * Put <mx> in busy-poll mode: after handling an event, mxRun() keeps checking
+ * for new ones for <spin> seconds before it goes to sleep, and reader and
+ * writer threads do the same for incoming data and outgoing messages. This
+ * trades CPU time for latency. If <spin> is 0, busy-polling is switched off.
+ */
+void mxSetBusyPoll(MX *mx, double spin);
+
+/*
+ * Call message handlers on a pool of <threads> worker threads instead of on the
+ * thread that calls mxRun() or mxProcessEvents(). Messages are divided among
+ * the workers by <key>: messages with the same key are handled one at a time
+ * and in order, while those with different keys may be handled in parallel.
+ * Timers, system messages and the callbacks for new and ended components,
+ * subscribers and messages stay on the main thread.
+ *
+ * Handlers that run on a worker may call mxSend(), mxBroadcast() and their
+ * Pack variants, mxMessageName(), mxComponentName() and mxShutdown(). Anything
+ * else that changes the message exchange, like subscribing or registering
+ * messages, must be done on the main thread. Handlers for different keys must
+ * protect any data they share themselves.
+ *
+ * Call this function once, before mxRun() or mxProcessEvents(). If <threads>
+ * is 0 nothing changes. Returns <0 on errors and 0 otherwise. Check mxError()
+ * when return value is not 0.
+ */
+int mxSetDispatchThreads(MX *mx, int threads, MX_DispatchKey key);
+
+/*
+ * Run all threads of kind <thread> on the CPUs in <cpus>, both the ones that
+ * exist now and the ones started later. <cpus> is a comma-separated list of
+ * CPU numbers, ranges of CPU numbers like "2-5", and NUMA nodes like "node1"
+ * (meaning all CPUs on that node). If <cpus> is NULL the threads may run on
+ * any CPU. The initial placement can also be set using the MX_AFFINITY
+ * environment variable, e.g. "main=0 reader=2-3 writer=2-3 timer=1". Returns
+ * <0 on errors and 0 otherwise. Check mxError() when return value is not 0.
+ */
+int mxSetAffinity(MX *mx, MX_Thread thread, const char *cpus);
+
+/*
+ * Run all threads of kind <thread> with scheduling policy <policy> (one of the
+ * SCHED_* constants from <sched.h>) and static priority <priority>, both the
+ * ones that exist now and the ones started later. Real-time policies usually
+ * require special privileges. The initial scheduling can also be set using the
+ * MX_SCHEDULING environment variable, e.g. "reader=fifo:50 timer=rr:10", where
+ * the policy is one of "other", "batch", "idle", "fifo" and "rr". Returns <0
+ * on errors and 0 otherwise. Check mxError() when return value is not 0.
+ */
+int mxSetScheduling(MX *mx, MX_Thread thread, int policy, int priority);
+
+/*
+ * Return traffic statistics for <mx>, with an entry for every connection and
+ * message type that has seen any traffic. If <delta> is true, the counts are
+ * those since the previous call to this function, otherwise they're totals since
+ * <mx> was created. The queue depth is always the current one. The returned
+ * struct must be freed using mxFreeStats().
+ */
+MX_Stats *mxGetStats(MX *mx, bool delta);
+
+/*
+ * Free <stats>, as returned by mxGetStats().
+ */
+void mxFreeStats(MX_Stats *stats);
+
+/*
+ * Call <handler> with the traffic totals of every other component, which they
+ * send us once a second from now on. <handler> is called with the file
+ * descriptor of the reporting component in <fd>, and its totals in <stats> (see
+ * mxGetStats()), which must be freed using mxFreeStats(). The fd of an entry is
+ * that of our own connection to the component at the other end, or -1 if we
+ * don't have one (which includes when it is us). If <handler> is NULL, the
+ * reports are stopped again.
+ */
+void mxOnStatsReport(MX *mx,
+        void (*handler)(MX *mx, int fd, MX_Stats *stats, void *udata),
+        void *udata);
+
+/*
+ * Add timestamps to messages sent by <mx> if <enable> is true, so that their
+ * receivers can measure their latency (see mxGetLatency()). This adds 16 bytes
+ * to every message.
+ */
+void mxSetTimestamps(MX *mx, bool enable);
+
+/*
+ * Get latency percentiles for the timestamped messages of type <type> that <mx>
+ * has received and handled, for stage <stage>, into <latency>. The network
+ * stage is only meaningful if the clocks of sender and receiver are in sync.
+ * Returns <0 on errors, >0 on notices and 0 otherwise. Check mxError() when
+ * return value is not 0.
+ */
+int mxGetLatency(MX *mx, uint32_t type, MX_Stage stage, MX_Latency *latency);
+
+/*
+ * Start recording trace events in every thread, in a ring of <events> events
+ * per thread (rounded up to a power of two, or 16384 if it is 0). Threads that
+ * are already recording keep the ring they have. Use mxTraceDump() to write the
+ * events out. Returns <0 on errors, >0 on notices and 0 otherwise. Check
+ * mxError() when return value is not 0.
+ */
+int mxTraceStart(uint32_t events);
+
+/*
+ * Stop recording trace events.
+ */
+void mxTraceStop(void);
+
+/*
+ * Write the trace events recorded since the last call to mxTraceStart() to
+ * <path>, in the Chrome trace event format (which Perfetto can also read), with
+ * one event per line. Only the last events that fit in its ring are available
+ * for each thread. Call mxTraceStop() first to get a consistent snapshot.
+ * Returns <0 on errors, >0 on notices and 0 otherwise. Check mxError() when
+ * return value is not 0.
+ */
+int mxTraceDump(const char *path);
+
+/*
+ * Create a recorder that writes the messages that <mx> receives to a message
+ * log in directory <path>, which is created if it doesn't exist yet. If it
+ * already contains a log, new segments are added to it. The log consists of
+ * segments of <segment_size> bytes (64 MB if it is 0). Use
+ * mxRecord() and mxRecordPattern() to say which messages to record. Returns
+ * NULL on errors. Check mxError() in that case.
+ */
+MX_Recorder *mxCreateRecorder(MX *mx, const char *path, size_t segment_size);
+
+/*
+ * Record all messages of type <type> using recorder <rec>. This subscribes to
+ * <type>, so <rec>'s MX can't have its own subscription to it. Returns <0 on
+ * errors, >0 on notices and 0 otherwise. Check mxError() when return value is
+ * not 0.
+ */
+int mxRecord(MX_Recorder *rec, uint32_t type);
+
+/*
+ * Record all messages whose name matches <pattern> (see mxSubscribePattern())
+ * using recorder <rec>. Returns <0 on errors, >0 on notices and 0 otherwise.
+ * Check mxError() when return value is not 0.
+ */
+int mxRecordPattern(MX_Recorder *rec, const char *pattern);
+
+/*
+ * Return the number of messages recorded by <rec>.
+ */
+uint64_t mxRecordCount(const MX_Recorder *rec);
+
+/*
+ * Stop recording, and finish and close the log that <rec> was writing.
+ */
+void mxDestroyRecorder(MX_Recorder *rec);
+
+/*
+ * Open the message log in directory <path>, as written by an MX_Recorder, and
+ * position it at the first message. Returns NULL on errors. Check mxError() in
+ * that case.
+ */
+MX_Log *mxOpenLog(const char *path);
+
+/*
+ * Position <log> at the first message that was received at or after time <t>.
+ * Returns 0 if there is such a message, or 1 if there isn't (in which case the
+ * next call to mxReadLog() will return 1).
+ */
+int mxSeekLog(MX_Log *log, double t);
+
+/*
+ * Read the next message from <log> into <entry>. If <name> is not NULL only
+ * messages with that name are returned. The pointers in <entry> remain valid
+ * until <log> is closed. Returns 0 if a message was read, or 1 if there are no
+ * more messages.
+ */
+int mxReadLog(MX_Log *log, const char *name, MX_LogEntry *entry);
+
+/*
+ * Close <log>.
+ */
+void mxCloseLog(MX_Log *log);
+
+/*
+ * Create a layout for messages with the fields given by the PACK_* types that
+ * follow, terminated by END. The layout can be used with mxSendWithLayout and
+ * mxBroadcastWithLayout to pack messages with those fields without parsing the
+ * field types again every time. Returns NULL if one of the types is unknown.
+ */
+MX_Layout *mxCreateLayout(int type, ...);
+
+/*
+ * Create a layout for messages with the fields given by the PACK_* types in
+ * <ap>, terminated by END.
+ */
+MX_Layout *mxVaCreateLayout(va_list ap);
+
+/*
+ * Destroy layout <layout>.
+ */
+void mxDestroyLayout(MX_Layout *layout);
+
+/*
+ * Send a message of type <type> to file descriptor <fd>. This function may be
+ * called from any thread, but at most 64 threads can be sending at the same
+ * time; any more wait until one of them is done.
  */
 void mxSend(MX *mx, int fd, uint32_t type, uint32_t version, const void *payload, uint32_t size);
 
@@ -242,9 +662,32 @@ void mxPackAndSend(MX *mx, int fd, uint32_t type, uint32_t version, ...);
  */
 void mxVaPackAndSend(MX *mx, int fd, uint32_t type, uint32_t version, va_list ap);
 
+/*
+ * Write a message of type <type> with version <version> to file descriptor <fd>
+ * over message exchange <mx>. The payload of the message consists of the fields
+ * in <layout>, with the values that follow. These are the same values that
+ * would follow each PACK_* type in mxPackAndSend, without the types themselves
+ * (so the size after a PACK_DATA pointer is a uint32_t, and the size after a
+ * PACK_RAW pointer is a size_t). The message is packed directly into the buffer
+ * that will be sent, without any intermediate copies. This function may be
+ * called from any thread.
+ */
+void mxSendWithLayout(MX *mx, int fd, uint32_t type, uint32_t version,
+        const MX_Layout *layout, ...);
+
+/*
+ * Write a message of type <type> with version <version> to file descriptor <fd>
+ * over message exchange <mx>. The payload of the message consists of the fields
+ * in <layout>, with the values in <ap>.
+ */
+void mxVaSendWithLayout(MX *mx, int fd, uint32_t type, uint32_t version,
+        const MX_Layout *layout, va_list ap);
+
 /*
  * Broadcast a message with type <type>, version <version> and payload <payload>
- * with size <size> to all subscribers of this message type.
+ * with size <size> to all subscribers of this message type. This function may
+ * be called from any thread, but at most 64 threads can be sending at the same
+ * time; any more wait until one of them is done.
  */
 void mxBroadcast(MX *mx, uint32_t type, uint32_t version, const void *payload, uint32_t size);
 
@@ -262,6 +705,23 @@ void mxPackAndBroadcast(MX *mx, uint32_t type, uint32_t version, ...);
  */
 void mxVaPackAndBroadcast(MX *mx, uint32_t type, uint32_t version, va_list ap);
 
+/*
+ * Broadcast a message with type <type> and version <version> to all subscribers
+ * of this message type. The payload of the message consists of the fields in
+ * <layout>, with the values that follow, as for mxSendWithLayout. This function
+ * may be called from any thread.
+ */
+void mxBroadcastWithLayout(MX *mx, uint32_t type, uint32_t version,
+        const MX_Layout *layout, ...);
+
+/*
+ * Broadcast a message with type <type> and version <version> to all subscribers
+ * of this message type. The payload of the message consists of the fields in
+ * <layout>, with the values in <ap>.
+ */
+void mxVaBroadcastWithLayout(MX *mx, uint32_t type, uint32_t version,
+        const MX_Layout *layout, va_list ap);
+
 /*
  * Wait for a message of type <type> to arrive on file descriptor <fd>. If the
  * message arrives within <timeout> seconds, 1 is returned and the version,
@@ -10,11 +10,14 @@
 
 /* Test */
 
+#define _GNU_SOURCE                     /* For cpu_set_t in types.h. */
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <signal.h>
 
 #include <libjvs/options.h>
 #include <libjvs/utils.h>
@@ -33,6 +36,7 @@ static void mx_usage(const char *argv0)
     fprintf(stderr, "Usage: %s <command> [ <options> ]\n\n", argv0);
 
     fprintf(stderr, "Commands:\n");
+    fprintf(stderr, "  bench    Measure throughput, loss and latency\n");
     fprintf(stderr, "  help     Show help\n");
     fprintf(stderr, "  master   Run a master component\n");
     fprintf(stderr, "  name     Print the effective MX name\n");
@@ -40,6 +44,9 @@ static void mx_usage(const char *argv0)
     fprintf(stderr, "  port     Print the effective MX port\n");
     fprintf(stderr, "  list     Show a list of participating components\n");
     fprintf(stderr, "  quit     Ask the master component to exit\n");
+    fprintf(stderr, "  record   Record messages to a message log\n");
+    fprintf(stderr, "  replay   Replay messages from a message log\n");
+    fprintf(stderr, "  top      Show live traffic per component and message\n");
     fprintf(stderr, "  version  Show the current version of MX\n\n");
     fprintf(stderr, "Use \"%s help <command>\" to get help on a specific command.\n", argv0);
 }
@@ -57,6 +64,7 @@ static int mx_master(int argc, char *argv[])
 
     optAdd(options, "mx-name", 'n', ARG_REQUIRED);
     optAdd(options, "background", 'b', ARG_NONE);
+    optAdd(options, "lazy", 'l', ARG_NONE);
 
     if (optParse(options, argc, argv) == -1) return 1;
 
@@ -68,7 +76,10 @@ static int mx_master(int argc, char *argv[])
         fputs(mxError(), stderr);
         return 1;
     }
-    else if ((r = mxRun(mx)) != 0) {
+
+    mxSetLazy(mx, optIsSet(options, "lazy"));
+
+    if ((r = mxRun(mx)) != 0) {
         fprintf(stderr, "mxRun returned %d: %s", r, mxError());
     }
 
@@ -330,95 +341,1575 @@ static int mx_list(const char *argv0, int argc, char *argv[])
 }
 
 /*
- * Execute the "mx help" command.
+ * Default refresh interval for "mx top", and the maximum number of slow
+ * consumers it shows.
  */
-static int mx_help(const char *argv0, int argc, char *argv[])
+#define MX_TOP_INTERVAL 1.0
+#define MX_TOP_SLOW     10
+
+/*
+ * What "mx top" knows about a component: the last two reports it sent.
+ */
+typedef struct {
+    MX_Stats *prev;                     // The report before...
+    MX_Stats *last;                     // ... the last one.
+} MX_TopComponent;
+
+/*
+ * Traffic rates, summed over a number of stats entries.
+ */
+typedef struct {
+    double sent_msgs;                   // Messages sent per second.
+    double sent_bytes;                  // Bytes sent per second.
+    double recv_msgs;                   // Messages received per second.
+    double recv_bytes;                  // Bytes received per second.
+    double drops;                       // Messages dropped per second.
+    double queued;                      // Messages waiting to be written now.
+} MX_TopRates;
+
+/*
+ * A connection with messages waiting to be written.
+ */
+typedef struct {
+    int sender;                         // Component that is sending...
+    int receiver;                       // ... to this one.
+    uint64_t queued;                    // Messages waiting.
+    double growth;                      // Change in messages waiting per second.
+} MX_TopQueue;
+
+/*
+ * State of the "mx top" command.
+ */
+typedef struct {
+    bool all;                           // Also show system messages.
+    bool batch;                         // Don't clear the screen.
+    int iterations;                     // Stop after this many refreshes.
+    double interval;                    // Refresh interval.
+    PointerArray components;            // MX_TopComponents, by fd.
+} MX_Top;
+
+/*
+ * Compare the MX_StatsEntries pointed to by <p1> and <p2> on fd and type.
+ */
+static int mx_top_compare_entries(const void *p1, const void *p2)
 {
-    if (argc == 1) {
-        mx_usage(argv0);
-    }
-    else if (strcmp(argv[1], "master") == 0) {
-        fprintf(stderr,
-                "%s master [ <options> ]\n\tStarts an MX master.\n\n", argv0);
-        fprintf(stderr, "Options:\n");
-        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
-        fprintf(stderr, "\t-b, --background\t\tRun in the background.\n");
-    }
-    else if (strcmp(argv[1], "name") == 0) {
-        fprintf(stderr,
-                "%s name\n\tPrints the effective MX name.\n", argv0);
-    }
-    else if (strcmp(argv[1], "host") == 0) {
-        fprintf(stderr,
-                "%s host\n\tPrints the effective MX host.\n", argv0);
-    }
-    else if (strcmp(argv[1], "port") == 0) {
-        fprintf(stderr,
-                "%s port [ <options> ]\n\tPrints the effective MX port.\n\n", argv0);
-        fprintf(stderr, "Options:\n");
-        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
+    const MX_StatsEntry *e1 = p1;
+    const MX_StatsEntry *e2 = p2;
+
+    if (e1->fd != e2->fd)
+        return e1->fd < e2->fd ? -1 : 1;
+    else if (e1->type != e2->type)
+        return e1->type < e2->type ? -1 : 1;
+    else
+        return 0;
+}
+
+/*
+ * Compare the MX_TopQueues pointed to by <p1> and <p2>, longest queue first.
+ */
+static int mx_top_compare_queues(const void *p1, const void *p2)
+{
+    const MX_TopQueue *q1 = p1;
+    const MX_TopQueue *q2 = p2;
+
+    return q1->queued > q2->queued ? -1 : q1->queued < q2->queued ? 1 : 0;
+}
+
+/*
+ * Handle the stats report <stats> from the component on <fd>.
+ */
+static void mx_top_on_stats_report(MX *mx, int fd, MX_Stats *stats, void *udata)
+{
+    MX_Top *top = udata;
+    MX_TopComponent *comp = paGet(&top->components, fd);
+
+    /* Entries are sorted on the reporter's fds, we want ours. */
+
+    qsort(stats->entry, stats->count, sizeof(MX_StatsEntry),
+            mx_top_compare_entries);
+
+    if (comp == NULL) {
+        comp = calloc(1, sizeof(*comp));
+
+        paSet(&top->components, fd, comp);
     }
-    else if (strcmp(argv[1], "list") == 0) {
-        fprintf(stderr,
-                "%s list [ <options> ]\n\tLists connected components.\n\n", argv0);
-        fprintf(stderr, "Options:\n");
-        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
-        fprintf(stderr, "\t-h, --mx-host <name>\tUse this MX host.\n");
-        fprintf(stderr, "\t-v, --verbose[=<level>]\tVerbosity level:\n");
-        fprintf(stderr, "\t\tlevel 0: only show components (default)\n");
-        fprintf(stderr, "\t\tlevel 1: also show subscriptions\n");
-        fprintf(stderr, "\t\tlevel 2: also show system subscriptions\n");
+
+    if (comp->prev != NULL) mxFreeStats(comp->prev);
+
+    comp->prev = comp->last;
+    comp->last = stats;
+}
+
+/*
+ * Forget about the component on <fd>, which has left.
+ */
+static void mx_top_on_end_component(MX *mx, int fd, const char *name, void *udata)
+{
+    MX_Top *top = udata;
+    MX_TopComponent *comp = paGet(&top->components, fd);
+
+    if (comp == NULL) return;
+
+    if (comp->prev != NULL) mxFreeStats(comp->prev);
+    if (comp->last != NULL) mxFreeStats(comp->last);
+
+    free(comp);
+
+    paDrop(&top->components, fd);
+}
+
+/*
+ * Return the name of the component on <fd>, or "?" if we don't know it.
+ */
+static const char *mx_top_component_name(MX *mx, int fd)
+{
+    const char *name = fd < 0 ? NULL : mxComponentName(mx, fd);
+
+    return name ? name : "?";
+}
+
+/*
+ * Return the entry in the previous report of <comp> that matches <entry>, or
+ * NULL if there is none.
+ */
+static const MX_StatsEntry *mx_top_prev_entry(const MX_TopComponent *comp,
+        const MX_StatsEntry *entry)
+{
+    if (comp->prev == NULL) return NULL;
+
+    return bsearch(entry, comp->prev->entry, comp->prev->count,
+            sizeof(MX_StatsEntry), mx_top_compare_entries);
+}
+
+/*
+ * Add the rates for <entry> in the last report of <comp> to <rates>. Before the
+ * second report comes in, these are the averages since the component started.
+ */
+static void mx_top_add_rates(const MX_TopComponent *comp,
+        const MX_StatsEntry *entry, MX_TopRates *rates)
+{
+    MX_StatsEntry prev = { 0 };
+    const MX_StatsEntry *p = mx_top_prev_entry(comp, entry);
+
+    double dt = comp->prev ? comp->last->t - comp->prev->t : comp->last->interval;
+
+    if (p != NULL) prev = *p;
+
+    rates->queued += entry->queued;
+
+    if (dt <= 0) return;
+
+    rates->sent_msgs  += (entry->sent_msgs - prev.sent_msgs) / dt;
+    rates->sent_bytes += (entry->sent_bytes - prev.sent_bytes) / dt;
+    rates->recv_msgs  += (entry->recv_msgs - prev.recv_msgs) / dt;
+    rates->recv_bytes += (entry->recv_bytes - prev.recv_bytes) / dt;
+    rates->drops      += (entry->send_drops - prev.send_drops +
+                          entry->recv_drops - prev.recv_drops) / dt;
+}
+
+/*
+ * Return true if "mx top" should show message type <type>.
+ */
+static bool mx_top_shows(const MX_Top *top, uint32_t type)
+{
+    return top->all || type >= NUM_MX_MESSAGES;
+}
+
+/*
+ * Show the component table in "mx top".
+ */
+static void mx_top_show_components(MX *mx, MX_Top *top)
+{
+    int fd, i;
+
+    printf("%-24s %10s %12s %10s %12s %8s %8s\n",
+            "COMPONENT", "OUT MSG/S", "OUT BYTE/S", "IN MSG/S", "IN BYTE/S",
+            "QUEUED", "DROP/S");
+
+    for (fd = 0; fd < paCount(&top->components); fd++) {
+        MX_TopComponent *comp = paGet(&top->components, fd);
+        MX_TopRates rates = { 0 };
+
+        if (comp == NULL) continue;
+
+        for (i = 0; i < comp->last->count; i++) {
+            MX_StatsEntry *entry = comp->last->entry + i;
+
+            if (mx_top_shows(top, entry->type)) {
+                mx_top_add_rates(comp, entry, &rates);
+            }
+        }
+
+        printf("%-24.24s %10.0f %12.0f %10.0f %12.0f %8.0f %8.0f\n",
+                mx_top_component_name(mx, fd),
+                rates.sent_msgs, rates.sent_bytes,
+                rates.recv_msgs, rates.recv_bytes,
+                rates.queued, rates.drops);
     }
-    else if (strcmp(argv[1], "quit") == 0) {
-        fprintf(stderr,
-                "%s quit [ <options> ]\n\tAsks a master component to exit.\n\n", argv0);
-        fprintf(stderr, "Options:\n");
-        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
-        fprintf(stderr, "\t-h, --mx-host <name>\tUse this MX host.\n");
-        fprintf(stderr, "\t-v, --verbose\t\tBe verbose.\n");
+}
+
+/*
+ * Show the message type table in "mx top". Rates are those of the senders.
+ */
+static void mx_top_show_types(MX *mx, MX_Top *top)
+{
+    int fd, i;
+    uint32_t type;
+
+    PointerArray types = { 0 };
+
+    for (fd = 0; fd < paCount(&top->components); fd++) {
+        MX_TopComponent *comp = paGet(&top->components, fd);
+
+        if (comp == NULL) continue;
+
+        for (i = 0; i < comp->last->count; i++) {
+            MX_StatsEntry *entry = comp->last->entry + i;
+            MX_TopRates *rates;
+
+            if (!mx_top_shows(top, entry->type)) continue;
+
+            if ((rates = paGet(&types, entry->type)) == NULL) {
+                rates = calloc(1, sizeof(*rates));
+                paSet(&types, entry->type, rates);
+            }
+
+            mx_top_add_rates(comp, entry, rates);
+        }
     }
-    else if (strcmp(argv[1], "version") == 0) {
-        fprintf(stderr,
-                "%s version\n\tPrints the version of the MX software.\n", argv0);
+
+    printf("%-32s %10s %12s %8s %8s\n",
+            "MESSAGE", "MSG/S", "BYTE/S", "QUEUED", "DROP/S");
+
+    for (type = 0; type < paCount(&types); type++) {
+        MX_TopRates *rates = paGet(&types, type);
+        const char *name = mxMessageName(mx, type);
+
+        if (rates == NULL) continue;
+
+        printf("%-32.32s %10.0f %12.0f %8.0f %8.0f\n",
+                name ? name : "?",
+                rates->sent_msgs, rates->sent_bytes,
+                rates->queued, rates->drops);
+
+        free(rates);
     }
-    else if (strcmp(argv[1], "help") == 0) {
-        fprintf(stderr,
-                "%s help\n\tShows a list of mx subcommands.\n", argv0);
+
+    paClear(&types);
+}
+
+/*
+ * Show the longest outgoing queues in "mx top": the components at the other
+ * end aren't keeping up.
+ */
+static void mx_top_show_slow_consumers(MX *mx, MX_Top *top)
+{
+    int fd, i;
+    size_t count;
+    double dt;
+
+    Buffer queues = { 0 };
+    MX_TopQueue *queue;
+
+    for (fd = 0; fd < paCount(&top->components); fd++) {
+        MX_TopComponent *comp = paGet(&top->components, fd);
+
+        if (comp == NULL) continue;
+
+        dt = comp->prev ? comp->last->t - comp->prev->t : 0;
+
+        for (i = 0; i < comp->last->count; i++) {
+            MX_StatsEntry *entry = comp->last->entry + i;
+            const MX_StatsEntry *prev = mx_top_prev_entry(comp, entry);
+
+            MX_TopQueue q = { fd, entry->fd, entry->queued };
+
+            if (q.queued == 0 || !mx_top_shows(top, entry->type)) continue;
+
+            if (dt > 0) {
+                q.growth = ((double) entry->queued -
+                            (prev ? prev->queued : 0)) / dt;
+            }
+
+            /* Entries are sorted on fd, so add up all types per receiver. */
+
+            queue = (MX_TopQueue *) bufGet(&queues);
+            count = bufLen(&queues) / sizeof(MX_TopQueue);
+
+            if (count > 0 && queue[count - 1].sender == q.sender &&
+                queue[count - 1].receiver == q.receiver) {
+                queue[count - 1].queued += q.queued;
+                queue[count - 1].growth += q.growth;
+            }
+            else {
+                bufAdd(&queues, &q, sizeof(q));
+            }
+        }
     }
-    else {
-        fprintf(stderr, "Unknown command \"%s\".\n\n", argv[1]);
-        mx_usage(argv0);
+
+    queue = (MX_TopQueue *) bufGet(&queues);
+    count = bufLen(&queues) / sizeof(MX_TopQueue);
+
+    if (count > 0) {
+        qsort(queue, count, sizeof(MX_TopQueue), mx_top_compare_queues);
+
+        printf("\n%-24s %-24s %8s %10s\n",
+                "SLOW CONSUMER", "SENDER", "QUEUED", "GROWTH/S");
+
+        for (i = 0; i < count && i < MX_TOP_SLOW; i++) {
+            printf("%-24.24s %-24.24s %8lu %10.0f\n",
+                    mx_top_component_name(mx, queue[i].receiver),
+                    mx_top_component_name(mx, queue[i].sender),
+                    queue[i].queued, queue[i].growth);
+        }
     }
 
-    return 0;
+    bufClear(&queues);
 }
 
 /*
- * Main.
+ * Timer handler for "mx top": refresh the screen.
  */
-int main(int argc, char *argv[])
+static void mx_top_refresh(MX *mx, MX_Timer *timer, double t, void *udata)
 {
-    if (argc == 1) {
-        mx_usage(argv[0]);
-        exit(0);
+    MX_Top *top = udata;
+
+    if (!top->batch) printf("\033[H\033[J");
+
+    printf("MX \"%s\" at %s:%d\n\n", mxName(mx), mxHost(mx), mxPort(mx));
+
+    mx_top_show_components(mx, top);
+
+    printf("\n");
+
+    mx_top_show_types(mx, top);
+    mx_top_show_slow_consumers(mx, top);
+
+    if (top->batch) printf("\n");
+
+    fflush(stdout);
+
+    if (top->iterations > 0 && --top->iterations == 0) {
+        mxShutdown(mx);
     }
-    else if (strcmp(argv[1], "master") == 0) {
-        return mx_master(argc - 1, argv + 1);
+    else {
+        mxAdjustTimer(mx, timer, t + top->interval);
     }
-    else if (strcmp(argv[1], "name") == 0) {
-        return mx_name(argc - 1, argv + 1);
+}
+
+/*
+ * Execute the "mx top" command.
+ */
+static int mx_top(const char *argv0, int argc, char *argv[])
+{
+    MX *mx;
+    int fd, r, next_arg;
+
+    MX_Top top = { 0 };
+
+    Options *options = optCreate();
+
+    optAdd(options, "mx-name", 'n', ARG_REQUIRED);
+    optAdd(options, "mx-host", 'h', ARG_REQUIRED);
+    optAdd(options, "interval", 'i', ARG_REQUIRED);
+    optAdd(options, "iterations", 'c', ARG_REQUIRED);
+    optAdd(options, "all", 'a', ARG_NONE);
+    optAdd(options, "batch", 'b', ARG_NONE);
+
+    if ((next_arg = optParse(options, argc, argv)) == -1) {
+        return 1;
     }
-    else if (strcmp(argv[1], "host") == 0) {
-        return mx_host(argc - 1, argv + 1);
+    else if (next_arg != argc) {
+        fprintf(stderr, "Unexpected argument \"%s\"\n\n", argv[next_arg]);
+        mx_usage(argv0);
+        return 1;
     }
-    else if (strcmp(argv[1], "port") == 0) {
-        return mx_port(argc - 1, argv + 1);
+
+    top.all        = optIsSet(options, "all");
+    top.batch      = optIsSet(options, "batch");
+    top.iterations = atoi(optArg(options, "iterations", "0"));
+    top.interval   = atof(optArg(options, "interval", "0"));
+
+    if (top.interval <= 0) top.interval = MX_TOP_INTERVAL;
+
+    mx = mxClient(mxEffectiveHost(optArg(options, "mx-host", NULL)),
+                  mxEffectiveName(optArg(options, "mx-name", NULL)), "mx-top");
+
+    if (mx == NULL) {
+        fputs(mxError(), stderr);
+        return 1;
     }
-    else if (strcmp(argv[1], "list") == 0) {
-        return mx_list(argv[0], argc - 1, argv + 1);
+
+    mxOnStatsReport(mx, mx_top_on_stats_report, &top);
+    mxOnEndComponent(mx, mx_top_on_end_component, &top);
+
+    /* Give everyone time to send their first report. */
+
+    mxCreateTimer(mx, mxNow() + MIN(top.interval, MX_TOP_INTERVAL),
+            mx_top_refresh, &top);
+
+    r = mxRun(mx);
+
+    for (fd = 0; fd < paCount(&top.components); fd++) {
+        mx_top_on_end_component(mx, fd, NULL, &top);
     }
-    else if (strcmp(argv[1], "quit") == 0) {
-        return mx_quit(argc - 1, argv + 1);
+
+    paClear(&top.components);
+
+    optDestroy(options);
+    mxDestroy(mx);
+
+    return r;
+}
+
+/*
+ * Timer interval for "mx bench", and the maximum number of messages to send per
+ * tick when running at full speed.
+ */
+#define MX_BENCH_TICK   0.001
+#define MX_BENCH_BATCH  1000
+
+/*
+ * Don't publish at full speed while more than this many messages are waiting to
+ * be written.
+ */
+#define MX_BENCH_MAX_QUEUED 10000
+
+/*
+ * Ping messages that haven't been answered in this many seconds are lost.
+ */
+#define MX_BENCH_TIMEOUT 1.0
+
+/*
+ * Time between publishing the last message and shutting down.
+ */
+#define MX_BENCH_LINGER 0.1
+
+/*
+ * Every "mx bench" message begins with a 64-bit sequence number, a timestamp
+ * and a flag to say it is the last one.
+ */
+#define MX_BENCH_HEADER (sizeof(uint64_t) + sizeof(double) + sizeof(uint8_t))
+
+/*
+ * What we know about a publisher, in "mx bench subscribe".
+ */
+typedef struct {
+    uint64_t next;                      // Next sequence number expected.
+    bool done;                          // Sent its last message.
+} MX_BenchPublisher;
+
+/*
+ * State of an "mx bench" command.
+ */
+typedef struct {
+    uint32_t data_msg;                  // Published or ping message.
+    uint32_t reply_msg;                 // Pong message.
+
+    uint32_t size;                      // Payload size.
+    double rate;                        // Messages per second, or 0 for max.
+    double duration;                    // Stop after this many seconds...
+    uint64_t count;                     // ... or this many messages.
+
+    double t0, t1;                      // Start and end of the run.
+
+    uint64_t sent;                      // Messages sent.
+    uint64_t received;                  // Messages received.
+    uint64_t bytes;                     // Bytes received.
+    uint64_t lost;                      // Messages lost.
+
+    int peers;                          // Subscribers or publishers seen.
+    int done;                           // Publishers that are done.
+    int fd;                             // Echoing component (pingpong).
+
+    PointerArray publishers;            // MX_BenchPublishers, by fd.
+
+    Buffer latency;                     // Measured latencies (doubles).
+    Buffer payload;                     // Outgoing payload.
+    char *padding;                      // Zeroes to fill up the payload.
+} MX_Bench;
+
+/*
+ * Compare the doubles pointed to by <p1> and <p2>.
+ */
+static int mx_bench_compare(const void *p1, const void *p2)
+{
+    const double *d1 = p1;
+    const double *d2 = p2;
+
+    return *d1 < *d2 ? -1 : *d1 > *d2 ? 1 : 0;
+}
+
+/*
+ * Build the payload for message <seq>, which is the last one if <last> is true.
+ */
+static void mx_bench_payload(MX_Bench *bench, uint64_t seq, bool last)
+{
+    bufClear(&bench->payload);
+
+    bufPack(&bench->payload,
+            PACK_INT64,  seq,
+            PACK_DOUBLE, mxNow(),
+            PACK_INT8,   last,
+            END);
+
+    bufAdd(&bench->payload, bench->padding, bench->size - MX_BENCH_HEADER);
+}
+
+/*
+ * Return the number of messages that should have been sent by now.
+ */
+static uint64_t mx_bench_due(MX_Bench *bench, double now)
+{
+    uint64_t due;
+
+    if (bench->rate > 0) {
+        due = (now - bench->t0) * bench->rate;
+    }
+    else {
+        due = bench->sent + MX_BENCH_BATCH;
+    }
+
+    return bench->count > 0 && due > bench->count ? bench->count : due;
+}
+
+/*
+ * Return true if the run is over at time <now>.
+ */
+static bool mx_bench_over(MX_Bench *bench, double now)
+{
+    return (bench->count > 0 && bench->sent >= bench->count) ||
+           (bench->duration > 0 && now - bench->t0 >= bench->duration);
+}
+
+/*
+ * Report the latencies in <bench>.
+ */
+static void mx_bench_report_latency(MX_Bench *bench)
+{
+    double *latency = (double *) bufGet(&bench->latency);
+    size_t n = bufLen(&bench->latency) / sizeof(double);
+
+    if (n == 0) return;
+
+    qsort(latency, n, sizeof(double), mx_bench_compare);
+
+    printf("Latency (us): p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+            1e6 * latency[(n - 1) / 2],
+            1e6 * latency[(n - 1) * 99 / 100],
+            1e6 * latency[(n - 1) * 999 / 1000],
+            1e6 * latency[n - 1]);
+}
+
+/*
+ * Report the latency per stage for the timestamped messages of type <type> that
+ * <mx> has received.
+ */
+static void mx_bench_report_stages(MX *mx, uint32_t type)
+{
+    MX_Stage stage;
+    MX_Latency latency;
+
+    static const char *stage_name[] = { "queue", "network", "dispatch", "handler" };
+
+    for (stage = 0; stage < NUM_MX_STAGES; stage++) {
+        if (mxGetLatency(mx, type, stage, &latency) != 0 || latency.count == 0) {
+            continue;
+        }
+
+        printf("  %-9s p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+                stage_name[stage], 1e6 * latency.p50, 1e6 * latency.p99,
+                1e6 * latency.p999, 1e6 * latency.max);
+    }
+}
+
+/*
+ * Return the number of messages of type <type> waiting to be written in <mx>.
+ */
+static uint64_t mx_bench_queued(MX *mx, uint32_t type)
+{
+    int i;
+    uint64_t queued = 0;
+
+    MX_Stats *stats = mxGetStats(mx, false);
+
+    for (i = 0; i < stats->count; i++) {
+        if (stats->entry[i].type == type) queued += stats->entry[i].queued;
+    }
+
+    mxFreeStats(stats);
+
+    return queued;
+}
+
+/*
+ * Timer handler to end an "mx bench" command.
+ */
+static void mx_bench_stop(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    mxShutdown(mx);
+}
+
+/*
+ * Timer handler for "mx bench publish": publish the messages that are due.
+ */
+static void mx_bench_publish_tick(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    MX_Bench *bench = udata;
+
+    double now = mxNow();
+
+    if (mx_bench_over(bench, now)) {
+        bench->t1 = now;
+
+        mx_bench_payload(bench, bench->sent, true);
+
+        mxBroadcast(mx, bench->data_msg, 0,
+                bufGet(&bench->payload), bufLen(&bench->payload));
+
+        // Give the writer threads some time to send out what's left.
+
+        mxCreateTimer(mx, now + MX_BENCH_LINGER, mx_bench_stop, bench);
+
+        return;
+    }
+
+    if (bench->rate > 0 ||
+        mx_bench_queued(mx, bench->data_msg) < MX_BENCH_MAX_QUEUED) {
+        uint64_t due = mx_bench_due(bench, now);
+
+        while (bench->sent < due) {
+            mx_bench_payload(bench, bench->sent++, false);
+
+            mxBroadcast(mx, bench->data_msg, 0,
+                    bufGet(&bench->payload), bufLen(&bench->payload));
+        }
+    }
+
+    mxAdjustTimer(mx, timer, now + MX_BENCH_TICK);
+}
+
+/*
+ * Keep track of the number of subscribers in "mx bench publish".
+ */
+static void mx_bench_on_new_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    MX_Bench *bench = udata;
+
+    bench->peers++;
+}
+
+/*
+ * Handle a message in "mx bench subscribe".
+ */
+static void mx_bench_handle_data(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint64_t seq;
+    double t;
+    uint8_t last;
+
+    MX_Bench *bench = udata;
+    MX_BenchPublisher *pub = paGet(&bench->publishers, fd);
+
+    double now = mxNow();
+
+    strunpack(payload, size,
+            PACK_INT64,  &seq,
+            PACK_DOUBLE, &t,
+            PACK_INT8,   &last,
+            END);
+
+    if (pub == NULL) {
+        pub = calloc(1, sizeof(*pub));
+
+        // Whatever was published before we subscribed isn't lost.
+
+        pub->next = seq;
+
+        paSet(&bench->publishers, fd, pub);
+
+        bench->peers++;
+
+        if (bench->t0 == 0) bench->t0 = now;
+    }
+
+    if (seq > pub->next) {
+        bench->lost += seq - pub->next;
+    }
+
+    pub->next = seq + 1;
+
+    if (last) {
+        pub->done = true;
+
+        bench->done++;
+    }
+    else {
+        double latency = now - t;
+
+        bench->received++;
+        bench->bytes += size;
+        bench->t1 = now;
+
+        bufAdd(&bench->latency, &latency, sizeof(latency));
+    }
+
+    if ((bench->count > 0 && bench->received >= bench->count) ||
+        bench->done == bench->peers) {
+        mxShutdown(mx);
+    }
+
+    free(payload);
+}
+
+/*
+ * Handle a ping message in "mx bench pingpong --echo".
+ */
+static void mx_bench_handle_ping(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    MX_Bench *bench = udata;
+
+    mxSend(mx, fd, bench->reply_msg, version, payload, size);
+
+    free(payload);
+
+    bench->received++;
+}
+
+/*
+ * Timer handler for "mx bench pingpong": send the pings that are due, and wait
+ * for the pongs.
+ */
+static void mx_bench_pingpong_tick(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    MX_Bench *bench = udata;
+
+    double now = mxNow();
+    uint64_t due = mx_bench_due(bench, now);
+
+    while (bench->sent < due && !mx_bench_over(bench, now)) {
+        uint32_t version, size;
+        char *reply;
+
+        mx_bench_payload(bench, bench->sent++, false);
+
+        if (mxSendAndWait(mx, bench->fd, MX_BENCH_TIMEOUT,
+                    bench->reply_msg, &version, &reply, &size,
+                    bench->data_msg, 0,
+                    bufGet(&bench->payload), bufLen(&bench->payload)) == 0) {
+            double latency = mxNow() - now;
+
+            bench->received++;
+
+            bufAdd(&bench->latency, &latency, sizeof(latency));
+
+            free(reply);
+        }
+        else {
+            bench->lost++;
+        }
+
+        now = mxNow();
+    }
+
+    if (mx_bench_over(bench, now)) {
+        bench->t1 = now;
+
+        mxShutdown(mx);
+    }
+    else {
+        mxAdjustTimer(mx, timer, now + MX_BENCH_TICK);
+    }
+}
+
+/*
+ * Start pinging in "mx bench pingpong" when the echoing component appears.
+ */
+static void mx_bench_on_echo(MX *mx, int fd, uint32_t type, void *udata)
+{
+    MX_Bench *bench = udata;
+
+    if (bench->peers++ > 0) return;
+
+    bench->fd = fd;
+    bench->t0 = mxNow();
+
+    mxCreateTimer(mx, bench->t0, mx_bench_pingpong_tick, bench);
+}
+
+/*
+ * Execute the "mx bench" command.
+ */
+static int mx_bench(const char *argv0, int argc, char *argv[])
+{
+    MX *mx;
+    int r, next_arg;
+    const char *mode, *type;
+    double elapsed;
+    char *my_name;
+
+    MX_Bench bench = { 0 };
+
+    Options *options = optCreate();
+
+    optAdd(options, "mx-name", 'n', ARG_REQUIRED);
+    optAdd(options, "mx-host", 'h', ARG_REQUIRED);
+    optAdd(options, "size", 's', ARG_REQUIRED);
+    optAdd(options, "rate", 'r', ARG_REQUIRED);
+    optAdd(options, "duration", 'd', ARG_REQUIRED);
+    optAdd(options, "count", 'c', ARG_REQUIRED);
+    optAdd(options, "type", 't', ARG_REQUIRED);
+    optAdd(options, "echo", 'e', ARG_NONE);
+
+    if ((next_arg = optParse(options, argc, argv)) == -1) {
+        return 1;
+    }
+    else if (next_arg >= argc) {
+        mx_usage(argv0);
+        return 1;
+    }
+
+    mode = argv[next_arg];
+
+    // Options may also follow the mode.
+
+    argc -= next_arg;
+    argv += next_arg;
+
+    if ((next_arg = optParse(options, argc, argv)) == -1) {
+        return 1;
+    }
+    else if (next_arg != argc) {
+        fprintf(stderr, "Unexpected argument \"%s\"\n\n", argv[next_arg]);
+        mx_usage(argv0);
+        return 1;
+    }
+
+    if (strcmp(mode, "publish") != 0 && strcmp(mode, "subscribe") != 0 &&
+        strcmp(mode, "pingpong") != 0) {
+        fprintf(stderr, "Unknown bench mode \"%s\".\n\n", mode);
+        mx_usage(argv0);
+        return 1;
+    }
+
+    bench.size     = atoi(optArg(options, "size", "64"));
+    bench.rate     = atof(optArg(options, "rate", "0"));
+    bench.count    = atoll(optArg(options, "count", "0"));
+    bench.duration = atof(optArg(options, "duration", "0"));
+
+    /* Senders stop after 10 seconds by default, receivers when the senders
+     * are done. */
+
+    if (bench.duration == 0 && bench.count == 0 &&
+        (strcmp(mode, "publish") == 0 ||
+         (strcmp(mode, "pingpong") == 0 && !optIsSet(options, "echo")))) {
+        bench.duration = 10;
+    }
+
+    if (bench.size < MX_BENCH_HEADER) {
+        bench.size = MX_BENCH_HEADER;
+    }
+
+    bench.padding = calloc(1, bench.size);
+
+    type = optArg(options, "type", "MX.Bench");
+
+    if (asprintf(&my_name, "mx-bench-%s", mode) == -1) {
+        return 1;
+    }
+
+    mx = mxClient(mxEffectiveHost(optArg(options, "mx-host", NULL)),
+                  mxEffectiveName(optArg(options, "mx-name", NULL)), my_name);
+
+    if (mx == NULL) {
+        fputs(mxError(), stderr);
+        return 1;
+    }
+
+    if (strcmp(mode, "publish") == 0) {
+        bench.data_msg = mxRegister(mx, type);
+
+        mxSetTimestamps(mx, true);
+
+        mxOnNewSubscriber(mx, bench.data_msg, mx_bench_on_new_subscriber, &bench);
+
+        bench.t0 = mxNow();
+
+        mxCreateTimer(mx, bench.t0, mx_bench_publish_tick, &bench);
+    }
+    else if (strcmp(mode, "subscribe") == 0) {
+        bench.data_msg = mxRegister(mx, type);
+
+        mxSubscribe(mx, bench.data_msg, mx_bench_handle_data, &bench);
+    }
+    else {
+        char *ping_name, *pong_name;
+
+        if (asprintf(&ping_name, "%s.Ping", type) == -1 ||
+            asprintf(&pong_name, "%s.Pong", type) == -1) {
+            return 1;
+        }
+
+        bench.data_msg  = mxRegister(mx, ping_name);
+        bench.reply_msg = mxRegister(mx, pong_name);
+
+        free(ping_name);
+        free(pong_name);
+
+        if (optIsSet(options, "echo")) {
+            mxSubscribe(mx, bench.data_msg, mx_bench_handle_ping, &bench);
+        }
+        else {
+            mxOnNewSubscriber(mx, bench.data_msg, mx_bench_on_echo, &bench);
+        }
+    }
+
+    if (bench.duration > 0 &&
+        (strcmp(mode, "subscribe") == 0 || optIsSet(options, "echo"))) {
+        mxCreateTimer(mx, mxNow() + bench.duration, mx_bench_stop, &bench);
+    }
+
+    r = mxRun(mx);
+
+    elapsed = bench.t1 - bench.t0;
+
+    if (strcmp(mode, "publish") == 0) {
+        printf("Published %lu messages of %u bytes in %.3f s to %d subscriber(s)\n",
+                bench.sent, bench.size, elapsed, bench.peers);
+        printf("Throughput: %.1f msg/s, %.3f MB/s\n",
+                bench.sent / elapsed, bench.sent * bench.size / elapsed / 1e6);
+    }
+    else if (strcmp(mode, "subscribe") == 0) {
+        uint64_t total = bench.received + bench.lost;
+
+        printf("Received %lu messages in %.3f s from %d publisher(s)\n",
+                bench.received, elapsed, bench.peers);
+
+        if (elapsed > 0) {
+            printf("Throughput: %.1f msg/s, %.3f MB/s\n",
+                    bench.received / elapsed,
+                    bench.bytes / elapsed / 1e6);
+        }
+
+        printf("Lost: %lu (%.3f%%)\n", bench.lost,
+                total > 0 ? 100.0 * bench.lost / total : 0.0);
+
+        mx_bench_report_latency(&bench);
+        mx_bench_report_stages(mx, bench.data_msg);
+    }
+    else if (optIsSet(options, "echo")) {
+        printf("Echoed %lu messages\n", bench.received);
+    }
+    else {
+        printf("Sent %lu pings of %u bytes in %.3f s, %lu answered\n",
+                bench.sent, bench.size, elapsed, bench.received);
+
+        if (elapsed > 0) {
+            printf("Throughput: %.1f round trips/s\n", bench.received / elapsed);
+        }
+
+        printf("Lost: %lu (%.3f%%)\n", bench.lost,
+                bench.sent > 0 ? 100.0 * bench.lost / bench.sent : 0.0);
+
+        mx_bench_report_latency(&bench);
+    }
+
+    for (int fd = 0; fd < paCount(&bench.publishers); fd++) {
+        free(paGet(&bench.publishers, fd));
+    }
+
+    paClear(&bench.publishers);
+
+    bufClear(&bench.latency);
+    bufClear(&bench.payload);
+
+    free(bench.padding);
+    free(my_name);
+
+    optDestroy(options);
+    mxDestroy(mx);
+
+    return r;
+}
+
+/*
+ * How often "mx record" checks whether it should stop.
+ */
+#define MX_RECORD_POLL 0.1
+
+/*
+ * State of an "mx record" command.
+ */
+typedef struct {
+    MX_Recorder *recorder;              // The recorder we're using.
+    uint64_t count;                     // Stop after this many messages...
+    double t_end;                       // ... or at this time.
+} MX_Record;
+
+/*
+ * Set when "mx record" gets SIGINT or SIGTERM.
+ */
+static volatile sig_atomic_t mx_record_interrupted = 0;
+
+/*
+ * Signal handler for "mx record".
+ */
+static void mx_record_on_signal(int sig)
+{
+    mx_record_interrupted = 1;
+}
+
+/*
+ * Timer handler for "mx record": stop if we've been interrupted, or if we've
+ * recorded enough messages or recorded long enough.
+ */
+static void mx_record_check(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    MX_Record *record = udata;
+
+    if (mx_record_interrupted ||
+        (record->count > 0 && mxRecordCount(record->recorder) >= record->count) ||
+        (record->t_end > 0 && t >= record->t_end)) {
+        mxShutdown(mx);
+    }
+    else {
+        mxAdjustTimer(mx, timer, t + MX_RECORD_POLL);
+    }
+}
+
+/*
+ * Execute the "mx record" command.
+ */
+static int mx_record(const char *argv0, int argc, char *argv[])
+{
+    MX *mx;
+    int i, r, next_arg;
+    const char *path;
+    double duration, t0;
+
+    MX_Record record = { 0 };
+
+    Options *options = optCreate();
+
+    optAdd(options, "mx-name", 'n', ARG_REQUIRED);
+    optAdd(options, "mx-host", 'h', ARG_REQUIRED);
+    optAdd(options, "output", 'o', ARG_REQUIRED);
+    optAdd(options, "segment-size", 's', ARG_REQUIRED);
+    optAdd(options, "duration", 'd', ARG_REQUIRED);
+    optAdd(options, "count", 'c', ARG_REQUIRED);
+
+    if ((next_arg = optParse(options, argc, argv)) == -1) {
+        return 1;
+    }
+
+    path         = optArg(options, "output", "mx.log");
+    duration     = atof(optArg(options, "duration", "0"));
+    record.count = atoll(optArg(options, "count", "0"));
+
+    mx = mxClient(mxEffectiveHost(optArg(options, "mx-host", NULL)),
+                  mxEffectiveName(optArg(options, "mx-name", NULL)), "mx-record");
+
+    if (mx == NULL) {
+        fputs(mxError(), stderr);
+        return 1;
+    }
+
+    record.recorder = mxCreateRecorder(mx, path,
+            (size_t) atoll(optArg(options, "segment-size", "0")) * 1024 * 1024);
+
+    if (record.recorder == NULL) {
+        fputs(mxError(), stderr);
+        mxDestroy(mx);
+        return 1;
+    }
+
+    /* Without any names, record all messages. */
+
+    if (next_arg == argc) {
+        r = mxRecordPattern(record.recorder, "*");
+    }
+    else for (i = next_arg, r = 0; i < argc && r == 0; i++) {
+        if (strchr(argv[i], '*') != NULL) {
+            r = mxRecordPattern(record.recorder, argv[i]);
+        }
+        else {
+            r = mxRecord(record.recorder, mxRegister(mx, argv[i]));
+        }
+    }
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+        mxDestroyRecorder(record.recorder);
+        mxDestroy(mx);
+        return 1;
+    }
+
+    signal(SIGINT, mx_record_on_signal);
+    signal(SIGTERM, mx_record_on_signal);
+
+    t0 = mxNow();
+
+    if (duration > 0) record.t_end = t0 + duration;
+
+    mxCreateTimer(mx, t0 + MX_RECORD_POLL, mx_record_check, &record);
+
+    r = mxRun(mx);
+
+    printf("Recorded %lu messages in %.3f s to \"%s\"\n",
+            mxRecordCount(record.recorder), mxNow() - t0, path);
+
+    mxDestroyRecorder(record.recorder);
+
+    optDestroy(options);
+    mxDestroy(mx);
+
+    return r;
+}
+
+/*
+ * Timer interval for "mx replay", and the maximum number of messages to send
+ * per tick when replaying as fast as possible.
+ */
+#define MX_REPLAY_TICK   0.001
+#define MX_REPLAY_BATCH  1000
+
+/*
+ * Don't replay anything while more than this many messages are waiting to be
+ * written.
+ */
+#define MX_REPLAY_MAX_QUEUED 10000
+
+/*
+ * How often to check whether everything has been written, after replaying the
+ * last message.
+ */
+#define MX_REPLAY_LINGER 0.1
+
+/*
+ * State of an "mx replay" command.
+ */
+typedef struct {
+    MX_Log *log;                        // The log we're replaying.
+    const char *name;                   // Only replay messages with this name.
+    MX_LogEntry entry;                  // The next message to replay...
+    bool have_entry;                    // ... if there is one.
+
+    double speed;                       // Speed factor, or 0 for max.
+    uint64_t count;                     // Stop after this many messages.
+
+    double t_log;                       // Log time of the first message.
+    double t0, t1;                      // Start and end of the replay.
+
+    uint64_t sent;                      // Messages replayed.
+    uint64_t bytes;                     // Payload bytes replayed.
+
+    uint32_t *type;                     // Our type for each type in the log.
+    uint32_t type_count;                // Number of entries in <type>.
+} MX_Replay;
+
+/*
+ * Return the total number of messages waiting to be written in <mx>.
+ */
+static uint64_t mx_replay_queued(MX *mx)
+{
+    int i;
+    uint64_t queued = 0;
+
+    MX_Stats *stats = mxGetStats(mx, false);
+
+    for (i = 0; i < stats->count; i++) {
+        queued += stats->entry[i].queued;
+    }
+
+    mxFreeStats(stats);
+
+    return queued;
+}
+
+/*
+ * Timer handler to end an "mx replay" command, once the writer threads have
+ * sent out everything we replayed.
+ */
+static void mx_replay_stop(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    if (mx_replay_queued(mx) > 0) {
+        mxAdjustTimer(mx, timer, t + MX_REPLAY_LINGER);
+    }
+    else {
+        mxShutdown(mx);
+    }
+}
+
+/*
+ * Read the next message to replay into <replay>.
+ */
+static void mx_replay_next(MX_Replay *replay)
+{
+    replay->have_entry = (replay->count == 0 || replay->sent < replay->count) &&
+        mxReadLog(replay->log, replay->name, &replay->entry) == 0;
+}
+
+/*
+ * Register the message types in the log of <replay>, from the current position
+ * onwards, so that subscribers can find them before we start. Leaves the log
+ * positioned at the end.
+ */
+static void mx_replay_register(MX *mx, MX_Replay *replay)
+{
+    MX_LogEntry entry;
+
+    while (mxReadLog(replay->log, replay->name, &entry) == 0) {
+        if (entry.type >= replay->type_count) {
+            uint32_t new_count = entry.type + 64;
+
+            replay->type = realloc(replay->type, new_count * sizeof(uint32_t));
+
+            memset(replay->type + replay->type_count, 0,
+                    (new_count - replay->type_count) * sizeof(uint32_t));
+
+            replay->type_count = new_count;
+        }
+
+        if (replay->type[entry.type] == 0) {
+            replay->type[entry.type] = mxRegister(mx, entry.name);
+        }
+    }
+}
+
+/*
+ * Timer handler for "mx replay": replay the messages that are due. Payloads go
+ * straight from the mapped log to mxBroadcast(). If the writer threads can't
+ * keep up we hold off, falling behind the recorded pace.
+ */
+static void mx_replay_tick(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    MX_Replay *replay = udata;
+
+    double now = mxNow();
+    int n = 0;
+
+    if (replay->t0 == 0) {
+        replay->t0 = now;
+        replay->t_log = replay->entry.t;
+    }
+
+    if (mx_replay_queued(mx) >= MX_REPLAY_MAX_QUEUED) {
+        mxAdjustTimer(mx, timer, now + MX_REPLAY_TICK);
+        return;
+    }
+
+    while (replay->have_entry) {
+        MX_LogEntry *entry = &replay->entry;
+
+        if (replay->speed == 0) {
+            if (n == MX_REPLAY_BATCH) break;
+        }
+        else if (replay->t0 + (entry->t - replay->t_log) / replay->speed > now) {
+            break;
+        }
+
+        mxBroadcast(mx, replay->type[entry->type], entry->version,
+                entry->payload, entry->size);
+
+        replay->sent++;
+        replay->bytes += entry->size;
+
+        n++;
+
+        mx_replay_next(replay);
+    }
+
+    if (replay->have_entry) {
+        mxAdjustTimer(mx, timer, now + MX_REPLAY_TICK);
+    }
+    else {
+        replay->t1 = now;
+
+        mxCreateTimer(mx, now, mx_replay_stop, replay);
+    }
+}
+
+/*
+ * Execute the "mx replay" command.
+ */
+static int mx_replay(const char *argv0, int argc, char *argv[])
+{
+    MX *mx;
+    int r, next_arg;
+    const char *path;
+    double offset, elapsed;
+
+    MX_Replay replay = { 0 };
+
+    Options *options = optCreate();
+
+    optAdd(options, "mx-name", 'n', ARG_REQUIRED);
+    optAdd(options, "mx-host", 'h', ARG_REQUIRED);
+    optAdd(options, "speed", 'x', ARG_REQUIRED);
+    optAdd(options, "fast", 'f', ARG_NONE);
+    optAdd(options, "message", 'm', ARG_REQUIRED);
+    optAdd(options, "offset", 'o', ARG_REQUIRED);
+    optAdd(options, "count", 'c', ARG_REQUIRED);
+    optAdd(options, "wait", 'w', ARG_REQUIRED);
+
+    if ((next_arg = optParse(options, argc, argv)) == -1) {
+        return 1;
+    }
+    else if (next_arg != argc - 1) {
+        mx_usage(argv0);
+        return 1;
+    }
+
+    path = argv[next_arg];
+
+    replay.name  = optArg(options, "message", NULL);
+    replay.count = atoll(optArg(options, "count", "0"));
+    replay.speed = optIsSet(options, "fast") ?
+        0 : atof(optArg(options, "speed", "1"));
+
+    if (replay.speed < 0) {
+        fprintf(stderr, "Speed can't be negative.\n");
+        return 1;
+    }
+
+    if ((replay.log = mxOpenLog(path)) == NULL) {
+        fputs(mxError(), stderr);
+        return 1;
+    }
+
+    mx = mxClient(mxEffectiveHost(optArg(options, "mx-host", NULL)),
+                  mxEffectiveName(optArg(options, "mx-name", NULL)), "mx-replay");
+
+    if (mx == NULL) {
+        fputs(mxError(), stderr);
+        mxCloseLog(replay.log);
+        return 1;
+    }
+
+    /* The offset is relative to the first message in the log. */
+
+    offset = atof(optArg(options, "offset", "0"));
+
+    if (mxReadLog(replay.log, NULL, &replay.entry) == 0) {
+        offset += replay.entry.t;
+    }
+
+    mxSeekLog(replay.log, offset);
+    mx_replay_register(mx, &replay);
+    mxSeekLog(replay.log, offset);
+    mx_replay_next(&replay);
+
+    mxCreateTimer(mx, mxNow() + atof(optArg(options, "wait", "1")),
+            mx_replay_tick, &replay);
+
+    r = mxRun(mx);
+
+    elapsed = replay.t1 - replay.t0;
+
+    printf("Replayed %lu messages in %.3f s", replay.sent, elapsed);
+
+    if (elapsed > 0) {
+        printf(" (%.1f msg/s, %.3f MB/s)",
+                replay.sent / elapsed, replay.bytes / elapsed / 1e6);
+    }
+
+    printf("\n");
+
+    free(replay.type);
+
+    mxCloseLog(replay.log);
+
+    optDestroy(options);
+    mxDestroy(mx);
+
+    return r;
+}
+
+/*
+ * Execute the "mx help" command.
+ */
+static int mx_help(const char *argv0, int argc, char *argv[])
+{
+    if (argc == 1) {
+        mx_usage(argv0);
+    }
+    else if (strcmp(argv[1], "master") == 0) {
+        fprintf(stderr,
+                "%s master [ <options> ]\n\tStarts an MX master.\n\n", argv0);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
+        fprintf(stderr, "\t-b, --background\t\tRun in the background.\n");
+        fprintf(stderr, "\t-l, --lazy\t\tOnly connect components "
+                "when they have something to send.\n");
+    }
+    else if (strcmp(argv[1], "name") == 0) {
+        fprintf(stderr,
+                "%s name\n\tPrints the effective MX name.\n", argv0);
+    }
+    else if (strcmp(argv[1], "host") == 0) {
+        fprintf(stderr,
+                "%s host\n\tPrints the effective MX host.\n", argv0);
+    }
+    else if (strcmp(argv[1], "port") == 0) {
+        fprintf(stderr,
+                "%s port [ <options> ]\n\tPrints the effective MX port.\n\n", argv0);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
+    }
+    else if (strcmp(argv[1], "list") == 0) {
+        fprintf(stderr,
+                "%s list [ <options> ]\n\tLists connected components.\n\n", argv0);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
+        fprintf(stderr, "\t-h, --mx-host <name>\tUse this MX host.\n");
+        fprintf(stderr, "\t-v, --verbose[=<level>]\tVerbosity level:\n");
+        fprintf(stderr, "\t\tlevel 0: only show components (default)\n");
+        fprintf(stderr, "\t\tlevel 1: also show subscriptions\n");
+        fprintf(stderr, "\t\tlevel 2: also show system subscriptions\n");
+    }
+    else if (strcmp(argv[1], "quit") == 0) {
+        fprintf(stderr,
+                "%s quit [ <options> ]\n\tAsks a master component to exit.\n\n", argv0);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
+        fprintf(stderr, "\t-h, --mx-host <name>\tUse this MX host.\n");
+        fprintf(stderr, "\t-v, --verbose\t\tBe verbose.\n");
+    }
+    else if (strcmp(argv[1], "top") == 0) {
+        fprintf(stderr,
+                "%s top [ <options> ]\n"
+                "\tContinuously shows message and byte rates, queue depths and "
+                "slow consumers\n\tper component and per message type.\n\n",
+                argv0);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
+        fprintf(stderr, "\t-h, --mx-host <name>\tUse this MX host.\n");
+        fprintf(stderr, "\t-i, --interval <s>\tRefresh interval (default 1).\n");
+        fprintf(stderr, "\t-c, --iterations <n>\tExit after this many refreshes.\n");
+        fprintf(stderr, "\t-a, --all\t\tInclude system messages.\n");
+        fprintf(stderr, "\t-b, --batch\t\tDon't clear the screen between "
+                "refreshes.\n");
+    }
+    else if (strcmp(argv[1], "bench") == 0) {
+        fprintf(stderr,
+                "%s bench [ <options> ] publish|subscribe|pingpong\n"
+                "\tMeasures throughput, loss and latency on a running MX.\n\n",
+                argv0);
+        fprintf(stderr, "Modes:\n");
+        fprintf(stderr, "\tpublish\t\tPublish messages to all subscribers.\n");
+        fprintf(stderr, "\tsubscribe\tReceive messages from all publishers.\n");
+        fprintf(stderr, "\tpingpong\tSend messages to an echoing component "
+                "and wait for them\n\t\t\tto come back.\n\n");
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
+        fprintf(stderr, "\t-h, --mx-host <name>\tUse this MX host.\n");
+        fprintf(stderr, "\t-s, --size <bytes>\tPayload size (default 64).\n");
+        fprintf(stderr, "\t-r, --rate <n>\t\tMessages per second "
+                "(default: as fast as possible).\n");
+        fprintf(stderr, "\t-d, --duration <s>\tStop after this many seconds "
+                "(default 10 for\n\t\t\t\tsenders, receivers stop when "
+                "the senders are done).\n");
+        fprintf(stderr, "\t-c, --count <n>\t\tStop after this many messages.\n");
+        fprintf(stderr, "\t-t, --type <name>\tMessage name to use "
+                "(default \"MX.Bench\").\n");
+        fprintf(stderr, "\t-e, --echo\t\tBe the echoing side of pingpong.\n");
+    }
+    else if (strcmp(argv[1], "record") == 0) {
+        fprintf(stderr,
+                "%s record [ <options> ] [ <name> ... ]\n"
+                "\tRecords messages with the given names to a message log. "
+                "Names may end\n\tin \"*\" to record all matching messages. "
+                "Without names, all messages\n\tare recorded. Stops on "
+                "SIGINT or SIGTERM.\n\n", argv0);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
+        fprintf(stderr, "\t-h, --mx-host <name>\tUse this MX host.\n");
+        fprintf(stderr, "\t-o, --output <dir>\tWrite the log to this "
+                "directory (default \"mx.log\").\n");
+        fprintf(stderr, "\t-s, --segment-size <MB>\tSize of the log "
+                "segments (default 64).\n");
+        fprintf(stderr, "\t-d, --duration <s>\tStop after this many "
+                "seconds.\n");
+        fprintf(stderr, "\t-c, --count <n>\t\tStop after (at least) this "
+                "many messages.\n");
+    }
+    else if (strcmp(argv[1], "replay") == 0) {
+        fprintf(stderr,
+                "%s replay [ <options> ] <dir>\n"
+                "\tReplays the messages in the message log in <dir>, as "
+                "written by \"mx record\",\n\tto their current "
+                "subscribers.\n\n", argv0);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "\t-n, --mx-name <name>\tUse this MX name.\n");
+        fprintf(stderr, "\t-h, --mx-host <name>\tUse this MX host.\n");
+        fprintf(stderr, "\t-x, --speed <factor>\tReplay this many times "
+                "faster than recorded (default 1).\n");
+        fprintf(stderr, "\t-f, --fast\t\tReplay as fast as possible.\n");
+        fprintf(stderr, "\t-m, --message <name>\tOnly replay messages "
+                "with this name.\n");
+        fprintf(stderr, "\t-o, --offset <s>\tStart this many seconds "
+                "into the log.\n");
+        fprintf(stderr, "\t-c, --count <n>\t\tStop after this many "
+                "messages.\n");
+        fprintf(stderr, "\t-w, --wait <s>\t\tWait this long for "
+                "subscribers before starting (default 1).\n");
+    }
+    else if (strcmp(argv[1], "version") == 0) {
+        fprintf(stderr,
+                "%s version\n\tPrints the version of the MX software.\n", argv0);
+    }
+    else if (strcmp(argv[1], "help") == 0) {
+        fprintf(stderr,
+                "%s help\n\tShows a list of mx subcommands.\n", argv0);
+    }
+    else {
+        fprintf(stderr, "Unknown command \"%s\".\n\n", argv[1]);
+        mx_usage(argv0);
+    }
+
+    return 0;
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char *argv[])
+{
+    if (argc == 1) {
+        mx_usage(argv[0]);
+        exit(0);
+    }
+    else if (strcmp(argv[1], "master") == 0) {
+        return mx_master(argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "name") == 0) {
+        return mx_name(argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "host") == 0) {
+        return mx_host(argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "port") == 0) {
+        return mx_port(argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "list") == 0) {
+        return mx_list(argv[0], argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "quit") == 0) {
+        return mx_quit(argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "top") == 0) {
+        return mx_top(argv[0], argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "bench") == 0) {
+        return mx_bench(argv[0], argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "record") == 0) {
+        return mx_record(argv[0], argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "replay") == 0) {
+        return mx_replay(argv[0], argc - 1, argv + 1);
     }
     else if (strcmp(argv[1], "help") == 0) {
         return mx_help(argv[0], argc - 1, argv + 1);
@@ -0,0 +1,105 @@
+/*
+ * producer.c: Message producer for test10.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <libjvs/utils.h>
+#include <libjvs/debug.h>
+
+#include "libmx.h"
+
+#define MESSAGES 1000
+
+static uint32_t price_msg, trade_a_msg, trade_b_msg;
+static bool subscribed[3] = { false };
+static bool started = false;
+
+/*
+ * Send messages <first> to <last>. Half of them are prices, the rest are evenly
+ * divided between two kinds of trades.
+ */
+static void send_messages(MX *mx, uint32_t first, uint32_t last)
+{
+    uint32_t i;
+    uint32_t type[] = { price_msg, price_msg, trade_a_msg, trade_b_msg };
+
+    for (i = first; i < last; i++) {
+        mxPackAndBroadcast(mx, type[i % 4], 0,
+                PACK_INT32, i,
+                PACK_STRING, "Some padding to make the message a bit longer",
+                END);
+    }
+}
+
+void on_stop(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    mxShutdown(mx);
+}
+
+void on_second_half(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    send_messages(mx, MESSAGES / 2, MESSAGES);
+
+    mxCreateTimer(mx, mxNow() + 1, on_stop, NULL);
+}
+
+void on_new_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    if (type == price_msg)
+        subscribed[0] = true;
+    else if (type == trade_a_msg)
+        subscribed[1] = true;
+    else if (type == trade_b_msg)
+        subscribed[2] = true;
+
+    if (started || !subscribed[0] || !subscribed[1] || !subscribed[2]) return;
+
+    started = true;
+
+    /* Send the second half a while after the first, so that the recorder can
+     * seek to it. */
+
+    send_messages(mx, 0, MESSAGES / 2);
+
+    mxCreateTimer(mx, mxNow() + 0.2, on_second_half, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Producer");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    price_msg   = mxRegister(mx, "Test.Price");
+    trade_a_msg = mxRegister(mx, "Test.Trade.A");
+    trade_b_msg = mxRegister(mx, "Test.Trade.B");
+
+    mxOnNewSubscriber(mx, price_msg, on_new_subscriber, NULL);
+    mxOnNewSubscriber(mx, trade_a_msg, on_new_subscriber, NULL);
+    mxOnNewSubscriber(mx, trade_b_msg, on_new_subscriber, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
@@ -0,0 +1,164 @@
+/*
+ * recorder.c: Message recorder for test10 and test11.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+#include <libjvs/debug.h>
+
+#include "libmx.h"
+
+static MX_Recorder *recorder;
+
+static const char *log_dir;
+static const char *sender;
+
+/*
+ * Stop recording when the sender goes away.
+ */
+void on_end_component(MX *mx, int fd, const char *name, void *udata)
+{
+    if (strncmp(name, sender, strlen(sender)) != 0) return;
+
+    printf("Recorded %lu messages\n", mxRecordCount(recorder));
+
+    mxDestroyRecorder(recorder);
+
+    mxShutdown(mx);
+}
+
+/*
+ * Return the number in the message in <entry>.
+ */
+static uint32_t msg_number(const MX_LogEntry *entry)
+{
+    uint32_t number;
+
+    strunpack(entry->payload, entry->size,
+            PACK_INT32, &number,
+            END);
+
+    return number;
+}
+
+/*
+ * Read back the log that we wrote.
+ */
+static int read_log(void)
+{
+    int prices = 0, trades_a = 0, trades_b = 0, others = 0, wrong = 0;
+    double second_half = 0;
+
+    MX_LogEntry entry;
+    MX_Log *log;
+
+    if ((log = mxOpenLog(log_dir)) == NULL) {
+        fputs(mxError(), stderr);
+        return 1;
+    }
+
+    while (mxReadLog(log, NULL, &entry) == 0) {
+        uint32_t number = msg_number(&entry);
+
+        if (strcmp(entry.name, "Test.Price") == 0)
+            prices++;
+        else if (strcmp(entry.name, "Test.Trade.A") == 0)
+            trades_a++;
+        else if (strcmp(entry.name, "Test.Trade.B") == 0)
+            trades_b++;
+        else
+            others++;
+
+        if (strncmp(entry.sender, sender, strlen(sender)) != 0) wrong++;
+
+        if (number == 500) second_half = entry.t;
+    }
+
+    printf("Read %d prices, %d A trades, %d B trades, %d others\n",
+            prices, trades_a, trades_b, others);
+    printf("%d messages from the wrong sender\n", wrong);
+
+    trades_b = 0;
+    wrong = 0;
+
+    /* Messages that were received at the same time as message 500 may come
+     * before it. */
+
+    mxSeekLog(log, second_half);
+
+    while (mxReadLog(log, "Test.Trade.B", &entry) == 0) {
+        uint32_t number = msg_number(&entry);
+
+        if (number % 4 != 3 || entry.t < second_half)
+            wrong++;
+        else if (number >= 500)
+            trades_b++;
+    }
+
+    printf("Read %d B trades from the second half, %d wrong\n", trades_b, wrong);
+
+    mxCloseLog(log);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+    MX *mx;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <log directory> <sender>\n", argv[0]);
+        return 1;
+    }
+
+    log_dir = argv[1];
+    sender = argv[2];
+
+    if ((mx = mxClient("localhost", NULL, "Recorder")) == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    /* Use small segments, so that we get several of them. */
+
+    if ((recorder = mxCreateRecorder(mx, log_dir, 16384)) == NULL) {
+        fputs(mxError(), stderr);
+        return 1;
+    }
+
+    /* Register the trades before the producer starts sending them, or the
+     * first ones might arrive before we know their type. */
+
+    mxRegister(mx, "Test.Trade.A");
+    mxRegister(mx, "Test.Trade.B");
+
+    mxRecord(recorder, mxRegister(mx, "Test.Price"));
+    mxRecordPattern(recorder, "Test.Trade.*");
+
+    mxOnEndComponent(mx, on_end_component, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    if (r == 0) {
+        r = read_log();
+    }
+
+    return r;
+}
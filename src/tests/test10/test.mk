@@ -0,0 +1,33 @@
+# tests/test10/test.mk: Makefile fragment for test10.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST10_DIR  := tests/test10
+TEST10_PROD := $(TEST10_DIR)/producer
+TEST10_REC  := $(TEST10_DIR)/recorder
+TEST10_LOG  := $(TEST10_DIR)/*.log $(TEST10_DIR)/*.idx
+
+TEST10_OUTPUT := $(TEST10_DIR)/output.test
+BASE10_OUTPUT := $(TEST10_DIR)/output.base
+
+TESTS += test10
+BASES += base10
+CLEAN += $(TEST10_PROD) $(TEST10_REC) $(TEST10_OUTPUT) $(TEST10_LOG)
+
+test10: $(TEST10_OUTPUT)
+	diff $(TEST10_OUTPUT) $(BASE10_OUTPUT)
+
+base10: $(TEST10_OUTPUT)
+	cp $(TEST10_OUTPUT) $(BASE10_OUTPUT)
+
+$(TEST10_OUTPUT): mx $(TEST10_PROD) $(TEST10_REC)
+	rm -f $(TEST10_LOG)
+	./mx master -b
+	$(TEST10_REC) $(TEST10_DIR) Producer/ > $(TEST10_OUTPUT) &
+	$(TEST10_PROD)
+	./mx quit
+	sleep 1
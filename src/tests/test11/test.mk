@@ -0,0 +1,34 @@
+# tests/test11/test.mk: Makefile fragment for test11.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST11_DIR  := tests/test11
+TEST11_LOG  := $(TEST11_DIR)/*.log $(TEST11_DIR)/*.idx
+
+TEST11_OUTPUT := $(TEST11_DIR)/output.test
+BASE11_OUTPUT := $(TEST11_DIR)/output.base
+
+TESTS += test11
+BASES += base11
+CLEAN += $(TEST11_OUTPUT) $(TEST11_LOG)
+
+test11: $(TEST11_OUTPUT)
+	diff $(TEST11_OUTPUT) $(BASE11_OUTPUT)
+
+base11: $(TEST11_OUTPUT)
+	cp $(TEST11_OUTPUT) $(BASE11_OUTPUT)
+
+# Replay the log written by test10, and record it again.
+
+$(TEST11_OUTPUT): mx $(TEST10_REC) $(TEST10_OUTPUT)
+	rm -f $(TEST11_LOG)
+	./mx master -b
+	$(TEST10_REC) $(TEST11_DIR) mx-replay/ > $(TEST11_OUTPUT) &
+	./mx replay --speed 10 --wait 0.5 $(TEST10_DIR) > /dev/null
+	sleep 1
+	./mx quit
+	sleep 1
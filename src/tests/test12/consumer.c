@@ -0,0 +1,112 @@
+/*
+ * consumer.c: Consumer with dispatch workers for test12.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <semaphore.h>
+
+#include <libjvs/utils.h>
+#include <libjvs/debug.h>
+
+#include "libmx.h"
+
+#define FAST_MESSAGES 1000
+
+static uint32_t slow_msg, fast_msg, done_msg;
+
+static uint32_t fast_count = 0;
+static uint32_t out_of_order = 0;
+static int fast_done_first = 0;
+
+static sem_t fast_done;
+
+/*
+ * Handle the single slow message. It blocks until all fast messages have been
+ * handled, which can only happen if they're handled on a different thread.
+ */
+void handle_slow(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    struct timespec deadline;
+
+    free(payload);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    deadline.tv_sec += 5;
+
+    fast_done_first = (sem_timedwait(&fast_done, &deadline) == 0);
+
+    mxBroadcast(mx, done_msg, 0, NULL, 0);
+
+    mxShutdown(mx);
+}
+
+/*
+ * Handle a fast message, checking that they come in in order.
+ */
+void handle_fast(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint32_t msg_number;
+
+    strunpack(payload, size,
+            PACK_INT32, &msg_number,
+            END);
+
+    free(payload);
+
+    if (msg_number != fast_count) out_of_order++;
+
+    if (++fast_count == FAST_MESSAGES) sem_post(&fast_done);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Consumer");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    sem_init(&fast_done, 0, 0);
+
+    slow_msg = mxRegister(mx, "Test.Slow");
+    fast_msg = mxRegister(mx, "Test.Fast");
+    done_msg = mxRegister(mx, "Test.Done");
+
+    if (mxSetDispatchThreads(mx, 4, MX_DISPATCH_BY_TYPE) != 0) {
+        fputs(mxError(), stderr);
+        return 1;
+    }
+
+    mxSubscribe(mx, slow_msg, handle_slow, NULL);
+    mxSubscribe(mx, fast_msg, handle_fast, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    printf("Handled %u fast messages, %u out of order\n",
+            fast_count, out_of_order);
+    printf("Fast messages handled while the slow handler waited: %s\n",
+            fast_done_first ? "yes" : "no");
+
+    return r;
+}
@@ -0,0 +1,86 @@
+/*
+ * producer.c: Message producer for test12.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libjvs/utils.h>
+#include <libjvs/debug.h>
+
+#include "libmx.h"
+
+#define FAST_MESSAGES 1000
+
+static uint32_t slow_msg, fast_msg, done_msg;
+static int subscribed[2] = { 0 };
+
+/*
+ * Once the consumer has subscribed to both message types, send it one slow
+ * message followed by a lot of fast ones.
+ */
+void on_new_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    uint32_t i;
+
+    subscribed[type == fast_msg] = 1;
+
+    if (!subscribed[0] || !subscribed[1]) return;
+
+    mxBroadcast(mx, slow_msg, 0, NULL, 0);
+
+    for (i = 0; i < FAST_MESSAGES; i++) {
+        mxPackAndBroadcast(mx, fast_msg, 0,
+                PACK_INT32, i,
+                END);
+    }
+}
+
+/*
+ * The consumer is done.
+ */
+void handle_done(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    free(payload);
+
+    mxShutdown(mx);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Producer");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    slow_msg = mxRegister(mx, "Test.Slow");
+    fast_msg = mxRegister(mx, "Test.Fast");
+    done_msg = mxRegister(mx, "Test.Done");
+
+    mxOnNewSubscriber(mx, slow_msg, on_new_subscriber, NULL);
+    mxOnNewSubscriber(mx, fast_msg, on_new_subscriber, NULL);
+
+    mxSubscribe(mx, done_msg, handle_done, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
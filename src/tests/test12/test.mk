@@ -0,0 +1,31 @@
+# tests/test12/test.mk: Makefile fragment for test12.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST12_DIR  := tests/test12
+TEST12_PROD := $(TEST12_DIR)/producer
+TEST12_CONS := $(TEST12_DIR)/consumer
+
+TEST12_OUTPUT := $(TEST12_DIR)/output.test
+BASE12_OUTPUT := $(TEST12_DIR)/output.base
+
+TESTS += test12
+BASES += base12
+CLEAN += $(TEST12_PROD) $(TEST12_CONS) $(TEST12_OUTPUT)
+
+test12: $(TEST12_OUTPUT)
+	diff $(TEST12_OUTPUT) $(BASE12_OUTPUT)
+
+base12: $(TEST12_OUTPUT)
+	cp $(TEST12_OUTPUT) $(BASE12_OUTPUT)
+
+$(TEST12_OUTPUT): mx $(TEST12_PROD) $(TEST12_CONS)
+	./mx master -b
+	$(TEST12_CONS) > $(TEST12_OUTPUT) &
+	$(TEST12_PROD)
+	./mx quit
+	sleep 1
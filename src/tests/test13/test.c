@@ -0,0 +1,95 @@
+/*
+ * test.c: Thread placement test.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <dirent.h>
+
+#include "libmx.h"
+
+/*
+ * Count the threads in this process that may run on other CPUs than CPU 0.
+ */
+static int count_unpinned(void)
+{
+    DIR *dir = opendir("/proc/self/task");
+    struct dirent *entry;
+
+    int count = 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+        char path[300], line[256];
+        FILE *fp;
+
+        if (entry->d_name[0] == '.') continue;
+
+        snprintf(path, sizeof(path), "/proc/self/task/%s/status", entry->d_name);
+
+        if ((fp = fopen(path, "r")) == NULL) continue;
+
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (strncmp(line, "Cpus_allowed_list:", 18) == 0 &&
+                strcmp(line + 18 + strspn(line + 18, " \t"), "0\n") != 0) {
+                count++;
+            }
+        }
+
+        fclose(fp);
+    }
+
+    closedir(dir);
+
+    return count;
+}
+
+/*
+ * Print the result <r> of <what>, and clear any error message.
+ */
+static void report(const char *what, int r)
+{
+    printf("%s: %s\n", what, r == 0 ? "accepted" : "rejected");
+
+    free(mxError());
+}
+
+int main(int argc, char *argv[])
+{
+    MX *mx;
+
+    setenv("MX_AFFINITY", "main=0 reader=0 writer=0 timer=0 listener=0", 1);
+    setenv("MX_SCHEDULING", "timer=other", 1);
+
+    if ((mx = mxClient("localhost", NULL, "Test")) == NULL) {
+        fputs(mxError(), stderr);
+        return 1;
+    }
+
+    printf("Threads not on CPU 0: %d\n", count_unpinned());
+
+    report("CPU list \"0\"", mxSetAffinity(mx, MX_THREAD_TIMER, "0"));
+    report("CPU list \"0-\"", mxSetAffinity(mx, MX_THREAD_TIMER, "0-"));
+    report("CPU list \"node4095\"", mxSetAffinity(mx, MX_THREAD_TIMER, "node4095"));
+    report("All CPUs", mxSetAffinity(mx, MX_THREAD_MAIN, NULL));
+    report("SCHED_OTHER", mxSetScheduling(mx, MX_THREAD_READER, SCHED_OTHER, 0));
+    report("SCHED_FIFO at 1000", mxSetScheduling(mx, MX_THREAD_READER, SCHED_FIFO, 1000));
+
+    mxShutdown(mx);
+    mxDestroy(mx);
+
+    setenv("MX_AFFINITY", "nonsense=0", 1);
+
+    mx = mxClient("localhost", NULL, "Test");
+
+    report("Bad MX_AFFINITY", mx == NULL ? -1 : 0);
+
+    return 0;
+}
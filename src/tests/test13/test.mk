@@ -0,0 +1,29 @@
+# tests/test13/test.mk: Makefile fragment for test13.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST13_DIR  := tests/test13
+TEST13_EXE  := $(TEST13_DIR)/test
+
+TEST13_OUTPUT := $(TEST13_DIR)/output.test
+BASE13_OUTPUT := $(TEST13_DIR)/output.base
+
+TESTS += test13
+BASES += base13
+CLEAN += $(TEST13_EXE) $(TEST13_OUTPUT)
+
+test13: $(TEST13_OUTPUT)
+	diff $(TEST13_OUTPUT) $(BASE13_OUTPUT)
+
+base13: $(TEST13_OUTPUT)
+	cp $(TEST13_OUTPUT) $(BASE13_OUTPUT)
+
+$(TEST13_OUTPUT): mx $(TEST13_EXE)
+	./mx master -b
+	$(TEST13_EXE) > $(TEST13_OUTPUT)
+	./mx quit
+	sleep 1
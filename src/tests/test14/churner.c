@@ -0,0 +1,82 @@
+/*
+ * churner.c: Keeps subscribing and unsubscribing while test14 runs.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "libmx.h"
+
+#define INTERVAL    0.001
+#define DURATION    2.0
+
+static uint32_t data_msg;
+static double stop_time;
+static int subscribed = 0;
+
+/*
+ * Drop data messages.
+ */
+void handle_data(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    free(payload);
+}
+
+/*
+ * Toggle our subscription, which makes the publisher replace its snapshot of
+ * the subscribers while its threads are using it.
+ */
+void toggle(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    if (t >= stop_time) {
+        mxShutdown(mx);
+        return;
+    }
+
+    if (subscribed) {
+        mxCancel(mx, data_msg);
+    }
+    else {
+        mxSubscribe(mx, data_msg, handle_data, NULL);
+    }
+
+    subscribed = !subscribed;
+
+    mxAdjustTimer(mx, timer, t + INTERVAL);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Churner");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    data_msg = mxRegister(mx, "Test.Data");
+
+    stop_time = mxNow() + DURATION;
+
+    mxCreateTimer(mx, mxNow() + INTERVAL, toggle, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
@@ -0,0 +1,121 @@
+/*
+ * publisher.c: Multi-threaded publisher for test14.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libjvs/utils.h>
+#include <libjvs/debug.h>
+
+#include "libmx.h"
+
+#define THREADS     4
+#define MESSAGES    20000
+
+static uint32_t data_msg, end_msg, done_msg;
+static int subscribed[2] = { 0 };
+static int subscriber_fd = -1;
+
+static MX *mx;
+static pthread_t thread[THREADS];
+
+/*
+ * Broadcast MESSAGES data messages, then send an end message directly to the
+ * subscriber. Runs on its own thread.
+ */
+static void *publish(void *arg)
+{
+    uint32_t i, id = (uintptr_t) arg;
+
+    for (i = 0; i < MESSAGES; i++) {
+        mxPackAndBroadcast(mx, data_msg, 0,
+                PACK_INT32, id,
+                PACK_INT32, i,
+                END);
+    }
+
+    mxPackAndSend(mx, subscriber_fd, end_msg, 0,
+            PACK_INT32, id,
+            END);
+
+    return NULL;
+}
+
+/*
+ * Once the subscriber has subscribed to both message types, start the
+ * publishing threads. The churner's subscriptions come and go, and are ignored.
+ */
+void on_new_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    uintptr_t i;
+
+    if (strncmp(mxComponentName(mx, fd), "Subscriber", 10) != 0) return;
+
+    subscribed[type == end_msg] = 1;
+
+    if (!subscribed[0] || !subscribed[1]) return;
+
+    subscriber_fd = fd;
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&thread[i], NULL, publish, (void *) i);
+    }
+}
+
+/*
+ * The subscriber is done.
+ */
+void handle_done(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    int i;
+
+    free(payload);
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(thread[i], NULL);
+    }
+
+    mxShutdown(mx);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    mx = mxClient("localhost", NULL, "Publisher");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    data_msg = mxRegister(mx, "Test.Data");
+    end_msg  = mxRegister(mx, "Test.End");
+    done_msg = mxRegister(mx, "Test.Done");
+
+    mxOnNewSubscriber(mx, data_msg, on_new_subscriber, NULL);
+    mxOnNewSubscriber(mx, end_msg, on_new_subscriber, NULL);
+
+    mxSubscribe(mx, done_msg, handle_done, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
@@ -0,0 +1,107 @@
+/*
+ * subscriber.c: Subscriber for test14.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+#include <libjvs/debug.h>
+
+#include "libmx.h"
+
+#define THREADS     4
+
+static uint32_t data_msg, end_msg, done_msg;
+
+static uint32_t count[THREADS] = { 0 };
+static uint32_t out_of_order[THREADS] = { 0 };
+static int ended = 0;
+
+/*
+ * Handle a data message, checking that each thread's messages come in in
+ * order.
+ */
+void handle_data(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint32_t id, msg_number;
+
+    strunpack(payload, size,
+            PACK_INT32, &id,
+            PACK_INT32, &msg_number,
+            END);
+
+    free(payload);
+
+    if (id >= THREADS) return;
+
+    if (msg_number != count[id]) out_of_order[id]++;
+
+    count[id]++;
+}
+
+/*
+ * Handle an end message. Once all threads are done, tell the publisher.
+ */
+void handle_end(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    free(payload);
+
+    if (++ended < THREADS) return;
+
+    mxBroadcast(mx, done_msg, 0, NULL, 0);
+}
+
+/*
+ * Once the publisher has seen our done message and gone away, we're done too.
+ */
+void on_end_component(MX *mx, int fd, const char *name, void *udata)
+{
+    if (strncmp(name, "Publisher", 9) == 0) mxShutdown(mx);
+}
+
+int main(int argc, char *argv[])
+{
+    int i, r;
+
+    MX *mx = mxClient("localhost", NULL, "Subscriber");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    data_msg = mxRegister(mx, "Test.Data");
+    end_msg  = mxRegister(mx, "Test.End");
+    done_msg = mxRegister(mx, "Test.Done");
+
+    mxSubscribe(mx, data_msg, handle_data, NULL);
+    mxSubscribe(mx, end_msg, handle_end, NULL);
+
+    mxOnEndComponent(mx, on_end_component, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    for (i = 0; i < THREADS; i++) {
+        printf("Thread %d: %u messages, %u out of order\n",
+                i, count[i], out_of_order[i]);
+    }
+
+    return r;
+}
@@ -0,0 +1,34 @@
+# tests/test14/test.mk: Makefile fragment for test14.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST14_DIR  := tests/test14
+TEST14_PUB  := $(TEST14_DIR)/publisher
+TEST14_SUB  := $(TEST14_DIR)/subscriber
+TEST14_CHRN := $(TEST14_DIR)/churner
+
+TEST14_OUTPUT := $(TEST14_DIR)/output.test
+BASE14_OUTPUT := $(TEST14_DIR)/output.base
+
+TESTS += test14
+BASES += base14
+CLEAN += $(TEST14_PUB) $(TEST14_SUB) $(TEST14_CHRN) $(TEST14_OUTPUT)
+
+test14: $(TEST14_OUTPUT)
+	diff $(TEST14_OUTPUT) $(BASE14_OUTPUT)
+
+base14: $(TEST14_OUTPUT)
+	cp $(TEST14_OUTPUT) $(BASE14_OUTPUT)
+
+$(TEST14_OUTPUT): mx $(TEST14_PUB) $(TEST14_SUB) $(TEST14_CHRN)
+	./mx master -b
+	$(TEST14_CHRN) &
+	$(TEST14_SUB) > $(TEST14_OUTPUT) &
+	$(TEST14_PUB)
+	sleep 2
+	./mx quit
+	sleep 1
@@ -0,0 +1,109 @@
+/*
+ * receiver.c: Message receiver for test15.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+
+#include "libmx.h"
+
+static char *reference = NULL;
+static uint32_t reference_size = 0;
+
+/*
+ * Print the fields in <payload>.
+ */
+static void print_fields(const char *payload, uint32_t size)
+{
+    uint8_t i8;
+    uint16_t i16;
+    uint32_t i32, data_size;
+    uint64_t i64;
+    float f;
+    double d;
+    char *str, *data, raw[4] = { 0 };
+
+    strunpack(payload, size,
+            PACK_INT8,   &i8,
+            PACK_INT16,  &i16,
+            PACK_INT32,  &i32,
+            PACK_INT64,  &i64,
+            PACK_FLOAT,  &f,
+            PACK_DOUBLE, &d,
+            PACK_STRING, &str,
+            PACK_DATA,   &data, &data_size,
+            PACK_RAW,    raw, (size_t) 3,
+            END);
+
+    printf("\t%d %d 0x%X 0x%lX %.5f %.5f \"%.20s\" (%zu) \"%.*s\" \"%s\"\n",
+            (int8_t) i8, (int16_t) i16, i32, (unsigned long) i64, f, d,
+            str, strlen(str), (int) data_size, data, raw);
+
+    free(str);
+    free(data);
+}
+
+void on_end_component(MX *mx, int fd, const char *name, void *udata)
+{
+    mxShutdown(mx);
+}
+
+void msg_handler(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    if (version % 5 == 0) {
+        free(reference);
+
+        reference = payload;
+        reference_size = size;
+
+        printf("Version %u: %u bytes\n", version, size);
+
+        print_fields(payload, size);
+    }
+    else {
+        printf("Version %u: %u bytes, %s\n", version, size,
+                size == reference_size && memcmp(payload, reference, size) == 0 ?
+                "same as reference" : "DIFFERENT from reference");
+
+        free(payload);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Receiver");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    mxSubscribe(mx, mxRegister(mx, "Test"), msg_handler, NULL);
+
+    mxOnEndComponent(mx, on_end_component, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    free(reference);
+
+    return r;
+}
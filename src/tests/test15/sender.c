@@ -0,0 +1,128 @@
+/*
+ * sender.c: Message sender for test15.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+
+#include "libmx.h"
+
+static uint32_t test_msg;
+
+static MX_Layout *layout;
+
+static char long_string[5000];
+
+/*
+ * Send a message with string <str> in every possible way, starting with
+ * version <version>. The first one is packed by libjvs, to compare the others
+ * with.
+ */
+static void send_all(MX *mx, int fd, uint32_t version, const char *str)
+{
+    char *payload;
+
+    size_t size = astrpack(&payload,
+            PACK_INT8,   -8,
+            PACK_INT16,  -16,
+            PACK_INT32,  0xDEADBEEF,
+            PACK_INT64,  0x0123456789ABCDEFULL,
+            PACK_FLOAT,  3.14159,
+            PACK_DOUBLE, 2.71828,
+            PACK_STRING, str,
+            PACK_DATA,   "data", 4,
+            PACK_RAW,    "raw", (size_t) 3,
+            END);
+
+    mxSend(mx, fd, test_msg, version++, payload, size);
+
+    free(payload);
+
+    mxPackAndSend(mx, fd, test_msg, version++,
+            PACK_INT8,   -8,
+            PACK_INT16,  -16,
+            PACK_INT32,  0xDEADBEEF,
+            PACK_INT64,  0x0123456789ABCDEFULL,
+            PACK_FLOAT,  3.14159,
+            PACK_DOUBLE, 2.71828,
+            PACK_STRING, str,
+            PACK_DATA,   "data", 4,
+            PACK_RAW,    "raw", (size_t) 3,
+            END);
+
+    mxSendWithLayout(mx, fd, test_msg, version++, layout,
+            -8, -16, 0xDEADBEEF, 0x0123456789ABCDEFULL, 3.14159, 2.71828,
+            str, "data", 4, "raw", (size_t) 3);
+
+    mxPackAndBroadcast(mx, test_msg, version++,
+            PACK_INT8,   -8,
+            PACK_INT16,  -16,
+            PACK_INT32,  0xDEADBEEF,
+            PACK_INT64,  0x0123456789ABCDEFULL,
+            PACK_FLOAT,  3.14159,
+            PACK_DOUBLE, 2.71828,
+            PACK_STRING, str,
+            PACK_DATA,   "data", 4,
+            PACK_RAW,    "raw", (size_t) 3,
+            END);
+
+    mxBroadcastWithLayout(mx, test_msg, version++, layout,
+            -8, -16, 0xDEADBEEF, 0x0123456789ABCDEFULL, 3.14159, 2.71828,
+            str, "data", 4, "raw", (size_t) 3);
+}
+
+void on_time(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    mxShutdown(mx);
+}
+
+void on_new_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    send_all(mx, fd, 0, "Short string");
+    send_all(mx, fd, 5, long_string);
+
+    mxCreateTimer(mx, mxNow() + 1, on_time, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Sender");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    memset(long_string, 'x', sizeof(long_string) - 1);
+
+    test_msg = mxRegister(mx, "Test");
+
+    layout = mxCreateLayout(PACK_INT8, PACK_INT16, PACK_INT32, PACK_INT64,
+            PACK_FLOAT, PACK_DOUBLE, PACK_STRING, PACK_DATA, PACK_RAW, END);
+
+    mxOnNewSubscriber(mx, test_msg, on_new_subscriber, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    mxDestroyLayout(layout);
+
+    return r;
+}
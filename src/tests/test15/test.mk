@@ -0,0 +1,31 @@
+# tests/test15/test.mk: Makefile fragment for test15.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST15_DIR  := tests/test15
+TEST15_SEND := $(TEST15_DIR)/sender
+TEST15_RECV := $(TEST15_DIR)/receiver
+
+TEST15_OUTPUT := $(TEST15_DIR)/output.test
+BASE15_OUTPUT := $(TEST15_DIR)/output.base
+
+TESTS += test15
+BASES += base15
+CLEAN += $(TEST15_SEND) $(TEST15_RECV) $(TEST15_OUTPUT)
+
+test15: $(TEST15_OUTPUT)
+	diff $(TEST15_OUTPUT) $(BASE15_OUTPUT)
+
+base15: $(TEST15_OUTPUT)
+	cp $(TEST15_OUTPUT) $(BASE15_OUTPUT)
+
+$(TEST15_OUTPUT): mx $(TEST15_SEND) $(TEST15_RECV)
+	./mx master -b
+	$(TEST15_RECV) > $(TEST15_OUTPUT) &
+	$(TEST15_SEND)
+	./mx quit
+	sleep 1
@@ -0,0 +1,76 @@
+/*
+ * receiver.c: Message receiver for test16.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+
+#include "libmx.h"
+
+#define TICKS 3
+
+static int sender_fd = -1;
+
+/*
+ * Handle a tick. The sender has to wake us up for every one of them, and each
+ * time we should take its connection over on the fd we already know it by.
+ */
+void handle_tick(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint32_t tick;
+
+    strunpack(payload, size, PACK_INT32, &tick, END);
+
+    printf("Receiver: received tick %d on the %s fd.\n", tick,
+            fd == sender_fd ? "sender's" : "wrong");
+
+    if (tick == TICKS) mxShutdown(mx);
+}
+
+void on_new_component(MX *mx, int fd, const char *name, void *udata)
+{
+    if (strncmp(name, "Sender", 6) != 0) return;
+
+    printf("Receiver: sender has joined.\n");
+
+    sender_fd = fd;
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Receiver");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    mxOnNewComponent(mx, on_new_component, NULL);
+
+    mxSubscribe(mx, mxRegister(mx, "Tick"), handle_tick, NULL);
+
+    r = mxRun(mx);
+
+    printf("Receiver: mxRun returned %d.\n", r);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
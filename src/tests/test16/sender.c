@@ -0,0 +1,106 @@
+/*
+ * sender.c: Message sender for test16.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+#include <libjvs/utils.h>
+
+#include "libmx.h"
+
+#define IDLE_TIMEOUT 0.5
+#define IDLE_PERIOD  2.0
+#define TICKS        3
+
+static uint32_t tick_msg;
+
+static int receiver_fd = -1;
+static int ticks_sent = 0;
+
+/*
+ * Return true if we have an open connection on <fd>. Dormant components keep
+ * their fd, but it isn't connected to anything.
+ */
+static bool is_connected(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    return getpeername(fd, (struct sockaddr *) &addr, &len) == 0;
+}
+
+/*
+ * Send the next tick to the receiver, which should be dormant by now.
+ */
+void on_time(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    printf("Sender: receiver is %s before tick %d.\n",
+            is_connected(receiver_fd) ? "connected" : "dormant",
+            ticks_sent + 1);
+
+    mxPackAndSend(mx, receiver_fd, tick_msg, 0,
+            PACK_INT32, ++ticks_sent,
+            END);
+
+    if (ticks_sent < TICKS) {
+        mxCreateTimer(mx, t + IDLE_PERIOD, on_time, NULL);
+    }
+}
+
+void on_new_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    printf("Sender: receiver subscribes to Tick messages.\n");
+
+    receiver_fd = fd;
+
+    mxCreateTimer(mx, mxNow() + IDLE_PERIOD, on_time, NULL);
+}
+
+void on_end_component(MX *mx, int fd, const char *name, void *udata)
+{
+    if (fd != receiver_fd) return;
+
+    printf("Sender: receiver has left.\n");
+
+    mxShutdown(mx);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Sender");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    mxSetIdleTimeout(mx, IDLE_TIMEOUT);
+
+    tick_msg = mxRegister(mx, "Tick");
+
+    mxOnNewSubscriber(mx, tick_msg, on_new_subscriber, NULL);
+    mxOnEndComponent(mx, on_end_component, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
@@ -0,0 +1,36 @@
+# tests/test16/test.mk: Makefile fragment for test16. Sends messages between
+# two components in lazy mode, with idle periods in between that are longer
+# than the idle timeout.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST16_DIR  := tests/test16
+TEST16_SEND := $(TEST16_DIR)/sender
+TEST16_RECV := $(TEST16_DIR)/receiver
+
+TEST16_OUTPUT := $(TEST16_DIR)/output.test
+BASE16_OUTPUT := $(TEST16_DIR)/output.base
+
+TESTS += test16
+BASES += base16
+CLEAN += $(TEST16_SEND) $(TEST16_RECV) $(TEST16_OUTPUT)
+
+test16: $(TEST16_OUTPUT)
+	diff $(TEST16_OUTPUT) $(BASE16_OUTPUT)
+
+base16: $(TEST16_OUTPUT)
+	cp $(TEST16_OUTPUT) $(BASE16_OUTPUT)
+
+$(TEST16_OUTPUT): mx $(TEST16_SEND) $(TEST16_RECV)
+	./mx master -b -l
+	$(TEST16_RECV) > $(TEST16_DIR)/receiver.test &
+	sleep 1
+	$(TEST16_SEND) > $(TEST16_DIR)/sender.test
+	./mx quit
+	sleep 1
+	cat $(TEST16_DIR)/sender.test $(TEST16_DIR)/receiver.test > $(TEST16_OUTPUT)
+	rm $(TEST16_DIR)/sender.test $(TEST16_DIR)/receiver.test
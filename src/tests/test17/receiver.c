@@ -0,0 +1,120 @@
+/*
+ * receiver.c: Message receiver for test17.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+
+#include "libmx.h"
+
+static uint32_t alpha_msg, beta_msg, unfiltered_msg, filtered_msg, round_msg;
+static uint32_t unused_msg;
+
+/*
+ * Print the return value <r> of <call>, and the notice or error it left if
+ * there is one.
+ */
+static void report(const char *call, int r)
+{
+    printf("Receiver: %s returned %d.\n", call, r);
+
+    if (r != 0) {
+        char *msg = mxError();
+
+        printf("Receiver: %s", msg);
+
+        free(msg);
+    }
+}
+
+void handle_msg(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint32_t value;
+
+    strunpack(payload, size, PACK_INT32, &value, END);
+
+    free(payload);
+
+    if (type != round_msg) {
+        printf("Receiver: received %s %d.\n", mxMessageName(mx, type), value);
+    }
+    else if (value == 1) {
+        /* Cancel a subset, plus a type we never subscribed to. */
+
+        uint32_t types[] = { beta_msg, unfiltered_msg, filtered_msg, unused_msg };
+
+        printf("Receiver: end of round 1.\n");
+
+        report("mxCancelMany", mxCancelMany(mx, types, 4));
+    }
+    else {
+        printf("Receiver: end of round 2.\n");
+
+        mxShutdown(mx);
+    }
+}
+
+/*
+ * Subscribe once we're connected to the sender, so that it hears about each
+ * call separately.
+ */
+void on_ready(MX *mx, void *udata)
+{
+    static const uint64_t two[] = { 2 };
+
+    MX_Filter filter = { 0, 4, MX_FILTER_EQUALS, 1, two };
+
+    /* Unfiltered starts out with a filter, which mxSubscribeMany removes again.
+     * Filtered keeps its filter, because it isn't in the list. */
+
+    uint32_t types[] = { alpha_msg, beta_msg, unfiltered_msg, round_msg };
+
+    mxSubscribeFiltered(mx, unfiltered_msg, &filter, handle_msg, NULL);
+    mxSubscribeFiltered(mx, filtered_msg, &filter, handle_msg, NULL);
+
+    report("mxSubscribeMany", mxSubscribeMany(mx, types, 4, handle_msg, NULL));
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Receiver");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    alpha_msg      = mxRegister(mx, "Alpha");
+    beta_msg       = mxRegister(mx, "Beta");
+    unfiltered_msg = mxRegister(mx, "Unfiltered");
+    filtered_msg   = mxRegister(mx, "Filtered");
+    round_msg      = mxRegister(mx, "Round");
+    unused_msg     = mxRegister(mx, "Unused");
+
+    mxOnReady(mx, on_ready, NULL);
+
+    r = mxRun(mx);
+
+    printf("Receiver: mxRun returned %d.\n", r);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
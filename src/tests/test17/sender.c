@@ -0,0 +1,120 @@
+/*
+ * sender.c: Message sender for test17.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+
+#include "libmx.h"
+
+static uint32_t alpha_msg, beta_msg, unfiltered_msg, filtered_msg, round_msg;
+
+static int cancellations = 0;
+
+/*
+ * Broadcast message type <type> with value <value>. Broadcasting (rather than
+ * sending) applies the subscribers' filters.
+ */
+static void broadcast_value(MX *mx, uint32_t type, uint32_t value)
+{
+    mxPackAndBroadcast(mx, type, 0, PACK_INT32, value, END);
+}
+
+/*
+ * Broadcast a round of messages, ending with a Round message with number
+ * <round>. Of values 1 to 3, only 2 passes the receiver's filter.
+ */
+static void broadcast_round(MX *mx, uint32_t round)
+{
+    uint32_t value;
+
+    broadcast_value(mx, alpha_msg, round);
+    broadcast_value(mx, beta_msg, round);
+
+    for (value = 1; value <= 3; value++) {
+        broadcast_value(mx, unfiltered_msg, value);
+        broadcast_value(mx, filtered_msg, value);
+    }
+
+    broadcast_value(mx, round_msg, round);
+}
+
+void on_new_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    printf("Sender: receiver subscribes to %s.\n", mxMessageName(mx, type));
+
+    /* Round is the last type in the receiver's mxSubscribeMany. */
+
+    if (type == round_msg) broadcast_round(mx, 1);
+}
+
+void on_end_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    printf("Sender: receiver cancels %s.\n", mxMessageName(mx, type));
+
+    /* The receiver cancels three types in a single mxCancelMany. */
+
+    if (++cancellations == 3) broadcast_round(mx, 2);
+}
+
+void on_end_component(MX *mx, int fd, const char *name, void *udata)
+{
+    if (strncmp(name, "Receiver", 8) != 0) return;
+
+    printf("Sender: receiver has left.\n");
+
+    mxShutdown(mx);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Sender");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    /* Register in the same order as the receiver, so that both get the same
+     * message type numbers whoever gets there first. */
+
+    alpha_msg      = mxRegister(mx, "Alpha");
+    beta_msg       = mxRegister(mx, "Beta");
+    unfiltered_msg = mxRegister(mx, "Unfiltered");
+    filtered_msg   = mxRegister(mx, "Filtered");
+    round_msg      = mxRegister(mx, "Round");
+
+    mxOnNewSubscriber(mx, alpha_msg, on_new_subscriber, NULL);
+    mxOnNewSubscriber(mx, beta_msg, on_new_subscriber, NULL);
+    mxOnNewSubscriber(mx, unfiltered_msg, on_new_subscriber, NULL);
+    mxOnNewSubscriber(mx, filtered_msg, on_new_subscriber, NULL);
+    mxOnNewSubscriber(mx, round_msg, on_new_subscriber, NULL);
+
+    mxOnEndSubscriber(mx, beta_msg, on_end_subscriber, NULL);
+    mxOnEndSubscriber(mx, unfiltered_msg, on_end_subscriber, NULL);
+    mxOnEndSubscriber(mx, filtered_msg, on_end_subscriber, NULL);
+
+    mxOnEndComponent(mx, on_end_component, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
@@ -0,0 +1,35 @@
+# tests/test17/test.mk: Makefile fragment for test17. Subscribes to, and
+# cancels, several message types at once.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST17_DIR  := tests/test17
+TEST17_SEND := $(TEST17_DIR)/sender
+TEST17_RECV := $(TEST17_DIR)/receiver
+
+TEST17_OUTPUT := $(TEST17_DIR)/output.test
+BASE17_OUTPUT := $(TEST17_DIR)/output.base
+
+TESTS += test17
+BASES += base17
+CLEAN += $(TEST17_SEND) $(TEST17_RECV) $(TEST17_OUTPUT)
+
+test17: $(TEST17_OUTPUT)
+	diff $(TEST17_OUTPUT) $(BASE17_OUTPUT)
+
+base17: $(TEST17_OUTPUT)
+	cp $(TEST17_OUTPUT) $(BASE17_OUTPUT)
+
+$(TEST17_OUTPUT): mx $(TEST17_SEND) $(TEST17_RECV)
+	./mx master -b
+	$(TEST17_SEND) > $(TEST17_DIR)/sender.test &
+	sleep 1
+	$(TEST17_RECV) > $(TEST17_DIR)/receiver.test
+	./mx quit
+	sleep 1
+	cat $(TEST17_DIR)/sender.test $(TEST17_DIR)/receiver.test > $(TEST17_OUTPUT)
+	rm $(TEST17_DIR)/sender.test $(TEST17_DIR)/receiver.test
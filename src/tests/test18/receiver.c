@@ -0,0 +1,106 @@
+/*
+ * receiver.c: Message receiver for test18.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+
+#include "libmx.h"
+
+/*
+ * Print the return value <r> of <call>, and the notice or error it left if
+ * there is one.
+ */
+static void report(const char *call, int r)
+{
+    printf("Receiver: %s returned %d.\n", call, r);
+
+    if (r != 0) {
+        char *msg = mxError();
+
+        printf("Receiver: %s", msg);
+
+        free(msg);
+    }
+}
+
+void handle_msg(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint32_t round;
+
+    strunpack(payload, size, PACK_INT32, &round, END);
+
+    free(payload);
+
+    printf("Receiver: received %s %d.\n", mxMessageName(mx, type), round);
+}
+
+void handle_round(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint32_t round;
+
+    strunpack(payload, size, PACK_INT32, &round, END);
+
+    free(payload);
+
+    printf("Receiver: end of round %d.\n", round);
+
+    if (round == 1) {
+        report("mxCancelPattern(\"Quote.*\")", mxCancelPattern(mx, "Quote.*"));
+    }
+    else if (round == 2) {
+        report("mxCancelPattern(\"Quote.*\")", mxCancelPattern(mx, "Quote.*"));
+        report("mxCancelPattern(\"Quote.EUR*\")",
+                mxCancelPattern(mx, "Quote.EUR*"));
+    }
+    else {
+        mxShutdown(mx);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Receiver");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    report("mxSubscribePattern(\"Quote.*\")",
+            mxSubscribePattern(mx, "Quote.*", handle_msg, NULL));
+    report("mxSubscribePattern(\"Quote.EUR*\")",
+            mxSubscribePattern(mx, "Quote.EUR*", handle_msg, NULL));
+    report("mxSubscribePattern(\"Trade\")",
+            mxSubscribePattern(mx, "Trade", handle_msg, NULL));
+    report("mxSubscribePattern(\"Trade*x\")",
+            mxSubscribePattern(mx, "Trade*x", handle_msg, NULL));
+
+    mxSubscribePattern(mx, "Round", handle_round, NULL);
+
+    r = mxRun(mx);
+
+    printf("Receiver: mxRun returned %d.\n", r);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
@@ -0,0 +1,129 @@
+/*
+ * sender.c: Message sender for test18.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+
+#include "libmx.h"
+
+/* We only register these once the receiver is there, so none of them exist
+ * yet when it subscribes to its patterns. */
+
+static const char *names[] = {
+    "Quote.EURUSD", "Quote.GBPUSD", "Trade", "Trades", "Other"
+};
+
+#define NUM_NAMES (sizeof(names) / sizeof(names[0]))
+
+static uint32_t types[NUM_NAMES];
+static uint32_t round_msg;
+
+static int round_number = 0;
+
+/*
+ * Broadcast one message of each type, followed by a Round message.
+ */
+static void broadcast_round(MX *mx)
+{
+    int i;
+
+    round_number++;
+
+    for (i = 0; i < NUM_NAMES; i++) {
+        mxPackAndBroadcast(mx, types[i], 0, PACK_INT32, round_number, END);
+    }
+
+    mxPackAndBroadcast(mx, round_msg, 0, PACK_INT32, round_number, END);
+}
+
+void on_time(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    broadcast_round(mx);
+}
+
+void on_new_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    printf("Sender: receiver subscribes to %s.\n", mxMessageName(mx, type));
+
+    /* The receiver hears about our new message types from the master, and
+     * only subscribes to them when it does. Give it some time for that. */
+
+    if (type == round_msg) mxCreateTimer(mx, mxNow() + 0.5, on_time, NULL);
+}
+
+void on_end_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    printf("Sender: receiver cancels %s.\n", mxMessageName(mx, type));
+
+    /* Cancelling "Quote.*" only ends the subscription to Quote.GBPUSD, because
+     * "Quote.EUR*" still covers Quote.EURUSD. */
+
+    broadcast_round(mx);
+}
+
+/*
+ * Register our message types when the receiver has joined. Its patterns follow
+ * its introduction, so we'll hear about its subscriptions after this.
+ */
+void on_new_component(MX *mx, int fd, const char *name, void *udata)
+{
+    int i;
+
+    if (strncmp(name, "Receiver", 8) != 0) return;
+
+    for (i = 0; i < NUM_NAMES; i++) {
+        types[i] = mxRegister(mx, names[i]);
+
+        mxOnNewSubscriber(mx, types[i], on_new_subscriber, NULL);
+        mxOnEndSubscriber(mx, types[i], on_end_subscriber, NULL);
+    }
+
+    round_msg = mxRegister(mx, "Round");
+
+    mxOnNewSubscriber(mx, round_msg, on_new_subscriber, NULL);
+}
+
+void on_end_component(MX *mx, int fd, const char *name, void *udata)
+{
+    if (strncmp(name, "Receiver", 8) != 0) return;
+
+    printf("Sender: receiver has left.\n");
+
+    mxShutdown(mx);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Sender");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    mxOnNewComponent(mx, on_new_component, NULL);
+    mxOnEndComponent(mx, on_end_component, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
@@ -0,0 +1,36 @@
+# tests/test18/test.mk: Makefile fragment for test18. Subscribes to message
+# name patterns before the matching message types exist, and cancels them
+# again.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST18_DIR  := tests/test18
+TEST18_SEND := $(TEST18_DIR)/sender
+TEST18_RECV := $(TEST18_DIR)/receiver
+
+TEST18_OUTPUT := $(TEST18_DIR)/output.test
+BASE18_OUTPUT := $(TEST18_DIR)/output.base
+
+TESTS += test18
+BASES += base18
+CLEAN += $(TEST18_SEND) $(TEST18_RECV) $(TEST18_OUTPUT)
+
+test18: $(TEST18_OUTPUT)
+	diff $(TEST18_OUTPUT) $(BASE18_OUTPUT)
+
+base18: $(TEST18_OUTPUT)
+	cp $(TEST18_OUTPUT) $(BASE18_OUTPUT)
+
+$(TEST18_OUTPUT): mx $(TEST18_SEND) $(TEST18_RECV)
+	./mx master -b
+	$(TEST18_SEND) > $(TEST18_DIR)/sender.test &
+	sleep 1
+	$(TEST18_RECV) > $(TEST18_DIR)/receiver.test
+	./mx quit
+	sleep 1
+	cat $(TEST18_DIR)/sender.test $(TEST18_DIR)/receiver.test > $(TEST18_OUTPUT)
+	rm $(TEST18_DIR)/sender.test $(TEST18_DIR)/receiver.test
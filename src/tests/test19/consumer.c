@@ -0,0 +1,103 @@
+/*
+ * consumer.c: Late message consumer for test19.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+
+#include "libmx.h"
+
+static const char *mode;
+
+void handle_quote(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint32_t instrument, price;
+
+    strunpack(payload, size,
+            PACK_INT32, &instrument,
+            PACK_INT32, &price,
+            END);
+
+    free(payload);
+
+    printf("Consumer %s: quote for instrument %d: %d.\n",
+            mode, instrument, price);
+}
+
+void handle_status(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    char *status;
+
+    strunpack(payload, size, PACK_STRING, &status, END);
+
+    free(payload);
+
+    printf("Consumer %s: status %s.\n", mode, status);
+
+    free(status);
+}
+
+/*
+ * The cached values are sent as soon as the producer sees our subscription, so
+ * by now we have everything we're going to get.
+ */
+void on_time(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    mxShutdown(mx);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    static const uint64_t two[] = { 2 };
+
+    MX_Filter filter = { 0, 4, MX_FILTER_EQUALS, 1, two };
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s all|filtered\n", argv[0]);
+        return 1;
+    }
+
+    mode = argv[1];
+
+    MX *mx = mxClient("localhost", NULL, "Consumer");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    if (strcmp(mode, "all") == 0) {
+        mxSubscribe(mx, mxRegister(mx, "Quote"), handle_quote, NULL);
+        mxSubscribe(mx, mxRegister(mx, "Status"), handle_status, NULL);
+    }
+    else {
+        mxSubscribeFiltered(mx, mxRegister(mx, "Quote"), &filter,
+                handle_quote, NULL);
+    }
+
+    mxCreateTimer(mx, mxNow() + 1, on_time, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
@@ -0,0 +1,77 @@
+/*
+ * producer.c: Caching message producer for test19.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+
+#include "libmx.h"
+
+static int consumers = 2;
+
+void on_end_component(MX *mx, int fd, const char *name, void *udata)
+{
+    if (strncmp(name, "Consumer", 8) != 0) return;
+
+    if (--consumers == 0) {
+        printf("Producer: all consumers have left.\n");
+
+        mxShutdown(mx);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+    uint32_t quote_msg, status_msg;
+
+    MX *mx = mxClient("localhost", NULL, "Producer");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    quote_msg  = mxRegister(mx, "Quote");
+    status_msg = mxRegister(mx, "Status");
+
+    /* Quotes are keyed by the instrument id in their first 4 bytes. There is
+     * only one status. */
+
+    printf("Producer: mxSetCache for Quote returned %d.\n",
+            mxSetCache(mx, quote_msg, 0, 4));
+    printf("Producer: mxSetCache for Status returned %d.\n",
+            mxSetCache(mx, status_msg, 0, 0));
+
+    /* Nobody is listening yet. Instrument 1 is updated after instrument 2 has
+     * been added, but it keeps its place in the cache. */
+
+    mxPackAndBroadcast(mx, quote_msg, 0, PACK_INT32, 1, PACK_INT32, 100, END);
+    mxPackAndBroadcast(mx, quote_msg, 0, PACK_INT32, 2, PACK_INT32, 200, END);
+    mxPackAndBroadcast(mx, quote_msg, 0, PACK_INT32, 1, PACK_INT32, 101, END);
+
+    mxPackAndBroadcast(mx, status_msg, 0, PACK_STRING, "starting", END);
+    mxPackAndBroadcast(mx, status_msg, 0, PACK_STRING, "running", END);
+
+    mxOnEndComponent(mx, on_end_component, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
@@ -0,0 +1,39 @@
+# tests/test19/test.mk: Makefile fragment for test19. A producer caches the
+# values it broadcasts, and consumers that subscribe later get them anyway.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST19_DIR  := tests/test19
+TEST19_PROD := $(TEST19_DIR)/producer
+TEST19_CONS := $(TEST19_DIR)/consumer
+
+TEST19_OUTPUT := $(TEST19_DIR)/output.test
+BASE19_OUTPUT := $(TEST19_DIR)/output.base
+
+TESTS += test19
+BASES += base19
+CLEAN += $(TEST19_PROD) $(TEST19_CONS) $(TEST19_OUTPUT)
+
+test19: $(TEST19_OUTPUT)
+	diff $(TEST19_OUTPUT) $(BASE19_OUTPUT)
+
+base19: $(TEST19_OUTPUT)
+	cp $(TEST19_OUTPUT) $(BASE19_OUTPUT)
+
+$(TEST19_OUTPUT): mx $(TEST19_PROD) $(TEST19_CONS)
+	./mx master -b
+	$(TEST19_PROD) > $(TEST19_DIR)/producer.test &
+	sleep 1
+	$(TEST19_CONS) all > $(TEST19_DIR)/all.test &
+	$(TEST19_CONS) filtered > $(TEST19_DIR)/filtered.test
+	sleep 1
+	./mx quit
+	sleep 1
+	cat $(TEST19_DIR)/producer.test $(TEST19_DIR)/all.test \
+	    $(TEST19_DIR)/filtered.test > $(TEST19_OUTPUT)
+	rm $(TEST19_DIR)/producer.test $(TEST19_DIR)/all.test \
+	    $(TEST19_DIR)/filtered.test
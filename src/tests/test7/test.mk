@@ -0,0 +1,32 @@
+# tests/test7/test.mk: Makefile fragment for test7. This is test1 again, but
+# with the master in lazy mode.
+#
+# Copyright:	(c) 2014-2025 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST7_DIR  := tests/test7
+TEST7_LOG  := $(TEST7_DIR)/*.log
+
+TEST7_OUTPUT := $(TEST7_DIR)/output.test
+BASE7_OUTPUT := $(TEST7_DIR)/output.base
+
+TESTS += test7
+BASES += base7
+CLEAN += $(TEST7_OUTPUT) $(TEST7_LOG)
+
+test7: $(TEST7_OUTPUT)
+	diff $(TEST7_OUTPUT) $(BASE7_OUTPUT)
+
+base7: $(TEST7_OUTPUT)
+	cp $(TEST7_OUTPUT) $(BASE7_OUTPUT)
+
+$(TEST7_OUTPUT): mx $(TEST1_PING) $(TEST1_OBS) $(TEST1_ECHO)
+	./mx master -b -l
+	export LC_ALL=C; $(TEST1_OBS) | sort > $(TEST7_OUTPUT) &
+	$(TEST1_ECHO) &
+	$(TEST1_PING)
+	./mx quit
+	sleep 1
@@ -0,0 +1,93 @@
+/*
+ * consumer.c: Filtering message consumer for test8.
+ *
+ * Copyright:	(c) 2014-2025 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+#include <libjvs/debug.h>
+
+#include "libmx.h"
+
+static uint32_t test_msg;
+static int received[10] = { 0 };
+
+void msg_handler(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    uint32_t msg_number;
+
+    strunpack(payload, size,
+            PACK_INT32, &msg_number,
+            END);
+
+    free(payload);
+
+    received[msg_number] = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int r, i, n = sizeof(received) / sizeof(received[0]);
+
+    static const uint64_t equals[] = { 3 };
+    static const uint64_t range[]  = { 2, 5 };
+    static const uint64_t set[]    = { 0 };
+
+    MX_Filter filter;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s equals|range|set\n", argv[0]);
+        return 1;
+    }
+    else if (strcmp(argv[1], "equals") == 0) {
+        filter = (MX_Filter) { 0, 4, MX_FILTER_EQUALS, 1, equals };
+    }
+    else if (strcmp(argv[1], "range") == 0) {
+        filter = (MX_Filter) { 0, 4, MX_FILTER_RANGE, 2, range };
+    }
+    else {
+        filter = (MX_Filter) { 4, 2, MX_FILTER_SET, 1, set };
+    }
+
+    MX *mx = mxClient("localhost", NULL, argv[1]);
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    test_msg = mxRegister(mx, "Test");
+
+    mxSubscribeFiltered(mx, test_msg, &filter, msg_handler, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    printf("%s:", argv[1]);
+
+    for (i = 0; i < n; i++) {
+        if (received[i])
+            printf(" %d", i);
+        else
+            printf("  ");
+    }
+
+    printf("\n");
+
+    return r;
+}
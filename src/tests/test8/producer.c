@@ -0,0 +1,70 @@
+/*
+ * producer.c: Message producer for test8.
+ *
+ * Copyright:	(c) 2014-2025 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libjvs/utils.h>
+#include <libjvs/debug.h>
+
+#include "libmx.h"
+
+#define CONSUMERS 3
+
+static uint32_t test_msg;
+static int subscribers = 0;
+
+void on_time(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    mxShutdown(mx);
+}
+
+void on_new_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    uint32_t i;
+
+    if (++subscribers < CONSUMERS) return;
+
+    for (i = 0; i < 10; i++) {
+        mxPackAndBroadcast(mx, test_msg, 0,
+                PACK_INT32, i,
+                PACK_INT16, i % 3,
+                END);
+    }
+
+    mxCreateTimer(mx, mxNow() + 1, on_time, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Producer");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    test_msg = mxRegister(mx, "Test");
+
+    mxOnNewSubscriber(mx, test_msg, on_new_subscriber, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
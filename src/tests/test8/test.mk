@@ -0,0 +1,37 @@
+# tests/test8/test.mk: Makefile fragment for test8.
+#
+# Copyright:	(c) 2014-2025 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST8_DIR  := tests/test8
+TEST8_PROD := $(TEST8_DIR)/producer
+TEST8_CONS := $(TEST8_DIR)/consumer
+TEST8_LOG  := $(TEST8_DIR)/*.log
+
+TEST8_OUTPUT := $(TEST8_DIR)/output.test
+BASE8_OUTPUT := $(TEST8_DIR)/output.base
+
+TESTS += test8
+BASES += base8
+CLEAN += $(TEST8_PROD) $(TEST8_CONS) $(TEST8_OUTPUT) $(TEST8_LOG)
+
+test8: $(TEST8_OUTPUT)
+	diff $(TEST8_OUTPUT) $(BASE8_OUTPUT)
+
+base8: $(TEST8_OUTPUT)
+	cp $(TEST8_OUTPUT) $(BASE8_OUTPUT)
+
+$(TEST8_OUTPUT): mx $(TEST8_PROD) $(TEST8_CONS)
+	./mx master -b
+	$(TEST8_CONS) equals > $(TEST8_DIR)/equals.test &
+	$(TEST8_CONS) range > $(TEST8_DIR)/range.test &
+	$(TEST8_CONS) set > $(TEST8_DIR)/set.test &
+	$(TEST8_PROD)
+	./mx quit
+	sleep 1
+	cat $(TEST8_DIR)/equals.test $(TEST8_DIR)/range.test \
+	    $(TEST8_DIR)/set.test > $(TEST8_OUTPUT)
+	rm $(TEST8_DIR)/equals.test $(TEST8_DIR)/range.test $(TEST8_DIR)/set.test
@@ -0,0 +1,136 @@
+/*
+ * receiver.c: Message receiver for test9.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libjvs/utils.h>
+#include <libjvs/debug.h>
+
+#include "libmx.h"
+
+static uint32_t test_msg, other_msg;
+
+void print_stats(MX *mx, const char *title, bool delta)
+{
+    int i;
+
+    MX_Stats *stats = mxGetStats(mx, delta);
+
+    printf("%s:\n", title);
+
+    for (i = 0; i < stats->count; i++) {
+        MX_StatsEntry *entry = stats->entry + i;
+
+        if (entry->type < test_msg) continue;
+
+        printf("\t%s %s: sent %lu/%lu (%lu dropped), "
+               "received %lu/%lu (%lu dropped), %lu queued\n",
+                mxComponentName(mx, entry->fd), mxMessageName(mx, entry->type),
+                entry->sent_msgs, entry->sent_bytes, entry->send_drops,
+                entry->recv_msgs, entry->recv_bytes, entry->recv_drops,
+                entry->queued);
+    }
+
+    mxFreeStats(stats);
+}
+
+static MX_Timer *timer = NULL;
+
+void print_latency(MX *mx)
+{
+    MX_Stage stage;
+    MX_Latency latency;
+
+    printf("Receiver latency:\n");
+
+    for (stage = 0; stage < NUM_MX_STAGES; stage++) {
+        mxGetLatency(mx, test_msg, stage, &latency);
+
+        printf("\t%lu messages, %s\n", latency.count,
+                latency.p50 <= latency.p99 && latency.p99 <= latency.p999 &&
+                latency.p999 <= latency.max ? "ordered" : "NOT ordered");
+    }
+}
+
+void on_time(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    print_stats(mx, "Receiver totals", false);
+    print_stats(mx, "Receiver delta", true);
+    print_latency(mx);
+}
+
+void on_end_component(MX *mx, int fd, const char *name, void *udata)
+{
+    mxShutdown(mx);
+}
+
+void on_stats_report(MX *mx, int fd, MX_Stats *stats, void *udata)
+{
+    int i;
+    static bool reported = false;
+
+    for (i = 0; i < stats->count && !reported; i++) {
+        MX_StatsEntry *entry = stats->entry + i;
+
+        if (entry->type != test_msg) continue;
+
+        printf("Stats report from %s:\n", mxComponentName(mx, fd));
+        printf("\t%s %s: %lu messages\n",
+                entry->fd == -1 ? "Receiver/1" : mxComponentName(mx, entry->fd),
+                mxMessageName(mx, entry->type),
+                entry->sent_msgs + entry->send_drops + entry->queued);
+
+        reported = true;
+    }
+
+    mxFreeStats(stats);
+}
+
+void msg_handler(MX *mx, int fd, uint32_t type, uint32_t version,
+        char *payload, uint32_t size, void *udata)
+{
+    free(payload);
+
+    if (timer == NULL) {
+        timer = mxCreateTimer(mx, mxNow() + 0.5, on_time, NULL);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Receiver");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    test_msg = mxRegister(mx, "Test");
+    other_msg = mxRegister(mx, "Other");
+
+    mxSubscribe(mx, test_msg, msg_handler, NULL);
+
+    mxOnStatsReport(mx, on_stats_report, NULL);
+    mxOnEndComponent(mx, on_end_component, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
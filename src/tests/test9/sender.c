@@ -0,0 +1,124 @@
+/*
+ * sender.c: Message sender for test9.
+ *
+ * Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+ * Version:	$Id$
+ *
+ * This software is distributed under the terms of the MIT license. See
+ * http://www.opensource.org/licenses/mit-license.php for details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjvs/utils.h>
+#include <libjvs/debug.h>
+
+#include "libmx.h"
+
+static uint32_t test_msg, other_msg;
+
+void print_stats(MX *mx, const char *title, bool delta)
+{
+    int i;
+
+    MX_Stats *stats = mxGetStats(mx, delta);
+
+    printf("%s:\n", title);
+
+    for (i = 0; i < stats->count; i++) {
+        MX_StatsEntry *entry = stats->entry + i;
+
+        if (entry->type < test_msg) continue;
+
+        printf("\t%s %s: sent %lu/%lu (%lu dropped), "
+               "received %lu/%lu (%lu dropped), %lu queued\n",
+                mxComponentName(mx, entry->fd), mxMessageName(mx, entry->type),
+                entry->sent_msgs, entry->sent_bytes, entry->send_drops,
+                entry->recv_msgs, entry->recv_bytes, entry->recv_drops,
+                entry->queued);
+    }
+
+    mxFreeStats(stats);
+}
+
+void print_trace(MX *mx, const char *path)
+{
+    char line[256], type[32];
+    int sends = 0, writes = 0;
+
+    FILE *fp = fopen(path, "r");
+
+    snprintf(type, sizeof(type), "\"type\":%u,", test_msg);
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strstr(line, type) == NULL) continue;
+
+        if (strstr(line, "\"name\":\"send\"") != NULL) sends++;
+        if (strstr(line, "\"name\":\"write\"") != NULL) writes++;
+    }
+
+    fclose(fp);
+
+    printf("Sender trace: %d send, %d write\n", sends, writes);
+}
+
+void on_time(MX *mx, MX_Timer *timer, double t, void *udata)
+{
+    print_stats(mx, "Sender totals", false);
+
+    mxTraceStop();
+    mxTraceDump("tests/test9/sender.trace");
+
+    print_trace(mx, "tests/test9/sender.trace");
+
+    mxShutdown(mx);
+}
+
+void on_new_subscriber(MX *mx, int fd, uint32_t type, void *udata)
+{
+    uint32_t i;
+
+    for (i = 0; i < 10; i++) {
+        mxPackAndBroadcast(mx, test_msg, 0, PACK_INT32, i, END);
+    }
+
+    for (i = 0; i < 2; i++) {
+        mxPackAndSend(mx, fd, other_msg, 0, PACK_INT16, i, END);
+    }
+
+    mxCreateTimer(mx, mxNow() + 1, on_time, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+
+    MX *mx = mxClient("localhost", NULL, "Sender");
+
+    if (mx == NULL) {
+        fprintf(stderr, "mxClient failed.\n");
+        return 1;
+    }
+
+    test_msg = mxRegister(mx, "Test");
+    other_msg = mxRegister(mx, "Other");
+
+    mxSetTimestamps(mx, true);
+
+    mxTraceStart(0);
+
+    mxOnNewSubscriber(mx, test_msg, on_new_subscriber, NULL);
+
+    r = mxRun(mx);
+
+    if (r != 0) {
+        fputs(mxError(), stderr);
+    }
+
+    mxDestroy(mx);
+
+    return r;
+}
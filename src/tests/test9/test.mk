@@ -0,0 +1,35 @@
+# tests/test9/test.mk: Makefile fragment for test9.
+#
+# Copyright:	(c) 2014-2026 Jacco van Schaik (jacco@jaccovanschaik.net)
+# Version:	$Id$
+#
+# This software is distributed under the terms of the MIT license. See
+# http://www.opensource.org/licenses/mit-license.php for details.
+
+TEST9_DIR  := tests/test9
+TEST9_SEND := $(TEST9_DIR)/sender
+TEST9_RECV := $(TEST9_DIR)/receiver
+TEST9_LOG  := $(TEST9_DIR)/*.log
+TEST9_TRACE := $(TEST9_DIR)/sender.trace
+
+TEST9_OUTPUT := $(TEST9_DIR)/output.test
+BASE9_OUTPUT := $(TEST9_DIR)/output.base
+
+TESTS += test9
+BASES += base9
+CLEAN += $(TEST9_SEND) $(TEST9_RECV) $(TEST9_OUTPUT) $(TEST9_LOG) $(TEST9_TRACE)
+
+test9: $(TEST9_OUTPUT)
+	diff $(TEST9_OUTPUT) $(BASE9_OUTPUT)
+
+base9: $(TEST9_OUTPUT)
+	cp $(TEST9_OUTPUT) $(BASE9_OUTPUT)
+
+$(TEST9_OUTPUT): mx $(TEST9_SEND) $(TEST9_RECV)
+	./mx master -b
+	$(TEST9_RECV) > $(TEST9_DIR)/receiver.test &
+	$(TEST9_SEND) > $(TEST9_DIR)/sender.test
+	./mx quit
+	sleep 1
+	cat $(TEST9_DIR)/sender.test $(TEST9_DIR)/receiver.test > $(TEST9_OUTPUT)
+	rm $(TEST9_DIR)/sender.test $(TEST9_DIR)/receiver.test
@@ -6,6 +6,10 @@
 # This software is distributed under the terms of the MIT license. See
 # http://www.opensource.org/licenses/mit-license.php for details.
 
-SUBS := tests/test1 tests/test2 tests/test3 tests/test4 tests/test5 tests/test6
+SUBS := tests/test1 tests/test2 tests/test3 tests/test4 tests/test5 tests/test6 \
+        tests/test7 tests/test8 tests/test9 tests/test10 \
+        tests/test11 tests/test12 tests/test13 \
+        tests/test14 tests/test15 tests/test16 \
+        tests/test17 tests/test18 tests/test19
 
 include $(patsubst %, %/test.mk, $(SUBS))
@@ -13,6 +13,8 @@
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <sched.h>
+#include <sys/types.h>
 
 #include <libjvs/buffer.h>
 #include <libjvs/list.h>
@@ -24,6 +26,7 @@
 #include "libmx.h"
 #include "cmd.h"
 #include "evt.h"
+#include "trc.h"
 
 /*
  * The read- and write-end of a pipe.
@@ -39,6 +42,210 @@ enum {
  */
 #define HEADER_SIZE (3 * sizeof(uint32_t))
 
+/*
+ * Set in the message type of a header if the payload is preceded by two
+ * timestamps (as doubles): when the message was queued and when it was written.
+ */
+#define MX_TIMESTAMPED 0x80000000
+
+#define TIMESTAMPS_SIZE (2 * sizeof(double))
+
+/*
+ * Latency histograms have logarithmic buckets: every power of 2 is split into
+ * MX_HIST_SUB linear sub-buckets, so values are stored with a precision of
+ * about 6%. Values are in nanoseconds, and are capped at 2^MX_HIST_MAX_BITS
+ * (about 18 minutes).
+ */
+#define MX_HIST_SUB_BITS 4
+#define MX_HIST_SUB      (1 << MX_HIST_SUB_BITS)
+#define MX_HIST_MAX_BITS 40
+#define MX_HIST_BUCKETS  ((MX_HIST_MAX_BITS - MX_HIST_SUB_BITS + 1) * MX_HIST_SUB)
+
+/*
+ * A latency histogram.
+ */
+typedef struct {
+    uint64_t count;                     // Number of values.
+    uint64_t max;                       // Largest value.
+    uint64_t bucket[MX_HIST_BUCKETS];   // Number of values per bucket.
+} MX_Histogram;
+
+/*
+ * Traffic counters are kept per message type, in chunks of MX_STATS_CHUNK_SIZE
+ * types that are allocated on first use and aligned to MX_CACHE_LINE. Message
+ * types of MX_STATS_CHUNKS * MX_STATS_CHUNK_SIZE and up are not counted.
+ */
+#define MX_CACHE_LINE       64
+#define MX_STATS_CHUNK_SIZE 64
+#define MX_STATS_CHUNKS     256
+
+/*
+ * Traffic counts for one message type.
+ */
+typedef struct {
+    uint64_t msgs;                      // Number of messages.
+    uint64_t bytes;                     // Number of payload bytes.
+    uint64_t drops;                     // Number of messages dropped.
+} MX_Count;
+
+/*
+ * A set of traffic counters. Each set is only ever updated by one thread, so
+ * updates need no locks or atomic read-modify-writes.
+ */
+typedef struct {
+    MX_Count *chunk[MX_STATS_CHUNKS];   // Chunks of counts, indexed by type.
+} MX_Counters;
+
+/*
+ * The counters of one publishing thread for messages it queued for a component.
+ * Any thread may publish, so each one gets a set of its own.
+ */
+typedef struct MX_ThreadCounters MX_ThreadCounters;
+
+struct MX_ThreadCounters {
+    MX_ThreadCounters *next;            // Set of another thread.
+    uint64_t thread;                    // Owning thread, see mx_thread_id().
+    MX_Counters counters;               // Its counters.
+};
+
+/*
+ * Default number of events in a trace ring.
+ */
+#define MX_TRACE_EVENTS 16384
+
+/*
+ * One trace event. Times are in ticks of the trace clock.
+ */
+typedef struct {
+    uint64_t t;                         // Time of the event (or its start).
+    uint32_t duration;                  // Its duration, for spans.
+    uint16_t what;                      // An MX_TraceEventType.
+    int16_t fd;                         // File descriptor involved, or -1.
+    uint32_t type;                      // Message type involved.
+    uint32_t size;                      // Number of bytes involved.
+} MX_TraceRecord;
+
+/*
+ * A ring of trace events, written only by the thread that owns it.
+ */
+typedef struct MX_TraceRing MX_TraceRing;
+
+struct MX_TraceRing {
+    MX_TraceRing *next;                 // Next ring in the list of all rings.
+    pid_t tid;                          // Thread that owns this ring.
+    char name[32];                      // Name of that thread.
+    bool dead;                          // The thread has exited.
+    uint32_t mask;                      // Number of records - 1.
+    uint64_t head;                      // Number of records ever written.
+    MX_TraceRecord record[];            // The records.
+};
+
+/*
+ * Message log parameters: the default size of a segment, the number of records
+ * covered by one index entry, and the number of bytes we write before asking
+ * the kernel to start writing them out.
+ */
+#define MX_LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define MX_LOG_INDEX_BLOCK  256
+#define MX_LOG_SYNC_SIZE    (4 * 1024 * 1024)
+
+#define MX_LOG_MAGIC        "MXLOG001"
+
+/*
+ * The kinds of records in a message log. The (zeroed) space after the last
+ * record in a segment reads as an MX_LOG_END record.
+ */
+typedef enum {
+    MX_LOG_END,                         // End of the data in this segment.
+    MX_LOG_MESSAGE,                     // A recorded message.
+    MX_LOG_COMPONENT,                   // Name of component <sender>.
+    MX_LOG_NAME                         // Name of message type <type>.
+} MX_LogKind;
+
+/*
+ * Header at the start of every message log segment.
+ */
+typedef struct {
+    char magic[8];                      // MX_LOG_MAGIC.
+    uint32_t number;                    // Sequence number of this segment.
+    uint32_t reserved;
+    double start;                       // Time at which it was started.
+    char pad[40];
+} MX_LogHeader;
+
+/*
+ * Header of every record in a message log segment. It is followed by <size>
+ * bytes of payload, padded to a multiple of 8 bytes.
+ */
+typedef struct {
+    uint16_t kind;                      // An MX_LogKind.
+    uint16_t sender;                    // Id of the sending component.
+    uint32_t type;                      // Message type.
+    uint32_t version;                   // Message version.
+    uint32_t size;                      // Payload size.
+    double t;                           // Time at which it was received.
+} MX_LogRecord;
+
+/*
+ * An entry in a message log index. Each entry covers MX_LOG_INDEX_BLOCK records.
+ */
+typedef struct {
+    double t;                           // Time of the first record in the block.
+    uint64_t offset;                    // Its offset in the segment.
+    uint64_t types;                     // Bit <type % 64> set for every type.
+} MX_LogIndexEntry;
+
+/*
+ * Recorder data, writing a message log.
+ */
+struct MX_Recorder {
+    MX *mx;                             // The MX we're recording from.
+    char *path;                         // Directory for the log.
+    size_t segment_size;                // Size of a new segment.
+    uint32_t number;                    // Number of the current segment.
+    int fd;                             // File descriptor of the current segment.
+    char *map;                          // Current segment, mapped into memory.
+    size_t map_size;                    // Size of the mapped segment.
+    size_t used;                        // Bytes of it used so far.
+    size_t synced;                      // Bytes of it handed to msync.
+    FILE *index;                        // Index of the current segment.
+    MX_LogIndexEntry block;             // Index entry for the current block.
+    uint32_t block_count;               // Records in the current block.
+    uint8_t comp_seen[8192];            // Component ids named in this segment.
+    uint8_t *type_seen;                 // Message types named in this segment.
+    uint32_t type_seen_size;            // Size of <type_seen> in bytes.
+    Buffer types;                       // Message types we subscribed to.
+    PointerArray patterns;              // Patterns we subscribed to.
+    uint64_t count;                     // Messages recorded.
+};
+
+/*
+ * A segment of a message log that is being read.
+ */
+typedef struct {
+    uint32_t number;                    // Sequence number of the segment.
+    double start;                       // Time at which it was started.
+    char *map;                          // Segment, mapped into memory.
+    size_t size;                        // Size of the segment.
+    MX_LogIndexEntry *index;            // Its index.
+    size_t index_count;                 // Number of entries in <index>.
+} MX_LogSegment;
+
+/*
+ * Message log data, for reading.
+ */
+struct MX_Log {
+    int count;                          // Number of segments.
+    MX_LogSegment *segment;             // The segments, in order.
+    int current;                        // Segment we're reading from.
+    size_t offset;                      // Offset of the next record in it.
+    PointerArray components;            // Component names, indexed by id.
+    PointerArray messages;              // Message names, indexed by type.
+    char *filter;                       // Message name we're reading.
+    uint32_t filter_type;               // Its type in the log...
+    bool filter_known;                  // ... if we've seen it yet.
+};
+
 /*
  * MX timer data.
  */
@@ -50,6 +257,16 @@ struct MX_Timer {
     void *udata;
 };
 
+/*
+ * A precompiled list of PACK_* field types, created by mxCreateLayout.
+ */
+struct MX_Layout {
+    int count;                          // Number of fields.
+    bool fixed;                         // All fields have a fixed size...
+    uint32_t fixed_size;                // ... which adds up to this.
+    int type[];                         // PACK_* type of each field.
+};
+
 /*
  * Command to timer thread to create a timer.
  */
@@ -65,6 +282,7 @@ typedef struct {
     uint32_t version;                   // Version.
     uint32_t size;                      // Payload size.
     char *payload;                      // Payload.
+    double queued;                      // Time queued if timestamped, else 0.
 } MX_WriteCommand;
 
 /*
@@ -85,8 +303,10 @@ typedef struct {
 /*
  * Command to a thread.
  */
-typedef struct {
-    ListNode _node;
+typedef struct MX_Command MX_Command;
+
+struct MX_Command {
+    MX_Command *next;                   // Next command in the queue.
     MX_CommandType cmd_type;
     union {
         MX_WriteCommand write;
@@ -94,15 +314,21 @@ typedef struct {
         MX_TimerAdjustCommand timer_adjust;
         MX_TimerDeleteCommand timer_delete;
     } u;
-} MX_Command;
+};
 
 /*
- * A command queue.
+ * A command queue. Any number of threads may push commands onto it without
+ * taking a lock, but only one thread may pop them off. <head> and <tail> live
+ * on separate cache lines so that producers and the consumer don't keep
+ * stealing the line from each other.
  */
 typedef struct {
-    List commands;
-    pthread_mutex_t ok_to_access;
-    sem_t ok_to_read;
+    MX_Command *head;                   // Consumer pops from here.
+    char pad1[64 - sizeof(MX_Command *)];
+    MX_Command *tail;                   // Producers push here.
+    char pad2[64 - sizeof(MX_Command *)];
+    int waiting;                        // Futex: 1 if consumer is sleeping.
+    MX_Command stub;                    // Keeps the queue from going empty.
 } MX_Queue;
 
 /*
@@ -128,8 +354,17 @@ typedef struct {
     char *host;                         // Host on which it runs.
     uint16_t port;                      // Port on which it listens.
     int fd;                             // Connected to it on this fd.
+    bool connecting;                    // Outgoing connect still in progress.
+    bool dormant;                       // Known, but not connected (lazy).
+    bool duplicate;                     // Second connection to a peer (lazy).
+    bool reported;                      // Master has told us about it (lazy).
+    double last_active;                 // Last send or receive (lazy).
+
+    bool handshake;                     // Reader waits after first message.
+    sem_t handshake_done;               // Main thread has handled it.
 
     MList subscriptions;                // Its subscriptions.
+    MList patterns;                     // Its pattern subscriptions.
 
     Buffer incoming;                    // Buffer for incoming data.
 
@@ -140,8 +375,90 @@ typedef struct {
     pthread_rwlock_t await_lock;        // Lock to access await list.
 
     MX_Queue writer_queue;              // Command queue to writer thread.
+    MX_Command *greeting;               // HelloUpdate to write first (lazy).
+    MX_Command *pending;                // Writes kept while dormant (lazy).
+
+    MX_ThreadCounters *queued;          // Sent to the writer (per thread).
+    MX_Counters written;                // Written or dropped (writer thread).
+    MX_Counters received;               // Read from the socket (reader thread).
+    MX_Counters handled;                // Unhandled are dropped (main thread).
+
+    MX_StatsEntry *last_stats;          // Totals at the previous mxGetStats.
+    int last_stats_count;               // Number of entries in last_stats.
 } MX_Component;
 
+/*
+ * A node in the trie of subscription patterns. Each node stands for the prefix
+ * spelled by the characters on the path from the root to it.
+ */
+typedef struct MX_PatternNode MX_PatternNode;
+
+struct MX_PatternNode {
+    MX_PatternNode *child;              // First child.
+    MX_PatternNode *next;               // Next sibling.
+    char c;                             // Last character of this prefix.
+    MList subs;                         // Patterns that end here.
+};
+
+/*
+ * A pattern subscription. The pattern is either a full message name, or a
+ * prefix followed by "*".
+ */
+typedef struct {
+    MListNode _node;                    // Make it listable.
+
+    MX_Component *comp;                 // Subscriber.
+    MX_PatternNode *node;               // Trie node it hangs from.
+    char *pattern;                      // The pattern itself.
+    bool prefix;                        // True if it ends in "*".
+
+    void (*handler)(MX *mx, int fd,
+            uint32_t type, uint32_t version, char *payload, uint32_t size, void *udata);
+    void *udata;
+} MX_PatternSub;
+
+/*
+ * A component reported by the master that we haven't started connecting to
+ * yet.
+ */
+typedef struct {
+    ListNode _node;                     // Make it listable.
+
+    uint16_t id;                        // Component id
+    char *name;                         // Name of the component.
+    char *host;                         // Host on which it runs.
+    uint16_t port;                      // Port on which it listens.
+} MX_Peer;
+
+/*
+ * A value cached for new subscribers.
+ */
+typedef struct {
+    ListNode _node;                     // Make it listable.
+    uint64_t key;                       // Value of the key field.
+    uint32_t version;                   // Message version.
+    uint32_t size;                      // Payload size.
+    char *payload;                      // Payload.
+} MX_CachedValue;
+
+/*
+ * One subscriber in a fanout.
+ */
+typedef struct {
+    MX_Component *comp;                 // Subscriber.
+    const MX_Filter *filter;            // Only messages that pass, or NULL.
+} MX_Subscriber;
+
+/*
+ * An immutable snapshot of the subscribers to a message type, as used by
+ * mxBroadcast. It is replaced whenever the subscriptions change. The filters
+ * are copies that live in the same allocation, after <sub>.
+ */
+typedef struct {
+    int count;                          // Number of subscribers.
+    MX_Subscriber sub[];                // The subscribers.
+} MX_Fanout;
+
 /*
  * A message type definition.
  */
@@ -158,6 +475,16 @@ typedef struct {
     void *on_end_sub_udata;
 
     MList subscriptions;                // Subscriptions to this msg type.
+    MX_Fanout *fanout;                  // Snapshot of the above, or NULL.
+
+    MX_Histogram *latency;              // NUM_MX_STAGES histograms, or NULL.
+
+    bool cached;                        // Cache broadcast values.
+    uint32_t cache_offset;              // Offset of the key field...
+    uint32_t cache_width;               // ... and its width (0 for no key).
+    List cache;                         // Cached values (MX_CachedValues)...
+    HashTable cache_by_key;             // ... hashed by key.
+    pthread_mutex_t cache_lock;         // Guards the cache.
 } MX_Message;
 
 /*
@@ -168,6 +495,8 @@ typedef struct {
 
     MX_Component *comp;                 // Subscriber.
     MX_Message *msg;                    // Message type.
+    MX_Filter *filter;                  // Only messages that pass, or NULL.
+    MX_PatternSub *pattern;             // Pattern it came from, or NULL.
 
     void (*handler)(MX *mx, int fd,
             uint32_t type, uint32_t version, char *payload, uint32_t size, void *udata);
@@ -198,8 +527,22 @@ typedef struct {
     uint32_t version;                   // Version of the message.
     uint32_t size;                      // Payload size.
     char *payload;                      // Payload.
+    bool timestamped;                   // True if the times below are set.
+    double stamp[3];                    // Time queued, written and read.
+                                        // Handler, for dispatch workers.
+    void (*handler)(MX *mx, int fd,
+            uint32_t type, uint32_t version, char *payload, uint32_t size, void *udata);
+    void *udata;
 } MX_MessageEvent;
 
+/*
+ * Outgoing connection event data.
+ */
+typedef struct {
+    int fd;                             // FD of the new connection.
+    int error;                          // errno code, 0 if connected.
+} MX_PeerEvent;
+
 typedef struct {
     MX_Timer *timer;
     double t;                           // Time since epoch.
@@ -223,6 +566,14 @@ typedef struct {
     int error;                          // errno code.
 } MX_ErrorEvent;
 
+/*
+ * Message for a dormant component, sent from outside the main thread.
+ */
+typedef struct {
+    uint16_t id;                        // Id of the dormant component.
+    MX_Command *cmd;                    // Write command to queue once awake.
+} MX_WakeEvent;
+
 /*
  * Event data.
  */
@@ -236,9 +587,96 @@ typedef struct {
         MX_TimerEvent      timer;       // Timer event data.
         MX_ReadableEvent   read;        // Readable event data.
         MX_ErrorEvent      err;         // Error event data.
+        MX_PeerEvent       peer;        // Outgoing connection event data.
+        MX_WakeEvent       wake;        // Wake event data.
     } u;
 } MX_Event;
 
+/*
+ * Messages handed to dispatch workers are spread over MX_DISPATCH_SHARDS
+ * shards. A worker takes up to MX_DISPATCH_BATCH messages from a shard at a
+ * time, and the main thread waits when MX_DISPATCH_BACKLOG messages are waiting
+ * for a worker.
+ */
+#define MX_DISPATCH_SHARDS  256
+#define MX_DISPATCH_BATCH   64
+#define MX_DISPATCH_BACKLOG 16384
+
+/*
+ * A dispatch shard. Its messages are handled in order, by one worker at a time.
+ */
+typedef struct {
+    ListNode _node;                     // Make it listable (in the run queue).
+    List events;                        // Message events waiting for a worker.
+    bool busy;                          // In the run queue or being worked on.
+} MX_Shard;
+
+/*
+ * A pool of threads that call message handlers on behalf of the main thread.
+ */
+typedef struct {
+    MX_DispatchKey key;                 // How messages are assigned to shards.
+    int count;                          // Number of worker threads.
+    pthread_t *threads;                 // Their thread ids.
+    int wake_fd;                        // Workers' copy of the event pipe.
+
+    pthread_mutex_t lock;               // Guards the rest of the MX (recursive).
+
+    pthread_mutex_t queue_lock;         // Guards everything below.
+    pthread_cond_t work;                // A shard was added to the run queue.
+    pthread_cond_t room;                // The backlog dropped below the max.
+    List run_queue;                     // Shards with messages and no worker.
+    int backlog;                        // Messages waiting for a worker.
+    bool stop;                          // Set by mxShutdown.
+    MX_Shard shard[MX_DISPATCH_SHARDS];
+} MX_Dispatcher;
+
+/*
+ * An immutable snapshot of a table of pointers (components by fd, or messages
+ * by type), used by publishers on any thread. It is replaced when the table
+ * changes.
+ */
+typedef struct {
+    uint32_t count;                     // Number of entries.
+    void *entry[];                      // The entries (NULL if unused).
+} MX_Table;
+
+/*
+ * Number of threads that can be publishing at the same time.
+ */
+#define MX_EPOCH_SLOTS 64
+
+/*
+ * A slot in which a publishing thread announces the epoch it started in.
+ */
+typedef struct {
+    uint64_t epoch;                     // Epoch it started in, 0 if unused.
+    char pad[MX_CACHE_LINE - sizeof(uint64_t)];
+} MX_EpochSlot;
+
+/*
+ * Something that was replaced or removed, but that publishers may still be
+ * using. It is destroyed once all publishers have moved beyond <epoch>.
+ */
+typedef struct {
+    ListNode _node;                     // Make it listable.
+    uint64_t epoch;                     // Epoch in which it was retired.
+    void (*destroy)(MX *mx, void *ptr); // How to destroy it.
+    void *ptr;                          // What to destroy.
+} MX_Retired;
+
+/*
+ * Where and how threads of one kind run (see mxSetAffinity and
+ * mxSetScheduling).
+ */
+typedef struct {
+    bool pinned;                        // Restricted to the CPUs below.
+    cpu_set_t cpus;                     // CPUs it may run on.
+    bool scheduled;                     // Policy and priority below were set.
+    int policy;                         // Scheduling policy (SCHED_*).
+    int priority;                       // Static priority for that policy.
+} MX_Placement;
+
 /*
  * The MX struct.
  */
@@ -248,9 +686,12 @@ struct MX {
 
     int event_pipe[2];                  // Incoming event pipe.
 
+    pthread_t main_thread;              // Thread that called mxClient etc.
     pthread_t timer_thread;             // Timer thread id.
     pthread_t listener_thread;          // Listener thread id.
 
+    MX_Placement placement[NUM_MX_THREADS]; // Placement per kind of thread.
+
     List timers;                        // List of timers.
     MX_Queue timer_queue;               // Command queue to timer thread.
 
@@ -262,9 +703,39 @@ struct MX {
     HashTable message_by_name;          // Message info hashed by name.
 
     uint32_t next_message_type;         // Next message ID to be allocated.
+    uint16_t next_component_id;         // Last component ID handed out.
+
+    MX_PatternNode patterns;            // Root of the pattern trie.
+
+    bool lazy;                          // Connect to peers only when needed.
+    double idle_timeout;                // Close peer connections idle this long.
+    MX_Timer *idle_timer;               // Timer to check for idle connections.
+    HashTable component_by_id;          // Components hashed by id (lazy).
+
+    bool timestamps;                    // Timestamp outgoing messages.
+
+    double busy_poll;                   // Spin this long before sleeping (s).
+
+    MX_Dispatcher *dispatcher;          // Handler worker pool, or NULL.
+
+    MX_Table *component_table;          // Snapshot of components by fd.
+    MX_Table *message_table;            // Snapshot of messages by type.
+    uint64_t epoch;                     // Current epoch (starts at 1).
+    MX_EpochSlot epoch_slot[MX_EPOCH_SLOTS];   // Publishers' epochs.
+    List retired;                       // Retired, in order of epoch.
+
+    double stats_start;                 // When we started counting traffic.
+    double stats_time;                  // Time of the previous mxGetStats.
+    MX_Timer *stats_timer;              // Timer to send StatsReports.
 
     int shutting_down;                  // True if this MX is shutting down.
 
+    List peer_backlog;                  // Reported peers not connected yet.
+    int peer_connects;                  // Peer connects in progress.
+    int max_peer_connects;              // Max. simultaneous peer connects.
+    int unready_peers;                  // Reported peers still to connect.
+    bool ready;                         // Connected to all reported peers.
+
     // Callback on new components.
     void (*on_new_comp_callback)(MX *mx, int fd, const char *name, void *udata);
     void *on_new_comp_udata;
@@ -276,6 +747,18 @@ struct MX {
     // Callback on registered messages.
     void (*on_register_callback)(MX *mx, uint32_t type, const char *name, void *udata);
     void *on_register_udata;
+
+    // Callback on stats reports.
+    void (*on_stats_callback)(MX *mx, int fd, MX_Stats *stats, void *udata);
+    void *on_stats_udata;
+
+    // Callback when connected to all reported peers.
+    void (*on_ready_callback)(MX *mx, void *udata);
+    void *on_ready_udata;
+
+    // Callback when all pending events have been processed.
+    void (*on_processed_callback)(MX *mx, void *udata);
+    void *on_processed_udata;
 };
 
 #endif